@@ -0,0 +1,42 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Detection of the SIMD extensions the CPU supports, used to pick the sample
+ * processing kernels at run time.
+ */
+#ifndef CRAS_CPU_H_
+#define CRAS_CPU_H_
+
+
+enum CRAS_CPU_FLAGS {
+	CRAS_CPU_SSE2 = 1 << 0,
+	CRAS_CPU_SSE4_1 = 1 << 1,
+	CRAS_CPU_AVX2 = 1 << 2,
+	CRAS_CPU_NEON = 1 << 3,
+};
+
+/* Returns the mask of CRAS_CPU_FLAGS supported by the running CPU.  NEON is
+ * only reported when the build targets it, it can't be probed portably. */
+static inline unsigned int cras_cpu_get_flags()
+{
+	unsigned int flags = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		flags |= CRAS_CPU_SSE2;
+	if (__builtin_cpu_supports("sse4.1"))
+		flags |= CRAS_CPU_SSE4_1;
+	if (__builtin_cpu_supports("avx2"))
+		flags |= CRAS_CPU_AVX2;
+#elif defined(__ARM_NEON__)
+	flags |= CRAS_CPU_NEON;
+#endif
+
+	return flags;
+}
+
+#endif /* CRAS_CPU_H_ */
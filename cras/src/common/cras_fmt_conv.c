@@ -3,22 +3,34 @@
  * found in the LICENSE file.
  */
 
-/* For now just use speex, can add more resamplers later. */
+/* Speex resamples rates the built in resampler has no filter for. */
 #include <speex/speex_resampler.h>
+#include <errno.h>
+#include <math.h>
 #include <syslog.h>
 
+#include "cras_cpu.h"
 #include "cras_fmt_conv.h"
 #include "cras_audio_format.h"
+#include "cras_resampler.h"
 #include "cras_util.h"
 
 /* The quality level is a value between 0 and 10. This is a tradeoff between
  * performance, latency, and quality. */
 #define SPEEX_QUALITY_LEVEL 4
-/* Max number of converters, src, down/up mix, and format. */
-#define MAX_NUM_CONVERTERS 3
+/* Quality of the built in resampler. */
+#define RESAMPLER_QUALITY CRAS_RESAMPLER_QUALITY_MEDIUM
+/* Following drift keeps the ratio next to one, where nothing needs filtering
+ * out, so the short filter is enough and adds the least delay. */
+#define resampler_quality(in_rate, out_rate) \
+	((in_rate) == (out_rate) ? CRAS_RESAMPLER_QUALITY_LOW : RESAMPLER_QUALITY)
+/* Max number of converters, src, down/up mix, and format in and out. */
+#define MAX_NUM_CONVERTERS 4
 /* Channel index for stereo. */
 #define STEREO_L 0
 #define STEREO_R 1
+/* Max channels of the matrix converters, more use convert_channels. */
+#define MAX_MATRIX_CHANNELS 8
 
 typedef void (*sample_format_converter_t)(const uint8_t *in,
 					  size_t in_samples,
@@ -27,17 +39,57 @@ typedef size_t (*channel_converter_t)(struct cras_fmt_conv *conv,
 				      const int16_t *in,
 				      size_t in_frames,
 				      int16_t *out);
+typedef size_t (*float_channel_converter_t)(struct cras_fmt_conv *conv,
+					    const float *in,
+					    size_t in_frames,
+					    float *out);
+typedef size_t (*fused_converter_t)(struct cras_fmt_conv *conv,
+				    const uint8_t *in,
+				    size_t in_frames,
+				    uint8_t *out);
+
+/* A channel conversion matrix precomputed for the matrix converters. */
+struct channel_matrix {
+	/* The non-zero coefficients of each output channel, and the input
+	 * channels they apply to in increasing order. */
+	size_t row_len[MAX_MATRIX_CHANNELS];
+	uint8_t row_ch[MAX_MATRIX_CHANNELS][MAX_MATRIX_CHANNELS];
+	float row_coef[MAX_MATRIX_CHANNELS][MAX_MATRIX_CHANNELS];
+	/* The coefficients of each input channel that has any, for all the
+	 * output channels at once. */
+	size_t num_cols;
+	uint8_t col_ch[MAX_MATRIX_CHANNELS];
+	float cols[MAX_MATRIX_CHANNELS][MAX_MATRIX_CHANNELS];
+	/* Set if the matrix only reorders channels.  Then perm has the input
+	 * channel of each output channel, -1 if it is silent, and shuffle
+	 * has the same as bytes of a frame, 0x80 where silent. */
+	int is_permutation;
+	int8_t perm[MAX_MATRIX_CHANNELS];
+	uint8_t shuffle[2 * MAX_MATRIX_CHANNELS];
+};
 
 /* Member data for the resampler. */
 struct cras_fmt_conv {
+	struct cras_resampler *resampler;
 	SpeexResamplerState *speex_state;
+	double ratio; /* Output rate adjustment of the resampler. */
 	channel_converter_t channel_converter;
+	/* Set instead of channel_converter on the float path. */
+	float_channel_converter_t float_channel_converter;
 	float **ch_conv_mtx; /* Coefficient matrix for mixing channels. */
-	sample_format_converter_t sample_format_converter;
+	struct channel_matrix mtx; /* ch_conv_mtx for the matrix converters. */
+	/* Runs the stages it replaces in a single pass, first in the chain. */
+	fused_converter_t fused_converter;
+	sample_format_converter_t in_format_converter;
+	sample_format_converter_t out_format_converter;
 	struct cras_audio_format in_fmt;
 	struct cras_audio_format out_fmt;
+	/* Set if channels and rate are converted in float rather than S16, so
+	 * formats wider than S16 keep their low bits. */
+	int float_path;
 	uint8_t *tmp_bufs[MAX_NUM_CONVERTERS - 1];
-	size_t num_converters; /* Incremented once for SRC, channel, format. */
+	size_t num_converters; /* Incremented once for SRC, channel, and each
+				  format conversion. */
 };
 
 /* Add and clip two s16 samples. */
@@ -55,6 +107,59 @@ static int16_t s16_add_and_clip(int16_t a, int16_t b)
  * Convert between different sample formats.
  */
 
+/* Single sample conversions from and to S16, shared by the format and the
+ * fused converters. */
+static inline int16_t u8_to_s16(uint8_t in)
+{
+	return ((int16_t)in - 0x80) << 8;
+}
+
+static inline int16_t s24le_to_s16(int32_t in)
+{
+	return (int16_t)((in & 0x00ffffff) >> 8);
+}
+
+static inline int16_t s32le_to_s16(int32_t in)
+{
+	return (int16_t)(in >> 16);
+}
+
+static inline int16_t floatle_to_s16(float in)
+{
+	float f = in * 32768.0f;
+
+	if (f > 32767.0f)
+		f = 32767.0f;
+	else if (f < -32768.0f)
+		f = -32768.0f;
+	return (int16_t)f;
+}
+
+static inline int16_t s16_to_s16(int16_t in)
+{
+	return in;
+}
+
+static inline uint8_t s16_to_u8(int16_t in)
+{
+	return (uint8_t)(in >> 8) + 128;
+}
+
+static inline int32_t s16_to_s24le(int16_t in)
+{
+	return (int32_t)in << 8;
+}
+
+static inline int32_t s16_to_s32le(int16_t in)
+{
+	return (int32_t)in << 16;
+}
+
+static inline float s16_to_floatle(int16_t in)
+{
+	return in / 32768.0f;
+}
+
 /* Converts from U8 to S16. */
 static void convert_u8_to_s16le(const uint8_t *in, size_t in_samples,
 				uint8_t *out)
@@ -63,7 +168,7 @@ static void convert_u8_to_s16le(const uint8_t *in, size_t in_samples,
 	uint16_t *_out = (uint16_t *)out;
 
 	for (i = 0; i < in_samples; i++, in++, _out++)
-		*_out = ((int16_t)*in - 0x80) << 8;
+		*_out = u8_to_s16(*in);
 }
 
 /* Converts from S24 to S16. */
@@ -75,7 +180,7 @@ static void convert_s24le_to_s16le(const uint8_t *in, size_t in_samples,
 	uint16_t *_out = (uint16_t *)out;
 
 	for (i = 0; i < in_samples; i++, _in++, _out++)
-		*_out = (int16_t)((*_in & 0x00ffffff) >> 8);
+		*_out = s24le_to_s16(*_in);
 }
 
 /* Converts from S32 to S16. */
@@ -87,7 +192,19 @@ static void convert_s32le_to_s16le(const uint8_t *in, size_t in_samples,
 	uint16_t *_out = (uint16_t *)out;
 
 	for (i = 0; i < in_samples; i++, _in++, _out++)
-		*_out = (int16_t)(*_in >> 16);
+		*_out = s32le_to_s16(*_in);
+}
+
+/* Converts from FLOAT to S16, clipping. */
+static void convert_floatle_to_s16le(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	size_t i;
+	float *_in = (float *)in;
+	int16_t *_out = (int16_t *)out;
+
+	for (i = 0; i < in_samples; i++, _in++, _out++)
+		*_out = floatle_to_s16(*_in);
 }
 
 /* Converts from S16 to U8. */
@@ -98,7 +215,7 @@ static void convert_s16le_to_u8(const uint8_t *in, size_t in_samples,
 	int16_t *_in = (int16_t *)in;
 
 	for (i = 0; i < in_samples; i++, _in++, out++)
-		*out = (uint8_t)(*_in >> 8) + 128;
+		*out = s16_to_u8(*_in);
 }
 
 /* Converts from S16 to S24. */
@@ -110,7 +227,7 @@ static void convert_s16le_to_s24le(const uint8_t *in, size_t in_samples,
 	uint32_t *_out = (uint32_t *)out;
 
 	for (i = 0; i < in_samples; i++, _in++, _out++)
-		*_out = ((int32_t)*_in << 8);
+		*_out = s16_to_s24le(*_in);
 }
 
 /* Converts from S16 to S32. */
@@ -122,7 +239,884 @@ static void convert_s16le_to_s32le(const uint8_t *in, size_t in_samples,
 	uint32_t *_out = (uint32_t *)out;
 
 	for (i = 0; i < in_samples; i++, _in++, _out++)
-		*_out = ((int32_t)*_in << 16);
+		*_out = s16_to_s32le(*_in);
+}
+
+/* Converts from S16 to FLOAT. */
+static void convert_s16le_to_floatle(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	size_t i;
+	int16_t *_in = (int16_t *)in;
+	float *_out = (float *)out;
+
+	for (i = 0; i < in_samples; i++, _in++, _out++)
+		*_out = s16_to_floatle(*_in);
+}
+
+/* Single sample conversions from and to FLOAT, for the float path.  Full
+ * scale is [-1, 1) as for FLOAT samples. */
+static inline float u8_to_float(uint8_t in)
+{
+	return ((int)in - 0x80) / 128.0f;
+}
+
+static inline float s24le_to_float(int32_t in)
+{
+	return (int32_t)((uint32_t)in << 8) / 2147483648.0f;
+}
+
+static inline float s32le_to_float(int32_t in)
+{
+	return in / 2147483648.0f;
+}
+
+static inline uint8_t float_to_u8(float in)
+{
+	float f = in * 128.0f;
+
+	if (f > 127.0f)
+		f = 127.0f;
+	else if (f < -128.0f)
+		f = -128.0f;
+	return (uint8_t)((int)f + 128);
+}
+
+static inline int32_t float_to_s24le(float in)
+{
+	float f = in * 8388608.0f;
+
+	if (f > 8388607.0f)
+		f = 8388607.0f;
+	else if (f < -8388608.0f)
+		f = -8388608.0f;
+	return (int32_t)f;
+}
+
+static inline int32_t float_to_s32le(float in)
+{
+	float f = in * 2147483648.0f;
+
+	/* 2^31 - 1 isn't a float, it rounds up to 2^31. */
+	if (f >= 2147483648.0f)
+		return 0x7fffffff;
+	if (f < -2147483648.0f)
+		f = -2147483648.0f;
+	return (int32_t)f;
+}
+
+/* Converts from U8 to FLOAT. */
+static void convert_u8_to_floatle(const uint8_t *in, size_t in_samples,
+				  uint8_t *out)
+{
+	size_t i;
+	float *_out = (float *)out;
+
+	for (i = 0; i < in_samples; i++, in++, _out++)
+		*_out = u8_to_float(*in);
+}
+
+/* Converts from S24 to FLOAT. */
+static void convert_s24le_to_floatle(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	size_t i;
+	int32_t *_in = (int32_t *)in;
+	float *_out = (float *)out;
+
+	for (i = 0; i < in_samples; i++, _in++, _out++)
+		*_out = s24le_to_float(*_in);
+}
+
+/* Converts from S32 to FLOAT. */
+static void convert_s32le_to_floatle(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	size_t i;
+	int32_t *_in = (int32_t *)in;
+	float *_out = (float *)out;
+
+	for (i = 0; i < in_samples; i++, _in++, _out++)
+		*_out = s32le_to_float(*_in);
+}
+
+/* Converts from FLOAT to U8, clipping. */
+static void convert_floatle_to_u8(const uint8_t *in, size_t in_samples,
+				  uint8_t *out)
+{
+	size_t i;
+	float *_in = (float *)in;
+
+	for (i = 0; i < in_samples; i++, _in++, out++)
+		*out = float_to_u8(*_in);
+}
+
+/* Converts from FLOAT to S24, clipping. */
+static void convert_floatle_to_s24le(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	size_t i;
+	float *_in = (float *)in;
+	int32_t *_out = (int32_t *)out;
+
+	for (i = 0; i < in_samples; i++, _in++, _out++)
+		*_out = float_to_s24le(*_in);
+}
+
+/* Converts from FLOAT to S32, clipping. */
+static void convert_floatle_to_s32le(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	size_t i;
+	float *_in = (float *)in;
+	int32_t *_out = (int32_t *)out;
+
+	for (i = 0; i < in_samples; i++, _in++, _out++)
+		*_out = float_to_s32le(*_in);
+}
+
+/*
+ * Convert channels with a matrix of up to MAX_MATRIX_CHANNELS channels.
+ */
+
+/* Converts channels with the non-zero coefficients of the precomputed
+ * matrix.  Same results as convert_channels. */
+static size_t matrix_channels(struct cras_fmt_conv *conv,
+			      const int16_t *in, size_t in_frames,
+			      int16_t *out)
+{
+	const struct channel_matrix *m = &conv->mtx;
+	size_t in_ch = conv->in_fmt.num_channels;
+	size_t out_ch = conv->out_fmt.num_channels;
+	size_t fr, i, t;
+
+	for (fr = 0; fr < in_frames; fr++, in += in_ch, out += out_ch) {
+		for (i = 0; i < out_ch; i++) {
+			int32_t sum = 0;
+
+			for (t = 0; t < m->row_len[i]; t++)
+				sum += m->row_coef[i][t] * in[m->row_ch[i][t]];
+			sum = max(sum, -0x8000);
+			sum = min(sum, 0x7fff);
+			out[i] = sum;
+		}
+	}
+	return in_frames;
+}
+
+/* Converts channels with a matrix that only reorders them. */
+static size_t permute_channels(struct cras_fmt_conv *conv,
+			       const int16_t *in, size_t in_frames,
+			       int16_t *out)
+{
+	const int8_t *perm = conv->mtx.perm;
+	size_t in_ch = conv->in_fmt.num_channels;
+	size_t out_ch = conv->out_fmt.num_channels;
+	size_t fr, i;
+
+	for (fr = 0; fr < in_frames; fr++, in += in_ch, out += out_ch)
+		for (i = 0; i < out_ch; i++)
+			out[i] = perm[i] < 0 ? 0 : in[perm[i]];
+	return in_frames;
+}
+
+/* The SIMD versions of the sample format converters match the C ones bit
+ * for bit.  S24LE samples are in 32 bit words so shifts are all they need.
+ * What doesn't fill a vector is left to the C code. */
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+#define FMT_CONV_SIMD
+
+static void convert_u8_to_s16le_neon(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	const uint8x16_t bias = vdupq_n_u8(0x80);
+	uint16_t *_out = (uint16_t *)out;
+	size_t i;
+
+	for (i = 0; i + 16 <= in_samples; i += 16) {
+		uint8x16_t x = veorq_u8(vld1q_u8(in + i), bias);
+
+		vst1q_u16(_out + i, vshll_n_u8(vget_low_u8(x), 8));
+		vst1q_u16(_out + i + 8, vshll_n_u8(vget_high_u8(x), 8));
+	}
+	convert_u8_to_s16le(in + i, in_samples - i, (uint8_t *)(_out + i));
+}
+
+static void convert_s24le_to_s16le_neon(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const int32_t *_in = (const int32_t *)in;
+	int16_t *_out = (int16_t *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8) {
+		int32x4_t a = vshlq_n_s32(vld1q_s32(_in + i), 8);
+		int32x4_t b = vshlq_n_s32(vld1q_s32(_in + i + 4), 8);
+
+		vst1q_s16(_out + i, vcombine_s16(vshrn_n_s32(a, 16),
+						 vshrn_n_s32(b, 16)));
+	}
+	convert_s24le_to_s16le((const uint8_t *)(_in + i), in_samples - i,
+			       (uint8_t *)(_out + i));
+}
+
+static void convert_s32le_to_s16le_neon(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const int32_t *_in = (const int32_t *)in;
+	int16_t *_out = (int16_t *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8)
+		vst1q_s16(_out + i,
+			  vcombine_s16(vshrn_n_s32(vld1q_s32(_in + i), 16),
+				       vshrn_n_s32(vld1q_s32(_in + i + 4),
+						   16)));
+	convert_s32le_to_s16le((const uint8_t *)(_in + i), in_samples - i,
+			       (uint8_t *)(_out + i));
+}
+
+static void convert_floatle_to_s16le_neon(const uint8_t *in,
+					  size_t in_samples, uint8_t *out)
+{
+	const float *_in = (const float *)in;
+	int16_t *_out = (int16_t *)out;
+	const float32x4_t scale = vdupq_n_f32(32768.0f);
+	const float32x4_t hi = vdupq_n_f32(32767.0f);
+	const float32x4_t lo = vdupq_n_f32(-32768.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8) {
+		float32x4_t a = vmulq_f32(vld1q_f32(_in + i), scale);
+		float32x4_t b = vmulq_f32(vld1q_f32(_in + i + 4), scale);
+
+		a = vmaxq_f32(vminq_f32(a, hi), lo);
+		b = vmaxq_f32(vminq_f32(b, hi), lo);
+		vst1q_s16(_out + i,
+			  vcombine_s16(vmovn_s32(vcvtq_s32_f32(a)),
+				       vmovn_s32(vcvtq_s32_f32(b))));
+	}
+	convert_floatle_to_s16le((const uint8_t *)(_in + i), in_samples - i,
+				 (uint8_t *)(_out + i));
+}
+
+static void convert_s16le_to_u8_neon(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	const int16_t *_in = (const int16_t *)in;
+	const uint8x16_t bias = vdupq_n_u8(0x80);
+	size_t i;
+
+	for (i = 0; i + 16 <= in_samples; i += 16) {
+		int8x16_t x = vcombine_s8(vshrn_n_s16(vld1q_s16(_in + i), 8),
+					  vshrn_n_s16(vld1q_s16(_in + i + 8),
+						      8));
+
+		vst1q_u8(out + i, veorq_u8(vreinterpretq_u8_s8(x), bias));
+	}
+	convert_s16le_to_u8((const uint8_t *)(_in + i), in_samples - i,
+			    out + i);
+}
+
+static void convert_s16le_to_s24le_neon(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const int16_t *_in = (const int16_t *)in;
+	int32_t *_out = (int32_t *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8) {
+		int16x8_t x = vld1q_s16(_in + i);
+
+		vst1q_s32(_out + i, vshll_n_s16(vget_low_s16(x), 8));
+		vst1q_s32(_out + i + 4, vshll_n_s16(vget_high_s16(x), 8));
+	}
+	convert_s16le_to_s24le((const uint8_t *)(_in + i), in_samples - i,
+			       (uint8_t *)(_out + i));
+}
+
+static void convert_s16le_to_s32le_neon(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const int16_t *_in = (const int16_t *)in;
+	int32_t *_out = (int32_t *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8) {
+		int16x8_t x = vld1q_s16(_in + i);
+
+		vst1q_s32(_out + i, vshll_n_s16(vget_low_s16(x), 16));
+		vst1q_s32(_out + i + 4, vshll_n_s16(vget_high_s16(x), 16));
+	}
+	convert_s16le_to_s32le((const uint8_t *)(_in + i), in_samples - i,
+			       (uint8_t *)(_out + i));
+}
+
+static void convert_s16le_to_floatle_neon(const uint8_t *in,
+					  size_t in_samples, uint8_t *out)
+{
+	const int16_t *_in = (const int16_t *)in;
+	float *_out = (float *)out;
+	const float32x4_t scale = vdupq_n_f32(1.0f / 32768.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8) {
+		int16x8_t x = vld1q_s16(_in + i);
+
+		vst1q_f32(_out + i, vmulq_f32(vcvtq_f32_s32(
+				vmovl_s16(vget_low_s16(x))), scale));
+		vst1q_f32(_out + i + 4, vmulq_f32(vcvtq_f32_s32(
+				vmovl_s16(vget_high_s16(x))), scale));
+	}
+	convert_s16le_to_floatle((const uint8_t *)(_in + i), in_samples - i,
+				 (uint8_t *)(_out + i));
+}
+
+static size_t matrix_channels_neon(struct cras_fmt_conv *conv,
+				   const int16_t *in, size_t in_frames,
+				   int16_t *out)
+{
+	const struct channel_matrix *m = &conv->mtx;
+	size_t in_ch = conv->in_fmt.num_channels;
+	size_t out_ch = conv->out_fmt.num_channels;
+	size_t out_samples = in_frames * out_ch;
+	int16_t last[MAX_MATRIX_CHANNELS];
+	size_t fr, c;
+
+	for (fr = 0; fr < in_frames; fr++, in += in_ch) {
+		int32x4_t lo = vdupq_n_s32(0);
+		int32x4_t hi = vdupq_n_s32(0);
+		int16x8_t v;
+
+		for (c = 0; c < m->num_cols; c++) {
+			float32x4_t x = vdupq_n_f32(in[m->col_ch[c]]);
+
+			lo = vcvtq_s32_f32(vaddq_f32(vcvtq_f32_s32(lo),
+				vmulq_f32(vld1q_f32(m->cols[c]), x)));
+			if (out_ch > 4)
+				hi = vcvtq_s32_f32(vaddq_f32(vcvtq_f32_s32(hi),
+					vmulq_f32(vld1q_f32(m->cols[c] + 4),
+						  x)));
+		}
+		v = vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi));
+		if (fr * out_ch + MAX_MATRIX_CHANNELS <= out_samples) {
+			vst1q_s16(out + fr * out_ch, v);
+		} else {
+			vst1q_s16(last, v);
+			memcpy(out + fr * out_ch, last, out_ch * sizeof(*out));
+		}
+	}
+	return in_frames;
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define FMT_CONV_SIMD
+
+__attribute__((target("sse2")))
+static void convert_u8_to_s16le_sse2(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i *_out = (__m128i *)out;
+	size_t i;
+
+	for (i = 0; i + 16 <= in_samples; i += 16, _out += 2) {
+		__m128i x = _mm_xor_si128(
+			_mm_loadu_si128((const __m128i *)(in + i)), bias);
+
+		_mm_storeu_si128(_out, _mm_unpacklo_epi8(zero, x));
+		_mm_storeu_si128(_out + 1, _mm_unpackhi_epi8(zero, x));
+	}
+	convert_u8_to_s16le(in + i, in_samples - i, (uint8_t *)_out);
+}
+
+__attribute__((target("sse2")))
+static void convert_s24le_to_s16le_sse2(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const __m128i *_in = (const __m128i *)in;
+	__m128i *_out = (__m128i *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8, _in += 2, _out++) {
+		__m128i a = _mm_slli_epi32(_mm_loadu_si128(_in), 8);
+		__m128i b = _mm_slli_epi32(_mm_loadu_si128(_in + 1), 8);
+
+		_mm_storeu_si128(_out, _mm_packs_epi32(_mm_srai_epi32(a, 16),
+						       _mm_srai_epi32(b, 16)));
+	}
+	convert_s24le_to_s16le((const uint8_t *)_in, in_samples - i,
+			       (uint8_t *)_out);
+}
+
+__attribute__((target("sse2")))
+static void convert_s32le_to_s16le_sse2(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const __m128i *_in = (const __m128i *)in;
+	__m128i *_out = (__m128i *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8, _in += 2, _out++)
+		_mm_storeu_si128(_out, _mm_packs_epi32(
+			_mm_srai_epi32(_mm_loadu_si128(_in), 16),
+			_mm_srai_epi32(_mm_loadu_si128(_in + 1), 16)));
+	convert_s32le_to_s16le((const uint8_t *)_in, in_samples - i,
+			       (uint8_t *)_out);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i float_to_s32_sse2(__m128 f)
+{
+	f = _mm_mul_ps(f, _mm_set1_ps(32768.0f));
+	f = _mm_max_ps(_mm_min_ps(f, _mm_set1_ps(32767.0f)),
+		       _mm_set1_ps(-32768.0f));
+	return _mm_cvttps_epi32(f);
+}
+
+__attribute__((target("sse2")))
+static void convert_floatle_to_s16le_sse2(const uint8_t *in,
+					  size_t in_samples, uint8_t *out)
+{
+	const float *_in = (const float *)in;
+	__m128i *_out = (__m128i *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8, _out++)
+		_mm_storeu_si128(_out, _mm_packs_epi32(
+			float_to_s32_sse2(_mm_loadu_ps(_in + i)),
+			float_to_s32_sse2(_mm_loadu_ps(_in + i + 4))));
+	convert_floatle_to_s16le((const uint8_t *)(_in + i), in_samples - i,
+				 (uint8_t *)_out);
+}
+
+__attribute__((target("sse2")))
+static void convert_s16le_to_u8_sse2(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	const __m128i *_in = (const __m128i *)in;
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	size_t i;
+
+	for (i = 0; i + 16 <= in_samples; i += 16, _in += 2) {
+		__m128i x = _mm_packs_epi16(
+			_mm_srai_epi16(_mm_loadu_si128(_in), 8),
+			_mm_srai_epi16(_mm_loadu_si128(_in + 1), 8));
+
+		_mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(x, bias));
+	}
+	convert_s16le_to_u8((const uint8_t *)_in, in_samples - i, out + i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s16le_to_s24le_sse2(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const __m128i *_in = (const __m128i *)in;
+	__m128i *_out = (__m128i *)out;
+	size_t i;
+
+	/* Unpack to the high half and shift down to sign extend. */
+	for (i = 0; i + 8 <= in_samples; i += 8, _in++, _out += 2) {
+		__m128i x = _mm_loadu_si128(_in);
+
+		_mm_storeu_si128(_out, _mm_slli_epi32(
+			_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16), 8));
+		_mm_storeu_si128(_out + 1, _mm_slli_epi32(
+			_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16), 8));
+	}
+	convert_s16le_to_s24le((const uint8_t *)_in, in_samples - i,
+			       (uint8_t *)_out);
+}
+
+__attribute__((target("sse2")))
+static void convert_s16le_to_s32le_sse2(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const __m128i *_in = (const __m128i *)in;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i *_out = (__m128i *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8, _in++, _out += 2) {
+		__m128i x = _mm_loadu_si128(_in);
+
+		_mm_storeu_si128(_out, _mm_unpacklo_epi16(zero, x));
+		_mm_storeu_si128(_out + 1, _mm_unpackhi_epi16(zero, x));
+	}
+	convert_s16le_to_s32le((const uint8_t *)_in, in_samples - i,
+			       (uint8_t *)_out);
+}
+
+__attribute__((target("sse2")))
+static void convert_s16le_to_floatle_sse2(const uint8_t *in,
+					  size_t in_samples, uint8_t *out)
+{
+	const __m128i *_in = (const __m128i *)in;
+	const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+	float *_out = (float *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8, _in++) {
+		__m128i x = _mm_loadu_si128(_in);
+
+		_mm_storeu_ps(_out + i, _mm_mul_ps(_mm_cvtepi32_ps(
+			_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)), scale));
+		_mm_storeu_ps(_out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(
+			_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)), scale));
+	}
+	convert_s16le_to_floatle((const uint8_t *)_in, in_samples - i,
+				 (uint8_t *)(_out + i));
+}
+
+/* AVX2 packs within each 128 bit lane, the permutes put the halves of the
+ * two sources back in order. */
+__attribute__((target("avx2")))
+static void convert_u8_to_s16le_avx2(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	__m256i *_out = (__m256i *)out;
+	size_t i;
+
+	for (i = 0; i + 16 <= in_samples; i += 16, _out++) {
+		__m128i x = _mm_xor_si128(
+			_mm_loadu_si128((const __m128i *)(in + i)), bias);
+
+		_mm256_storeu_si256(_out, _mm256_slli_epi16(
+			_mm256_cvtepu8_epi16(x), 8));
+	}
+	convert_u8_to_s16le(in + i, in_samples - i, (uint8_t *)_out);
+}
+
+__attribute__((target("avx2")))
+static void convert_s24le_to_s16le_avx2(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const __m256i *_in = (const __m256i *)in;
+	__m256i *_out = (__m256i *)out;
+	size_t i;
+
+	for (i = 0; i + 16 <= in_samples; i += 16, _in += 2, _out++) {
+		__m256i a = _mm256_slli_epi32(_mm256_loadu_si256(_in), 8);
+		__m256i b = _mm256_slli_epi32(_mm256_loadu_si256(_in + 1), 8);
+
+		a = _mm256_packs_epi32(_mm256_srai_epi32(a, 16),
+				       _mm256_srai_epi32(b, 16));
+		_mm256_storeu_si256(_out, _mm256_permute4x64_epi64(a, 0xd8));
+	}
+	convert_s24le_to_s16le_sse2((const uint8_t *)_in, in_samples - i,
+				    (uint8_t *)_out);
+}
+
+__attribute__((target("avx2")))
+static void convert_s32le_to_s16le_avx2(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const __m256i *_in = (const __m256i *)in;
+	__m256i *_out = (__m256i *)out;
+	size_t i;
+
+	for (i = 0; i + 16 <= in_samples; i += 16, _in += 2, _out++) {
+		__m256i a = _mm256_packs_epi32(
+			_mm256_srai_epi32(_mm256_loadu_si256(_in), 16),
+			_mm256_srai_epi32(_mm256_loadu_si256(_in + 1), 16));
+
+		_mm256_storeu_si256(_out, _mm256_permute4x64_epi64(a, 0xd8));
+	}
+	convert_s32le_to_s16le_sse2((const uint8_t *)_in, in_samples - i,
+				    (uint8_t *)_out);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i float_to_s32_avx2(__m256 f)
+{
+	f = _mm256_mul_ps(f, _mm256_set1_ps(32768.0f));
+	f = _mm256_max_ps(_mm256_min_ps(f, _mm256_set1_ps(32767.0f)),
+			  _mm256_set1_ps(-32768.0f));
+	return _mm256_cvttps_epi32(f);
+}
+
+__attribute__((target("avx2")))
+static void convert_floatle_to_s16le_avx2(const uint8_t *in,
+					  size_t in_samples, uint8_t *out)
+{
+	const float *_in = (const float *)in;
+	__m256i *_out = (__m256i *)out;
+	size_t i;
+
+	for (i = 0; i + 16 <= in_samples; i += 16, _out++) {
+		__m256i a = _mm256_packs_epi32(
+			float_to_s32_avx2(_mm256_loadu_ps(_in + i)),
+			float_to_s32_avx2(_mm256_loadu_ps(_in + i + 8)));
+
+		_mm256_storeu_si256(_out, _mm256_permute4x64_epi64(a, 0xd8));
+	}
+	convert_floatle_to_s16le_sse2((const uint8_t *)(_in + i),
+				      in_samples - i, (uint8_t *)_out);
+}
+
+__attribute__((target("avx2")))
+static void convert_s16le_to_u8_avx2(const uint8_t *in, size_t in_samples,
+				     uint8_t *out)
+{
+	const __m256i *_in = (const __m256i *)in;
+	const __m256i bias = _mm256_set1_epi8((char)0x80);
+	size_t i;
+
+	for (i = 0; i + 32 <= in_samples; i += 32, _in += 2) {
+		__m256i x = _mm256_packs_epi16(
+			_mm256_srai_epi16(_mm256_loadu_si256(_in), 8),
+			_mm256_srai_epi16(_mm256_loadu_si256(_in + 1), 8));
+
+		x = _mm256_permute4x64_epi64(x, 0xd8);
+		_mm256_storeu_si256((__m256i *)(out + i),
+				    _mm256_xor_si256(x, bias));
+	}
+	convert_s16le_to_u8_sse2((const uint8_t *)_in, in_samples - i,
+				 out + i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s16le_to_s24le_avx2(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const __m128i *_in = (const __m128i *)in;
+	__m256i *_out = (__m256i *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8, _in++, _out++)
+		_mm256_storeu_si256(_out, _mm256_slli_epi32(
+			_mm256_cvtepi16_epi32(_mm_loadu_si128(_in)), 8));
+	convert_s16le_to_s24le((const uint8_t *)_in, in_samples - i,
+			       (uint8_t *)_out);
+}
+
+__attribute__((target("avx2")))
+static void convert_s16le_to_s32le_avx2(const uint8_t *in, size_t in_samples,
+					uint8_t *out)
+{
+	const __m128i *_in = (const __m128i *)in;
+	__m256i *_out = (__m256i *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8, _in++, _out++)
+		_mm256_storeu_si256(_out, _mm256_slli_epi32(
+			_mm256_cvtepi16_epi32(_mm_loadu_si128(_in)), 16));
+	convert_s16le_to_s32le((const uint8_t *)_in, in_samples - i,
+			       (uint8_t *)_out);
+}
+
+__attribute__((target("avx2")))
+static void convert_s16le_to_floatle_avx2(const uint8_t *in,
+					  size_t in_samples, uint8_t *out)
+{
+	const __m128i *_in = (const __m128i *)in;
+	const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+	float *_out = (float *)out;
+	size_t i;
+
+	for (i = 0; i + 8 <= in_samples; i += 8, _in++)
+		_mm256_storeu_ps(_out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(
+			_mm256_cvtepi16_epi32(_mm_loadu_si128(_in))), scale));
+	convert_s16le_to_floatle((const uint8_t *)_in, in_samples - i,
+				 (uint8_t *)(_out + i));
+}
+
+/* The SIMD matrix converters work out all the output channels of a frame
+ * at once, one lane each.  Like the C code they add the input channels in
+ * order and truncate the sum to an integer after each one.  The last frames
+ * go through a small buffer so that nothing is written past the output. */
+__attribute__((target("sse2")))
+static size_t matrix_channels_sse2(struct cras_fmt_conv *conv,
+				   const int16_t *in, size_t in_frames,
+				   int16_t *out)
+{
+	const struct channel_matrix *m = &conv->mtx;
+	size_t in_ch = conv->in_fmt.num_channels;
+	size_t out_ch = conv->out_fmt.num_channels;
+	size_t out_samples = in_frames * out_ch;
+	int16_t last[MAX_MATRIX_CHANNELS];
+	size_t fr, c;
+
+	for (fr = 0; fr < in_frames; fr++, in += in_ch) {
+		__m128i lo = _mm_setzero_si128();
+		__m128i hi = _mm_setzero_si128();
+		__m128i v;
+
+		for (c = 0; c < m->num_cols; c++) {
+			__m128 x = _mm_set1_ps(in[m->col_ch[c]]);
+
+			lo = _mm_cvttps_epi32(_mm_add_ps(_mm_cvtepi32_ps(lo),
+				_mm_mul_ps(_mm_loadu_ps(m->cols[c]), x)));
+			if (out_ch > 4)
+				hi = _mm_cvttps_epi32(_mm_add_ps(
+					_mm_cvtepi32_ps(hi),
+					_mm_mul_ps(_mm_loadu_ps(m->cols[c] + 4),
+						   x)));
+		}
+		v = _mm_packs_epi32(lo, hi);
+		if (fr * out_ch + MAX_MATRIX_CHANNELS <= out_samples) {
+			_mm_storeu_si128((__m128i *)(out + fr * out_ch), v);
+		} else {
+			_mm_storeu_si128((__m128i *)last, v);
+			memcpy(out + fr * out_ch, last, out_ch * sizeof(*out));
+		}
+	}
+	return in_frames;
+}
+
+__attribute__((target("avx2")))
+static size_t matrix_channels_avx2(struct cras_fmt_conv *conv,
+				   const int16_t *in, size_t in_frames,
+				   int16_t *out)
+{
+	const struct channel_matrix *m = &conv->mtx;
+	size_t in_ch = conv->in_fmt.num_channels;
+	size_t out_ch = conv->out_fmt.num_channels;
+	size_t out_samples = in_frames * out_ch;
+	int16_t last[MAX_MATRIX_CHANNELS];
+	size_t fr, c;
+
+	for (fr = 0; fr < in_frames; fr++, in += in_ch) {
+		__m256i acc = _mm256_setzero_si256();
+		__m128i v;
+
+		for (c = 0; c < m->num_cols; c++)
+			acc = _mm256_cvttps_epi32(_mm256_add_ps(
+				_mm256_cvtepi32_ps(acc),
+				_mm256_mul_ps(_mm256_loadu_ps(m->cols[c]),
+					_mm256_set1_ps(in[m->col_ch[c]]))));
+		v = _mm_packs_epi32(_mm256_castsi256_si128(acc),
+				    _mm256_extracti128_si256(acc, 1));
+		if (fr * out_ch + MAX_MATRIX_CHANNELS <= out_samples) {
+			_mm_storeu_si128((__m128i *)(out + fr * out_ch), v);
+		} else {
+			_mm_storeu_si128((__m128i *)last, v);
+			memcpy(out + fr * out_ch, last, out_ch * sizeof(*out));
+		}
+	}
+	return in_frames;
+}
+
+/* Reorders the channels of a frame with one byte shuffle.  Frames too close
+ * to the end of the buffers for a full vector are left to the C code. */
+__attribute__((target("avx2")))
+static size_t permute_channels_avx2(struct cras_fmt_conv *conv,
+				    const int16_t *in, size_t in_frames,
+				    int16_t *out)
+{
+	size_t in_ch = conv->in_fmt.num_channels;
+	size_t out_ch = conv->out_fmt.num_channels;
+	__m128i shuffle = _mm_loadu_si128((const __m128i *)conv->mtx.shuffle);
+	size_t fr;
+
+	for (fr = 0; fr * in_ch + MAX_MATRIX_CHANNELS <= in_frames * in_ch &&
+		     fr * out_ch + MAX_MATRIX_CHANNELS <= in_frames * out_ch;
+	     fr++)
+		_mm_storeu_si128((__m128i *)(out + fr * out_ch),
+			_mm_shuffle_epi8(_mm_loadu_si128(
+				(const __m128i *)(in + fr * in_ch)), shuffle));
+	permute_channels(conv, in + fr * in_ch, in_frames - fr,
+			 out + fr * out_ch);
+	return in_frames;
+}
+#endif
+
+/* Converters from and to S16LE and channel matrix converters, one set for
+ * each instruction set. */
+struct sample_format_converters {
+	sample_format_converter_t u8_to_s16le;
+	sample_format_converter_t s24le_to_s16le;
+	sample_format_converter_t s32le_to_s16le;
+	sample_format_converter_t floatle_to_s16le;
+	sample_format_converter_t s16le_to_u8;
+	sample_format_converter_t s16le_to_s24le;
+	sample_format_converter_t s16le_to_s32le;
+	sample_format_converter_t s16le_to_floatle;
+	channel_converter_t matrix_channels;
+	channel_converter_t permute_channels;
+};
+
+static const struct sample_format_converters c_converters = {
+	convert_u8_to_s16le,
+	convert_s24le_to_s16le,
+	convert_s32le_to_s16le,
+	convert_floatle_to_s16le,
+	convert_s16le_to_u8,
+	convert_s16le_to_s24le,
+	convert_s16le_to_s32le,
+	convert_s16le_to_floatle,
+	matrix_channels,
+	permute_channels,
+};
+
+#if defined(__ARM_NEON__)
+static const struct sample_format_converters neon_converters = {
+	convert_u8_to_s16le_neon,
+	convert_s24le_to_s16le_neon,
+	convert_s32le_to_s16le_neon,
+	convert_floatle_to_s16le_neon,
+	convert_s16le_to_u8_neon,
+	convert_s16le_to_s24le_neon,
+	convert_s16le_to_s32le_neon,
+	convert_s16le_to_floatle_neon,
+	matrix_channels_neon,
+	permute_channels,
+};
+#elif defined(FMT_CONV_SIMD)
+static const struct sample_format_converters sse2_converters = {
+	convert_u8_to_s16le_sse2,
+	convert_s24le_to_s16le_sse2,
+	convert_s32le_to_s16le_sse2,
+	convert_floatle_to_s16le_sse2,
+	convert_s16le_to_u8_sse2,
+	convert_s16le_to_s24le_sse2,
+	convert_s16le_to_s32le_sse2,
+	convert_s16le_to_floatle_sse2,
+	matrix_channels_sse2,
+	permute_channels,
+};
+
+static const struct sample_format_converters avx2_converters = {
+	convert_u8_to_s16le_avx2,
+	convert_s24le_to_s16le_avx2,
+	convert_s32le_to_s16le_avx2,
+	convert_floatle_to_s16le_avx2,
+	convert_s16le_to_u8_avx2,
+	convert_s16le_to_s24le_avx2,
+	convert_s16le_to_s32le_avx2,
+	convert_s16le_to_floatle_avx2,
+	matrix_channels_avx2,
+	permute_channels_avx2,
+};
+#endif
+
+/* CPU features the converters are allowed to use. */
+static unsigned int allowed_cpu_flags = ~0U;
+
+/* Returns the fastest converters the running CPU can use. */
+static const struct sample_format_converters *get_converters()
+{
+	unsigned int flags = cras_cpu_get_flags() & allowed_cpu_flags;
+
+#if defined(__ARM_NEON__)
+	if (flags & CRAS_CPU_NEON)
+		return &neon_converters;
+#elif defined(FMT_CONV_SIMD)
+	if (flags & CRAS_CPU_AVX2)
+		return &avx2_converters;
+	if (flags & CRAS_CPU_SSE2)
+		return &sse2_converters;
+#endif
+	return &c_converters;
 }
 
 /*
@@ -354,65 +1348,432 @@ static void surround51_to_stereo_downmix_mtx(float **mtx,
 	normalize_buf(mtx[STEREO_R], 6);
 }
 
+/* Precomputes ch_conv_mtx for the matrix converters, returns the one to use
+ * or convert_channels if there are too many channels for them. */
+static channel_converter_t prepare_channel_matrix(
+		struct cras_fmt_conv *conv,
+		const struct sample_format_converters *convs)
+{
+	struct channel_matrix *m = &conv->mtx;
+	size_t in_ch = conv->in_fmt.num_channels;
+	size_t out_ch = conv->out_fmt.num_channels;
+	size_t i, c;
+
+	if (in_ch > MAX_MATRIX_CHANNELS || out_ch > MAX_MATRIX_CHANNELS)
+		return convert_channels;
+
+	m->is_permutation = 1;
+	memset(m->shuffle, 0x80, sizeof(m->shuffle));
+	for (i = 0; i < out_ch; i++) {
+		m->perm[i] = -1;
+		for (c = 0; c < in_ch; c++) {
+			if (conv->ch_conv_mtx[i][c] == 0.0f)
+				continue;
+			m->row_ch[i][m->row_len[i]] = c;
+			m->row_coef[i][m->row_len[i]] = conv->ch_conv_mtx[i][c];
+			m->row_len[i]++;
+		}
+		if (m->row_len[i] > 1 ||
+		    (m->row_len[i] == 1 && m->row_coef[i][0] != 1.0f)) {
+			m->is_permutation = 0;
+		} else if (m->row_len[i] == 1) {
+			m->perm[i] = m->row_ch[i][0];
+			m->shuffle[2 * i] = 2 * m->perm[i];
+			m->shuffle[2 * i + 1] = 2 * m->perm[i] + 1;
+		}
+	}
+
+	for (c = 0; c < in_ch; c++) {
+		for (i = 0; i < out_ch; i++)
+			if (conv->ch_conv_mtx[i][c] != 0.0f)
+				break;
+		if (i == out_ch)
+			continue;
+		for (i = 0; i < out_ch; i++)
+			m->cols[m->num_cols][i] = conv->ch_conv_mtx[i][c];
+		m->col_ch[m->num_cols++] = c;
+	}
+
+	return m->is_permutation ? convs->permute_channels
+				 : convs->matrix_channels;
+}
+
+/* Converts float channels with the coefficient matrix, leaving clipping to
+ * the output format converter. */
+static size_t float_convert_channels(struct cras_fmt_conv *conv,
+				     const float *in, size_t in_frames,
+				     float *out)
+{
+	size_t in_ch = conv->in_fmt.num_channels;
+	size_t out_ch = conv->out_fmt.num_channels;
+	size_t fr, i, c;
+
+	for (fr = 0; fr < in_frames; fr++, in += in_ch, out += out_ch) {
+		for (i = 0; i < out_ch; i++) {
+			const float *coef = conv->ch_conv_mtx[i];
+			float sum = 0.0f;
+
+			for (c = 0; c < in_ch; c++)
+				sum += coef[c] * in[c];
+			out[i] = sum;
+		}
+	}
+	return in_frames;
+}
+
+/* Sets up the float path to mix channels as channel_converter does, with
+ * ch_conv_mtx holding its coefficients.  Returns 0 or -ENOMEM. */
+static int prepare_float_channels(struct cras_fmt_conv *conv)
+{
+	const int8_t *layout = conv->out_fmt.channel_layout;
+	float **mtx;
+
+	if (conv->ch_conv_mtx == NULL) {
+		conv->ch_conv_mtx = cras_channel_conv_matrix_alloc(
+				conv->in_fmt.num_channels,
+				conv->out_fmt.num_channels);
+		if (conv->ch_conv_mtx == NULL)
+			return -ENOMEM;
+		mtx = conv->ch_conv_mtx;
+
+		if (conv->channel_converter == s16_mono_to_stereo) {
+			mtx[STEREO_L][0] = 1.0f;
+			mtx[STEREO_R][0] = 1.0f;
+		} else if (conv->channel_converter == s16_stereo_to_mono) {
+			mtx[0][STEREO_L] = 1.0f;
+			mtx[0][STEREO_R] = 1.0f;
+		} else if (conv->channel_converter == s16_mono_to_51) {
+			if (layout[CRAS_CH_FC] != -1) {
+				mtx[layout[CRAS_CH_FC]][0] = 1.0f;
+			} else if (layout[CRAS_CH_FL] != -1 &&
+				   layout[CRAS_CH_FR] != -1) {
+				mtx[layout[CRAS_CH_FL]][0] = 0.5f;
+				mtx[layout[CRAS_CH_FR]][0] = 0.5f;
+			} else {
+				mtx[0][0] = 1.0f;
+			}
+		} else if (conv->channel_converter == s16_stereo_to_51) {
+			if (layout[CRAS_CH_FL] != -1 &&
+			    layout[CRAS_CH_FR] != -1) {
+				mtx[layout[CRAS_CH_FL]][STEREO_L] = 1.0f;
+				mtx[layout[CRAS_CH_FR]][STEREO_R] = 1.0f;
+			} else if (layout[CRAS_CH_FC] != -1) {
+				mtx[layout[CRAS_CH_FC]][STEREO_L] = 1.0f;
+				mtx[layout[CRAS_CH_FC]][STEREO_R] = 1.0f;
+			} else {
+				mtx[0][STEREO_L] = 1.0f;
+				mtx[1][STEREO_R] = 1.0f;
+			}
+		} else if (conv->channel_converter == s16_51_to_stereo) {
+			/* Front left, right and center. */
+			mtx[STEREO_L][0] = 1.0f;
+			mtx[STEREO_L][4] = 0.5f;
+			mtx[STEREO_R][1] = 1.0f;
+			mtx[STEREO_R][4] = 0.5f;
+		}
+	}
+	conv->channel_converter = NULL;
+	conv->float_channel_converter = float_convert_channels;
+	return 0;
+}
+
+/*
+ * Fused conversions.
+ */
+
+/* Converters for common chains of stages that read each input sample once
+ * and write the output directly, with no temporary buffers.  They convert
+ * through S16 like the chain does, so the results are the same. */
+#define FUSED_CHANNEL_CONVERTERS(in_name, in_t, out_name, out_t)	\
+static size_t fused_##in_name##_to_##out_name##_mono_to_stereo(	\
+		struct cras_fmt_conv *conv, const uint8_t *in,		\
+		size_t in_frames, uint8_t *out)				\
+{									\
+	const in_t *_in = (const in_t *)in;				\
+	out_t *_out = (out_t *)out;					\
+	size_t i;							\
+									\
+	for (i = 0; i < in_frames; i++)					\
+		_out[2 * i] = _out[2 * i + 1] =				\
+			s16_to_##out_name(in_name##_to_s16(_in[i]));	\
+	return in_frames;						\
+}									\
+									\
+static size_t fused_##in_name##_to_##out_name##_stereo_to_mono(	\
+		struct cras_fmt_conv *conv, const uint8_t *in,		\
+		size_t in_frames, uint8_t *out)				\
+{									\
+	const in_t *_in = (const in_t *)in;				\
+	out_t *_out = (out_t *)out;					\
+	size_t i;							\
+									\
+	for (i = 0; i < in_frames; i++)					\
+		_out[i] = s16_to_##out_name(s16_add_and_clip(		\
+				in_name##_to_s16(_in[2 * i]),		\
+				in_name##_to_s16(_in[2 * i + 1])));	\
+	return in_frames;						\
+}
+
+#define FUSED_FORMAT_CONVERTER(in_name, in_t, out_name, out_t)		\
+static size_t fused_##in_name##_to_##out_name(				\
+		struct cras_fmt_conv *conv, const uint8_t *in,		\
+		size_t in_frames, uint8_t *out)				\
+{									\
+	const in_t *_in = (const in_t *)in;				\
+	out_t *_out = (out_t *)out;					\
+	size_t samples = in_frames * conv->in_fmt.num_channels;		\
+	size_t i;							\
+									\
+	for (i = 0; i < samples; i++)					\
+		_out[i] = s16_to_##out_name(in_name##_to_s16(_in[i]));	\
+	return in_frames;						\
+}
+
+FUSED_CHANNEL_CONVERTERS(u8, uint8_t, s16, int16_t)
+FUSED_CHANNEL_CONVERTERS(s24le, int32_t, s16, int16_t)
+FUSED_CHANNEL_CONVERTERS(s32le, int32_t, s16, int16_t)
+FUSED_CHANNEL_CONVERTERS(floatle, float, s16, int16_t)
+FUSED_CHANNEL_CONVERTERS(s16, int16_t, u8, uint8_t)
+FUSED_CHANNEL_CONVERTERS(s16, int16_t, s24le, int32_t)
+FUSED_CHANNEL_CONVERTERS(s16, int16_t, s32le, int32_t)
+FUSED_CHANNEL_CONVERTERS(s16, int16_t, floatle, float)
+
+FUSED_FORMAT_CONVERTER(u8, uint8_t, s24le, int32_t)
+FUSED_FORMAT_CONVERTER(u8, uint8_t, s32le, int32_t)
+FUSED_FORMAT_CONVERTER(u8, uint8_t, floatle, float)
+FUSED_FORMAT_CONVERTER(s24le, int32_t, u8, uint8_t)
+FUSED_FORMAT_CONVERTER(s24le, int32_t, s32le, int32_t)
+FUSED_FORMAT_CONVERTER(s24le, int32_t, floatle, float)
+FUSED_FORMAT_CONVERTER(s32le, int32_t, u8, uint8_t)
+FUSED_FORMAT_CONVERTER(s32le, int32_t, s24le, int32_t)
+FUSED_FORMAT_CONVERTER(s32le, int32_t, floatle, float)
+FUSED_FORMAT_CONVERTER(floatle, float, u8, uint8_t)
+FUSED_FORMAT_CONVERTER(floatle, float, s24le, int32_t)
+FUSED_FORMAT_CONVERTER(floatle, float, s32le, int32_t)
+
+#define FUSED_CHANNEL_ENTRIES(in_fmt, in_name, out_fmt, out_name)	\
+	{ in_fmt, out_fmt, 1, 2,					\
+	  fused_##in_name##_to_##out_name##_mono_to_stereo },		\
+	{ in_fmt, out_fmt, 2, 1,					\
+	  fused_##in_name##_to_##out_name##_stereo_to_mono }
+
+#define FUSED_FORMAT_ENTRY(in_fmt, in_name, out_fmt, out_name)		\
+	{ in_fmt, out_fmt, 0, 0, fused_##in_name##_to_##out_name }
+
+/* The fused converters, by the formats and channel counts they convert
+ * between.  Zero channels is any count left unchanged. */
+static const struct {
+	snd_pcm_format_t in_format;
+	snd_pcm_format_t out_format;
+	size_t in_channels;
+	size_t out_channels;
+	fused_converter_t convert;
+} fused_converters[] = {
+	FUSED_CHANNEL_ENTRIES(SND_PCM_FORMAT_U8, u8,
+			      SND_PCM_FORMAT_S16_LE, s16),
+	FUSED_CHANNEL_ENTRIES(SND_PCM_FORMAT_S24_LE, s24le,
+			      SND_PCM_FORMAT_S16_LE, s16),
+	FUSED_CHANNEL_ENTRIES(SND_PCM_FORMAT_S32_LE, s32le,
+			      SND_PCM_FORMAT_S16_LE, s16),
+	FUSED_CHANNEL_ENTRIES(SND_PCM_FORMAT_FLOAT_LE, floatle,
+			      SND_PCM_FORMAT_S16_LE, s16),
+	FUSED_CHANNEL_ENTRIES(SND_PCM_FORMAT_S16_LE, s16,
+			      SND_PCM_FORMAT_U8, u8),
+	FUSED_CHANNEL_ENTRIES(SND_PCM_FORMAT_S16_LE, s16,
+			      SND_PCM_FORMAT_S24_LE, s24le),
+	FUSED_CHANNEL_ENTRIES(SND_PCM_FORMAT_S16_LE, s16,
+			      SND_PCM_FORMAT_S32_LE, s32le),
+	FUSED_CHANNEL_ENTRIES(SND_PCM_FORMAT_S16_LE, s16,
+			      SND_PCM_FORMAT_FLOAT_LE, floatle),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_U8, u8,
+			   SND_PCM_FORMAT_S24_LE, s24le),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_U8, u8,
+			   SND_PCM_FORMAT_S32_LE, s32le),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_U8, u8,
+			   SND_PCM_FORMAT_FLOAT_LE, floatle),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_S24_LE, s24le,
+			   SND_PCM_FORMAT_U8, u8),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_S24_LE, s24le,
+			   SND_PCM_FORMAT_S32_LE, s32le),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_S24_LE, s24le,
+			   SND_PCM_FORMAT_FLOAT_LE, floatle),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_S32_LE, s32le,
+			   SND_PCM_FORMAT_U8, u8),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_S32_LE, s32le,
+			   SND_PCM_FORMAT_S24_LE, s24le),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_S32_LE, s32le,
+			   SND_PCM_FORMAT_FLOAT_LE, floatle),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_FLOAT_LE, floatle,
+			   SND_PCM_FORMAT_U8, u8),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_FLOAT_LE, floatle,
+			   SND_PCM_FORMAT_S24_LE, s24le),
+	FUSED_FORMAT_ENTRY(SND_PCM_FORMAT_FLOAT_LE, floatle,
+			   SND_PCM_FORMAT_S32_LE, s32le),
+};
+
+/* Formats with more precision than S16. */
+static inline int is_wide_format(snd_pcm_format_t format)
+{
+	return format == SND_PCM_FORMAT_S24_LE ||
+	       format == SND_PCM_FORMAT_S32_LE ||
+	       format == SND_PCM_FORMAT_FLOAT_LE;
+}
+
+static inline int has_resampler(const struct cras_fmt_conv *conv)
+{
+	return conv->resampler || conv->speex_state;
+}
+
+/* Replaces the stages before the resampler, or all of them when there is
+ * none, with a fused converter if one covers them and there are at least two
+ * to save a pass over the samples.  The fused loops are scalar, so next to
+ * SIMD sample format converters they only pay off when they also take over
+ * the channel conversion of integer samples. */
+static void plan_fused_converter(
+		struct cras_fmt_conv *conv,
+		const struct sample_format_converters *convs)
+{
+	snd_pcm_format_t out_format = SND_PCM_FORMAT_S16_LE;
+	size_t in_channels = conv->in_fmt.num_channels;
+	size_t out_channels = conv->out_fmt.num_channels;
+	size_t stages;
+	unsigned i;
+
+	stages = !!conv->in_format_converter + !!conv->channel_converter;
+	if (!has_resampler(conv)) {
+		out_format = conv->out_fmt.format;
+		stages += !!conv->out_format_converter;
+	}
+	if (stages < 2)
+		return;
+
+	/* Other than mono and stereo conversions, channels must be left as
+	 * they are. */
+	if (conv->channel_converter != NULL &&
+	    conv->channel_converter != s16_mono_to_stereo &&
+	    conv->channel_converter != s16_stereo_to_mono)
+		return;
+	if (conv->channel_converter == NULL)
+		in_channels = out_channels = 0;
+
+	if (convs != &c_converters &&
+	    (conv->channel_converter == NULL ||
+	     conv->in_fmt.format == SND_PCM_FORMAT_FLOAT_LE ||
+	     out_format == SND_PCM_FORMAT_FLOAT_LE))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(fused_converters); i++) {
+		if (fused_converters[i].in_format != conv->in_fmt.format ||
+		    fused_converters[i].out_format != out_format ||
+		    fused_converters[i].in_channels != in_channels ||
+		    fused_converters[i].out_channels != out_channels)
+			continue;
+
+		syslog(LOG_DEBUG, "Fuse %zu conversion stages.", stages);
+		conv->fused_converter = fused_converters[i].convert;
+		conv->in_format_converter = NULL;
+		conv->channel_converter = NULL;
+		if (!has_resampler(conv))
+			conv->out_format_converter = NULL;
+		conv->num_converters -= stages - 1;
+		return;
+	}
+}
+
 /*
  * Exported interface
  */
 
-struct cras_fmt_conv *cras_fmt_conv_create(const struct cras_audio_format *in,
-					   const struct cras_audio_format *out,
-					   size_t max_frames)
+/* Creates a converter, with a resampler even between equal rates when it
+ * must be adjustable. */
+static struct cras_fmt_conv *fmt_conv_create(
+		const struct cras_audio_format *in,
+		const struct cras_audio_format *out,
+		size_t max_frames,
+		int adjustable)
 {
+	const struct sample_format_converters *convs = get_converters();
 	struct cras_fmt_conv *conv;
+	snd_pcm_format_t work_format;
 	int rc;
 	unsigned i;
 
-	/* Only support conversion to/from S16LE samples. */
-	if (out->format != SND_PCM_FORMAT_S16_LE &&
-	    in->format != SND_PCM_FORMAT_S16_LE) {
-		syslog(LOG_WARNING, "Invalid conversion %d %d",
-		       in->format, out->format);
-		return NULL;
-	}
-
 	conv = calloc(1, sizeof(*conv));
 	if (conv == NULL)
 		return NULL;
 	conv->in_fmt = *in;
 	conv->out_fmt = *out;
-
-	/* Set up sample format conversion. */
-	if (in->format != SND_PCM_FORMAT_S16_LE) {
+	conv->ratio = 1.0;
+
+	/* Set up sample format conversion.  Channels and rate are converted
+	 * in S16LE, or in FLOAT_LE when either side is wider than S16, so
+	 * formats other than that are converted from on the way in and to on
+	 * the way out.  Only changing the format needs no wider samples. */
+	conv->float_path = (is_wide_format(in->format) ||
+			    is_wide_format(out->format)) &&
+			   (in->num_channels != out->num_channels ||
+			    (in->num_channels > 2 &&
+			     !is_channel_layout_equal(in, out)) ||
+			    in->frame_rate != out->frame_rate || adjustable);
+	work_format = conv->float_path ? SND_PCM_FORMAT_FLOAT_LE
+				       : SND_PCM_FORMAT_S16_LE;
+	if (in->format != work_format) {
 		conv->num_converters++;
 		syslog(LOG_DEBUG, "Convert from format %d to %d.",
-		       in->format, out->format);
+		       in->format, work_format);
 		switch(in->format) {
 		case SND_PCM_FORMAT_U8:
-			conv->sample_format_converter = convert_u8_to_s16le;
+			conv->in_format_converter = conv->float_path
+					? convert_u8_to_floatle
+					: convs->u8_to_s16le;
+			break;
+		case SND_PCM_FORMAT_S16_LE:
+			conv->in_format_converter = convs->s16le_to_floatle;
 			break;
 		case SND_PCM_FORMAT_S24_LE:
-			conv->sample_format_converter = convert_s24le_to_s16le;
+			conv->in_format_converter = conv->float_path
+					? convert_s24le_to_floatle
+					: convs->s24le_to_s16le;
 			break;
 		case SND_PCM_FORMAT_S32_LE:
-			conv->sample_format_converter = convert_s32le_to_s16le;
+			conv->in_format_converter = conv->float_path
+					? convert_s32le_to_floatle
+					: convs->s32le_to_s16le;
+			break;
+		case SND_PCM_FORMAT_FLOAT_LE:
+			conv->in_format_converter = convs->floatle_to_s16le;
 			break;
 		default:
 			syslog(LOG_WARNING, "Invalid format %d", in->format);
 			cras_fmt_conv_destroy(conv);
 			return NULL;
 		}
-	} else if (out->format != SND_PCM_FORMAT_S16_LE) {
+	}
+	if (out->format != work_format) {
 		conv->num_converters++;
 		syslog(LOG_DEBUG, "Convert from format %d to %d.",
-		       in->format, out->format);
+		       work_format, out->format);
 		switch (out->format) {
 		case SND_PCM_FORMAT_U8:
-			conv->sample_format_converter = convert_s16le_to_u8;
+			conv->out_format_converter = conv->float_path
+					? convert_floatle_to_u8
+					: convs->s16le_to_u8;
+			break;
+		case SND_PCM_FORMAT_S16_LE:
+			conv->out_format_converter = convs->floatle_to_s16le;
 			break;
 		case SND_PCM_FORMAT_S24_LE:
-			conv->sample_format_converter = convert_s16le_to_s24le;
+			conv->out_format_converter = conv->float_path
+					? convert_floatle_to_s24le
+					: convs->s16le_to_s24le;
 			break;
 		case SND_PCM_FORMAT_S32_LE:
-			conv->sample_format_converter = convert_s16le_to_s32le;
+			conv->out_format_converter = conv->float_path
+					? convert_floatle_to_s32le
+					: convs->s16le_to_s32le;
+			break;
+		case SND_PCM_FORMAT_FLOAT_LE:
+			conv->out_format_converter = convs->s16le_to_floatle;
 			break;
 		default:
 			syslog(LOG_WARNING, "Invalid format %d", out->format);
@@ -456,10 +1817,11 @@ struct cras_fmt_conv *cras_fmt_conv_create(const struct cras_audio_format *in,
 					cras_fmt_conv_destroy(conv);
 					return NULL;
 				}
-				conv->channel_converter = convert_channels;
 				surround51_to_stereo_downmix_mtx(
 						conv->ch_conv_mtx,
 						conv->in_fmt.channel_layout);
+				conv->channel_converter =
+					prepare_channel_matrix(conv, convs);
 			} else {
 				conv->channel_converter = s16_51_to_stereo;
 			}
@@ -479,19 +1841,33 @@ struct cras_fmt_conv *cras_fmt_conv_create(const struct cras_audio_format *in,
 			cras_fmt_conv_destroy(conv);
 			return NULL;
 		}
-		conv->channel_converter = convert_channels;
+		conv->channel_converter = prepare_channel_matrix(conv, convs);
+	}
+	if (conv->float_path && conv->channel_converter &&
+	    prepare_float_channels(conv)) {
+		cras_fmt_conv_destroy(conv);
+		return NULL;
 	}
 	/* Set up sample rate conversion. */
-	if (in->frame_rate != out->frame_rate) {
+	if (in->frame_rate != out->frame_rate || adjustable) {
 		conv->num_converters++;
 		syslog(LOG_DEBUG, "Convert from %zu to %zu Hz.",
 		       in->frame_rate, out->frame_rate);
-		conv->speex_state = speex_resampler_init(out->num_channels,
-							 in->frame_rate,
-							 out->frame_rate,
-							 SPEEX_QUALITY_LEVEL,
-							 &rc);
-		if (conv->speex_state == NULL) {
+		conv->resampler = cras_resampler_create(out->num_channels,
+							in->frame_rate,
+							out->frame_rate,
+							resampler_quality(
+								in->frame_rate,
+								out->frame_rate));
+		/* Speex can't follow a ratio, it keeps the nominal rates. */
+		if (conv->resampler == NULL)
+			conv->speex_state = speex_resampler_init(
+					out->num_channels,
+					in->frame_rate,
+					out->frame_rate,
+					SPEEX_QUALITY_LEVEL,
+					&rc);
+		if (conv->resampler == NULL && conv->speex_state == NULL) {
 			syslog(LOG_ERR, "Fail to create speex:%zu %zu %zu %d",
 			       out->num_channels,
 			       in->frame_rate,
@@ -502,9 +1878,13 @@ struct cras_fmt_conv *cras_fmt_conv_create(const struct cras_audio_format *in,
 		}
 	}
 
+	/* The fused converters go through S16. */
+	if (!conv->float_path)
+		plan_fused_converter(conv, convs);
+
 	/* Need num_converters-1 temp buffers, the final converter renders
 	 * directly into the output. */
-	for (i = 0; i < conv->num_converters - 1; i++) {
+	for (i = 0; i + 1 < conv->num_converters; i++) {
 		conv->tmp_bufs[i] = malloc(
 			max_frames *
 			4 * /* width in bytes largest format. */
@@ -520,12 +1900,41 @@ struct cras_fmt_conv *cras_fmt_conv_create(const struct cras_audio_format *in,
 	return conv;
 }
 
+struct cras_fmt_conv *cras_fmt_conv_create(const struct cras_audio_format *in,
+					   const struct cras_audio_format *out,
+					   size_t max_frames)
+{
+	return fmt_conv_create(in, out, max_frames, 0);
+}
+
+struct cras_fmt_conv *cras_fmt_conv_create_adjustable(
+		const struct cras_audio_format *in,
+		const struct cras_audio_format *out,
+		size_t max_frames)
+{
+	return fmt_conv_create(in, out, max_frames, 1);
+}
+
+void cras_fmt_conv_prepare(const struct cras_audio_format *in,
+			   const struct cras_audio_format *out,
+			   int adjustable)
+{
+	if (in->frame_rate == out->frame_rate && !adjustable)
+		return;
+	/* Rates without a filter are left to speex. */
+	cras_resampler_prepare(in->frame_rate, out->frame_rate,
+			       resampler_quality(in->frame_rate,
+						 out->frame_rate));
+}
+
 void cras_fmt_conv_destroy(struct cras_fmt_conv *conv)
 {
 	unsigned i;
 	if (conv->ch_conv_mtx)
 		cras_channel_conv_matrix_destroy(conv->ch_conv_mtx,
 						 conv->out_fmt.num_channels);
+	if (conv->resampler)
+		cras_resampler_destroy(conv->resampler);
 	if (conv->speex_state)
 		speex_resampler_destroy(conv->speex_state);
 	for (i = 0; i < MAX_NUM_CONVERTERS - 1; i++)
@@ -536,17 +1945,34 @@ void cras_fmt_conv_destroy(struct cras_fmt_conv *conv)
 size_t cras_fmt_conv_in_frames_to_out(struct cras_fmt_conv *conv,
 				      size_t in_frames)
 {
-	return cras_frames_at_rate(conv->in_fmt.frame_rate,
-				   in_frames,
-				   conv->out_fmt.frame_rate);
+	size_t frames = cras_frames_at_rate(conv->in_fmt.frame_rate,
+					    in_frames,
+					    conv->out_fmt.frame_rate);
+
+	if (conv->ratio == 1.0)
+		return frames;
+	return ceil(frames * conv->ratio);
 }
 
 size_t cras_fmt_conv_out_frames_to_in(struct cras_fmt_conv *conv,
 				      size_t out_frames)
 {
-	return cras_frames_at_rate(conv->out_fmt.frame_rate,
-				   out_frames,
-				   conv->in_fmt.frame_rate);
+	size_t frames = cras_frames_at_rate(conv->out_fmt.frame_rate,
+					    out_frames,
+					    conv->in_fmt.frame_rate);
+
+	if (conv->ratio == 1.0)
+		return frames;
+	return ceil(frames / conv->ratio);
+}
+
+int cras_fmt_conv_set_ratio(struct cras_fmt_conv *conv, double ratio)
+{
+	if (!conv->resampler)
+		return -EINVAL;
+	conv->ratio = ratio;
+	cras_resampler_set_ratio(conv->resampler, ratio);
+	return 0;
 }
 
 size_t cras_fmt_conv_convert_frames(struct cras_fmt_conv *conv,
@@ -554,26 +1980,37 @@ size_t cras_fmt_conv_convert_frames(struct cras_fmt_conv *conv,
 				    uint8_t *out_buf,
 				    size_t in_frames,
 				    size_t out_frames)
+{
+	return cras_fmt_conv_convert_some_frames(conv, in_buf, out_buf,
+						 &in_frames, out_frames);
+}
+
+size_t cras_fmt_conv_convert_some_frames(struct cras_fmt_conv *conv,
+					 uint8_t *in_buf,
+					 uint8_t *out_buf,
+					 size_t *in_frames,
+					 size_t out_frames)
 {
 	uint32_t fr_in, fr_out;
 	uint8_t *buffers[MAX_NUM_CONVERTERS + 1]; /* converters + out buffer. */
 	size_t buf_idx = 0;
+	size_t i;
 	static int logged_frames_dont_fit;
 
 	assert(conv);
 
 	/* If no SRC, then in_frames should = out_frames. */
-	if (conv->speex_state == NULL) {
-		fr_in = min(in_frames, out_frames);
-		if (out_frames < in_frames && !logged_frames_dont_fit) {
+	if (!has_resampler(conv)) {
+		fr_in = min(*in_frames, out_frames);
+		if (out_frames < *in_frames && !logged_frames_dont_fit) {
 			syslog(LOG_INFO,
 			       "fmt_conv: %zu to %zu no SRC.",
-			       in_frames,
+			       *in_frames,
 			       out_frames);
 			logged_frames_dont_fit = 1;
 		}
 	} else {
-		fr_in = in_frames;
+		fr_in = *in_frames;
 	}
 	fr_out = fr_in;
 
@@ -581,17 +2018,20 @@ size_t cras_fmt_conv_convert_frames(struct cras_fmt_conv *conv,
 	 * is used as input to the second and so forth, ending in the output
 	 * buffer. */
 	buffers[0] = (uint8_t *)in_buf;
-	if (conv->num_converters == 2) {
-		buffers[1] = (uint8_t *)conv->tmp_bufs[0];
-	} else if (conv->num_converters == 3) {
-		buffers[1] = (uint8_t *)conv->tmp_bufs[0];
-		buffers[2] = (uint8_t *)conv->tmp_bufs[1];
-	}
+	for (i = 1; i < conv->num_converters; i++)
+		buffers[i] = conv->tmp_bufs[i - 1];
 	buffers[conv->num_converters] = out_buf;
 
-	/* If the input format isn't S16_LE convert to it. */
-	if (conv->in_fmt.format != SND_PCM_FORMAT_S16_LE) {
-		conv->sample_format_converter(buffers[buf_idx],
+	/* Stages fused at create time run first. */
+	if (conv->fused_converter) {
+		conv->fused_converter(conv, buffers[buf_idx], fr_in,
+				      buffers[buf_idx + 1]);
+		buf_idx++;
+	}
+
+	/* If the input format isn't the working one convert to it. */
+	if (conv->in_format_converter) {
+		conv->in_format_converter(buffers[buf_idx],
 					      fr_in * conv->in_fmt.num_channels,
 					      (uint8_t *)buffers[buf_idx + 1]);
 		buf_idx++;
@@ -604,13 +2044,17 @@ size_t cras_fmt_conv_convert_frames(struct cras_fmt_conv *conv,
 					fr_in,
 					(int16_t *)buffers[buf_idx + 1]);
 		buf_idx++;
+	} else if (conv->float_channel_converter != NULL) {
+		conv->float_channel_converter(conv,
+					      (float *)buffers[buf_idx],
+					      fr_in,
+					      (float *)buffers[buf_idx + 1]);
+		buf_idx++;
 	}
 
 	/* Then SRC. */
-	if (conv->speex_state != NULL) {
-		fr_out = cras_frames_at_rate(conv->in_fmt.frame_rate,
-					     fr_in,
-					     conv->out_fmt.frame_rate);
+	if (has_resampler(conv)) {
+		fr_out = cras_fmt_conv_in_frames_to_out(conv, fr_in);
 		if (fr_out > out_frames + 1 && !logged_frames_dont_fit) {
 			syslog(LOG_INFO,
 			       "fmt_conv: put %u frames in %zu sized buffer",
@@ -620,26 +2064,64 @@ size_t cras_fmt_conv_convert_frames(struct cras_fmt_conv *conv,
 		}
 		/* limit frames to the output size. */
 		fr_out = min(fr_out, out_frames);
-		speex_resampler_process_interleaved_int(
-				conv->speex_state,
-				(int16_t *)buffers[buf_idx],
-				&fr_in,
-				(int16_t *)out_buf,
-				&fr_out);
+		if (conv->resampler && conv->float_path) {
+			size_t rs_in = fr_in, rs_out = fr_out;
+
+			cras_resampler_process_float(
+					conv->resampler,
+					(float *)buffers[buf_idx],
+					&rs_in,
+					(float *)buffers[buf_idx + 1],
+					&rs_out);
+			fr_in = rs_in;
+			fr_out = rs_out;
+		} else if (conv->resampler) {
+			size_t rs_in = fr_in, rs_out = fr_out;
+
+			cras_resampler_process(conv->resampler,
+					       (int16_t *)buffers[buf_idx],
+					       &rs_in,
+					       (int16_t *)buffers[buf_idx + 1],
+					       &rs_out);
+			fr_in = rs_in;
+			fr_out = rs_out;
+		} else if (conv->float_path) {
+			speex_resampler_process_interleaved_float(
+					conv->speex_state,
+					(float *)buffers[buf_idx],
+					&fr_in,
+					(float *)buffers[buf_idx + 1],
+					&fr_out);
+		} else {
+			speex_resampler_process_interleaved_int(
+					conv->speex_state,
+					(int16_t *)buffers[buf_idx],
+					&fr_in,
+					(int16_t *)buffers[buf_idx + 1],
+					&fr_out);
+		}
+		buf_idx++;
 	}
 
-	/* If the output format isn't S16_LE convert to it. */
-	if (conv->out_fmt.format != SND_PCM_FORMAT_S16_LE) {
-		conv->sample_format_converter(
+	/* If the output format isn't the working one convert to it. */
+	if (conv->out_format_converter) {
+		conv->out_format_converter(
 				buffers[buf_idx],
-				fr_in * conv->out_fmt.num_channels,
+				fr_out * conv->out_fmt.num_channels,
 				(uint8_t *)buffers[buf_idx + 1]);
 		buf_idx++;
 	}
 
+	*in_frames = fr_in;
 	return fr_out;
 }
 
+void cras_fmt_conv_set_cpu_flags(unsigned int cpu_flags)
+{
+	allowed_cpu_flags = cpu_flags;
+	cras_resampler_set_cpu_flags(cpu_flags);
+}
+
 int cras_fmt_conversion_needed(const struct cras_audio_format *a,
 			       const struct cras_audio_format *b)
 {
@@ -4,8 +4,9 @@
  */
 
 /*
- * Used to convert from one audio format to another.  Currently only supports
- * sample rate conversion with the speex backend.
+ * Used to convert from one audio format to another.  Sample rates are
+ * converted with the built in polyphase resampler, or speex for rates it has
+ * no filter for.
  */
 #ifndef CRAS_FMT_CONV_H_
 #define CRAS_FMT_CONV_H_
@@ -22,6 +23,38 @@ struct cras_fmt_conv *cras_fmt_conv_create(const struct cras_audio_format *in,
 					   size_t max_frames);
 void cras_fmt_conv_destroy(struct cras_fmt_conv *conv);
 
+/* Creates a format converter that always resamples, even between equal
+ * rates, so that its output rate can follow a drifting device clock with
+ * cras_fmt_conv_set_ratio().  Args as cras_fmt_conv_create(). */
+struct cras_fmt_conv *cras_fmt_conv_create_adjustable(
+		const struct cras_audio_format *in,
+		const struct cras_audio_format *out,
+		size_t max_frames);
+
+/* Computes ahead of time the resampler filter that a converter created later
+ * from in to out will use, so that creating it doesn't have to.  Called from
+ * the main thread for converters that are created on the audio thread.
+ * Args:
+ *    in - Format of the samples to convert.
+ *    out - Format they are converted to.
+ *    adjustable - Non-zero if the converter will be made adjustable.
+ */
+void cras_fmt_conv_prepare(const struct cras_audio_format *in,
+			   const struct cras_audio_format *out,
+			   int adjustable);
+
+/* Scales the output rate of a converter by ratio, 1.0 converts between the
+ * nominal rates.  The frame counts from cras_fmt_conv_in_frames_to_out() and
+ * cras_fmt_conv_out_frames_to_in() follow the ratio.
+ * Args:
+ *    conv - The format converter.
+ *    ratio - The actual over the nominal rate of the output.
+ * Returns:
+ *    0 on success, -EINVAL if the converter can't adjust its rate, as when it
+ *    doesn't resample or uses speex for rates the built in resampler lacks.
+ */
+int cras_fmt_conv_set_ratio(struct cras_fmt_conv *conv, double ratio);
+
 /* Get the number of output frames that will result from converting in_frames */
 size_t cras_fmt_conv_in_frames_to_out(struct cras_fmt_conv *conv,
 				      size_t in_frames);
@@ -45,6 +78,28 @@ size_t cras_fmt_conv_convert_frames(struct cras_fmt_conv *conv,
 				    size_t in_frames,
 				    size_t out_frames);
 
+/* Like cras_fmt_conv_convert_frames(), but reports how much of the input was
+ * used.  A resampler takes what the output has room for, along with the
+ * frames its filter needs ahead, so that can be less or more than the output
+ * frames imply.
+ * Args:
+ *    in_frames - Number of frames from in_buf to convert, set to the number
+ *      used.  Those not used should be passed again.
+ * Return number of frames put in out_buf. */
+size_t cras_fmt_conv_convert_some_frames(struct cras_fmt_conv *conv,
+					 uint8_t *in_buf,
+					 uint8_t *out_buf,
+					 size_t *in_frames,
+					 size_t out_frames);
+
+/* Limits the SIMD extensions that the converters created from now on may use
+ * to those in cpu_flags, a mask of CRAS_CPU_FLAGS.  All those of the CPU are
+ * used by default, this is for tests and benchmarks.
+ * Args:
+ *    cpu_flags - SIMD extensions the converters may use.
+ */
+void cras_fmt_conv_set_cpu_flags(unsigned int cpu_flags);
+
 /* Checks if format conversion is needed between two formats.
  * Args:
  *    a - First format to compare.
@@ -16,7 +16,7 @@
 
 /* Rev when message format changes. If new messages are added, or message ID
  * values change. */
-#define CRAS_PROTO_VER 0
+#define CRAS_PROTO_VER 2
 #define CRAS_SERV_MAX_MSG_SIZE 256
 #define CRAS_CLIENT_MAX_MSG_SIZE 256
 
@@ -78,6 +78,7 @@ struct cras_connect_message {
 	size_t min_cb_level; /* don't callback unless this much is avail */
 	uint32_t flags;
 	struct cras_audio_format format; /* rate, channels, sample size */
+	uint32_t num_periods; /* Periods of a ring shm, 0 to double buffer. */
 };
 static inline void cras_fill_connect_message(struct cras_connect_message *m,
 					   enum CRAS_STREAM_DIRECTION direction,
@@ -87,7 +88,8 @@ static inline void cras_fill_connect_message(struct cras_connect_message *m,
 					   size_t cb_threshold,
 					   size_t min_cb_level,
 					   uint32_t flags,
-					   struct cras_audio_format format)
+					   struct cras_audio_format format,
+					   uint32_t num_periods)
 {
 	m->proto_version = CRAS_PROTO_VER;
 	m->direction = direction;
@@ -98,6 +100,7 @@ static inline void cras_fill_connect_message(struct cras_connect_message *m,
 	m->min_cb_level = min_cb_level;
 	m->flags = flags;
 	m->format = format;
+	m->num_periods = num_periods;
 	m->header.id = CRAS_SERVER_CONNECT_STREAM;
 	m->header.length = sizeof(struct cras_connect_message);
 }
@@ -282,31 +285,30 @@ static inline void cras_fill_dump_audio_thread(
  * Messages sent from server to client.
  */
 
-/* Reply from the server indicating that the client has connected. */
+/* Reply from the server indicating that the client has connected.  Sent
+ * with a read only fd of the shm area holding the cras_server_state. */
 struct cras_client_connected {
 	struct cras_client_message header;
 	size_t client_id;
-	key_t shm_key;
 };
 static inline void cras_fill_client_connected(
 		struct cras_client_connected *m,
-		size_t client_id,
-		key_t shm_key)
+		size_t client_id)
 {
 	m->client_id = client_id;
-	m->shm_key = shm_key;
 	m->header.id = CRAS_CLIENT_CONNECTED;
 	m->header.length = sizeof(struct cras_client_connected);
 }
 
-/* Reply from server that a stream has been successfully added. */
+/* Reply from server that a stream has been successfully added.  Unless err is
+ * set it is sent with the fds of the shm areas of the stream, the input one
+ * first if the stream has input, then the output one if it has output.  Each
+ * area is shm_max_size bytes. */
 struct cras_client_stream_connected {
 	struct cras_client_message header;
 	int err;
 	cras_stream_id_t stream_id;
 	struct cras_audio_format format;
-	int input_shm_key;
-	int output_shm_key;
 	size_t shm_max_size;
 };
 static inline void cras_fill_client_stream_connected(
@@ -314,15 +316,11 @@ static inline void cras_fill_client_stream_connected(
 		int err,
 		cras_stream_id_t stream_id,
 		struct cras_audio_format format,
-		int input_shm_key,
-		int output_shm_key,
 		size_t shm_max_size)
 {
 	m->err = err;
 	m->stream_id = stream_id;
 	m->format = format;
-	m->input_shm_key = input_shm_key;
-	m->output_shm_key = output_shm_key;
 	m->shm_max_size = shm_max_size;
 	m->header.id = CRAS_CLIENT_STREAM_CONNECTED;
 	m->header.length = sizeof(struct cras_client_stream_connected);
@@ -0,0 +1,625 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "cras_cpu.h"
+#include "cras_resampler.h"
+#include "cras_util.h"
+#include "utlist.h"
+
+/* Rates that need more filter phases than this, that is with an output rate
+ * over this many times their greatest common divisor, aren't supported. */
+#define MAX_PHASES 1024
+/* Filters have at least this many phases, so that a ratio off the one of the
+ * rates can interpolate between close enough phases. */
+#define MIN_PHASES 256
+/* Input frames loaded at a time, on top of the filter history. */
+#define CHUNK_FRAMES 256
+/* Filters no resampler uses that are kept for the next one, oldest dropped
+ * first. */
+#define MAX_IDLE_FILTERS 4
+
+/* Taps of each filter phase, the cutoff as a fraction of the lower Nyquist
+ * frequency and the beta of the Kaiser window for each quality.  Each tier
+ * doubles the taps, the window is picked for the transition band to end
+ * near the Nyquist frequency, at about 55, 70 and 90 dB. */
+static const struct {
+	size_t taps;
+	double cutoff;
+	double beta;
+} quality_params[CRAS_RESAMPLER_NUM_QUALITIES] = {
+	{ 16, 0.80, 5.0 }, /* CRAS_RESAMPLER_QUALITY_LOW */
+	{ 32, 0.86, 7.0 }, /* CRAS_RESAMPLER_QUALITY_MEDIUM */
+	{ 64, 0.91, 9.0 }, /* CRAS_RESAMPLER_QUALITY_HIGH */
+};
+
+typedef float (*dot_product_t)(const float *a, const float *b, size_t n);
+
+/* Filter coefficients shared by the resamplers with the same rates and
+ * quality.
+ * Members:
+ *    in_rate, out_rate, quality - What the filter was made for.
+ *    num_phases - Output frames for each step input frames, the ratio of the
+ *      rates scaled up to MIN_PHASES.
+ *    step - Input frames for each num_phases output frames.
+ *    num_taps - Coefficients of each phase, a multiple of 8.
+ *    coefs - num_phases rows of num_taps coefficients.
+ *    num_users - Resamplers using the filter, 0 while it is idle.
+ */
+struct resampler_filter {
+	size_t in_rate;
+	size_t out_rate;
+	enum CRAS_RESAMPLER_QUALITY quality;
+	size_t num_phases;
+	size_t step;
+	size_t num_taps;
+	float *coefs;
+	unsigned int num_users;
+	struct resampler_filter *prev, *next;
+};
+
+/* Members:
+ *    filter - The shared filter coefficients.
+ *    dot - Dot product of the filter and the input.
+ *    num_channels - Interleaved channels in and out.
+ *    phase - Filter phase of the next output frame.
+ *    frac - How far the next output frame is past phase, towards the next
+ *      phase, when the ratio of the rates is adjusted.
+ *    step - Phases between output frames when the ratio is adjusted.
+ *    adjusted - Non-zero if the ratio of the rates is adjusted, the output
+ *      is then interpolated between the two phases around it.
+ *    buffered - Frames in buf, from the start of the next output's window.
+ *    capacity - Room for frames in each channel of buf.
+ *    buf - Planar input, capacity frames for each channel.
+ */
+struct cras_resampler {
+	struct resampler_filter *filter;
+	dot_product_t dot;
+	size_t num_channels;
+	size_t phase;
+	double frac;
+	double step;
+	int adjusted;
+	size_t buffered;
+	size_t capacity;
+	float *buf;
+};
+
+/* Designed filters, the idle ones in the order they were last used.  The
+ * mutex only guards the list and the counts, filters are designed and freed
+ * outside of it. */
+static struct resampler_filter *filters;
+static unsigned int num_idle_filters;
+static pthread_mutex_t filters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* CPU features the dot products are allowed to use. */
+static unsigned int allowed_cpu_flags = ~0U;
+
+/*
+ * Dot products.  The taps are a multiple of 8.
+ */
+
+static float dot_product(const float *a, const float *b, size_t n)
+{
+	float sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+static float dot_product_neon(const float *a, const float *b, size_t n)
+{
+	float32x4_t sum0 = vdupq_n_f32(0);
+	float32x4_t sum1 = vdupq_n_f32(0);
+	float32x2_t sum;
+	size_t i;
+
+	for (i = 0; i < n; i += 8) {
+		sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+		sum1 = vmlaq_f32(sum1, vld1q_f32(a + i + 4),
+				 vld1q_f32(b + i + 4));
+	}
+	sum0 = vaddq_f32(sum0, sum1);
+	sum = vadd_f32(vget_low_f32(sum0), vget_high_f32(sum0));
+	return vget_lane_f32(vpadd_f32(sum, sum), 0);
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define RESAMPLER_X86_SIMD
+
+__attribute__((target("sse2")))
+static float dot_product_sse2(const float *a, const float *b, size_t n)
+{
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	size_t i;
+
+	for (i = 0; i < n; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i),
+						   _mm_loadu_ps(b + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+						   _mm_loadu_ps(b + i + 4)));
+	}
+	sum0 = _mm_add_ps(sum0, sum1);
+	sum0 = _mm_add_ps(sum0, _mm_movehl_ps(sum0, sum0));
+	sum0 = _mm_add_ss(sum0, _mm_shuffle_ps(sum0, sum0, 1));
+	return _mm_cvtss_f32(sum0);
+}
+
+__attribute__((target("avx2")))
+static float dot_product_avx2(const float *a, const float *b, size_t n)
+{
+	__m256 sum = _mm256_setzero_ps();
+	__m128 half;
+	size_t i;
+
+	for (i = 0; i < n; i += 8)
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+						       _mm256_loadu_ps(b + i)));
+	half = _mm_add_ps(_mm256_castps256_ps128(sum),
+			  _mm256_extractf128_ps(sum, 1));
+	half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+	return _mm_cvtss_f32(half);
+}
+#endif
+
+/* Returns the fastest dot product the running CPU can use. */
+static dot_product_t get_dot_product()
+{
+	unsigned int flags = cras_cpu_get_flags() & allowed_cpu_flags;
+
+#if defined(__ARM_NEON__)
+	if (flags & CRAS_CPU_NEON)
+		return dot_product_neon;
+#elif defined(RESAMPLER_X86_SIMD)
+	if (flags & CRAS_CPU_AVX2)
+		return dot_product_avx2;
+	if (flags & CRAS_CPU_SSE2)
+		return dot_product_sse2;
+#endif
+	return dot_product;
+}
+
+/*
+ * Filter design.
+ */
+
+static size_t gcd(size_t a, size_t b)
+{
+	while (b) {
+		size_t t = a % b;
+
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Zeroth order modified Bessel function of the first kind. */
+static double bessel_i0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+	unsigned int k;
+
+	for (k = 1; term > sum * 1e-12; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/* Fills the coefficients of a Kaiser windowed sinc low pass filter.  Phase p
+ * interpolates at p / num_phases past the middle of its taps, each phase is
+ * normalized for unity gain at DC. */
+static void design_filter(struct resampler_filter *filter, double cutoff,
+			  double beta)
+{
+	double half = filter->num_taps / 2.0;
+	double norm = bessel_i0(beta);
+	size_t p, k;
+
+	for (p = 0; p < filter->num_phases; p++) {
+		float *coefs = filter->coefs + p * filter->num_taps;
+		double frac = (double)p / filter->num_phases;
+		double sum = 0.0;
+
+		for (k = 0; k < filter->num_taps; k++) {
+			double d = k - (half - 1.0) - frac;
+			double x = d / half;
+			double h = 2.0 * cutoff;
+
+			if (d != 0.0)
+				h = sin(2.0 * M_PI * cutoff * d) / (M_PI * d);
+			if (x * x < 1.0)
+				h *= bessel_i0(beta * sqrt(1.0 - x * x)) / norm;
+			else
+				h = 0.0;
+			coefs[k] = h;
+			sum += h;
+		}
+		for (k = 0; k < filter->num_taps; k++)
+			coefs[k] /= sum;
+	}
+}
+
+static struct resampler_filter *filter_create(
+		size_t in_rate, size_t out_rate,
+		enum CRAS_RESAMPLER_QUALITY quality)
+{
+	struct resampler_filter *filter;
+	size_t div = gcd(in_rate, out_rate);
+	double cutoff;
+
+	if (out_rate / div > MAX_PHASES)
+		return NULL;
+
+	filter = (struct resampler_filter *)calloc(1, sizeof(*filter));
+	if (!filter)
+		return NULL;
+	filter->in_rate = in_rate;
+	filter->out_rate = out_rate;
+	filter->quality = quality;
+	filter->num_phases = out_rate / div;
+	filter->step = in_rate / div;
+	if (filter->num_phases < MIN_PHASES) {
+		size_t scale = (MIN_PHASES + filter->num_phases - 1) /
+			       filter->num_phases;
+
+		filter->num_phases *= scale;
+		filter->step *= scale;
+	}
+
+	/* Cutoff in cycles per input frame.  Downsampling lowers it and
+	 * lengthens the filter to keep the same transition band. */
+	filter->num_taps = quality_params[quality].taps;
+	cutoff = quality_params[quality].cutoff / 2.0;
+	if (in_rate > out_rate) {
+		filter->num_taps = (filter->num_taps * in_rate + out_rate - 1) /
+				   out_rate;
+		filter->num_taps = (filter->num_taps + 7) & ~7;
+		cutoff = cutoff * out_rate / in_rate;
+	}
+
+	filter->coefs = (float *)malloc(filter->num_phases * filter->num_taps *
+					sizeof(*filter->coefs));
+	if (!filter->coefs) {
+		free(filter);
+		return NULL;
+	}
+	design_filter(filter, cutoff, quality_params[quality].beta);
+
+	return filter;
+}
+
+static void filter_free(struct resampler_filter *filter)
+{
+	free(filter->coefs);
+	free(filter);
+}
+
+/* Looks up the filter for the rates and quality and takes a reference to it.
+ * Called with filters_mutex held. */
+static struct resampler_filter *filter_find_locked(
+		size_t in_rate, size_t out_rate,
+		enum CRAS_RESAMPLER_QUALITY quality)
+{
+	struct resampler_filter *filter;
+
+	DL_FOREACH(filters, filter)
+		if (filter->in_rate == in_rate &&
+		    filter->out_rate == out_rate &&
+		    filter->quality == quality)
+			break;
+	if (filter && filter->num_users++ == 0)
+		num_idle_filters--;
+	return filter;
+}
+
+/* Frees the oldest idle filters past keep. */
+static void release_idle_filters(unsigned int keep)
+{
+	struct resampler_filter *filter, *released = NULL;
+
+	pthread_mutex_lock(&filters_mutex);
+	DL_FOREACH(filters, filter) {
+		if (num_idle_filters <= keep)
+			break;
+		if (filter->num_users)
+			continue;
+		DL_DELETE(filters, filter);
+		DL_APPEND(released, filter);
+		num_idle_filters--;
+	}
+	pthread_mutex_unlock(&filters_mutex);
+
+	DL_FOREACH(released, filter)
+		filter_free(filter);
+}
+
+/* Finds or makes the filter for the rates and quality, with a reference.  A
+ * missing filter is designed without holding the lock, if another one was
+ * published meanwhile that one is used. */
+static struct resampler_filter *filter_get(
+		size_t in_rate, size_t out_rate,
+		enum CRAS_RESAMPLER_QUALITY quality)
+{
+	struct resampler_filter *filter, *created;
+
+	pthread_mutex_lock(&filters_mutex);
+	filter = filter_find_locked(in_rate, out_rate, quality);
+	pthread_mutex_unlock(&filters_mutex);
+	if (filter)
+		return filter;
+
+	created = filter_create(in_rate, out_rate, quality);
+	if (!created)
+		return NULL;
+
+	pthread_mutex_lock(&filters_mutex);
+	filter = filter_find_locked(in_rate, out_rate, quality);
+	if (!filter) {
+		filter = created;
+		filter->num_users = 1;
+		DL_APPEND(filters, filter);
+		created = NULL;
+	}
+	pthread_mutex_unlock(&filters_mutex);
+
+	if (created)
+		filter_free(created);
+	return filter;
+}
+
+/* Drops a reference to a filter.  The last one leaves it idle, it is freed
+ * once more than MAX_IDLE_FILTERS are. */
+static void filter_put(struct resampler_filter *filter)
+{
+	int idle;
+
+	pthread_mutex_lock(&filters_mutex);
+	idle = --filter->num_users == 0;
+	if (idle) {
+		/* Idle filters are kept in the order they were last used. */
+		DL_DELETE(filters, filter);
+		DL_APPEND(filters, filter);
+		num_idle_filters++;
+	}
+	pthread_mutex_unlock(&filters_mutex);
+
+	if (idle)
+		release_idle_filters(MAX_IDLE_FILTERS);
+}
+
+/*
+ * Resampling.
+ */
+
+static inline int16_t float_to_s16(float x)
+{
+	if (x > 32767.0f)
+		return 32767;
+	if (x < -32768.0f)
+		return -32768;
+	return lrintf(x);
+}
+
+/* Appends up to the frames that fit in buf, returns how many.  The input is
+ * S16, or float if in_f isn't NULL. */
+static size_t load_frames(struct cras_resampler *rs, const int16_t *in,
+			  const float *in_f, size_t frames)
+{
+	size_t ch, i;
+
+	frames = min(frames, rs->capacity - rs->buffered);
+	for (ch = 0; ch < rs->num_channels; ch++) {
+		float *buf = rs->buf + ch * rs->capacity + rs->buffered;
+
+		if (in_f)
+			for (i = 0; i < frames; i++)
+				buf[i] = in_f[i * rs->num_channels + ch];
+		else
+			for (i = 0; i < frames; i++)
+				buf[i] = in[i * rs->num_channels + ch];
+	}
+	rs->buffered += frames;
+	return frames;
+}
+
+/* Writes output frames while the input covers their window and there is
+ * room, then drops the input no window needs anymore.  The output is S16, or
+ * float if out_f isn't NULL.  Returns the frames written. */
+static size_t filter_frames(struct cras_resampler *rs, int16_t *out,
+			    float *out_f, size_t frames)
+{
+	const struct resampler_filter *filter = rs->filter;
+	size_t num_taps = filter->num_taps;
+	size_t pos = 0;
+	size_t written = 0;
+	size_t ch;
+
+	/* The phase after the last one is the first, a frame later. */
+	while (written < frames &&
+	       pos + num_taps + rs->adjusted <= rs->buffered) {
+		const float *coefs = filter->coefs + rs->phase * num_taps;
+
+		for (ch = 0; ch < rs->num_channels; ch++) {
+			const float *buf = rs->buf + ch * rs->capacity + pos;
+			float x = rs->dot(coefs, buf, num_taps);
+
+			if (rs->adjusted) {
+				float next;
+
+				if (rs->phase + 1 < filter->num_phases)
+					next = rs->dot(coefs + num_taps, buf,
+						       num_taps);
+				else
+					next = rs->dot(filter->coefs, buf + 1,
+						       num_taps);
+				x += (next - x) * rs->frac;
+			}
+			if (out_f)
+				*out_f++ = x;
+			else
+				*out++ = float_to_s16(x);
+		}
+		written++;
+
+		if (rs->adjusted) {
+			double phases = rs->frac + rs->step;
+
+			rs->phase += (size_t)phases;
+			rs->frac = phases - (size_t)phases;
+		} else {
+			rs->phase += filter->step;
+		}
+		pos += rs->phase / filter->num_phases;
+		rs->phase %= filter->num_phases;
+	}
+
+	/* Output windows never go back, so what is before pos is done. */
+	pos = min(pos, rs->buffered);
+	for (ch = 0; ch < rs->num_channels; ch++) {
+		float *buf = rs->buf + ch * rs->capacity;
+
+		memmove(buf, buf + pos, (rs->buffered - pos) * sizeof(*buf));
+	}
+	rs->buffered -= pos;
+
+	return written;
+}
+
+/*
+ * Exported interface.
+ */
+
+struct cras_resampler *cras_resampler_create(
+		size_t num_channels, size_t in_rate, size_t out_rate,
+		enum CRAS_RESAMPLER_QUALITY quality)
+{
+	struct cras_resampler *rs;
+
+	if (num_channels == 0 || in_rate == 0 || out_rate == 0 ||
+	    quality >= CRAS_RESAMPLER_NUM_QUALITIES)
+		return NULL;
+
+	rs = (struct cras_resampler *)calloc(1, sizeof(*rs));
+	if (!rs)
+		return NULL;
+
+	rs->filter = filter_get(in_rate, out_rate, quality);
+	if (!rs->filter) {
+		syslog(LOG_DEBUG, "No resampler filter for %zu to %zu Hz.",
+		       in_rate, out_rate);
+		free(rs);
+		return NULL;
+	}
+	rs->dot = get_dot_product();
+	rs->num_channels = num_channels;
+	rs->step = rs->filter->step;
+
+	/* Start with a window of silence so output comes with the first
+	 * input frame. */
+	rs->buffered = rs->filter->num_taps - 1;
+	rs->capacity = rs->buffered + CHUNK_FRAMES;
+	rs->buf = (float *)calloc(num_channels * rs->capacity,
+				 sizeof(*rs->buf));
+	if (!rs->buf) {
+		cras_resampler_destroy(rs);
+		return NULL;
+	}
+
+	return rs;
+}
+
+int cras_resampler_prepare(size_t in_rate, size_t out_rate,
+			   enum CRAS_RESAMPLER_QUALITY quality)
+{
+	struct resampler_filter *filter;
+
+	if (in_rate == 0 || out_rate == 0 ||
+	    quality >= CRAS_RESAMPLER_NUM_QUALITIES)
+		return -EINVAL;
+
+	filter = filter_get(in_rate, out_rate, quality);
+	if (!filter)
+		return -EINVAL;
+	filter_put(filter);
+	return 0;
+}
+
+void cras_resampler_destroy(struct cras_resampler *rs)
+{
+	filter_put(rs->filter);
+	free(rs->buf);
+	free(rs);
+}
+
+/* Resamples S16 frames, or float ones if in_f and out_f aren't NULL. */
+static void resampler_process(struct cras_resampler *rs,
+			      const int16_t *in, const float *in_f,
+			      size_t *in_frames,
+			      int16_t *out, float *out_f,
+			      size_t *out_frames)
+{
+	size_t ch = rs->num_channels;
+	size_t used = 0;
+	size_t written;
+
+	/* Frames left from a full output come first. */
+	written = filter_frames(rs, out, out_f, *out_frames);
+	while (used < *in_frames && written < *out_frames) {
+		used += load_frames(rs, in ? in + used * ch : NULL,
+				    in_f ? in_f + used * ch : NULL,
+				    *in_frames - used);
+		written += filter_frames(rs, out ? out + written * ch : NULL,
+					 out_f ? out_f + written * ch : NULL,
+					 *out_frames - written);
+	}
+
+	*in_frames = used;
+	*out_frames = written;
+}
+
+void cras_resampler_process(struct cras_resampler *rs,
+			    const int16_t *in, size_t *in_frames,
+			    int16_t *out, size_t *out_frames)
+{
+	resampler_process(rs, in, NULL, in_frames, out, NULL, out_frames);
+}
+
+void cras_resampler_process_float(struct cras_resampler *rs,
+				  const float *in, size_t *in_frames,
+				  float *out, size_t *out_frames)
+{
+	resampler_process(rs, NULL, in, in_frames, NULL, out, out_frames);
+}
+
+void cras_resampler_set_ratio(struct cras_resampler *rs, double ratio)
+{
+	rs->adjusted = ratio != 1.0;
+	rs->step = rs->filter->step / ratio;
+	if (!rs->adjusted)
+		rs->frac = 0.0;
+}
+
+void cras_resampler_set_cpu_flags(unsigned int cpu_flags)
+{
+	allowed_cpu_flags = cpu_flags;
+}
@@ -0,0 +1,104 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Polyphase sample rate converter for interleaved S16 or float samples.  The
+ * filter coefficients for a pair of rates and a quality are shared by
+ * reference count.  They are computed by cras_resampler_prepare() or, failing that, by
+ * the first resampler that needs them, and kept for a while after the last
+ * one is destroyed.
+ */
+#ifndef CRAS_RESAMPLER_H_
+#define CRAS_RESAMPLER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct cras_resampler;
+
+/* Trade CPU for a sharper filter with more attenuation past the cutoff. */
+enum CRAS_RESAMPLER_QUALITY {
+	CRAS_RESAMPLER_QUALITY_LOW,
+	CRAS_RESAMPLER_QUALITY_MEDIUM,
+	CRAS_RESAMPLER_QUALITY_HIGH,
+	CRAS_RESAMPLER_NUM_QUALITIES,
+};
+
+/* Creates a resampler.
+ * Args:
+ *    num_channels - Number of interleaved channels.
+ *    in_rate - Sample rate of the input.
+ *    out_rate - Sample rate of the output.
+ *    quality - One of CRAS_RESAMPLER_QUALITY.
+ * Returns:
+ *    The new resampler or NULL if the rates need too many filter phases or
+ *    there is no memory.
+ */
+struct cras_resampler *cras_resampler_create(
+		size_t num_channels, size_t in_rate, size_t out_rate,
+		enum CRAS_RESAMPLER_QUALITY quality);
+
+/* Designs the filter for a pair of rates and a quality ahead of time, so that
+ * a resampler created for them later, maybe on a real time thread, only looks
+ * it up.  The filter is kept until it has been idle for a while.
+ * Args:
+ *    in_rate - Sample rate of the input.
+ *    out_rate - Sample rate of the output.
+ *    quality - One of CRAS_RESAMPLER_QUALITY.
+ * Returns:
+ *    0 on success, -EINVAL if there is no filter for the rates or no memory.
+ */
+int cras_resampler_prepare(size_t in_rate, size_t out_rate,
+			   enum CRAS_RESAMPLER_QUALITY quality);
+
+/* Destroys a resampler from cras_resampler_create(). */
+void cras_resampler_destroy(struct cras_resampler *rs);
+
+/* Resamples interleaved S16 frames.  The output starts half a filter length
+ * late and is produced as soon as the input reaches it, so converting n input
+ * frames gives about n * out_rate / in_rate output frames.
+ * Args:
+ *    rs - The resampler.
+ *    in - Frames to resample.
+ *    in_frames - The number of frames in in, set to the number used.  Frames
+ *      not used because the output is full should be passed again.
+ *    out - Where to put the resampled frames.
+ *    out_frames - The room in out, set to the number of frames written.
+ */
+void cras_resampler_process(struct cras_resampler *rs,
+			    const int16_t *in, size_t *in_frames,
+			    int16_t *out, size_t *out_frames);
+
+/* Resamples interleaved float frames, as cras_resampler_process() does S16
+ * ones.  The samples aren't clipped, they keep the scale of the input.
+ * Args:
+ *    rs - The resampler.
+ *    in - Frames to resample.
+ *    in_frames - The number of frames in in, set to the number used.
+ *    out - Where to put the resampled frames.
+ *    out_frames - The room in out, set to the number of frames written.
+ */
+void cras_resampler_process_float(struct cras_resampler *rs,
+				  const float *in, size_t *in_frames,
+				  float *out, size_t *out_frames);
+
+/* Adjusts the output rate of a resampler to ratio times the one it was
+ * created for, to follow a device clock that drifts from its nominal rate.
+ * The ratio can be changed while resampling, the output stays continuous.
+ * Args:
+ *    rs - The resampler.
+ *    ratio - Scales the output rate, 1.0 resamples between the nominal rates.
+ */
+void cras_resampler_set_ratio(struct cras_resampler *rs, double ratio);
+
+/* Limits the SIMD extensions that the resamplers created from now on may use
+ * to those in cpu_flags, a mask of CRAS_CPU_FLAGS.  For tests and
+ * benchmarks.
+ * Args:
+ *    cpu_flags - SIMD extensions the resamplers may use.
+ */
+void cras_resampler_set_cpu_flags(unsigned int cpu_flags);
+
+#endif /* CRAS_RESAMPLER_H_ */
@@ -0,0 +1,113 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE /* Needed for memfd_create and file sealing. */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "cras_shm.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010 /* Linux 5.1, older libc lacks it. */
+#endif
+
+/* The size of a shared area is fixed, whoever else holds the fd can neither
+ * shrink it under a mapping, which would fault on access, nor grow it. */
+#define CRAS_SHM_SIZE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+#define CRAS_SHM_SEALS (CRAS_SHM_SIZE_SEALS | F_SEAL_SEAL)
+/* Added to the areas only their creator writes, once it has mapped them. */
+#define CRAS_SHM_RO_SEALS (F_SEAL_FUTURE_WRITE | F_SEAL_SEAL)
+
+/* Creates a memfd of size bytes sealed with seals. */
+static int shm_create_sealed(const char *name, size_t size, int seals)
+{
+	int fd, rc;
+
+	fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		syslog(LOG_ERR, "memfd_create %s failed: %d", name, errno);
+		return -errno;
+	}
+
+	if (ftruncate(fd, size) < 0 || fcntl(fd, F_ADD_SEALS, seals) < 0) {
+		rc = -errno;
+		syslog(LOG_ERR, "Failed to size shm %s: %d", name, rc);
+		close(fd);
+		return rc;
+	}
+
+	return fd;
+}
+
+int cras_shm_create(const char *name, size_t size)
+{
+	return shm_create_sealed(name, size, CRAS_SHM_SEALS);
+}
+
+int cras_shm_create_ro(const char *name, size_t size, void **area)
+{
+	int fd, rc;
+
+	fd = shm_create_sealed(name, size, CRAS_SHM_SIZE_SEALS);
+	if (fd < 0)
+		return fd;
+
+	*area = cras_shm_map(fd, size, 1);
+	if (*area == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	/* From here on no new writable mapping can be made from the fd, nor
+	 * from a file opened again through /proc, whatever its mode.  Kernels
+	 * before 5.1 don't know that seal, there the clients map the area
+	 * read only and only its size is sealed. */
+	rc = fcntl(fd, F_ADD_SEALS, CRAS_SHM_RO_SEALS);
+	if (rc < 0 && errno == EINVAL) {
+		syslog(LOG_WARNING, "Can't seal shm %s writes, not supported",
+		       name);
+		rc = fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL);
+	}
+	if (rc < 0) {
+		rc = -errno;
+		syslog(LOG_ERR, "Failed to seal shm %s writes: %d", name, rc);
+		cras_shm_unmap(*area, size);
+		*area = NULL;
+		close(fd);
+		return rc;
+	}
+
+	return fd;
+}
+
+void *cras_shm_map(int fd, size_t size, int writable)
+{
+	struct stat st;
+	void *area;
+
+	/* A smaller area would fault past its end. */
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)size) {
+		syslog(LOG_ERR, "shm fd %d is smaller than %zu", fd, size);
+		return NULL;
+	}
+
+	area = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		    MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (area == MAP_FAILED) {
+		syslog(LOG_ERR, "Failed to map shm fd %d: %d", fd, errno);
+		return NULL;
+	}
+	return area;
+}
+
+void cras_shm_unmap(void *area, size_t size)
+{
+	munmap(area, size);
+}
@@ -14,19 +14,40 @@
 
 #define CRAS_NUM_SHM_BUFFERS 2U /* double buffer */
 #define CRAS_SHM_BUFFERS_MASK (CRAS_NUM_SHM_BUFFERS - 1)
+#define CRAS_SHM_MAX_PERIODS 16U /* Largest ring of periods. */
+
+/* Rev when the layout of cras_audio_shm_area changes. */
+#define CRAS_SHM_LAYOUT_VERSION 3
+#define CRAS_SHM_CACHELINE_SIZE 64
+#define CRAS_SHM_SAMPLES_ALIGN 4096
+
+/* Starts a block of fields written by one side on its own cache line. */
+#define CRAS_SHM_CACHELINE_ALIGNED \
+	__attribute__((aligned(CRAS_SHM_CACHELINE_SIZE)))
 
 /* Configuration of the shm area.
  *
  *  used_size - The size in bytes of the sample area being actively used.
  *  frame_bytes - The size of each frame in bytes.
+ *  num_periods - Zero for the double buffer, otherwise the area is a ring of
+ *    this many periods of used_size bytes, a power of two, followed by a
+ *    spare period.
  */
 struct cras_audio_shm_config {
 	unsigned int used_size;
 	unsigned int frame_bytes;
+	unsigned int num_periods;
 };
 
 /* Structure that is shared as shm between client and server.
  *
+ * The fields are grouped by who writes them: set up once by the server, the
+ * writer of samples, the reader of samples, the server during playback or
+ * capture, and the client when it replies to the server.  Each group starts a
+ * cache line, so one side's updates don't evict the lines the other side
+ * polls, and the samples start on a page.
+ *
+ *  layout_version - CRAS_SHM_LAYOUT_VERSION of the server.
  *  config - Size config data.  A copy of the config shared with clients.
  *  read_buf_idx - index of the current buffer to read from (0 or 1 if double
  *    buffered).
@@ -41,26 +62,57 @@ struct cras_audio_shm_config {
  *    written because too much accumulated before a read.
  *  num_cb_timeouts = how many times has the client failed to meet the read or
  *    write deadline.
+ *  ring_read_count - For a ring, the number of periods read, only written by
+ *    the reader.
+ *  ring_read_offset - For a ring, bytes read of the oldest unread period.
+ *  ring_write_count - For a ring, the number of periods written, only written
+ *    by the writer.
+ *  ring_write_offset - For a ring, bytes written to the period being written,
+ *    not visible to the reader until the period is complete.
+ *  ring_write_spare - For a ring, non-zero if the period being written went
+ *    to the spare slot as the ring was full, it is dropped when complete.
+ *  ring_period_bytes - For a ring, the bytes written to each period.
  *  ts - For capture, the time stamp of the next sample at read_index.  For
  *    playback, this is the time that the next sample written will be played.
  *    This is only valid in audio callbacks.
+ *  aud_request - For streams woken through shm, the number of requests sent
+ *    by the server in the high 32 bits and the frames of the last one in the
+ *    low bits.  Stored at once, so a request is never seen half written.
+ *  aud_reply - For streams woken through shm, the number of the request the
+ *    client last replied to in the high 32 bits and the frames written, or a
+ *    negative error, in the low bits.
  *  samples - Audio data - a double buffered area that is used to exchange
  *    audio samples.
  */
 struct cras_audio_shm_area {
+	/* Set up by the server, rarely changed. */
+	uint32_t layout_version;
 	struct cras_audio_shm_config config;
-	size_t read_buf_idx; /* use buffer A or B */
-	size_t write_buf_idx;
-	size_t read_offset[CRAS_NUM_SHM_BUFFERS];
-	size_t write_offset[CRAS_NUM_SHM_BUFFERS];
-	int write_in_progress[CRAS_NUM_SHM_BUFFERS];
 	float volume_scaler;
 	size_t mute;
-	size_t callback_pending;
+	/* Written by the writer of samples.  The double buffer's reader also
+	 * resets write_offset, only the ring keeps to its own fields. */
+	size_t write_buf_idx CRAS_SHM_CACHELINE_ALIGNED;
+	size_t write_offset[CRAS_NUM_SHM_BUFFERS];
+	int write_in_progress[CRAS_NUM_SHM_BUFFERS];
 	size_t num_overruns;
+	uint64_t ring_write_count;
+	uint32_t ring_write_offset;
+	uint32_t ring_write_spare;
+	uint32_t ring_period_bytes[CRAS_SHM_MAX_PERIODS];
+	/* Written by the reader of samples. */
+	size_t read_buf_idx CRAS_SHM_CACHELINE_ALIGNED; /* use buffer A or B */
+	size_t read_offset[CRAS_NUM_SHM_BUFFERS];
+	uint64_t ring_read_count;
+	uint32_t ring_read_offset;
+	/* Written by the server. */
+	size_t callback_pending CRAS_SHM_CACHELINE_ALIGNED;
 	size_t num_cb_timeouts;
 	struct timespec ts;
-	uint8_t samples[];
+	uint64_t aud_request;
+	/* Written by the client. */
+	uint64_t aud_reply CRAS_SHM_CACHELINE_ALIGNED;
+	uint8_t samples[] __attribute__((aligned(CRAS_SHM_SAMPLES_ALIGN)));
 };
 
 /* Structure that holds the config for and a pointer to the audio shm area.
@@ -73,12 +125,32 @@ struct cras_audio_shm {
 	struct cras_audio_shm_area *area;
 };
 
+/* Returns non-zero if the area is a ring of periods. */
+static inline int cras_shm_is_ring(const struct cras_audio_shm *shm)
+{
+	return shm->config.num_periods != 0;
+}
+
+/* Returns the number of buffers or periods the samples are divided into. */
+static inline unsigned cras_shm_num_periods(const struct cras_audio_shm *shm)
+{
+	return cras_shm_is_ring(shm) ? shm->config.num_periods :
+				       CRAS_NUM_SHM_BUFFERS;
+}
+
+/* Returns the number of period sized slots of the samples, a ring has a spare
+ * one after its periods. */
+static inline unsigned cras_shm_num_slots(const struct cras_audio_shm *shm)
+{
+	return cras_shm_num_periods(shm) + cras_shm_is_ring(shm);
+}
+
 /* Get a pointer to the buffer at idx. */
 static inline uint8_t *cras_shm_buff_for_idx(struct cras_audio_shm *shm,
 					     size_t idx)
 {
 	assert_on_compile_is_power_of_2(CRAS_NUM_SHM_BUFFERS);
-	idx = idx & CRAS_SHM_BUFFERS_MASK;
+	idx = idx & (cras_shm_num_periods(shm) - 1);
 	return shm->area->samples + shm->config.used_size * idx;
 }
 
@@ -106,11 +178,107 @@ static inline unsigned cras_shm_check_write_offset(struct cras_audio_shm *shm,
 	return offset;
 }
 
+/*
+ * The ring counts periods read and written up from zero, a period is in slot
+ * count modulo the ring size.  The writer fills the period of its count and
+ * then publishes it by incrementing the count, the reader consumes periods up
+ * to that count and frees them by incrementing its own.  Each count is only
+ * written by one side, so with acquire loads and release stores of the other
+ * side's count no lock is needed.
+ *
+ * When all the periods are unread the writer can't take the oldest one, the
+ * reader may be in the middle of it.  It writes to the spare slot instead and
+ * drops that period when complete, counting an overrun.
+ */
+
+/* Bytes written to the period of count, limited to the period size. */
+static inline unsigned cras_shm_ring_period_bytes(struct cras_audio_shm *shm,
+						  uint64_t count)
+{
+	unsigned bytes = shm->area->ring_period_bytes[
+			count & (shm->config.num_periods - 1)];
+
+	return min(bytes, shm->config.used_size);
+}
+
+/* Gets the counts of the ring for the reader.  The writer never gets more
+ * than the ring ahead, a count past that is from a corrupt area and only
+ * clamped to keep the reader in the ring.
+ * Returns:
+ *    The count of the next period to read, read_offset filled with the bytes
+ *    already read of it and write_count with the count of written periods.
+ */
+static inline uint64_t cras_shm_ring_read_start(struct cras_audio_shm *shm,
+						uint64_t *write_count,
+						unsigned *read_offset)
+{
+	struct cras_audio_shm_area *area = shm->area;
+	uint64_t read_count;
+
+	read_count = __atomic_load_n(&area->ring_read_count, __ATOMIC_ACQUIRE);
+	*write_count = __atomic_load_n(&area->ring_write_count,
+				       __ATOMIC_ACQUIRE);
+	*read_offset = area->ring_read_offset;
+	if (*write_count - read_count > shm->config.num_periods) {
+		read_count = *write_count - shm->config.num_periods;
+		*read_offset = 0;
+	}
+	return read_count;
+}
+
+/* Frees the periods before read_count for the writer. */
+static inline void cras_shm_ring_read_end(struct cras_audio_shm *shm,
+					  uint64_t read_count,
+					  unsigned read_offset)
+{
+	shm->area->ring_read_offset = read_offset;
+	__atomic_store_n(&shm->area->ring_read_count, read_count,
+			 __ATOMIC_RELEASE);
+}
+
+/* Number of periods written and not yet read, for the writer. */
+static inline uint64_t cras_shm_ring_periods_used(struct cras_audio_shm *shm)
+{
+	return shm->area->ring_write_count -
+		__atomic_load_n(&shm->area->ring_read_count, __ATOMIC_ACQUIRE);
+}
+
+/* Checks if the period being written goes to the spare slot, for the writer.
+ * Decided again until something is written to the period. */
+static inline int cras_shm_ring_writes_spare(struct cras_audio_shm *shm)
+{
+	struct cras_audio_shm_area *area = shm->area;
+
+	if (area->ring_write_offset == 0)
+		area->ring_write_spare = cras_shm_ring_periods_used(shm) >=
+					 shm->config.num_periods;
+	return area->ring_write_spare;
+}
+
+/* Gets the slot of the period being written, for the writer. */
+static inline uint8_t *cras_shm_ring_write_buffer(struct cras_audio_shm *shm)
+{
+	if (cras_shm_ring_writes_spare(shm))
+		return shm->area->samples +
+			shm->config.used_size * shm->config.num_periods;
+	return cras_shm_buff_for_idx(shm, shm->area->ring_write_count);
+}
+
 /* Get a pointer to the current read buffer */
 static inline uint8_t *cras_shm_get_curr_read_buffer(struct cras_audio_shm *shm)
 {
 	unsigned i = shm->area->read_buf_idx & CRAS_SHM_BUFFERS_MASK;
 
+	if (cras_shm_is_ring(shm)) {
+		uint64_t read_count, write_count;
+		unsigned read_offset;
+
+		read_count = cras_shm_ring_read_start(shm, &write_count,
+						      &read_offset);
+		return cras_shm_buff_for_idx(shm, read_count) +
+			cras_shm_check_read_offset(shm, read_offset);
+	}
+
 	return cras_shm_buff_for_idx(shm, i) +
 		cras_shm_check_read_offset(shm, shm->area->read_offset[i]);
 }
@@ -121,6 +289,8 @@ uint8_t *cras_shm_get_write_buffer_base(struct cras_audio_shm *shm)
 {
 	unsigned i = shm->area->write_buf_idx & CRAS_SHM_BUFFERS_MASK;
 
+	if (cras_shm_is_ring(shm))
+		return cras_shm_ring_write_buffer(shm);
 	return cras_shm_buff_for_idx(shm, i);
 }
 
@@ -130,16 +300,23 @@ uint8_t *cras_shm_get_writeable_frames(struct cras_audio_shm *shm,
 				       unsigned limit_frames,
 				       unsigned *frames)
 {
-	unsigned i = shm->area->write_buf_idx & CRAS_SHM_BUFFERS_MASK;
+	size_t i = shm->area->write_buf_idx & CRAS_SHM_BUFFERS_MASK;
 	unsigned write_offset;
+	uint8_t *base;
 	const unsigned frame_bytes = shm->config.frame_bytes;
 
-	write_offset = cras_shm_check_write_offset(shm,
-						   shm->area->write_offset[i]);
+	if (cras_shm_is_ring(shm)) {
+		base = cras_shm_ring_write_buffer(shm);
+		write_offset = shm->area->ring_write_offset;
+	} else {
+		base = cras_shm_buff_for_idx(shm, i);
+		write_offset = shm->area->write_offset[i];
+	}
+	write_offset = cras_shm_check_write_offset(shm, write_offset);
 	if (frames)
 		*frames = limit_frames - (write_offset / frame_bytes);
 
-	return cras_shm_buff_for_idx(shm, i) + write_offset;
+	return base + write_offset;
 }
 
 /* Get a pointer to the current read buffer plus an offset.  The offset might be
@@ -155,6 +332,29 @@ static inline int16_t *cras_shm_get_readable_frames(struct cras_audio_shm *shm,
 
 	assert(frames != NULL);
 
+	if (cras_shm_is_ring(shm)) {
+		uint64_t read_count, write_count;
+
+		read_count = cras_shm_ring_read_start(shm, &write_count,
+						      &read_offset);
+		final_offset = read_offset + offset * shm->config.frame_bytes;
+		for (; read_count != write_count; read_count++) {
+			unsigned bytes = cras_shm_ring_period_bytes(
+					shm, read_count);
+
+			if (final_offset < bytes) {
+				*frames = (bytes - final_offset) /
+					shm->config.frame_bytes;
+				return (int16_t *)(cras_shm_buff_for_idx(
+						shm, read_count) +
+						   final_offset);
+			}
+			final_offset -= bytes;
+		}
+		*frames = 0;
+		return NULL;
+	}
+
 	read_offset =
 		cras_shm_check_read_offset(shm,
 					   shm->area->read_offset[buf_idx]);
@@ -184,6 +384,18 @@ static inline size_t cras_shm_get_bytes_queued(struct cras_audio_shm *shm)
 	size_t total, i;
 	const unsigned used_size = shm->config.used_size;
 
+	if (cras_shm_is_ring(shm)) {
+		uint64_t read_count, write_count;
+		unsigned read_offset;
+
+		read_count = cras_shm_ring_read_start(shm, &write_count,
+						      &read_offset);
+		total = 0;
+		for (; read_count != write_count; read_count++)
+			total += cras_shm_ring_period_bytes(shm, read_count);
+		return total > read_offset ? total - read_offset : 0;
+	}
+
 	total = 0;
 	for (i = 0; i < CRAS_NUM_SHM_BUFFERS; i++) {
 		unsigned read_offset, write_offset;
@@ -216,6 +428,19 @@ size_t cras_shm_get_frames_in_curr_buffer(struct cras_audio_shm *shm)
 	unsigned read_offset, write_offset;
 	const unsigned used_size = shm->config.used_size;
 
+	if (cras_shm_is_ring(shm)) {
+		uint64_t read_count, write_count;
+
+		read_count = cras_shm_ring_read_start(shm, &write_count,
+						      &read_offset);
+		if (read_count == write_count)
+			return 0;
+		write_offset = cras_shm_ring_period_bytes(shm, read_count);
+		if (write_offset <= read_offset)
+			return 0;
+		return (write_offset - read_offset) / shm->config.frame_bytes;
+	}
+
 	read_offset = min(shm->area->read_offset[buf_idx], used_size);
 	write_offset = min(shm->area->write_offset[buf_idx], used_size);
 
@@ -230,6 +455,9 @@ static inline int cras_shm_is_buffer_available(struct cras_audio_shm *shm)
 {
 	size_t buf_idx = shm->area->write_buf_idx & CRAS_SHM_BUFFERS_MASK;
 
+	if (cras_shm_is_ring(shm))
+		return cras_shm_ring_periods_used(shm) <
+			shm->config.num_periods;
 	return (shm->area->write_offset[buf_idx] == 0);
 }
 
@@ -243,12 +471,16 @@ static inline size_t cras_shm_get_num_writeable(struct cras_audio_shm *shm)
 	return shm->config.used_size / shm->config.frame_bytes;
 }
 
-/* Flags an overrun if writing would cause one. */
+/* Flags an overrun if writing would cause one.  A ring counts its overruns
+ * when a period is complete. */
 static inline void cras_shm_check_write_overrun(struct cras_audio_shm *shm)
 {
 	size_t write_buf_idx = shm->area->write_buf_idx & CRAS_SHM_BUFFERS_MASK;
 	size_t read_buf_idx = shm->area->read_buf_idx & CRAS_SHM_BUFFERS_MASK;
 
+	if (cras_shm_is_ring(shm))
+		return;
+
 	if (!shm->area->write_in_progress[write_buf_idx]) {
 		if (write_buf_idx != read_buf_idx)
 			shm->area->num_overruns++; /* Will over-write unread */
@@ -264,6 +496,11 @@ void cras_shm_buffer_written(struct cras_audio_shm *shm, size_t frames)
 {
 	size_t buf_idx = shm->area->write_buf_idx & CRAS_SHM_BUFFERS_MASK;
 
+	if (cras_shm_is_ring(shm)) {
+		shm->area->ring_write_offset +=
+			frames * shm->config.frame_bytes;
+		return;
+	}
 	shm->area->write_offset[buf_idx] += frames * shm->config.frame_bytes;
 	shm->area->read_offset[buf_idx] = 0;
 }
@@ -273,6 +510,8 @@ static inline unsigned int cras_shm_frames_written(struct cras_audio_shm *shm)
 {
 	size_t buf_idx = shm->area->write_buf_idx & CRAS_SHM_BUFFERS_MASK;
 
+	if (cras_shm_is_ring(shm))
+		return shm->area->ring_write_offset / shm->config.frame_bytes;
 	return shm->area->write_offset[buf_idx] / shm->config.frame_bytes;
 }
 
@@ -281,6 +520,24 @@ static inline void cras_shm_buffer_write_complete(struct cras_audio_shm *shm)
 {
 	size_t buf_idx = shm->area->write_buf_idx & CRAS_SHM_BUFFERS_MASK;
 
+	if (cras_shm_is_ring(shm)) {
+		struct cras_audio_shm_area *area = shm->area;
+		uint64_t count = area->ring_write_count;
+
+		if (cras_shm_ring_writes_spare(shm)) {
+			area->num_overruns++;
+			area->ring_write_offset = 0;
+			area->ring_write_spare = 0;
+			return;
+		}
+		area->ring_period_bytes[count & (shm->config.num_periods - 1)] =
+			area->ring_write_offset;
+		area->ring_write_offset = 0;
+		__atomic_store_n(&area->ring_write_count, count + 1,
+				 __ATOMIC_RELEASE);
+		return;
+	}
+
 	shm->area->write_in_progress[buf_idx] = 0;
 
 	assert_on_compile_is_power_of_2(CRAS_NUM_SHM_BUFFERS);
@@ -289,7 +546,10 @@ static inline void cras_shm_buffer_write_complete(struct cras_audio_shm *shm)
 }
 
 /* Increment the read pointer.  If it goes past the write pointer for this
- * buffer, move to the next buffer. */
+ * buffer, move to the next buffer.  The double buffer marks a buffer free by
+ * clearing its write_offset, which is on the writer's cache line, so that
+ * line still moves between the sides on every buffer.  Clients that need the
+ * sides kept apart use a ring. */
 static inline
 void cras_shm_buffer_read(struct cras_audio_shm *shm, size_t frames)
 {
@@ -298,6 +558,27 @@ void cras_shm_buffer_read(struct cras_audio_shm *shm, size_t frames)
 	struct cras_audio_shm_area *area = shm->area;
 	struct cras_audio_shm_config *config = &shm->config;
 
+	if (cras_shm_is_ring(shm)) {
+		uint64_t read_count, write_count;
+		unsigned read_offset;
+
+		read_count = cras_shm_ring_read_start(shm, &write_count,
+						      &read_offset);
+		read_offset += frames * config->frame_bytes;
+		for (; read_count != write_count; read_count++) {
+			unsigned bytes = cras_shm_ring_period_bytes(
+					shm, read_count);
+
+			if (read_offset < bytes)
+				break;
+			read_offset -= bytes;
+		}
+		if (read_count == write_count)
+			read_offset = 0;
+		cras_shm_ring_read_end(shm, read_count, read_offset);
+		return;
+	}
+
 	area->read_offset[buf_idx] += frames * config->frame_bytes;
 	if (area->read_offset[buf_idx] >= area->write_offset[buf_idx]) {
 		remainder = area->read_offset[buf_idx] -
@@ -329,6 +610,23 @@ void cras_shm_buffer_read_current(struct cras_audio_shm *shm, size_t frames)
 	struct cras_audio_shm_area *area = shm->area;
 	struct cras_audio_shm_config *config = &shm->config;
 
+	if (cras_shm_is_ring(shm)) {
+		uint64_t read_count, write_count;
+		unsigned read_offset;
+
+		read_count = cras_shm_ring_read_start(shm, &write_count,
+						      &read_offset);
+		read_offset += frames * config->frame_bytes;
+		if (read_count != write_count &&
+		    read_offset >= cras_shm_ring_period_bytes(shm,
+							       read_count)) {
+			read_offset = 0;
+			read_count++;
+		}
+		cras_shm_ring_read_end(shm, read_count, read_offset);
+		return;
+	}
+
 	area->read_offset[buf_idx] += frames * config->frame_bytes;
 	if (area->read_offset[buf_idx] >= area->write_offset[buf_idx]) {
 		area->read_offset[buf_idx] = 0;
@@ -380,17 +678,20 @@ static inline unsigned cras_shm_frame_bytes(const struct cras_audio_shm *shm)
 	return shm->config.frame_bytes;
 }
 
-/* Sets if a callback is pending with the client. */
+/* Sets if a callback is pending with the client.  For a unified stream the
+ * thread of the input device sets it and the one of the output device, which
+ * reads the reply, clears it. */
 static inline
 void cras_shm_set_callback_pending(struct cras_audio_shm *shm, int pending)
 {
-	shm->area->callback_pending = !!pending;
+	__atomic_store_n(&shm->area->callback_pending, !!pending,
+			 __ATOMIC_RELEASE);
 }
 
 /* Returns non-zero if a callback is pending for this shm region. */
 static inline int cras_shm_callback_pending(const struct cras_audio_shm *shm)
 {
-	return shm->area->callback_pending;
+	return __atomic_load_n(&shm->area->callback_pending, __ATOMIC_ACQUIRE);
 }
 
 /* Sets the used_size of the shm region.  This is the maximum number of bytes
@@ -404,6 +705,16 @@ void cras_shm_set_used_size(struct cras_audio_shm *shm, unsigned used_size)
 		shm->area->config.used_size = used_size;
 }
 
+/* Sets the number of periods of a ring shm region, zero for a double buffer.
+ * Must be a power of two no larger than CRAS_SHM_MAX_PERIODS. */
+static inline
+void cras_shm_set_num_periods(struct cras_audio_shm *shm, unsigned num_periods)
+{
+	shm->config.num_periods = num_periods;
+	if (shm->area)
+		shm->area->config.num_periods = num_periods;
+}
+
 /* Returns the used size of the shm region in bytes. */
 static inline unsigned cras_shm_used_size(const struct cras_audio_shm *shm)
 {
@@ -419,7 +730,7 @@ static inline unsigned cras_shm_used_frames(const struct cras_audio_shm *shm)
 /* Returns the total size of the shared memory region. */
 static inline unsigned cras_shm_total_size(const struct cras_audio_shm *shm)
 {
-	return cras_shm_used_size(shm) * CRAS_NUM_SHM_BUFFERS +
+	return cras_shm_used_size(shm) * cras_shm_num_slots(shm) +
 			sizeof(*shm->area);
 }
 
@@ -451,4 +762,111 @@ static inline void cras_shm_copy_shared_config(struct cras_audio_shm *shm)
 	memcpy(&shm->config, &shm->area->config, sizeof(shm->config));
 }
 
+/* Packs the number of an audio message and its value in a word of the area. */
+static inline uint64_t cras_shm_aud_msg(uint32_t count, int32_t value)
+{
+	return ((uint64_t)count << 32) | (uint32_t)value;
+}
+
+/* Posts a request for frames, or the frames ready, to a client woken through
+ * shm.  Replaces a request the client hasn't taken yet. */
+static inline void cras_shm_post_aud_request(struct cras_audio_shm *shm,
+					     uint32_t frames)
+{
+	uint32_t count = shm->area->aud_request >> 32;
+
+	/* The release orders the samples before the request. */
+	__atomic_store_n(&shm->area->aud_request,
+			 cras_shm_aud_msg(count + 1, frames), __ATOMIC_RELEASE);
+}
+
+/* Takes the last request of the server if it is newer than the one taken
+ * before.
+ * Args:
+ *    shm - The shm area the requests are posted to.
+ *    count - The number of the last request taken, updated.
+ *    frames - Filled with the frames of the request.
+ * Returns:
+ *    1 if there is a new request, 0 otherwise.
+ */
+static inline int cras_shm_take_aud_request(const struct cras_audio_shm *shm,
+					    uint32_t *count,
+					    uint32_t *frames)
+{
+	uint64_t request = __atomic_load_n(&shm->area->aud_request,
+					   __ATOMIC_ACQUIRE);
+
+	if ((uint32_t)(request >> 32) == *count)
+		return 0;
+	*count = request >> 32;
+	*frames = (uint32_t)request;
+	return 1;
+}
+
+/* Replies to the request numbered count, with the frames written or a negative
+ * error. */
+static inline void cras_shm_post_aud_reply(struct cras_audio_shm *shm,
+					   uint32_t count, int32_t value)
+{
+	__atomic_store_n(&shm->area->aud_reply, cras_shm_aud_msg(count, value),
+			 __ATOMIC_RELEASE);
+}
+
+/* Checks if the client replied to the last request posted.
+ * Args:
+ *    shm - The shm area the requests are posted to.
+ *    value - If not NULL, filled with the value of the reply.
+ * Returns:
+ *    1 if the last request was replied to, 0 if it is still pending.
+ */
+static inline int cras_shm_aud_reply_ready(const struct cras_audio_shm *shm,
+					   int32_t *value)
+{
+	uint64_t reply = __atomic_load_n(&shm->area->aud_reply,
+					 __ATOMIC_ACQUIRE);
+
+	if ((reply >> 32) != (shm->area->aud_request >> 32))
+		return 0;
+	if (value)
+		*value = (int32_t)reply;
+	return 1;
+}
+
+/* Creates a shared memory area of size bytes, as an anonymous file sealed to
+ * that size.  The fd is passed to clients, which map it with cras_shm_map().
+ * Args:
+ *    name - Name of the area, for debugging.
+ *    size - Size of the area in bytes.
+ * Returns:
+ *    The fd of the area or a negative error code.
+ */
+int cras_shm_create(const char *name, size_t size);
+
+/* Creates a shared memory area like cras_shm_create(), that only the caller
+ * can write.  The area is mapped read write for the caller, then sealed so
+ * that any other mapping of it, by whoever gets the fd, is read only.  On
+ * kernels without F_SEAL_FUTURE_WRITE only its size is sealed.
+ * Args:
+ *    name - Name of the area, for debugging.
+ *    size - Size of the area in bytes.
+ *    area - Filled with the caller's mapping, unmap with cras_shm_unmap().
+ * Returns:
+ *    The fd of the area or a negative error code.
+ */
+int cras_shm_create_ro(const char *name, size_t size, void **area);
+
+/* Maps the first size bytes of a shared memory area with its pages populated,
+ * so they don't fault in when first used from the audio thread.
+ * Args:
+ *    fd - The fd of the area.
+ *    size - Bytes to map, the area must be at least that large.
+ *    writable - Non-zero to map the area read write, read only otherwise.
+ * Returns:
+ *    The mapped area, or NULL on error.
+ */
+void *cras_shm_map(int fd, size_t size, int writable);
+
+/* Unmaps an area from cras_shm_map(). */
+void cras_shm_unmap(void *area, size_t size);
+
 #endif /* CRAS_SHM_H_ */
@@ -55,6 +55,15 @@ enum CRAS_STREAM_TYPE {
 	CRAS_STREAM_TYPE_DEFAULT,
 };
 
+/* Flags of a stream, passed by the client when connecting it.
+ *  CRAS_STREAM_FLAG_SHM_WAKEUP - Requests for audio and their replies are
+ *    counters in the shm area, each side is woken through an eventfd instead
+ *    of reading messages from the audio socket.
+ */
+enum CRAS_STREAM_FLAGS {
+	CRAS_STREAM_FLAG_SHM_WAKEUP = 0x01,
+};
+
 /* Information about a client attached to the server. */
 struct cras_attached_client_info {
 	size_t id;
@@ -107,6 +116,7 @@ enum AUDIO_THREAD_LOG_EVENTS {
 	AUDIO_THREAD_LOOP_SLEEP,
 	AUDIO_THREAD_WRITE_STREAMS_STREAM,
 	AUDIO_THREAD_FETCH_STREAM,
+	AUDIO_THREAD_TIMER_WAKE,
 };
 
 /* Ring buffer of log events from the audio thread. */
@@ -128,16 +138,34 @@ struct audio_stream_debug_info {
 	int8_t channel_layout[CRAS_CH_MAX];
 };
 
+/* Time spent in each stage of the pass that takes the output mix to the
+ * device, in nanoseconds summed since the output device was opened.
+ *    frames - Frames rendered to the device.
+ *    loopback_ns - Spent copying the mix to the post mix loopback.
+ *    dsp_ns - Spent running the DSP pipeline.
+ *    render_ns - Spent applying mute and software volume and converting to
+ *        the device format.
+ */
+struct audio_post_mix_debug_info {
+	uint64_t frames;
+	uint64_t loopback_ns;
+	uint64_t dsp_ns;
+	uint64_t render_ns;
+};
+
 /* Debug info shared from server to client. */
 struct audio_debug_info {
 	char output_dev_name[CRAS_NODE_NAME_BUFFER_SIZE];
 	uint32_t output_buffer_size;
 	uint32_t output_used_size;
 	uint32_t output_cb_threshold;
+	struct audio_post_mix_debug_info output_post_mix;
+	int32_t output_drift_ppm; /* Estimated rate against the nominal one. */
 	char input_dev_name[CRAS_NODE_NAME_BUFFER_SIZE];
 	uint32_t input_buffer_size;
 	uint32_t input_used_size;
 	uint32_t input_cb_threshold;
+	int32_t input_drift_ppm;
 	uint32_t num_streams;
 	struct audio_stream_debug_info streams[MAX_DEBUG_STREAMS];
 	struct audio_thread_event_log log;
@@ -180,7 +208,7 @@ struct audio_debug_info {
  *        isn't protected against concurrent updating, only one client should
  *        use it.
  */
-#define CRAS_SERVER_STATE_VERSION 1
+#define CRAS_SERVER_STATE_VERSION 3
 struct cras_server_state {
 	unsigned state_version;
 	size_t volume;
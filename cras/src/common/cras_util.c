@@ -15,6 +15,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "cras_util.h"
+
 int cras_set_rt_scheduling(int rt_lim)
 {
 	struct rlimit rl;
@@ -85,39 +87,48 @@ int cras_make_fd_blocking(int fd)
 	return fcntl(fd, F_SETFL, fl & ~O_NONBLOCK);
 }
 
-int cras_send_with_fd(int sockfd, void *buf, size_t len, int fd)
+int cras_send_with_fds(int sockfd, const void *buf, size_t len,
+		       const int *fds, unsigned int num_fds)
 {
 	struct msghdr msg = {0};
 	struct iovec iov;
 	struct cmsghdr *cmsg;
-	char control[CMSG_SPACE(sizeof(int))];
+	char control[CMSG_SPACE(CRAS_MAX_SEND_FDS * sizeof(int))];
+
+	if (num_fds > CRAS_MAX_SEND_FDS)
+		return -EINVAL;
 
 	msg.msg_iov = &iov;
 	msg.msg_iovlen = 1;
-	iov.iov_base = buf;
+	iov.iov_base = (void *)buf;
 	iov.iov_len = len;
 
+	if (num_fds == 0)
+		return sendmsg(sockfd, &msg, 0);
+
 	msg.msg_control = control;
-	msg.msg_controllen = sizeof(control);
+	msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
 	cmsg = CMSG_FIRSTHDR(&msg);
 	cmsg->cmsg_level = SOL_SOCKET;
 	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
 	msg.msg_controllen = cmsg->cmsg_len;
 
 	return sendmsg(sockfd, &msg, 0);
 }
 
-int cras_recv_with_fd(int sockfd, void *buf, size_t len, int *fd)
+int cras_recv_with_fds(int sockfd, void *buf, size_t len,
+		       int *fds, unsigned int *num_fds)
 {
 	struct msghdr msg = {0};
 	struct iovec iov;
 	struct cmsghdr *cmsg;
-	char control[CMSG_SPACE(sizeof(int))];
+	char control[CMSG_SPACE(CRAS_MAX_SEND_FDS * sizeof(int))];
+	unsigned int max_fds = *num_fds;
 	int rc;
 
-	*fd = -1;
+	*num_fds = 0;
 	msg.msg_iov = &iov;
 	msg.msg_iovlen = 1;
 	iov.iov_base = buf;
@@ -125,18 +136,41 @@ int cras_recv_with_fd(int sockfd, void *buf, size_t len, int *fd)
 	msg.msg_control = control;
 	msg.msg_controllen = sizeof(control);
 
-	rc = recvmsg(sockfd, &msg, 0);
+	rc = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
 	if (rc < 0)
 		return rc;
 
 	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
 	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-		if (cmsg->cmsg_level == SOL_SOCKET
-		    && cmsg->cmsg_type == SCM_RIGHTS) {
-			memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
-			break;
+		unsigned int i, n;
+		int *cfds;
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		/* Close what doesn't fit rather than leak it. */
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		cfds = (int *)CMSG_DATA(cmsg);
+		for (i = 0; i < n; i++) {
+			if (*num_fds < max_fds)
+				fds[(*num_fds)++] = cfds[i];
+			else
+				close(cfds[i]);
 		}
 	}
 
 	return rc;
 }
+
+int cras_send_with_fd(int sockfd, const void *buf, size_t len, int fd)
+{
+	return cras_send_with_fds(sockfd, buf, len, &fd, 1);
+}
+
+int cras_recv_with_fd(int sockfd, void *buf, size_t len, int *fd)
+{
+	unsigned int num_fds = 1;
+
+	*fd = -1;
+	return cras_recv_with_fds(sockfd, buf, len, fd, &num_fds);
+}
@@ -61,12 +61,26 @@ int cras_make_fd_nonblocking(int fd);
 /* Makes a file descriptor blocking. */
 int cras_make_fd_blocking(int fd);
 
+/* Most file descriptors passed with one message. */
+#define CRAS_MAX_SEND_FDS 4
+
 /* Send data in buf to the socket with an extra file descriptor. */
 int cras_send_with_fd(int sockfd, const void *buf, size_t len, int fd);
 
 /* Receive data in buf from the socket. If we also receive a file
 descriptor, put it in *fd, otherwise set *fd to -1. */
-int cras_recv_with_fd(int sockfd, const void *buf, size_t len, int *fd);
+int cras_recv_with_fd(int sockfd, void *buf, size_t len, int *fd);
+
+/* Send data in buf to the socket with num_fds file descriptors, at most
+ * CRAS_MAX_SEND_FDS. */
+int cras_send_with_fds(int sockfd, const void *buf, size_t len,
+		       const int *fds, unsigned int num_fds);
+
+/* Receive data in buf from the socket along with the file descriptors sent
+ * with it.  *num_fds is the room in fds on the way in, set to the number
+ * received.  Descriptors past the room are closed. */
+int cras_recv_with_fds(int sockfd, void *buf, size_t len,
+		       int *fds, unsigned int *num_fds);
 
 /* This must be written a million times... */
 static inline void subtract_timespecs(const struct timespec *end,
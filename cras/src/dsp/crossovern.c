@@ -0,0 +1,186 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <string.h>
+#include "crossovern.h"
+#include "dsp_vec.h"
+
+/* Frames gathered into vectors at a time. */
+#define CROSSOVERN_CHUNK_FRAMES 64
+
+/* The same LR4 filter of up to four channels, one channel per lane. */
+struct lr4_vec {
+	dsp_vec b0, b1, b2;
+	dsp_vec a1, a2;
+	dsp_vec x1, x2;
+	dsp_vec y1, y2;
+	dsp_vec z1, z2;
+};
+
+/* Returns the lp or hp filter of the given stage of a crossover. */
+static struct lr4 *lr4_of(struct crossover *xo, int stage, int high)
+{
+	return high ? &xo->hp[stage] : &xo->lp[stage];
+}
+
+/* Loads the filter of a stage from lanes consecutive crossovers. Unused lanes
+ * are zero and produce zero. */
+static void lr4_vec_load(struct lr4_vec *v, struct crossover *xo, int lanes,
+			 int stage, int high)
+{
+	int i;
+
+	memset(v, 0, sizeof(*v));
+	for (i = 0; i < lanes; i++) {
+		struct lr4 *f = lr4_of(&xo[i], stage, high);
+		v->b0[i] = f->b0;
+		v->b1[i] = f->b1;
+		v->b2[i] = f->b2;
+		v->a1[i] = f->a1;
+		v->a2[i] = f->a2;
+		v->x1[i] = f->x1;
+		v->x2[i] = f->x2;
+		v->y1[i] = f->y1;
+		v->y2[i] = f->y2;
+		v->z1[i] = f->z1;
+		v->z2[i] = f->z2;
+	}
+}
+
+/* Stores the history values back to the crossovers. */
+static void lr4_vec_store(const struct lr4_vec *v, struct crossover *xo,
+			  int lanes, int stage, int high)
+{
+	int i;
+
+	for (i = 0; i < lanes; i++) {
+		struct lr4 *f = lr4_of(&xo[i], stage, high);
+		f->x1 = v->x1[i];
+		f->x2 = v->x2[i];
+		f->y1 = v->y1[i];
+		f->y2 = v->y2[i];
+		f->z1 = v->z1[i];
+		f->z2 = v->z2[i];
+	}
+}
+
+/* Runs one frame through the two biquads of an LR4 filter. */
+static inline dsp_vec lr4_vec_step(struct lr4_vec *f, dsp_vec x)
+{
+	dsp_vec y, z;
+
+	y = f->b0*x + f->b1*f->x1 + f->b2*f->x2 - f->a1*f->y1 - f->a2*f->y2;
+	z = f->b0*y + f->b1*f->y1 + f->b2*f->y2 - f->a1*f->z1 - f->a2*f->z2;
+	f->x2 = f->x1;
+	f->x1 = x;
+	f->y2 = f->y1;
+	f->y1 = y;
+	f->z2 = f->z1;
+	f->z1 = z;
+	return z;
+}
+
+/* Split input data using two LR4 filters, put the result into the input array
+ * and another array.
+ *
+ * data0 --+-- lp --> data0
+ *         |
+ *         \-- hp --> data1
+ */
+static void lr4_vec_split(struct lr4_vec *lp, struct lr4_vec *hp, int count,
+			  dsp_vec *data0, dsp_vec *data1)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		dsp_vec x = data0[i];
+		data0[i] = lr4_vec_step(lp, x);
+		data1[i] = lr4_vec_step(hp, x);
+	}
+}
+
+/* Split input data using two LR4 filters and sum them back to the original
+ * data array.
+ *
+ * data --+-- lp --+--> data
+ *        |        |
+ *        \-- hp --/
+ */
+static void lr4_vec_merge(struct lr4_vec *lp, struct lr4_vec *hp, int count,
+			  dsp_vec *data)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		dsp_vec x = data[i];
+		data[i] = lr4_vec_step(lp, x) + lr4_vec_step(hp, x);
+	}
+}
+
+int crossovern_init(struct crossovern *xon, int num_channels,
+		    float freq1, float freq2)
+{
+	int i;
+
+	if (num_channels <= 0 || num_channels > CROSSOVERN_MAX_CHANNELS)
+		return -1;
+
+	xon->num_channels = num_channels;
+	for (i = 0; i < num_channels; i++)
+		crossover_init(&xon->xo[i], freq1, freq2);
+	return 0;
+}
+
+/* Processes up to four channels starting at the given one. */
+static void crossovern_process_lanes(struct crossover *xo, int lanes,
+				     int count, float **data0, float **data1,
+				     float **data2)
+{
+	dsp_vec buf0[CROSSOVERN_CHUNK_FRAMES];
+	dsp_vec buf1[CROSSOVERN_CHUNK_FRAMES];
+	dsp_vec buf2[CROSSOVERN_CHUNK_FRAMES];
+	struct lr4_vec lp[3], hp[3];
+	int offset, chunk, i;
+
+	for (i = 0; i < 3; i++) {
+		lr4_vec_load(&lp[i], xo, lanes, i, 0);
+		lr4_vec_load(&hp[i], xo, lanes, i, 1);
+	}
+
+	for (offset = 0; offset < count; offset += chunk) {
+		chunk = count - offset;
+		if (chunk > CROSSOVERN_CHUNK_FRAMES)
+			chunk = CROSSOVERN_CHUNK_FRAMES;
+		dsp_vec_gather(buf0, data0, lanes, offset, chunk);
+		lr4_vec_split(&lp[0], &hp[0], chunk, buf0, buf1);
+		lr4_vec_merge(&lp[1], &hp[1], chunk, buf0);
+		lr4_vec_split(&lp[2], &hp[2], chunk, buf1, buf2);
+		dsp_vec_scatter(data0, buf0, lanes, offset, chunk);
+		dsp_vec_scatter(data1, buf1, lanes, offset, chunk);
+		dsp_vec_scatter(data2, buf2, lanes, offset, chunk);
+	}
+
+	for (i = 0; i < 3; i++) {
+		lr4_vec_store(&lp[i], xo, lanes, i, 0);
+		lr4_vec_store(&hp[i], xo, lanes, i, 1);
+	}
+}
+
+void crossovern_process(struct crossovern *xon, int count,
+			float **data0, float **data1, float **data2)
+{
+	int ch;
+
+	if (!count)
+		return;
+
+	for (ch = 0; ch < xon->num_channels; ch += DSP_VEC_LANES) {
+		int lanes = xon->num_channels - ch;
+		if (lanes > DSP_VEC_LANES)
+			lanes = DSP_VEC_LANES;
+		crossovern_process_lanes(&xon->xo[ch], lanes, count,
+					 &data0[ch], &data1[ch], &data2[ch]);
+	}
+}
@@ -0,0 +1,55 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef CROSSOVERN_H_
+#define CROSSOVERN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* "crossovern" is a multichannel version of the "crossover" filter. It keeps
+ * one crossover per channel and runs four channels of the same filter at once
+ * to increase performance. */
+
+#include "crossover.h"
+
+/* Maximum number of channels a crossovern can have */
+#define CROSSOVERN_MAX_CHANNELS 8
+
+struct crossovern {
+	int num_channels;
+	struct crossover xo[CROSSOVERN_MAX_CHANNELS];
+};
+
+/* Initializes a crossovern filter
+ * Args:
+ *    xon - The crossovern filter we want to initialize.
+ *    num_channels - The number of channels, at most CROSSOVERN_MAX_CHANNELS.
+ *    freq1 - The normalized frequency splits low and mid band.
+ *    freq2 - The normalized frequency splits mid and high band.
+ * Returns:
+ *    0 if success. -1 if num_channels is out of range.
+ */
+int crossovern_init(struct crossovern *xon, int num_channels,
+		    float freq1, float freq2);
+
+/* Splits input samples to three bands.
+ * Args:
+ *    xon - The crossovern filter to use.
+ *    count - The number of input samples.
+ *    data0 - The input samples of each channel, also the place to store low
+ *            band output.
+ *    data1 - The place to store mid band output of each channel.
+ *    data2 - The place to store high band output of each channel.
+ */
+void crossovern_process(struct crossovern *xon, int count,
+			float **data0, float **data1, float **data2);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* CROSSOVERN_H_ */
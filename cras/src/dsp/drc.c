@@ -23,10 +23,16 @@ static void free_data_buffer(struct drc *drc);
 static void free_emphasis_eq(struct drc *drc);
 static void free_kernel(struct drc *drc);
 
-struct drc *drc_new(float sample_rate)
+struct drc *drc_new(float sample_rate, int num_channels)
 {
-	struct drc *drc = (struct drc *)calloc(1, sizeof(struct drc));
+	struct drc *drc;
+
+	if (num_channels <= 0 || num_channels > DRC_MAX_CHANNELS)
+		return NULL;
+
+	drc = (struct drc *)calloc(1, sizeof(struct drc));
 	drc->sample_rate = sample_rate;
+	drc->num_channels = num_channels;
 	set_default_parameters(drc);
 	return drc;
 }
@@ -53,7 +59,7 @@ static void init_data_buffer(struct drc *drc)
 	int i;
 	size_t size = sizeof(float) * DRC_PROCESS_MAX_FRAMES;
 
-	for (i = 0; i < DRC_NUM_CHANNELS; i++) {
+	for (i = 0; i < drc->num_channels; i++) {
 		drc->data1[i] = (float *)calloc(1, size);
 		drc->data2[i] = (float *)calloc(1, size);
 	}
@@ -64,7 +70,7 @@ static void free_data_buffer(struct drc *drc)
 {
 	int i;
 
-	for (i = 0; i < DRC_NUM_CHANNELS; i++) {
+	for (i = 0; i < drc->num_channels; i++) {
 		free(drc->data1[i]);
 		free(drc->data2[i]);
 	}
@@ -178,16 +184,30 @@ static void init_emphasis_eq(struct drc *drc)
 	float stage_ratio = drc_get_param(drc, 0, PARAM_FILTER_STAGE_RATIO);
 	float anchor_freq = drc_get_param(drc, 0,  PARAM_FILTER_ANCHOR);
 
-	drc->emphasis_eq = eq2_new();
-	drc->deemphasis_eq = eq2_new();
+	if (drc->num_channels == 2) {
+		drc->emphasis_eq = eq2_new();
+		drc->deemphasis_eq = eq2_new();
+	} else {
+		drc->emphasis_eqn = eqn_new(drc->num_channels);
+		drc->deemphasis_eqn = eqn_new(drc->num_channels);
+	}
 
 	for (i = 0; i < 2; i++) {
 		emphasis_stage_pair_biquads(stage_gain, anchor_freq,
 					    anchor_freq / stage_ratio,
 					    &e, &d);
-		for (j = 0; j < 2; j++) {
-			eq2_append_biquad_direct(drc->emphasis_eq, j, &e);
-			eq2_append_biquad_direct(drc->deemphasis_eq, j, &d);
+		for (j = 0; j < drc->num_channels; j++) {
+			if (drc->emphasis_eq) {
+				eq2_append_biquad_direct(drc->emphasis_eq,
+							 j, &e);
+				eq2_append_biquad_direct(drc->deemphasis_eq,
+							 j, &d);
+			} else {
+				eqn_append_biquad_direct(drc->emphasis_eqn,
+							 j, &e);
+				eqn_append_biquad_direct(drc->deemphasis_eqn,
+							 j, &d);
+			}
 		}
 		anchor_freq /= (stage_ratio * stage_ratio);
 	}
@@ -198,6 +218,8 @@ static void free_emphasis_eq(struct drc *drc)
 {
 	eq2_free(drc->emphasis_eq);
 	eq2_free(drc->deemphasis_eq);
+	eqn_free(drc->emphasis_eqn);
+	eqn_free(drc->deemphasis_eqn);
 }
 
 /* Initializes the crossover filter */
@@ -206,7 +228,10 @@ static void init_crossover(struct drc *drc)
 	float freq1 = drc->parameters[1][PARAM_CROSSOVER_LOWER_FREQ];
 	float freq2 = drc->parameters[2][PARAM_CROSSOVER_LOWER_FREQ];
 
-	crossover2_init(&drc->xo2, freq1, freq2);
+	if (drc->num_channels == 2)
+		crossover2_init(&drc->xo2, freq1, freq2);
+	else
+		crossovern_init(&drc->xon, drc->num_channels, freq1, freq2);
 }
 
 /* Initializes the compressor kernels */
@@ -215,7 +240,7 @@ static void init_kernel(struct drc *drc)
 	int i;
 
 	for (i = 0; i < DRC_NUM_KERNELS; i++) {
-		dk_init(&drc->kernel[i], drc->sample_rate);
+		dk_init(&drc->kernel[i], drc->sample_rate, drc->num_channels);
 
 		float db_threshold = drc_get_param(drc, i, PARAM_THRESHOLD);
 		float db_knee = drc_get_param(drc, i, PARAM_KNEE);
@@ -357,12 +382,19 @@ void drc_process(struct drc *drc, float **data, int frames)
 	float **data2 = drc->data2;
 
 	/* Apply pre-emphasis filter if it is not disabled. */
-	if (!drc->emphasis_disabled)
-		eq2_process(drc->emphasis_eq, data[0], data[1], frames);
+	if (!drc->emphasis_disabled) {
+		if (drc->emphasis_eq)
+			eq2_process(drc->emphasis_eq, data[0], data[1], frames);
+		else
+			eqn_process(drc->emphasis_eqn, data, frames);
+	}
 
 	/* Crossover */
-	crossover2_process(&drc->xo2, frames, data[0], data[1],
-			   data1[0], data1[1], data2[0], data2[1]);
+	if (drc->num_channels == 2)
+		crossover2_process(&drc->xo2, frames, data[0], data[1],
+				   data1[0], data1[1], data2[0], data2[1]);
+	else
+		crossovern_process(&drc->xon, frames, data, data1, data2);
 
 	/* Apply compression to each band of the signal. The processing is
 	 * performed in place.
@@ -372,10 +404,15 @@ void drc_process(struct drc *drc, float **data, int frames)
 	dk_process(&drc->kernel[2], data2, frames);
 
 	/* Sum the three bands of signal */
-	for (i = 0; i < DRC_NUM_CHANNELS; i++)
+	for (i = 0; i < drc->num_channels; i++)
 		sum3(data[i], data1[i], data2[i], frames);
 
 	/* Apply de-emphasis filter if emphasis is not disabled. */
-	if (!drc->emphasis_disabled)
-		eq2_process(drc->deemphasis_eq, data[0], data[1], frames);
+	if (!drc->emphasis_disabled) {
+		if (drc->deemphasis_eq)
+			eq2_process(drc->deemphasis_eq, data[0], data[1],
+				    frames);
+		else
+			eqn_process(drc->deemphasis_eqn, data, frames);
+	}
 }
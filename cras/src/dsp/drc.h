@@ -16,17 +16,19 @@ extern "C" {
 #endif
 
 #include "crossover2.h"
+#include "crossovern.h"
 #include "drc_kernel.h"
 #include "eq2.h"
+#include "eqn.h"
 
 /* DRC implements a flexible audio dynamics compression effect such as is
  * commonly used in musical production and game audio. It lowers the volume of
  * the loudest parts of the signal and raises the volume of the softest parts,
  * making the sound richer, fuller, and more controlled.
  *
- * This is a three band stereo DRC. There are three compressor kernels, and each
- * can have its own parameters. If a kernel is disabled, it only delays the
- * signal and does not compress it.
+ * This is a three band DRC for up to DRC_MAX_CHANNELS linked channels. There
+ * are three compressor kernels, and each can have its own parameters. If a
+ * kernel is disabled, it only delays the signal and does not compress it.
  *
  *                   INPUT
  *                     |
@@ -110,6 +112,10 @@ struct drc {
 	/* sample rate in Hz */
 	float sample_rate;
 
+	/* The number of channels. Stereo runs the eq2 and crossover2 filters,
+	 * any other count the eqn and crossovern ones. */
+	int num_channels;
+
 	/* 1 to disable the emphasis and deemphasis, 0 to enable it. */
 	int emphasis_disabled;
 
@@ -119,9 +125,12 @@ struct drc {
 	/* The emphasis filter and deemphasis filter */
 	struct eq2 *emphasis_eq;
 	struct eq2 *deemphasis_eq;
+	struct eqn *emphasis_eqn;
+	struct eqn *deemphasis_eqn;
 
 	/* The crossover filter */
 	struct crossover2 xo2;
+	struct crossovern xon;
 
 	/* The compressor kernels */
 	struct drc_kernel kernel[DRC_NUM_KERNELS];
@@ -129,8 +138,8 @@ struct drc {
 	/* Temporary buffer used during drc_process(). The mid and high band
 	 * signal is stored in these buffers (the low band is stored in the
 	 * original input buffer). */
-	float *data1[DRC_NUM_CHANNELS];
-	float *data2[DRC_NUM_CHANNELS];
+	float *data1[DRC_MAX_CHANNELS];
+	float *data2[DRC_MAX_CHANNELS];
 };
 
 /* DRC needs the parameters to be set before initialization. So drc_new() should
@@ -150,8 +159,14 @@ struct drc {
  *  drc_free();
  */
 
-/* Allocates a DRC. */
-struct drc *drc_new(float sample_rate);
+/* Allocates a DRC.
+ * Args:
+ *    sample_rate - The sample rate in Hz.
+ *    num_channels - The number of channels, at most DRC_MAX_CHANNELS.
+ * Returns:
+ *    The new DRC, or NULL if num_channels is out of range.
+ */
+struct drc *drc_new(float sample_rate, int num_channels);
 
 /* Initializes a DRC. */
 void drc_init(struct drc *drc);
@@ -162,9 +177,8 @@ void drc_free(struct drc *drc);
 /* Processes input data using a DRC.
  * Args:
  *    drc - The DRC we want to use.
- *    float **data - Pointers to input/output data. The input must be stereo
- *        and one channel is pointed by data[0], another pointed by data[1]. The
- *        output data is stored in the same place.
+ *    float **data - Pointers to input/output data, one per channel of the
+ *        DRC. The output data is stored in the same place.
  *    frames - The number of frames to process.
  */
 void drc_process(struct drc *drc, float **data, int frames);
@@ -28,7 +28,7 @@
 const float uninitialized_value = -1;
 static int drc_math_initialized;
 
-void dk_init(struct drc_kernel *dk, float sample_rate)
+void dk_init(struct drc_kernel *dk, float sample_rate, int num_channels)
 {
 	int i;
 
@@ -38,6 +38,7 @@ void dk_init(struct drc_kernel *dk, float sample_rate)
 	}
 
 	dk->sample_rate = sample_rate;
+	dk->num_channels = num_channels;
 	dk->detector_average = 0;
 	dk->compressor_gain = 1;
 	dk->enabled = 0;
@@ -59,7 +60,7 @@ void dk_init(struct drc_kernel *dk, float sample_rate)
 	assert_on_compile(DIVISION_FRAMES % 4 == 0);
 	/* Allocate predelay buffers */
 	assert_on_compile_is_power_of_2(MAX_PRE_DELAY_FRAMES);
-	for (i = 0; i < DRC_NUM_CHANNELS; i++) {
+	for (i = 0; i < dk->num_channels; i++) {
 		size_t size = sizeof(float) * MAX_PRE_DELAY_FRAMES;
 		dk->pre_delay_buffers[i] = (float *)calloc(1, size);
 	}
@@ -68,7 +69,7 @@ void dk_init(struct drc_kernel *dk, float sample_rate)
 void dk_free(struct drc_kernel *dk)
 {
 	int i;
-	for (i = 0; i < DRC_NUM_CHANNELS; ++i)
+	for (i = 0; i < dk->num_channels; ++i)
 		free(dk->pre_delay_buffers[i]);
 }
 
@@ -93,7 +94,7 @@ static void set_pre_delay_time(struct drc_kernel *dk, float pre_delay_time)
 
 	if (dk->last_pre_delay_frames != pre_delay_frames) {
 		dk->last_pre_delay_frames = pre_delay_frames;
-		for (i = 0; i < DRC_NUM_CHANNELS; ++i) {
+		for (i = 0; i < dk->num_channels; ++i) {
 			size_t size = sizeof(float) * MAX_PRE_DELAY_FRAMES;
 			memset(dk->pre_delay_buffers[i], 0, size);
 		}
@@ -481,6 +482,20 @@ static inline void max_abs_division(float *output, float *data0, float *data1)
 }
 #endif
 
+/* The same as max_abs_division() for any number of channels, data points to
+ * the division in each of them. */
+static void max_abs_division_channels(float *output, float **data,
+				      int num_channels)
+{
+	int i, j;
+
+	for (i = 0; i < DIVISION_FRAMES; i++)
+		output[i] = fabsf(data[0][i]);
+	for (j = 1; j < num_channels; j++)
+		for (i = 0; i < DIVISION_FRAMES; i++)
+			output[i] = fmaxf(output[i], fabsf(data[j][i]));
+}
+
 /* Update detector_average from the last input division. */
 static void dk_update_detector_average(struct drc_kernel *dk)
 {
@@ -499,9 +514,18 @@ static void dk_update_detector_average(struct drc_kernel *dk)
 	}
 
 	/* The max abs value across all channels for this frame */
-	max_abs_division(abs_input_array,
-			 &dk->pre_delay_buffers[0][div_start],
-			 &dk->pre_delay_buffers[1][div_start]);
+	if (dk->num_channels == 2) {
+		max_abs_division(abs_input_array,
+				 &dk->pre_delay_buffers[0][div_start],
+				 &dk->pre_delay_buffers[1][div_start]);
+	} else {
+		float *data[DRC_MAX_CHANNELS];
+
+		for (i = 0; i < dk->num_channels; i++)
+			data[i] = &dk->pre_delay_buffers[i][div_start];
+		max_abs_division_channels(abs_input_array, data,
+					  dk->num_channels);
+	}
 
 	for (i = 0; i < DIVISION_FRAMES; i++) {
 		/* Compute compression amount from un-delayed signal */
@@ -930,6 +954,87 @@ static void dk_compress_output(struct drc_kernel *dk)
 }
 #endif
 
+/* The same as dk_compress_output() for any number of channels. The gain of
+ * each frame is computed once, then applied to every channel. */
+static void dk_compress_output_channels(struct drc_kernel *dk)
+{
+	const float master_linear_gain = dk->master_linear_gain;
+	const float envelope_rate = dk->envelope_rate;
+	const float scaled_desired_gain = dk->scaled_desired_gain;
+	const float compressor_gain = dk->compressor_gain;
+	const int div_start = dk->pre_delay_read_index;
+	float total_gain[DIVISION_FRAMES];
+	int count = DIVISION_FRAMES / 4;
+
+	int i, j;
+
+	/* Exponential approach to desired gain. */
+	if (envelope_rate < 1) {
+		/* Attack - reduce gain to desired. */
+		float c = compressor_gain - scaled_desired_gain;
+		float base = scaled_desired_gain;
+		float r = 1 - envelope_rate;
+		float x[4] = {c*r, c*r*r, c*r*r*r, c*r*r*r*r};
+		float r4 = r*r*r*r;
+
+		i = 0;
+		while (1) {
+			/* Warp pre-compression gain to smooth out sharp
+			 * exponential transition points, then calculate total
+			 * gain using master gain. */
+			for (j = 0; j < 4; j++)
+				total_gain[i * 4 + j] = master_linear_gain *
+					warp_sinf(x[j] + base);
+
+			if (++i == count)
+				break;
+
+			for (j = 0; j < 4; j++)
+				x[j] = x[j] * r4;
+		}
+
+		dk->compressor_gain = x[3] + base;
+	} else {
+		/* Release - exponentially increase gain to 1.0 */
+		float c = compressor_gain;
+		float r = envelope_rate;
+		float x[4] = {c*r, c*r*r, c*r*r*r, c*r*r*r*r};
+		float r4 = r*r*r*r;
+
+		i = 0;
+		while (1) {
+			for (j = 0; j < 4; j++)
+				total_gain[i * 4 + j] = master_linear_gain *
+					warp_sinf(x[j]);
+
+			if (++i == count)
+				break;
+
+			for (j = 0; j < 4; j++)
+				x[j] = min(1.0f, x[j] * r4);
+		}
+
+		dk->compressor_gain = x[3];
+	}
+
+	/* Apply final gain. */
+	for (j = 0; j < dk->num_channels; j++) {
+		float *ptr = &dk->pre_delay_buffers[j][div_start];
+		for (i = 0; i < DIVISION_FRAMES; i++)
+			ptr[i] *= total_gain[i];
+	}
+}
+
+/* Compresses the next output division, with the stereo version when it
+ * applies. */
+static void dk_compress_division(struct drc_kernel *dk)
+{
+	if (dk->num_channels == 2)
+		dk_compress_output(dk);
+	else
+		dk_compress_output_channels(dk);
+}
+
 /* After one complete divison of samples have been received (and one divison of
  * samples have been output), we calculate shaped power average
  * (detector_average) from the input division, update envelope parameters from
@@ -940,7 +1045,7 @@ static void dk_process_one_division(struct drc_kernel *dk)
 {
 	dk_update_detector_average(dk);
 	dk_update_envelope(dk);
-	dk_compress_output(dk);
+	dk_compress_division(dk);
 }
 
 /* Copy the input data to the pre-delay buffer, and copy the output data back to
@@ -952,7 +1057,7 @@ static void dk_copy_fragment(struct drc_kernel *dk, float *data_channels[],
 	int read_index = dk->pre_delay_read_index;
 	int j;
 
-	for (j = 0; j < DRC_NUM_CHANNELS; ++j) {
+	for (j = 0; j < dk->num_channels; ++j) {
 		memcpy(&dk->pre_delay_buffers[j][write_index],
 		       &data_channels[j][frame_index],
 		       frames_to_process * sizeof(float));
@@ -987,7 +1092,7 @@ static void dk_process_delay_only(struct drc_kernel *dk, float *data_channels[],
 		 * available input samples. */
 		int chunk = min(large - small, MAX_PRE_DELAY_FRAMES - large);
 		chunk = min(chunk, count - i);
-		for (j = 0; j < DRC_NUM_CHANNELS; ++j) {
+		for (j = 0; j < dk->num_channels; ++j) {
 			memcpy(&dk->pre_delay_buffers[j][write_index],
 			       &data_channels[j][i],
 			       chunk * sizeof(float));
@@ -1016,7 +1121,7 @@ void dk_process(struct drc_kernel *dk, float *data_channels[], unsigned count)
 
 	if (!dk->processed) {
 		dk_update_envelope(dk);
-		dk_compress_output(dk);
+		dk_compress_division(dk);
 		dk->processed = 1;
 	}
 
@@ -248,6 +248,96 @@ static void interleave_stereo(float *input1, float *input2,
 
 #endif
 
+#undef deinterleave_stereo_float
+#undef interleave_stereo_float
+
+#if defined(__ARM_NEON__)
+
+static void deinterleave_stereo_float(const float *input, float *output1,
+				      float *output2, int frames)
+{
+	int i;
+
+	/* Process 4 frames (8 samples) each loop. */
+	for (i = 0; i + 4 <= frames; i += 4) {
+		float32x4x2_t lr = vld2q_f32(input + 2 * i);
+
+		vst1q_f32(output1 + i, lr.val[0]);
+		vst1q_f32(output2 + i, lr.val[1]);
+	}
+	for (; i < frames; i++) {
+		output1[i] = input[2 * i];
+		output2[i] = input[2 * i + 1];
+	}
+}
+#define deinterleave_stereo_float deinterleave_stereo_float
+
+static void interleave_stereo_float(const float *input1, const float *input2,
+				    float *output, int frames)
+{
+	float32x4x2_t lr;
+	int i;
+
+	/* Process 4 frames (8 samples) each loop. */
+	for (i = 0; i + 4 <= frames; i += 4) {
+		lr.val[0] = vld1q_f32(input1 + i);
+		lr.val[1] = vld1q_f32(input2 + i);
+		vst2q_f32(output + 2 * i, lr);
+	}
+	for (; i < frames; i++) {
+		output[2 * i] = input1[i];
+		output[2 * i + 1] = input2[i];
+	}
+}
+#define interleave_stereo_float interleave_stereo_float
+
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+
+static void deinterleave_stereo_float(const float *input, float *output1,
+				      float *output2, int frames)
+{
+	int i;
+
+	/* Process 4 frames (8 samples) each loop. */
+	for (i = 0; i + 4 <= frames; i += 4) {
+		__m128 a = _mm_loadu_ps(input + 2 * i);
+		__m128 b = _mm_loadu_ps(input + 2 * i + 4);
+
+		_mm_storeu_ps(output1 + i,
+			      _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(output2 + i,
+			      _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	for (; i < frames; i++) {
+		output1[i] = input[2 * i];
+		output2[i] = input[2 * i + 1];
+	}
+}
+#define deinterleave_stereo_float deinterleave_stereo_float
+
+static void interleave_stereo_float(const float *input1, const float *input2,
+				    float *output, int frames)
+{
+	int i;
+
+	/* Process 4 frames (8 samples) each loop. */
+	for (i = 0; i + 4 <= frames; i += 4) {
+		__m128 l = _mm_loadu_ps(input1 + i);
+		__m128 r = _mm_loadu_ps(input2 + i);
+
+		_mm_storeu_ps(output + 2 * i, _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(output + 2 * i + 4, _mm_unpackhi_ps(l, r));
+	}
+	for (; i < frames; i++) {
+		output[2 * i] = input1[i];
+		output[2 * i + 1] = input2[i];
+	}
+}
+#define interleave_stereo_float interleave_stereo_float
+
+#endif
+
 void dsp_util_deinterleave(int16_t *input, float *const *output, int channels,
 			   int frames)
 {
@@ -299,6 +389,40 @@ void dsp_util_interleave(float *const *input, int16_t *output, int channels,
 		}
 }
 
+void dsp_util_deinterleave_float(const float *input, float *const *output,
+				 int channels, int frames)
+{
+	int i, j;
+
+#ifdef deinterleave_stereo_float
+	if (channels == 2) {
+		deinterleave_stereo_float(input, output[0], output[1], frames);
+		return;
+	}
+#endif
+
+	for (i = 0; i < frames; i++)
+		for (j = 0; j < channels; j++)
+			output[j][i] = *input++;
+}
+
+void dsp_util_interleave_float(float *const *input, float *output,
+			       int channels, int frames)
+{
+	int i, j;
+
+#ifdef interleave_stereo_float
+	if (channels == 2) {
+		interleave_stereo_float(input[0], input[1], output, frames);
+		return;
+	}
+#endif
+
+	for (i = 0; i < frames; i++)
+		for (j = 0; j < channels; j++)
+			*output++ = input[j][i];
+}
+
 void dsp_enable_flush_denormal_to_zero()
 {
 #if defined(__i386__) || defined(__x86_64__)
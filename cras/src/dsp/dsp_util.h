@@ -37,6 +37,29 @@ void dsp_util_deinterleave(int16_t *input, float *const *output, int channels,
 void dsp_util_interleave(float *const *input, int16_t *output, int channels,
 			 int frames);
 
+/* Splits interleaved float samples to one buffer per channel.  No conversion
+ * is done, the samples are already in the range of the DSP.
+ * Args:
+ *    input - The interleaved input buffer. Every "channels" samples is a frame.
+ *    output - Pointers to output buffers. There are "channels" output buffers.
+ *    channels - The number of samples per frame.
+ *    frames - The number of frames to split.
+ */
+void dsp_util_deinterleave_float(const float *input, float *const *output,
+				 int channels, int frames);
+
+/* Interleaves one float buffer per channel.  The inverse of
+ * dsp_util_deinterleave_float().
+ * Args:
+ *    input - Pointers to input buffers. There are "channels" input buffers.
+ *    output - The interleaved output buffer. Every "channels" samples is a
+ *        frame.
+ *    channels - The number of samples per frame.
+ *    frames - The number of frames to interleave.
+ */
+void dsp_util_interleave_float(float *const *input, float *output,
+			       int channels, int frames);
+
 /* Disables denormal numbers in floating point calculation. Denormal numbers
  * happens often in IIR filters, and it can be very slow.
  */
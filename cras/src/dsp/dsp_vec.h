@@ -0,0 +1,59 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef DSP_VEC_H_
+#define DSP_VEC_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Multichannel filters keep one sample of each of up to four channels in a
+ * vector, so a single instruction advances four channels of the same filter.
+ * The compiler maps the type to a NEON or SSE register, or to plain floats on
+ * targets with neither. */
+#define DSP_VEC_LANES 4
+
+typedef float dsp_vec __attribute__((vector_size(16)));
+
+/* Gathers count frames of lanes channels into vectors, starting at frame
+ * offset of each channel. Lanes beyond lanes are zero.
+ * Args:
+ *    dst - The vectors to fill, count of them.
+ *    src - Pointers to the channels, lanes of them.
+ *    lanes - Number of channels to gather, at most DSP_VEC_LANES.
+ *    offset - The first frame to gather.
+ *    count - The number of frames to gather.
+ */
+static inline void dsp_vec_gather(dsp_vec *dst, float *const *src, int lanes,
+				  int offset, int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		dsp_vec v = {0, 0, 0, 0};
+		for (j = 0; j < lanes; j++)
+			v[j] = src[j][offset + i];
+		dst[i] = v;
+	}
+}
+
+/* Scatters the vectors back to the channels, the reverse of
+ * dsp_vec_gather(). */
+static inline void dsp_vec_scatter(float *const *dst, const dsp_vec *src,
+				   int lanes, int offset, int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++)
+		for (j = 0; j < lanes; j++)
+			dst[j][offset + i] = src[i][j];
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* DSP_VEC_H_ */
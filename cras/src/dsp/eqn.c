@@ -0,0 +1,133 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include "dsp_vec.h"
+#include "eqn.h"
+
+/* Frames gathered into vectors at a time, small enough to stay in cache
+ * between the biquad stages. */
+#define EQN_CHUNK_FRAMES 64
+
+struct eqn {
+	int num_channels;
+	int n[EQN_MAX_CHANNELS];
+	struct biquad biquad[MAX_BIQUADS_PER_EQN][EQN_MAX_CHANNELS];
+};
+
+struct eqn *eqn_new(int num_channels)
+{
+	struct eqn *eqn;
+	int i, j;
+
+	if (num_channels <= 0 || num_channels > EQN_MAX_CHANNELS)
+		return NULL;
+
+	eqn = (struct eqn *)calloc(1, sizeof(*eqn));
+	if (!eqn)
+		return NULL;
+	eqn->num_channels = num_channels;
+
+	/* Initialize all biquads to identity filter, so if channels have
+	 * different numbers of biquads, it still works. */
+	for (i = 0; i < MAX_BIQUADS_PER_EQN; i++)
+		for (j = 0; j < EQN_MAX_CHANNELS; j++)
+			biquad_set(&eqn->biquad[i][j], BQ_NONE, 0, 0, 0);
+
+	return eqn;
+}
+
+void eqn_free(struct eqn *eqn)
+{
+	free(eqn);
+}
+
+int eqn_append_biquad(struct eqn *eqn, int channel,
+		      enum biquad_type type, float freq, float Q, float gain)
+{
+	if (eqn->n[channel] >= MAX_BIQUADS_PER_EQN)
+		return -1;
+	biquad_set(&eqn->biquad[eqn->n[channel]++][channel], type, freq, Q,
+		   gain);
+	return 0;
+}
+
+int eqn_append_biquad_direct(struct eqn *eqn, int channel,
+			     const struct biquad *biquad)
+{
+	if (eqn->n[channel] >= MAX_BIQUADS_PER_EQN)
+		return -1;
+	eqn->biquad[eqn->n[channel]++][channel] = *biquad;
+	return 0;
+}
+
+/* Runs one stage of biquads, one for each of lanes channels, over the
+ * gathered frames. Unused lanes see zero coefficients and produce zero. */
+static void eqn_process_one(struct biquad *bq, int lanes,
+			    dsp_vec *data, int count)
+{
+	dsp_vec b0 = {0}, b1 = {0}, b2 = {0}, a1 = {0}, a2 = {0};
+	dsp_vec x1 = {0}, x2 = {0}, y1 = {0}, y2 = {0};
+	int i;
+
+	for (i = 0; i < lanes; i++) {
+		b0[i] = bq[i].b0;
+		b1[i] = bq[i].b1;
+		b2[i] = bq[i].b2;
+		a1[i] = bq[i].a1;
+		a2[i] = bq[i].a2;
+		x1[i] = bq[i].x1;
+		x2[i] = bq[i].x2;
+		y1[i] = bq[i].y1;
+		y2[i] = bq[i].y2;
+	}
+
+	for (i = 0; i < count; i++) {
+		dsp_vec x = data[i];
+		dsp_vec y = b0*x + b1*x1 + b2*x2 - a1*y1 - a2*y2;
+		data[i] = y;
+		x2 = x1;
+		x1 = x;
+		y2 = y1;
+		y1 = y;
+	}
+
+	for (i = 0; i < lanes; i++) {
+		bq[i].x1 = x1[i];
+		bq[i].x2 = x2[i];
+		bq[i].y1 = y1[i];
+		bq[i].y2 = y2[i];
+	}
+}
+
+void eqn_process(struct eqn *eqn, float **data, int count)
+{
+	dsp_vec buf[EQN_CHUNK_FRAMES];
+	int ch, i;
+
+	for (ch = 0; ch < eqn->num_channels; ch += DSP_VEC_LANES) {
+		int lanes = eqn->num_channels - ch;
+		int offset, chunk, n = 0;
+
+		if (lanes > DSP_VEC_LANES)
+			lanes = DSP_VEC_LANES;
+		for (i = 0; i < lanes; i++)
+			if (eqn->n[ch + i] > n)
+				n = eqn->n[ch + i];
+		if (n == 0)
+			continue;
+
+		for (offset = 0; offset < count; offset += chunk) {
+			chunk = count - offset;
+			if (chunk > EQN_CHUNK_FRAMES)
+				chunk = EQN_CHUNK_FRAMES;
+			dsp_vec_gather(buf, &data[ch], lanes, offset, chunk);
+			for (i = 0; i < n; i++)
+				eqn_process_one(&eqn->biquad[i][ch], lanes,
+						buf, chunk);
+			dsp_vec_scatter(&data[ch], buf, lanes, offset, chunk);
+		}
+	}
+}
@@ -14,8 +14,8 @@
  *    descriptor and aud_fd are a pair created from socketpair().
  *  client_connected - The server will send a connected message to indicate that
  *    the client should start receving audio events from aud_fd. This message
- *    also specifies the shared memory region to use to share audio samples.
- *    This region will be shmat'd.
+ *    also carries the fds of the shared memory regions to use to share audio
+ *    samples.  These regions will be mmap'd.
  *  running - Once the connections are established, the client will listen for
  *    requests on aud_fd and fill the shm region with the requested number of
  *    samples. This happens in the aud_cb specified in the stream parameters.
@@ -25,8 +25,7 @@
 #include <limits.h>
 #include <pthread.h>
 #include <stdint.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/epoll.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -47,6 +46,7 @@ static const size_t MAX_CMD_MSG_LEN = 256;
 static const size_t SERVER_CONNECT_TIMEOUT_US = 500000;
 static const size_t SERVER_SHUTDOWN_TIMEOUT_US = 500000;
 static const size_t SERVER_FIRST_MESSAGE_TIMEOUT_US = 500000;
+#define MAX_SHARED_THREAD_EVENTS 32 /* Streams serviced per wake up. */
 
 /* Commands sent from the user to the running client. */
 enum {
@@ -94,6 +94,34 @@ struct thread_state {
 	unsigned  running;
 };
 
+/* One audio thread servicing all the streams of a client.
+ * thread - State of the thread.
+ * epoll_fd - Polls the fds the server signals the streams on, and wake_fds.
+ * wake_fds - Pipe to wake the thread so it notices it was stopped.
+ * lock - Held while the thread services streams, so a stream isn't removed
+ *     under its callback.
+ * num_removed - Count of streams removed, the events harvested before taking
+ *     the lock are stale if it changed.
+ */
+struct shared_audio_thread {
+	struct thread_state thread;
+	int epoll_fd;
+	int wake_fds[2];
+	pthread_mutex_t lock;
+	unsigned int num_removed;
+};
+
+/* A stream with a message to handle in the shared audio thread.
+ * stream - The stream.
+ * msg - The message from the server.
+ * deadline - When the callback is due.
+ */
+struct ready_stream {
+	struct client_stream *stream;
+	struct audio_message msg;
+	struct timespec deadline;
+};
+
 /* Parameters used when setting up a capture or playback stream. See comment
  * above cras_client_create_stream_params in the header for descriptions. */
 struct cras_stream_params {
@@ -108,13 +136,14 @@ struct cras_stream_params {
 	cras_unified_cb_t unified_cb;
 	cras_error_cb_t err_cb;
 	struct cras_audio_format format;
+	unsigned int num_periods;
 };
 
 /* Represents an attached audio stream.
  * id - Unique stream identifier.
  * aud_fd - After server connects audio messages come in here.
  * direction - playback, capture, both, or loopback (see CRAS_STREAM_DIRECTION).
- * flags - Currently not used.
+ * flags - CRAS_STREAM_FLAG_* bits the stream was connected with.
  * volume_scaler - Amount to scale the stream by, 0.0 to 1.0.
  * tid - Thread id of the audio thread spawned for this stream.
  * running - Audio thread runs while this is non-zero.
@@ -123,6 +152,11 @@ struct cras_stream_params {
  * config - Audio stream configuration.
  * capture_shm - Shared memory used to exchange audio samples with the server.
  * play_shm - Shared memory used to exchange audio samples with the server.
+ * shm_size - The size of each mapped shm area.
+ * request_fd - For a stream woken through shm, eventfd signaled by the server
+ *     when it posted a request, -1 if requests come in on aud_fd.
+ * reply_fd - For a stream woken through shm, eventfd to signal a reply on.
+ * aud_request_count - Number of the last request taken from shm.
  * play_conv - Format converter, if the server's audio format doesn't match.
  * play_conv_buffer - Buffer used to store samples before sending for format
  *     conversion.
@@ -143,6 +177,10 @@ struct client_stream {
 	struct cras_stream_params *config;
 	struct cras_audio_shm capture_shm;
 	struct cras_audio_shm play_shm;
+	size_t shm_size;
+	int request_fd;
+	int reply_fd;
+	uint32_t aud_request_count;
 	struct cras_fmt_conv *play_conv;
 	uint8_t *play_conv_buffer;
 	struct cras_fmt_conv *capture_conv;
@@ -164,6 +202,9 @@ struct client_stream {
  * streams - Linked list of streams attached to this client.
  * server_state - RO shared memory region holding server state.
  * debug_info_callback - Function to call when debug info is received.
+ * use_shared_audio_thread - Non-zero to service all streams from audio_thread
+ *     instead of a thread per stream.
+ * audio_thread - The audio thread shared by the streams, if used.
  */
 struct cras_client {
 	int id;
@@ -178,6 +219,8 @@ struct cras_client {
 	struct client_stream *streams;
 	const struct cras_server_state *server_state;
 	void (*debug_info_callback)(struct cras_client *);
+	int use_shared_audio_thread;
+	struct shared_audio_thread audio_thread;
 };
 
 /*
@@ -371,6 +414,84 @@ static int read_with_wake_fd(int wake_fd, int read_fd, uint8_t *buf, size_t len)
 	return nread;
 }
 
+/* The shm area requests and replies go through, the playback one if the
+ * stream replies to requests. */
+static struct cras_audio_shm *wakeup_shm(struct client_stream *stream)
+{
+	if (cras_stream_uses_output_hw(stream->direction))
+		return &stream->play_shm;
+	return &stream->capture_shm;
+}
+
+/* Gets the fd that becomes readable when the server has a message. */
+static int aud_poll_fd(const struct client_stream *stream)
+{
+	return stream->request_fd >= 0 ? stream->request_fd : stream->aud_fd;
+}
+
+/* Fills msg from the request posted to shm by the server.  Signals of
+ * requests already taken find nothing new.  Returns the size of the message,
+ * or zero if there is none. */
+static int take_shm_request(struct client_stream *stream,
+			    struct audio_message *msg)
+{
+	uint32_t frames;
+
+	if (!cras_shm_take_aud_request(wakeup_shm(stream),
+				       &stream->aud_request_count, &frames))
+		return 0;
+
+	if (stream->direction == CRAS_STREAM_OUTPUT)
+		msg->id = AUDIO_MESSAGE_REQUEST_DATA;
+	else if (cras_stream_is_unified(stream->direction))
+		msg->id = AUDIO_MESSAGE_UNIFIED;
+	else
+		msg->id = AUDIO_MESSAGE_DATA_READY;
+	msg->error = 0;
+	msg->frames = frames;
+	return sizeof(*msg);
+}
+
+/* Blocks until the next audio message from the server, or until woken by
+ * wake_fd.  A stream woken through shm takes the request posted to shm once
+ * request_fd is signaled.  Returns the size of the message, zero if there is
+ * none, or a negative error. */
+static int read_aud_message(struct client_stream *stream,
+			    struct audio_message *msg)
+{
+	uint64_t events;
+	int rc;
+
+	if (stream->request_fd < 0)
+		return read_with_wake_fd(stream->wake_fds[0], stream->aud_fd,
+					 (uint8_t *)msg, sizeof(*msg));
+
+	rc = read_with_wake_fd(stream->wake_fds[0], stream->request_fd,
+			       (uint8_t *)&events, sizeof(events));
+	if (rc <= 0)
+		return rc;
+	return take_shm_request(stream, msg);
+}
+
+/* Reads the audio message of a stream whose poll fd is readable, see
+ * read_aud_message(). */
+static int read_ready_aud_message(struct client_stream *stream,
+				  struct audio_message *msg)
+{
+	uint64_t events;
+	int rc;
+
+	if (stream->request_fd < 0) {
+		rc = read(stream->aud_fd, msg, sizeof(*msg));
+		return rc == sizeof(*msg) ? rc : -EIO;
+	}
+
+	if (read(stream->request_fd, &events, sizeof(events)) < 0 &&
+	    errno != EAGAIN)
+		return -EIO;
+	return take_shm_request(stream, msg);
+}
+
 /* Check if doing format conversion and configure a caprute buffer appropriately
  * before passing to the client. */
 static unsigned int config_capture_buf(struct client_stream *stream,
@@ -544,6 +665,17 @@ static int send_playback_reply(struct client_stream *stream,
 	if (!cras_stream_uses_output_hw(stream->direction))
 		return 0;
 
+	if (stream->reply_fd >= 0) {
+		uint64_t one = 1;
+
+		cras_shm_post_aud_reply(&stream->play_shm,
+					stream->aud_request_count,
+					error < 0 ? error : (int)frames);
+		if (write(stream->reply_fd, &one, sizeof(one)) != sizeof(one))
+			return -EPIPE;
+		return 0;
+	}
+
 	aud_msg.id = AUDIO_MESSAGE_DATA_READY;
 	aud_msg.frames = frames;
 	aud_msg.error = error;
@@ -666,8 +798,27 @@ static int handle_unified_request(struct client_stream *stream,
 	return send_playback_reply(stream, frames, rc);
 }
 
+/* Runs the callback of a stream for a message from the server.  Returns
+ * non-zero if the stream shouldn't be serviced anymore. */
+static int handle_aud_message(struct client_stream *stream,
+			      const struct audio_message *msg)
+{
+	switch (msg->id) {
+	case AUDIO_MESSAGE_DATA_READY:
+		return handle_capture_data_ready(stream, msg->frames);
+	case AUDIO_MESSAGE_REQUEST_DATA:
+		return handle_playback_request(stream, msg->frames);
+	case AUDIO_MESSAGE_UNIFIED:
+		return handle_unified_request(stream, msg->frames);
+	default:
+		syslog(LOG_WARNING, "Unknown aud msg %d\n", msg->id);
+		return 0;
+	}
+}
+
 /* Listens to the audio socket for messages from the server indicating that
- * the stream needs to be serviced.  One of these runs per stream. */
+ * the stream needs to be serviced.  One of these runs per stream, unless the
+ * client shares one audio thread between its streams. */
 static void *audio_thread(void *arg)
 {
 	struct client_stream *stream = (struct client_stream *)arg;
@@ -685,35 +836,13 @@ static void *audio_thread(void *arg)
 
 	syslog(LOG_DEBUG, "audio thread started");
 	while (stream->thread.running && !thread_terminated) {
-		num_read = read_with_wake_fd(stream->wake_fds[0],
-					     stream->aud_fd,
-					     (uint8_t *)&aud_msg,
-					     sizeof(aud_msg));
+		num_read = read_aud_message(stream, &aud_msg);
 		if (num_read < 0)
 			return (void *)-EIO;
 		if (num_read == 0)
 			continue;
 
-		switch (aud_msg.id) {
-		case AUDIO_MESSAGE_DATA_READY:
-			thread_terminated = handle_capture_data_ready(
-					stream,
-					aud_msg.frames);
-			break;
-		case AUDIO_MESSAGE_REQUEST_DATA:
-			thread_terminated = handle_playback_request(
-					stream,
-					aud_msg.frames);
-			break;
-		case AUDIO_MESSAGE_UNIFIED:
-			thread_terminated = handle_unified_request(
-					stream,
-					aud_msg.frames);
-			break;
-		default:
-			syslog(LOG_WARNING, "Unknown aud msg %d\n", aud_msg.id);
-			break;
-		}
+		thread_terminated = handle_aud_message(stream, &aud_msg);
 	}
 
 	return NULL;
@@ -722,7 +851,7 @@ static void *audio_thread(void *arg)
 /* Pokes the audio thread so that it can notice if it has been terminated. */
 static int wake_aud_thread(struct client_stream *stream)
 {
-	int rc;
+	int rc = 0;
 
 	rc = write(stream->wake_fds[1], &rc, 1);
 	if (rc != 1)
@@ -731,26 +860,264 @@ static int wake_aud_thread(struct client_stream *stream)
 }
 
 /*
- * Client thread.
+ * Shared audio thread.
  */
 
-/* Gets the shared memory region used to share audio data with the server. */
-static int config_shm(struct cras_audio_shm *shm, int key, size_t size)
+/* Gets the time by which a stream must be serviced, when the samples queued
+ * for playback run out or when the capture buffer overruns. */
+static void stream_deadline(const struct client_stream *stream,
+			    struct timespec *deadline)
 {
-	int shmid;
+	uint64_t nsec;
 
-	shmid = shmget(key, size, 0600);
-	if (shmid < 0) {
-		syslog(LOG_ERR, "shmget failed to get shm for stream.");
-		return shmid;
+	if (cras_stream_uses_output_hw(stream->direction)) {
+		*deadline = stream->play_shm.area->ts;
+		return;
 	}
-	shm->area = (struct cras_audio_shm_area *)shmat(shmid, NULL, 0);
-	if (shm->area == (struct cras_audio_shm_area *)-1) {
-		syslog(LOG_ERR, "shmat failed to attach shm for stream.");
-		return errno;
+
+	*deadline = stream->capture_shm.area->ts;
+	nsec = (uint64_t)stream->config->buffer_frames * 1000000000ULL /
+	       stream->config->format.frame_rate;
+	deadline->tv_sec += nsec / 1000000000ULL;
+	deadline->tv_nsec += nsec % 1000000000ULL;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Inserts a stream in the ready list, which is kept in order of deadline.
+ * Returns the new number of ready streams. */
+static unsigned int queue_ready_stream(struct ready_stream *ready,
+				       unsigned int num_ready,
+				       const struct ready_stream *entry)
+{
+	unsigned int i;
+
+	for (i = num_ready;
+	     i > 0 && timespec_after(&ready[i - 1].deadline, &entry->deadline);
+	     i--)
+		ready[i] = ready[i - 1];
+	ready[i] = *entry;
+	return num_ready + 1;
+}
+
+/* Stops polling a stream.  Called with the lock held. */
+static void unpoll_stream(struct shared_audio_thread *at,
+			  struct client_stream *stream)
+{
+	struct epoll_event ev;
+
+	epoll_ctl(at->epoll_fd, EPOLL_CTL_DEL, aud_poll_fd(stream), &ev);
+	stream->thread.running = 0;
+}
+
+/* Services all the streams of a client.  The messages of the streams ready
+ * at a wake up are read first, then the callbacks run earliest deadline
+ * first, so a stream that is due soon doesn't wait for one that has time. */
+static void *shared_audio_thread(void *arg)
+{
+	struct cras_client *client = (struct cras_client *)arg;
+	struct shared_audio_thread *at = &client->audio_thread;
+	struct epoll_event events[MAX_SHARED_THREAD_EVENTS];
+	struct ready_stream ready[MAX_SHARED_THREAD_EVENTS];
+	unsigned int num_removed, num_ready;
+	int nfds, i, rc;
+
+	/* Try to get RT scheduling, if that fails try to set the nice value. */
+	if (cras_set_rt_scheduling(CRAS_CLIENT_RT_THREAD_PRIORITY) ||
+	    cras_set_thread_priority(CRAS_CLIENT_RT_THREAD_PRIORITY))
+		cras_set_nice_level(CRAS_CLIENT_NICENESS_LEVEL);
+
+	syslog(LOG_DEBUG, "shared audio thread started");
+	pthread_mutex_lock(&at->lock);
+	while (at->thread.running) {
+		num_removed = at->num_removed;
+		pthread_mutex_unlock(&at->lock);
+		nfds = epoll_wait(at->epoll_fd, events,
+				  MAX_SHARED_THREAD_EVENTS, -1);
+		pthread_mutex_lock(&at->lock);
+
+		/* A stream removed during the wait may be in the events, take
+		 * them again now that none can be removed. */
+		if (nfds > 0 && num_removed != at->num_removed)
+			nfds = epoll_wait(at->epoll_fd, events,
+					  MAX_SHARED_THREAD_EVENTS, 0);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "shared audio thread epoll %d", errno);
+			break;
+		}
+
+		num_ready = 0;
+		for (i = 0; i < nfds; i++) {
+			struct ready_stream entry;
+			char tmp;
+
+			entry.stream = (struct client_stream *)
+					events[i].data.ptr;
+			if (entry.stream == NULL) {
+				if (read(at->wake_fds[0], &tmp, 1) < 0)
+					syslog(LOG_ERR, "Failed to read wake");
+				continue;
+			}
+			rc = read_ready_aud_message(entry.stream, &entry.msg);
+			if (rc < 0) {
+				unpoll_stream(at, entry.stream);
+				continue;
+			}
+			if (rc == 0)
+				continue;
+			stream_deadline(entry.stream, &entry.deadline);
+			num_ready = queue_ready_stream(ready, num_ready,
+						       &entry);
+		}
+
+		for (i = 0; i < (int)num_ready; i++)
+			if (handle_aud_message(ready[i].stream, &ready[i].msg))
+				unpoll_stream(at, ready[i].stream);
+	}
+	pthread_mutex_unlock(&at->lock);
+
+	return NULL;
+}
+
+/* Creates the fds of the shared audio thread and starts it. */
+static int start_shared_audio_thread(struct cras_client *client)
+{
+	struct shared_audio_thread *at = &client->audio_thread;
+	struct epoll_event ev;
+	int rc;
+
+	at->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (at->epoll_fd < 0)
+		return -errno;
+	if (pipe(at->wake_fds) < 0) {
+		rc = -errno;
+		goto close_epoll;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(at->epoll_fd, EPOLL_CTL_ADD, at->wake_fds[0], &ev) < 0) {
+		rc = -errno;
+		goto close_pipe;
+	}
+
+	at->thread.running = 1;
+	rc = pthread_create(&at->thread.tid, NULL, shared_audio_thread,
+			    client);
+	if (rc) {
+		syslog(LOG_ERR, "Couldn't create shared audio thread.");
+		at->thread.running = 0;
+		rc = -rc;
+		goto close_pipe;
+	}
+	return 0;
+
+close_pipe:
+	close(at->wake_fds[0]);
+	close(at->wake_fds[1]);
+close_epoll:
+	close(at->epoll_fd);
+	return rc;
+}
+
+/* Stops the shared audio thread, once its streams are removed. */
+static void stop_shared_audio_thread(struct cras_client *client)
+{
+	struct shared_audio_thread *at = &client->audio_thread;
+	char poke = 0;
+
+	if (!at->thread.running)
+		return;
+
+	pthread_mutex_lock(&at->lock);
+	at->thread.running = 0;
+	pthread_mutex_unlock(&at->lock);
+	if (write(at->wake_fds[1], &poke, 1) != 1)
+		syslog(LOG_ERR, "Failed to wake shared audio thread");
+	pthread_join(at->thread.tid, NULL);
+
+	close(at->wake_fds[0]);
+	close(at->wake_fds[1]);
+	close(at->epoll_fd);
+}
+
+/* Starts servicing a connected stream from the shared audio thread. */
+static int shared_thread_add_stream(struct cras_client *client,
+				    struct client_stream *stream)
+{
+	struct shared_audio_thread *at = &client->audio_thread;
+	struct epoll_event ev;
+	int rc = 0;
+
+	if (!at->thread.running) {
+		rc = start_shared_audio_thread(client);
+		if (rc < 0)
+			return rc;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = stream;
+	pthread_mutex_lock(&at->lock);
+	if (epoll_ctl(at->epoll_fd, EPOLL_CTL_ADD, aud_poll_fd(stream),
+		      &ev) < 0)
+		rc = -errno;
+	else
+		stream->thread.running = 1;
+	pthread_mutex_unlock(&at->lock);
+
+	return rc;
+}
+
+/* Stops servicing a stream, from the shared audio thread or its own. */
+static void stop_aud_thread(struct cras_client *client,
+			    struct client_stream *stream)
+{
+	struct shared_audio_thread *at = &client->audio_thread;
+
+	if (client->use_shared_audio_thread) {
+		pthread_mutex_lock(&at->lock);
+		if (stream->thread.running)
+			unpoll_stream(at, stream);
+		at->num_removed++;
+		pthread_mutex_unlock(&at->lock);
+		return;
+	}
+
+	if (stream->thread.running) {
+		stream->thread.running = 0;
+		wake_aud_thread(stream);
+		pthread_join(stream->thread.tid, NULL);
+	}
+}
+
+/*
+ * Client thread.
+ */
+
+/* Maps the shared memory region used to share audio data with the server. */
+static int config_shm(struct cras_audio_shm *shm, int fd, size_t size)
+{
+	shm->area = (struct cras_audio_shm_area *)cras_shm_map(fd, size, 1);
+	if (shm->area == NULL) {
+		syslog(LOG_ERR, "Failed to map shm for stream.");
+		return -ENOMEM;
+	}
+	if (shm->area->layout_version != CRAS_SHM_LAYOUT_VERSION) {
+		syslog(LOG_ERR, "Unknown shm layout version %u.",
+		       shm->area->layout_version);
+		return -EINVAL;
 	}
 	/* Copy server shm config locally. */
 	cras_shm_copy_shared_config(shm);
+	if (shm->config.num_periods > CRAS_SHM_MAX_PERIODS ||
+	    (shm->config.num_periods & (shm->config.num_periods - 1)) ||
+	    cras_shm_total_size(shm) > size) {
+		syslog(LOG_ERR, "Invalid shm config for stream.");
+		return -EINVAL;
+	}
 
 	return 0;
 }
@@ -759,9 +1126,9 @@ static int config_shm(struct cras_audio_shm *shm, int key, size_t size)
 static void free_shm(struct client_stream *stream)
 {
 	if (stream->capture_shm.area)
-		shmdt(stream->capture_shm.area);
+		cras_shm_unmap(stream->capture_shm.area, stream->shm_size);
 	if (stream->play_shm.area)
-		shmdt(stream->play_shm.area);
+		cras_shm_unmap(stream->play_shm.area, stream->shm_size);
 	stream->capture_shm.area = NULL;
 	stream->play_shm.area = NULL;
 }
@@ -807,25 +1174,65 @@ static void free_fmt_conv(struct client_stream *stream)
 	stream->capture_conv = NULL;
 }
 
+/* Closes the eventfds of a stream woken through shm. */
+static void free_wakeup_fds(struct client_stream *stream)
+{
+	if (stream->request_fd >= 0)
+		close(stream->request_fd);
+	if (stream->reply_fd >= 0)
+		close(stream->reply_fd);
+	stream->request_fd = -1;
+	stream->reply_fd = -1;
+}
+
 /* Handles the stream connected message from the server.  Check if we need a
  * format converter, configure the shared memory region, and start the audio
- * thread that will handle requests from the server. */
+ * thread that will handle requests from the server.  The fds are the shm fds,
+ * followed by the request and reply eventfds if the server wakes the stream
+ * through shm, they stay owned by the caller. */
 static int stream_connected(struct client_stream *stream,
-			    const struct cras_client_stream_connected *msg)
+			    const struct cras_client_stream_connected *msg,
+			    const int *shm_fds, unsigned int num_shm_fds)
 {
 	int rc;
 	struct cras_audio_format *sfmt = &stream->config->format;
+	unsigned int needed_fds;
+	const int *event_fds = NULL;
 
 	if (msg->err) {
 		syslog(LOG_ERR, "Error Setting up stream %d\n", msg->err);
 		return msg->err;
 	}
 
+	needed_fds = !!cras_stream_has_input(stream->direction) +
+		     !!cras_stream_uses_output_hw(stream->direction);
+	/* An older server or one out of eventfds keeps to the socket. */
+	if ((stream->flags & CRAS_STREAM_FLAG_SHM_WAKEUP) &&
+	    num_shm_fds == needed_fds + 2)
+		event_fds = shm_fds + needed_fds;
+	else if (num_shm_fds != needed_fds) {
+		syslog(LOG_ERR, "Stream connected with %u shm fds, need %u",
+		       num_shm_fds, needed_fds);
+		return -EINVAL;
+	}
+	stream->shm_size = msg->shm_max_size;
+
+	if (event_fds) {
+		stream->request_fd = dup(event_fds[0]);
+		stream->reply_fd = dup(event_fds[1]);
+		if (stream->request_fd < 0 || stream->reply_fd < 0) {
+			rc = -errno;
+			syslog(LOG_ERR, "Failed to keep stream eventfds");
+			goto err_ret;
+		}
+		stream->aud_request_count = 0;
+	}
+
 	if (cras_stream_has_input(stream->direction)) {
 		unsigned int max_frames;
 
 		rc = config_shm(&stream->capture_shm,
-				msg->input_shm_key,
+				*shm_fds++,
 				msg->shm_max_size);
 		if (rc < 0) {
 			syslog(LOG_ERR, "Error configuring capture shm");
@@ -858,7 +1265,7 @@ static int stream_connected(struct client_stream *stream,
 		unsigned int max_frames;
 
 		rc = config_shm(&stream->play_shm,
-				msg->output_shm_key,
+				*shm_fds,
 				msg->shm_max_size);
 		if (rc < 0) {
 			syslog(LOG_ERR, "Error configuring playback shm");
@@ -891,6 +1298,15 @@ static int stream_connected(struct client_stream *stream,
 					   stream->volume_scaler);
 	}
 
+	if (stream->client->use_shared_audio_thread) {
+		rc = shared_thread_add_stream(stream->client, stream);
+		if (rc < 0) {
+			syslog(LOG_ERR, "Couldn't poll stream %d", rc);
+			goto err_ret;
+		}
+		return 0;
+	}
+
 	rc = pipe(stream->wake_fds);
 	if (rc < 0) {
 		syslog(LOG_ERR, "Error piping");
@@ -909,6 +1325,7 @@ static int stream_connected(struct client_stream *stream,
 	return 0;
 err_ret:
 	free_fmt_conv(stream);
+	free_wakeup_fds(stream);
 	if (stream->wake_fds[0] >= 0) {
 		close(stream->wake_fds[0]);
 		close(stream->wake_fds[1]);
@@ -939,7 +1356,8 @@ static int send_connect_message(struct cras_client *client,
 				  stream->config->cb_threshold,
 				  stream->config->min_cb_level,
 				  stream->flags,
-				  stream->config->format);
+				  stream->config->format,
+				  stream->config->num_periods);
 	rc = cras_send_with_fd(client->server_fd, &serv_msg, sizeof(serv_msg),
 			       sock[1]);
 	if (rc != sizeof(serv_msg)) {
@@ -1013,11 +1431,7 @@ static int client_thread_rm_stream(struct cras_client *client,
 		syslog(LOG_WARNING, "error removing stream from server\n");
 
 	/* And shut down locally. */
-	if (stream->thread.running) {
-		stream->thread.running = 0;
-		wake_aud_thread(stream);
-		pthread_join(stream->thread.tid, NULL);
-	}
+	stop_aud_thread(client, stream);
 
 
 	free_shm(stream);
@@ -1026,6 +1440,7 @@ static int client_thread_rm_stream(struct cras_client *client,
 	if (stream->aud_fd >= 0)
 		if (close(stream->aud_fd))
 			syslog(LOG_WARNING, "Couldn't close audio socket");
+	free_wakeup_fds(stream);
 
 	free_fmt_conv(stream);
 
@@ -1070,11 +1485,7 @@ static int handle_stream_reattach(struct cras_client *client,
 		return 0;
 
 	/* Shut down locally. Stream has been removed on the server side. */
-	if (stream->thread.running) {
-		stream->thread.running = 0;
-		wake_aud_thread(stream);
-		pthread_join(stream->thread.tid, NULL);
-	}
+	stop_aud_thread(client, stream);
 
 	free_fmt_conv(stream);
 
@@ -1082,6 +1493,7 @@ static int handle_stream_reattach(struct cras_client *client,
 		close(stream->aud_fd);
 		stream->aud_fd = -1;
 	}
+	free_wakeup_fds(stream);
 	free_shm(stream);
 
 	/* send a message to the server asking that the stream be started. */
@@ -1095,29 +1507,27 @@ static int handle_stream_reattach(struct cras_client *client,
 }
 
 /* Attach to the shm region containing the server state. */
-static int client_attach_shm(struct cras_client *client, key_t shm_key)
+static int client_attach_shm(struct cras_client *client, int shm_fd)
 {
-	int shmid;
-
 	/* Should only happen once per client lifetime. */
 	if (client->server_state)
 		return -EBUSY;
 
-	shmid = shmget(shm_key, sizeof(*(client->server_state)), 0400);
-	if (shmid < 0) {
-		syslog(LOG_ERR, "shmget failed to get shm for client.");
-		return shmid;
+	if (shm_fd < 0) {
+		syslog(LOG_ERR, "No shm fd for client.");
+		return -EINVAL;
 	}
 	client->server_state = (struct cras_server_state *)
-			shmat(shmid, NULL, SHM_RDONLY);
-	if (client->server_state == (void *)-1) {
-		client->server_state = NULL;
-		syslog(LOG_ERR, "shmat failed to attach shm for client.");
-		return errno;
+			cras_shm_map(shm_fd, sizeof(*(client->server_state)),
+				     0);
+	if (client->server_state == NULL) {
+		syslog(LOG_ERR, "Failed to map shm for client.");
+		return -ENOMEM;
 	}
 
 	if (client->server_state->state_version != CRAS_SERVER_STATE_VERSION) {
-		shmdt(client->server_state);
+		cras_shm_unmap((void *)client->server_state,
+			       sizeof(*(client->server_state)));
 		client->server_state = NULL;
 		syslog(LOG_ERR, "Unknown server_state version.");
 		return -EINVAL;
@@ -1131,11 +1541,15 @@ static int handle_message_from_server(struct cras_client *client)
 {
 	uint8_t buf[CRAS_CLIENT_MAX_MSG_SIZE];
 	struct cras_client_message *msg;
+	int fds[CRAS_MAX_SEND_FDS];
+	unsigned int num_fds = ARRAY_SIZE(fds);
+	unsigned int i;
 	int rc = 0;
 	int nread;
 
 	msg = (struct cras_client_message *)buf;
-	nread = recv(client->server_fd, buf, sizeof(buf), 0);
+	nread = cras_recv_with_fds(client->server_fd, buf, sizeof(buf),
+				   fds, &num_fds);
 	if (nread < (int)sizeof(msg->length))
 		goto read_error;
 	if ((int)msg->length != nread)
@@ -1145,9 +1559,9 @@ static int handle_message_from_server(struct cras_client *client)
 	case CRAS_CLIENT_CONNECTED: {
 		struct cras_client_connected *cmsg =
 			(struct cras_client_connected *)msg;
-		rc = client_attach_shm(client, cmsg->shm_key);
+		rc = client_attach_shm(client, num_fds ? fds[0] : -1);
 		if (rc)
-			return rc;
+			goto close_fds;
 		client->id = cmsg->client_id;
 
 		break;
@@ -1159,7 +1573,7 @@ static int handle_message_from_server(struct cras_client *client)
 			stream_from_id(client, cmsg->stream_id);
 		if (stream == NULL)
 			break;
-		rc = stream_connected(stream, cmsg);
+		rc = stream_connected(stream, cmsg, fds, num_fds);
 		if (rc < 0)
 			stream->config->err_cb(stream->client,
 					       stream->id,
@@ -1181,9 +1595,16 @@ static int handle_message_from_server(struct cras_client *client)
 		syslog(LOG_WARNING, "Receive unknown command %d", msg->id);
 		break;
 	}
+	rc = 0;
 
-	return 0;
+close_fds:
+	/* Mappings of the shm areas hold their own references. */
+	for (i = 0; i < num_fds; i++)
+		close(fds[i]);
+	return rc;
 read_error:
+	for (i = 0; i < num_fds; i++)
+		close(fds[i]);
 	rc = connect_to_server_wait(client);
 	if (rc < 0) {
 		syslog(LOG_WARNING, "Can't read from server\n");
@@ -1242,6 +1663,7 @@ static int handle_command_message(struct cras_client *client)
 		/* Stop all playing streams */
 		DL_FOREACH(client->streams, s)
 			client_thread_rm_stream(client, s->id);
+		stop_shared_audio_thread(client);
 
 		/* And stop this client */
 		client->thread.running = 0;
@@ -1472,6 +1894,7 @@ int cras_client_create(struct cras_client **client)
 	}
 	(*client)->command_reply_fds[0] = -1;
 	(*client)->command_reply_fds[1] = -1;
+	pthread_mutex_init(&(*client)->audio_thread.lock, NULL);
 
 	openlog("cras_client", LOG_PID, LOG_USER);
 	setlogmask(LOG_MASK(LOG_ERR));
@@ -1512,13 +1935,15 @@ void cras_client_destroy(struct cras_client *client)
 		return;
 	cras_client_stop(client);
 	if (client->server_state)
-		shmdt(client->server_state);
+		cras_shm_unmap((void *)client->server_state,
+			       sizeof(*(client->server_state)));
 	if (client->server_fd >= 0)
 		shutdown_and_close_socket(client->server_fd);
 	close(client->command_fds[0]);
 	close(client->command_fds[1]);
 	close(client->stream_fds[0]);
 	close(client->stream_fds[1]);
+	pthread_mutex_destroy(&client->audio_thread.lock);
 	free(client);
 }
 
@@ -1568,6 +1993,7 @@ struct cras_stream_params *cras_client_stream_params_create(
 	params->unified_cb = 0;
 	params->err_cb = err_cb;
 	memcpy(&(params->format), format, sizeof(*format));
+	params->num_periods = 0;
 	return params;
 }
 
@@ -1598,10 +2024,24 @@ struct cras_stream_params *cras_client_unified_params_create(
 	params->unified_cb = unified_cb;
 	params->err_cb = err_cb;
 	memcpy(&(params->format), format, sizeof(*format));
+	params->num_periods = 0;
 
 	return params;
 }
 
+void cras_client_stream_params_set_num_periods(
+		struct cras_stream_params *params,
+		unsigned int num_periods)
+{
+	params->num_periods = num_periods;
+}
+
+void cras_client_stream_params_enable_shm_wakeup(
+		struct cras_stream_params *params)
+{
+	params->flags |= CRAS_STREAM_FLAG_SHM_WAKEUP;
+}
+
 void cras_client_stream_params_destroy(struct cras_stream_params *params)
 {
 	free(params);
@@ -1639,7 +2079,10 @@ int cras_client_add_stream(struct cras_client *client,
 	stream->aud_fd = -1;
 	stream->wake_fds[0] = -1;
 	stream->wake_fds[1] = -1;
+	stream->request_fd = -1;
+	stream->reply_fd = -1;
 	stream->direction = config->direction;
+	stream->flags = config->flags;
 	stream->volume_scaler = 1.0;
 
 
@@ -1908,6 +2351,15 @@ int cras_client_run_thread(struct cras_client *client)
 	return 0;
 }
 
+int cras_client_use_shared_audio_thread(struct cras_client *client)
+{
+	if (client == NULL || client->thread.running)
+		return -EINVAL;
+
+	client->use_shared_audio_thread = 1;
+	return 0;
+}
+
 int cras_client_stop(struct cras_client *client)
 {
 	if (client == NULL || !client->thread.running)
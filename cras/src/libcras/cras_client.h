@@ -111,6 +111,18 @@ int cras_client_connected_wait(struct cras_client *client);
  */
 int cras_client_run_thread(struct cras_client *client);
 
+/* Services the audio of all streams of a client from one real time thread,
+ * instead of starting a thread per stream.  The callbacks of streams due at
+ * the same time are called earliest deadline first.  A callback that blocks
+ * delays the other streams of the client.
+ * Args:
+ *    client - the client (from cras_client_create), before it is started
+ *        with cras_client_run_thread.
+ * Returns:
+ *    0 on success, -EINVAL if the client isn't valid or is already running.
+ */
+int cras_client_use_shared_audio_thread(struct cras_client *client);
+
 /* Stops running a client.
  * Args:
  *    client - the client to stop (from cras_client_create).
@@ -246,7 +258,7 @@ int cras_client_update_audio_debug_info(
  *        processing audio in blocks of a certain size(e.g. 512 or 1024 frames).
  *        Ignored for capture streams.
  *    stream_type - media or talk (currently only support "default").
- *    flags - None currently used.
+ *    flags - CRAS_STREAM_FLAG_* bits, see cras_types.h.
  *    user_data - Pointer that will be passed to the callback.
  *    aud_cb - Called when audio is needed(playback) or ready(capture). Allowed
  *        return EOF to indicate that the stream should terminate.
@@ -272,7 +284,7 @@ struct cras_stream_params *cras_client_stream_params_create(
  *        both(CRAS_STREAM_UNIFIED).
  *    block_size - The number of frames per callback(dictates latency).
  *    stream_type - media or talk (currently only support "default").
- *    flags - None currently used.
+ *    flags - CRAS_STREAM_FLAG_* bits, see cras_types.h.
  *    user_data - Pointer that will be passed to the callback.
  *    unified_cd - Called for streams that do simultaneous input/output.
  *    err_cb - Called when there is an error with the stream.
@@ -289,6 +301,28 @@ struct cras_stream_params *cras_client_unified_params_create(
 		cras_error_cb_t err_cb,
 		struct cras_audio_format *format);
 
+/* Asks for the samples of a stream to be exchanged through a ring of periods
+ * instead of a double buffer.  Playback clients can then be asked for up to
+ * num_periods - 1 periods ahead, for streams that don't mind the latency.
+ * Args:
+ *    params - Stream parameters from cras_client_stream_params_create.
+ *    num_periods - Periods of buffer_frames each, the server rounds it up to
+ *        a power of two.  Zero, the default, keeps the double buffer.
+ */
+void cras_client_stream_params_set_num_periods(
+		struct cras_stream_params *params,
+		unsigned int num_periods);
+
+/* Asks for the server to wake the stream through its shm area and eventfds,
+ * instead of messages on the audio socket, which saves copying messages
+ * through the socket for every callback.  Falls back to the socket if the
+ * server can't.
+ * Args:
+ *    params - Stream parameters from cras_client_stream_params_create.
+ */
+void cras_client_stream_params_enable_shm_wakeup(
+		struct cras_stream_params *params);
+
 /* Destroy stream params created with cras_client_stream_params_create. */
 void cras_client_stream_params_destroy(struct cras_stream_params *params);
 
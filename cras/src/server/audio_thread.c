@@ -3,12 +3,18 @@
  * found in the LICENSE file.
  */
 
+#define _GNU_SOURCE /* Needed for ppoll. */
+#include <poll.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <syslog.h>
 
 #include "cras_config.h"
 #include "cras_dsp.h"
 #include "cras_dsp_pipeline.h"
+#include "cras_fmt_conv.h"
 #include "cras_iodev.h"
 #include "cras_loopback_iodev.h"
 #include "cras_mix.h"
@@ -17,12 +23,19 @@
 #include "cras_types.h"
 #include "cras_util.h"
 #include "audio_thread.h"
+#include "dsp_util.h"
+#include "rate_estimator.h"
 #include "softvol_curve.h"
 #include "utlist.h"
 
 #define MIN_PROCESS_TIME_US 500 /* 0.5ms - min amount of time to mix/src. */
 #define SLEEP_FUZZ_FRAMES 10 /* # to consider "close enough" to sleep frames. */
 #define MIN_READ_WAIT_US 2000 /* 2ms */
+#define MAX_EPOLL_EVENTS 32 /* Events harvested per epoll_wait call. */
+#define WAKE_COALESCE_US 300 /* Capture waits this long for a playback wake. */
+#define MAX_WAKE_ADVANCE_US 1000 /* Most the timer is armed ahead of time. */
+#define POST_MIX_CHUNK_FRAMES 512 /* Frames taken through post mix at a time. */
+#define CONV_SLACK_FRAMES 16 /* Room for converted frames a rate rounds up. */
 
 /* Messages that can be sent from the main context to the audio thread. */
 enum AUDIO_THREAD_COMMAND {
@@ -33,14 +46,45 @@ enum AUDIO_THREAD_COMMAND {
 	AUDIO_THREAD_DUMP_THREAD_INFO,
 };
 
+/* Completion of an asynchronous command, queued on the thread once the command
+ * is reaped and run later from the main loop.
+ *    cb - Called with the result.
+ *    cb_data - Passed to cb.
+ *    rc - Result of the command.
+ */
+struct audio_thread_completion {
+	audio_thread_complete_cb cb;
+	void *cb_data;
+	int rc;
+	struct audio_thread_completion *prev, *next;
+};
+
+/* Result of a command waited for by audio_thread_post_message. */
+struct audio_thread_sync_result {
+	int done;
+	int rc;
+};
+
+/* Header of a command.
+ *    length - Size of the whole command.
+ *    id - Which command this is.
+ *    completion - Completion of an asynchronous command, NULL for none.
+ *    result - Where a synchronous command stores its result, NULL for none.
+ *    rc - Result of the command, set by the audio thread.
+ */
 struct audio_thread_msg {
 	size_t length;
 	enum AUDIO_THREAD_COMMAND id;
+	struct audio_thread_completion *completion;
+	struct audio_thread_sync_result *result;
+	int rc;
 };
 
 struct audio_thread_add_rm_stream_msg {
 	struct audio_thread_msg header;
 	struct cras_rstream *stream;
+	/* Container of an added stream, with its conversion. */
+	struct cras_io_stream *iostream;
 	enum CRAS_STREAM_DIRECTION dir;
 };
 
@@ -49,28 +93,111 @@ struct audio_thread_dump_debug_info_msg {
 	struct audio_debug_info *info;
 };
 
+/* A slot of the command ring, large enough for any command. */
+union audio_thread_cmd {
+	struct audio_thread_msg header;
+	struct audio_thread_add_rm_stream_msg add_rm_stream;
+	struct audio_thread_dump_debug_info_msg dump_debug_info;
+};
+
+/* Number of slots in the command ring, a power of two. */
+#define AUDIO_THREAD_CMD_RING_SIZE 64
+
+/* Single producer, single consumer ring of commands.  The main thread fills
+ * slots and reaps the completed ones, the audio thread runs them.  The indices
+ * only ever increase, a slot is found by masking.
+ *    write_idx - Next slot the main thread fills.
+ *    read_idx - Next slot the audio thread runs, the slots before it are done.
+ *    reap_idx - Next done slot the main thread takes the result of.
+ *    producer_waiting - Set by the main thread while it waits for space.
+ *    cmds - The slots.
+ */
+struct audio_thread_cmd_ring {
+	unsigned int write_idx;
+	unsigned int read_idx;
+	unsigned int reap_idx;
+	int producer_waiting;
+	union audio_thread_cmd cmds[AUDIO_THREAD_CMD_RING_SIZE];
+};
+
 /* For capture, the amount of frames that will be left after a read is
  * performed.  Sleep this many frames past the buffer size to be sure at least
  * the buffer size is captured when the audio thread wakes up.
  */
 static const unsigned int CAP_REMAINING_FRAMES_TARGET = 16;
 
-static struct iodev_callback_list *iodev_callbacks;
-
+/* An fd polled by the audio thread and the callback to run when it wakes.
+ *    polled - Set when the fd was ready on the last wake up.
+ */
 struct iodev_callback_list {
 	int fd;
+	int polled;
 	thread_callback cb;
 	void *cb_data;
 	struct iodev_callback_list *prev, *next;
 };
 
-void audio_thread_add_callback(int fd, thread_callback cb,
-                               void *data)
+/* Adds fd to an epoll set, data is returned with the events for the fd. */
+static int epoll_add_fd(int epoll_fd, int fd, void *data)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = data;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void epoll_rm_fd(int epoll_fd, int fd)
+{
+	struct epoll_event ev;
+
+	/* A non-NULL event is needed by kernels before 2.6.9. */
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+/* Waits for events on an epoll set.  Without a timeout this is a single
+ * epoll_wait.  With one, the set itself is polled first so that the timeout
+ * keeps the sub-millisecond precision of a timespec, epoll_wait only takes
+ * milliseconds.
+ * Args:
+ *    epoll_fd - The epoll set to wait on.
+ *    events - Filled with the ready events.
+ *    max_events - The size of events.
+ *    ts - The maximum time to wait, NULL to wait forever.
+ * Returns:
+ *    The number of events filled, 0 on timeout, negative error code on
+ *    failure.
+ */
+static int wait_epoll_events(int epoll_fd, struct epoll_event *events,
+			     int max_events, const struct timespec *ts)
+{
+	struct pollfd pfd;
+	int rc;
+
+	if (!ts) {
+		rc = epoll_wait(epoll_fd, events, max_events, -1);
+		return rc < 0 ? -errno : rc;
+	}
+
+	pfd.fd = epoll_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	rc = ppoll(&pfd, 1, ts, NULL);
+	if (rc <= 0)
+		return rc < 0 ? -errno : rc;
+
+	rc = epoll_wait(epoll_fd, events, max_events, 0);
+	return rc < 0 ? -errno : rc;
+}
+
+void audio_thread_add_callback(struct audio_thread *thread, int fd,
+			       thread_callback cb, void *data)
 {
 	struct iodev_callback_list *iodev_cb;
 
 	/* Don't add iodev_cb twice */
-	DL_FOREACH(iodev_callbacks, iodev_cb)
+	DL_FOREACH(thread->callbacks, iodev_cb)
 		if (iodev_cb->fd == fd && iodev_cb->cb_data == data)
 			return;
 
@@ -79,25 +206,27 @@ void audio_thread_add_callback(int fd, thread_callback cb,
 	iodev_cb->cb = cb;
 	iodev_cb->cb_data = data;
 
-	DL_APPEND(iodev_callbacks, iodev_cb);
+	DL_APPEND(thread->callbacks, iodev_cb);
+
+	if (epoll_add_fd(thread->epoll_fd, fd, iodev_cb))
+		syslog(LOG_ERR, "Failed to poll callback fd %d", fd);
 }
 
-void audio_thread_rm_callback(int fd)
+void audio_thread_rm_callback(struct audio_thread *thread, int fd)
 {
 	struct iodev_callback_list *iodev_cb;
 
-	DL_FOREACH(iodev_callbacks, iodev_cb) {
+	DL_FOREACH(thread->callbacks, iodev_cb) {
 		if (iodev_cb->fd == fd) {
-			DL_DELETE(iodev_callbacks, iodev_cb);
+			epoll_rm_fd(thread->epoll_fd, fd);
+			DL_DELETE(thread->callbacks, iodev_cb);
 			free(iodev_cb);
 			return;
 		}
 	}
 }
 
-/* Audio thread logging. */
-static struct audio_thread_event_log *atlog;
-
+/* Audio thread logging, each thread logs to its own thread->atlog. */
 static inline
 struct audio_thread_event_log *audio_thread_event_log_init()
 {
@@ -203,6 +332,16 @@ static inline int stream_uses_direction(struct cras_rstream *stream,
 	       stream->direction == CRAS_STREAM_UNIFIED;
 }
 
+/* Returns how many frames of the output device 'frames' frames of a stream
+ * last, they differ when the stream is converted to the device rate. */
+static inline size_t stream_dev_frames(const struct cras_io_stream *curr,
+				       size_t frames)
+{
+	if (!curr->conv)
+		return frames;
+	return cras_fmt_conv_in_frames_to_out(curr->conv, frames);
+}
+
 /* Finds the lowest latency stream attached to the thread. */
 static struct cras_io_stream *
 get_min_latency_stream(const struct audio_thread *thread,
@@ -215,57 +354,161 @@ get_min_latency_stream(const struct audio_thread *thread,
 		if (!stream_uses_direction(curr->stream, direction))
 			continue;
 		if (!lowest ||
-		    (cras_rstream_get_buffer_size(curr->stream) <
-		     cras_rstream_get_buffer_size(lowest->stream)))
+		    (stream_dev_frames(curr,
+				cras_rstream_get_buffer_size(curr->stream)) <
+		     stream_dev_frames(lowest,
+				cras_rstream_get_buffer_size(lowest->stream))))
 			lowest = curr;
 	}
 
 	return lowest;
 }
 
-/* Sends a response (error code) from the audio thread to the main thread.
- * Indicates that the last message sent to the audio thread has been handled
- * with an error code of rc.
+/* Reads the slot index of the ring without letting the compiler cache it. */
+static inline unsigned int ring_load_idx(const unsigned int *idx)
+{
+	return *(volatile const unsigned int *)idx;
+}
+
+static inline union audio_thread_cmd *ring_slot(
+		struct audio_thread_cmd_ring *ring, unsigned int idx)
+{
+	return &ring->cmds[idx & (AUDIO_THREAD_CMD_RING_SIZE - 1)];
+}
+
+/* Adds one to the counter of an eventfd, waking whoever polls it. */
+static void signal_event_fd(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0)
+		syslog(LOG_ERR, "Failed to signal event fd %d", fd);
+}
+
+/* Resets the counter of a non-blocking eventfd. */
+static void clear_event_fd(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		syslog(LOG_ERR, "Failed to clear event fd %d", fd);
+}
+
+/* Checks if a wake up at 'a' is due more than 'margin_us' before one at 'b'. */
+static int wake_before(const struct timespec *a, const struct timespec *b,
+		       unsigned int margin_us)
+{
+	struct timespec diff;
+
+	if (!timespec_after(b, a))
+		return 0;
+	subtract_timespecs(b, a, &diff);
+	return diff.tv_sec > 0 || diff.tv_nsec > (long)margin_us * 1000;
+}
+
+/* Picks the sooner of a capture or loopback wake up and the playback one.
+ * Captured samples keep in the device buffer, so a wake up that is due less
+ * than WAKE_COALESCE_US before the playback one is merged into it.
  * Args:
- *    thread - thread responding to command.
- *    rc - Result code to send back to the main thread.
- * Returns:
- *    The number of bytes written to the main thread.
+ *    sleep_ts - Time until the capture or loopback wake up, NULL for none.
+ *    pb_ts - Time until the playback wake up.
  */
-static int audio_thread_send_response(struct audio_thread *thread, int rc)
+const struct timespec *coalesce_wake(const struct timespec *sleep_ts,
+				     const struct timespec *pb_ts)
 {
-	return write(thread->to_main_fds[1], &rc, sizeof(rc));
+	if (!sleep_ts || !wake_before(sleep_ts, pb_ts, WAKE_COALESCE_US))
+		return pb_ts;
+	return sleep_ts;
 }
 
-/* Reads a command from the main thread.  Called from the playback/capture
- * thread.  This will read the next available command from the main thread and
- * put it in buf.
- * Args:
- *    thread - thread reading the command.
- *    buf - Message is stored here on return.
- *    max_len - maximum length of message to put into buf.
- * Returns:
- *    0 on success, negative error code on failure.
+/* Adds nsec nanoseconds, which can be negative, to ts. */
+static void add_timespec_ns(struct timespec *ts, long nsec)
+{
+	ts->tv_nsec += nsec;
+	while (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+	while (ts->tv_nsec < 0) {
+		ts->tv_nsec += 1000000000L;
+		ts->tv_sec--;
+	}
+}
+
+/* Returns how early the wake up timer is set off, the lateness measured on
+ * previous wake ups and twice its jitter. */
+long wake_timer_advance_ns(const struct audio_thread *thread)
+{
+	long advance_ns;
+
+	advance_ns = thread->wake_latency_ns + 2L * thread->wake_jitter_ns;
+	advance_ns = min(advance_ns, MAX_WAKE_ADVANCE_US * 1000L);
+	return max(advance_ns, 0L);
+}
+
+/* Folds the lateness of a wake up in the estimates, the same way TCP smooths
+ * round trip times. */
+void update_wake_latency(struct audio_thread *thread, long late_ns)
+{
+	long err_ns;
+
+	err_ns = late_ns - thread->wake_latency_ns;
+	thread->wake_latency_ns += err_ns / 8;
+	thread->wake_jitter_ns += (labs(err_ns) - thread->wake_jitter_ns) / 4;
+}
+
+/* Arms the wake up timer of the thread on the absolute time 'sleep_ts' from
+ * now.  The timer is set off early so the device is serviced on time.
  */
-static int audio_thread_read_command(struct audio_thread *thread,
-				     uint8_t *buf,
-				     size_t max_len)
-{
-	int to_read, nread, rc;
-	struct audio_thread_msg *msg = (struct audio_thread_msg *)buf;
-
-	/* Get the length of the message first */
-	nread = read(thread->to_thread_fds[0], buf, sizeof(msg->length));
-	if (nread < 0)
-		return nread;
-	if (msg->length > max_len)
-		return -ENOMEM;
+static void arm_wake_timer(struct audio_thread *thread,
+			   const struct timespec *sleep_ts)
+{
+	struct itimerspec its;
+	long advance_ns = wake_timer_advance_ns(thread);
+
+	clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+	add_timespec_ns(&its.it_value,
+			sleep_ts->tv_sec * 1000000000L + sleep_ts->tv_nsec -
+			advance_ns);
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+
+	if (timerfd_settime(thread->timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		syslog(LOG_ERR, "Failed to arm wake timer");
+		return;
+	}
+	thread->timer_armed_ts = its.it_value;
+}
 
-	to_read = msg->length - nread;
-	rc = read(thread->to_thread_fds[0], &buf[0] + nread, to_read);
-	if (rc < 0)
-		return rc;
-	return 0;
+static void disarm_wake_timer(struct audio_thread *thread)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(thread->timer_fd, 0, &its, NULL);
+}
+
+/* Called when the wake up timer fires, updates the lateness estimates. */
+static void handle_wake_timer(struct audio_thread *thread)
+{
+	struct timespec now, late;
+	uint64_t expirations;
+	long late_ns;
+
+	if (read(thread->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!timespec_after(&now, &thread->timer_armed_ts))
+		return;
+	subtract_timespecs(&now, &thread->timer_armed_ts, &late);
+	if (late.tv_sec)
+		return; /* Not a scheduling latency, likely a suspend. */
+	late_ns = late.tv_nsec;
+	update_wake_latency(thread, late_ns);
+
+	audio_thread_event_log_data(thread->atlog, AUDIO_THREAD_TIMER_WAKE,
+				    late_ns);
 }
 
 /* Checks if there are any active streams.
@@ -299,27 +542,228 @@ static int active_streams(const struct audio_thread *thread,
 	return *in_active || *out_active || *loop_active;
 }
 
-static int append_stream(struct audio_thread *thread,
-			 struct cras_rstream *stream)
+/* Only streams that play reply to the requests sent on their fd.  A unified
+ * stream is attached to the threads of both its devices when they differ, only
+ * the thread of the output device, which mixes the replies, polls its fd. */
+static inline int thread_polls_stream(const struct audio_thread *thread,
+				      const struct cras_rstream *stream)
 {
-	struct cras_io_stream *out;
+	return stream_uses_output(stream) && thread->output_dev;
+}
 
-	/* Check that we don't already have this stream */
-	DL_SEARCH_SCALAR(thread->streams, out, stream, stream);
-	if (out != NULL)
-		return -EEXIST;
+/* Makes the container of a stream, without a conversion. */
+static struct cras_io_stream *create_io_stream(struct cras_rstream *stream)
+{
+	struct cras_io_stream *out;
 
-	/* New stream, allocate a container and add it to the list. */
 	out = calloc(1, sizeof(*out));
 	if (out == NULL)
-		return -ENOMEM;
+		return NULL;
 	out->stream = stream;
-	out->fd = cras_rstream_get_audio_fd(stream);
+	out->fd = cras_rstream_get_reply_fd(stream);
+	return out;
+}
+
+/* Hands a stream that isn't in the list anymore to the main thread, which
+ * frees it.  Freeing the conversion can take the lock of the resampler
+ * filters and free their coefficients, that has no place on this thread. */
+static void retire_stream(struct audio_thread *thread,
+			  struct cras_io_stream *out)
+{
+	out->next = __atomic_load_n(&thread->retired_streams,
+				    __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&thread->retired_streams,
+					    &out->next, out, 1,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+/* Adds a stream to the list, in the container out made by the main thread or
+ * in a new one if out is NULL.  The container is retired if it can't be
+ * added. */
+static int append_stream(struct audio_thread *thread,
+			 struct cras_rstream *stream,
+			 struct cras_io_stream *out)
+{
+	struct cras_io_stream *curr;
+	int rc;
+
+	/* Check that we don't already have this stream */
+	DL_SEARCH_SCALAR(thread->streams, curr, stream, stream);
+	if (curr != NULL) {
+		if (out)
+			retire_stream(thread, out);
+		return -EEXIST;
+	}
+
+	if (out == NULL) {
+		out = create_io_stream(stream);
+		if (out == NULL)
+			return -ENOMEM;
+	}
+
+	if (thread_polls_stream(thread, stream) &&
+	    epoll_add_fd(thread->stream_epoll_fd, out->fd, out)) {
+		rc = -errno;
+		syslog(LOG_ERR, "Failed to poll stream fd %d", out->fd);
+		retire_stream(thread, out);
+		return rc;
+	}
 	DL_APPEND(thread->streams, out);
 
 	return 0;
 }
 
+static void free_stream_conv(struct cras_io_stream *curr)
+{
+	if (curr->conv)
+		cras_fmt_conv_destroy(curr->conv);
+	free(curr->conv_buf);
+	curr->conv = NULL;
+	curr->conv_buf = NULL;
+	curr->conv_buf_frames = 0;
+	curr->conv_frames = 0;
+}
+
+/* Frees the streams the audio thread removed since the last call. */
+static void free_retired_streams(struct audio_thread *thread)
+{
+	struct cras_io_stream *curr, *next;
+
+	curr = __atomic_exchange_n(&thread->retired_streams, NULL,
+				   __ATOMIC_ACQUIRE);
+	for (; curr; curr = next) {
+		next = curr->next;
+		free_stream_conv(curr);
+		free(curr);
+	}
+}
+
+/* Ratio of the rate estimated for a device that compensates drift to its
+ * nominal rate, 1.0 for the others. */
+static double drift_ratio(const struct cras_iodev *dev)
+{
+	if (!dev->compensate_drift || !dev->rate_est)
+		return 1.0;
+	return rate_estimator_get_rate(dev->rate_est) / dev->format->frame_rate;
+}
+
+/* Has the streams converted for the output device play at the rate estimated
+ * for it, so its level stays where it is instead of drifting to an underrun
+ * or to a full buffer. */
+static void apply_drift_ratio(struct audio_thread *thread)
+{
+	double ratio = drift_ratio(thread->output_dev);
+	struct cras_io_stream *curr;
+
+	DL_FOREACH(thread->streams, curr)
+		if (curr->conv)
+			cras_fmt_conv_set_ratio(curr->conv, ratio);
+}
+
+/* Checks if a stream in format sfmt needs converting before it is mixed for
+ * odev, for its rate, channels or a format the mix can't read. */
+static int stream_needs_conv(const struct cras_iodev *odev,
+			     const struct cras_audio_format *sfmt)
+{
+	struct cras_audio_format mix_fmt;
+
+	mix_fmt = *odev->format;
+	mix_fmt.format = sfmt->format;
+	return !cras_mix_format_supported(sfmt->format) ||
+	       cras_fmt_conversion_needed(sfmt, &mix_fmt);
+}
+
+/* Checks if a stream in format sfmt is resampled to follow the drift of odev.
+ * Formats wider than S16 are resampled in float, so every stream does. */
+static int stream_follows_drift(const struct cras_iodev *odev,
+				const struct cras_audio_format *sfmt)
+{
+	return odev->compensate_drift;
+}
+
+/* Makes the conversion of a stream that plays in a format the output device
+ * doesn't use.  Only the rate, channels and format the mix can't read are
+ * converted, to float frames ready to be added to the mix.  The streams of a
+ * device that compensates drift are also resampled at the rate estimated for
+ * the device.  Called by the main
+ * thread as it adds a stream, the audio thread only checks the conversion
+ * fits the device as it opened. */
+static int create_stream_conv(const struct cras_iodev *odev,
+			      struct cras_io_stream *curr)
+{
+	const struct cras_audio_format *sfmt = &curr->stream->format;
+	struct cras_audio_format mix_fmt;
+	size_t max_frames;
+	int follow_drift;
+
+	if (curr->stream->direction != CRAS_STREAM_OUTPUT)
+		return 0;
+
+	follow_drift = stream_follows_drift(odev, sfmt);
+	if (!follow_drift && !stream_needs_conv(odev, sfmt))
+		return 0;
+
+	mix_fmt = *odev->format;
+	curr->conv_dev_fmt = mix_fmt;
+
+	syslog(LOG_DEBUG, "stream %x converted from %d %zu %zu to %zu %zu",
+	       curr->stream->stream_id, sfmt->format, sfmt->frame_rate,
+	       sfmt->num_channels, mix_fmt.frame_rate, mix_fmt.num_channels);
+
+	/* A conversion is at most the shm of the stream in and the device
+	 * buffer out. */
+	mix_fmt.format = SND_PCM_FORMAT_FLOAT_LE;
+	curr->conv_buf_frames = odev->buffer_size + CONV_SLACK_FRAMES;
+	max_frames = max(cras_rstream_get_buffer_size(curr->stream),
+			 (size_t)curr->conv_buf_frames);
+	if (follow_drift)
+		curr->conv = cras_fmt_conv_create_adjustable(sfmt, &mix_fmt,
+							     max_frames);
+	else
+		curr->conv = cras_fmt_conv_create(sfmt, &mix_fmt, max_frames);
+	curr->conv_buf = malloc(curr->conv_buf_frames *
+				mix_fmt.num_channels * sizeof(float));
+	if (!curr->conv || !curr->conv_buf) {
+		syslog(LOG_ERR, "Failed to convert stream %x",
+		       curr->stream->stream_id);
+		free_stream_conv(curr);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Checks the conversion the main thread made for a stream against the output
+ * device.  If the device was opened for the stream in another format than the
+ * main thread saw, the conversion is made again here, before anything plays.
+ * Then starts it at the rate estimated for the device. */
+static int config_stream_conv(struct audio_thread *thread,
+			      struct cras_io_stream *curr)
+{
+	struct cras_iodev *odev = thread->output_dev;
+	int needed;
+
+	if (curr->stream->direction != CRAS_STREAM_OUTPUT)
+		return 0;
+
+	needed = stream_follows_drift(odev, &curr->stream->format) ||
+		 stream_needs_conv(odev, &curr->stream->format);
+	if (needed != !!curr->conv ||
+	    (curr->conv &&
+	     (cras_fmt_conversion_needed(&curr->conv_dev_fmt, odev->format) ||
+	      curr->conv_buf_frames != odev->buffer_size +
+				       CONV_SLACK_FRAMES))) {
+		free_stream_conv(curr);
+		if (create_stream_conv(odev, curr))
+			return -ENOMEM;
+	}
+
+	if (curr->conv && odev->compensate_drift)
+		cras_fmt_conv_set_ratio(curr->conv, drift_ratio(odev));
+	return 0;
+}
+
 static int delete_stream(struct audio_thread *thread,
 			 struct cras_rstream *stream)
 {
@@ -330,8 +774,10 @@ static int delete_stream(struct audio_thread *thread,
 	if (out == NULL)
 		return -EINVAL;
 
+	if (thread_polls_stream(thread, stream))
+		epoll_rm_fd(thread->stream_epoll_fd, out->fd);
 	DL_DELETE(thread->streams, out);
-	free(out);
+	retire_stream(thread, out);
 
 	return 0;
 }
@@ -345,6 +791,57 @@ static int init_device(struct cras_iodev *dev, struct cras_rstream *stream)
 	return dev->open_dev(dev);
 }
 
+/* Sizes the mix buffer for the buffer of the output device that was just
+ * opened and drops what was mixed ahead for its last open. */
+static int init_mix_buf(struct audio_thread *thread)
+{
+	struct cras_iodev *odev = thread->output_dev;
+	struct cras_io_stream *curr;
+	size_t samples;
+
+	samples = odev->buffer_size * odev->format->num_channels;
+	if (samples > thread->mix_buf_samples) {
+		float *buf = realloc(thread->mix_buf, samples * sizeof(*buf));
+		if (!buf)
+			return -ENOMEM;
+		thread->mix_buf = buf;
+		thread->mix_buf_samples = samples;
+	}
+
+	samples = POST_MIX_CHUNK_FRAMES * odev->format->num_channels;
+	if (samples > thread->dsp_bus_samples) {
+		float *buf = realloc(thread->dsp_bus, samples * sizeof(*buf));
+		if (!buf)
+			return -ENOMEM;
+		thread->dsp_bus = buf;
+		thread->dsp_bus_samples = samples;
+	}
+
+	thread->mix_ahead_frames = 0;
+	DL_FOREACH(thread->streams, curr)
+		curr->mix_offset = 0;
+	memset(&thread->post_mix_stats, 0, sizeof(thread->post_mix_stats));
+	return 0;
+}
+
+/* Drops the frames rendered to the output device from the front of the mix
+ * buffer, what was mixed ahead moves to the front. */
+static void advance_mix_buf(struct audio_thread *thread, size_t frames)
+{
+	struct cras_io_stream *curr;
+	size_t channels = thread->output_dev->format->num_channels;
+
+	frames = min(frames, (size_t)thread->mix_ahead_frames);
+	if (frames == 0)
+		return;
+
+	DL_FOREACH(thread->streams, curr)
+		curr->mix_offset -= min((size_t)curr->mix_offset, frames);
+	thread->mix_ahead_frames -= frames;
+	memmove(thread->mix_buf, thread->mix_buf + frames * channels,
+		thread->mix_ahead_frames * channels * sizeof(float));
+}
+
 /* Handles the rm_stream message from the main thread.
  * If this is the last stream to be removed close the device.
  * Returns the number of streams still attached to the thread.
@@ -366,7 +863,7 @@ int thread_remove_stream(struct audio_thread *thread,
 		/* No more streams, close the dev. */
 		if (device_open(idev))
 			idev->close_dev(idev);
-	} else {
+	} else if (idev) {
 		struct cras_io_stream *min_latency;
 		min_latency = get_min_latency_stream(thread, CRAS_STREAM_INPUT);
 		cras_iodev_config_params(
@@ -378,20 +875,24 @@ int thread_remove_stream(struct audio_thread *thread,
 		/* No more streams, close the dev. */
 		if (odev && odev->is_open(odev))
 			odev->close_dev(odev);
-	} else {
+	} else if (odev) {
 		struct cras_io_stream *min_latency;
 		min_latency = get_min_latency_stream(thread,
 						     CRAS_STREAM_OUTPUT);
 		cras_iodev_config_params(
 			odev,
-			cras_rstream_get_buffer_size(min_latency->stream),
-			cras_rstream_get_cb_threshold(min_latency->stream));
+			stream_dev_frames(min_latency,
+				cras_rstream_get_buffer_size(
+						min_latency->stream)),
+			stream_dev_frames(min_latency,
+				cras_rstream_get_cb_threshold(
+						min_latency->stream)));
 	}
 	if (!loop_active) {
 		/* No more streams, close the dev. */
 		if (loop_dev && loop_dev->is_open(loop_dev))
 			loop_dev->close_dev(loop_dev);
-	} else {
+	} else if (loop_dev) {
 		struct cras_io_stream *min_latency;
 		min_latency = get_min_latency_stream(
 			thread, CRAS_STREAM_POST_MIX_PRE_DSP);
@@ -423,9 +924,12 @@ void fill_odev_zeros(struct cras_iodev *odev, unsigned int frames)
 	odev->put_buffer(odev, frames);
 }
 
-/* Handles the add_stream message from the main thread. */
-int thread_add_stream(struct audio_thread *thread,
-		      struct cras_rstream *stream)
+/* Handles the add_stream message from the main thread.  The stream is added in
+ * the container iostream made for it by the main thread, or in a new one if
+ * iostream is NULL. */
+static int add_io_stream(struct audio_thread *thread,
+			 struct cras_rstream *stream,
+			 struct cras_io_stream *iostream)
 {
 	struct cras_iodev *odev = thread->output_dev;
 	struct cras_iodev *idev = thread->input_dev;
@@ -433,18 +937,24 @@ int thread_add_stream(struct audio_thread *thread,
 	struct cras_io_stream *min_latency;
 	int rc;
 
-	rc = append_stream(thread, stream);
+	rc = append_stream(thread, stream, iostream);
 	if (rc < 0)
 		return AUDIO_THREAD_ERROR_OTHER;
 
-	/* If not already, open the device(s). */
-	if (stream_uses_output(stream) && !odev->is_open(odev)) {
+	/* If not already, open the device(s).  A unified stream is attached to
+	 * the threads of both its devices, each opens the device it owns. */
+	if (odev && stream_uses_output(stream) && !odev->is_open(odev)) {
 		rc = init_device(odev, stream);
 		if (rc < 0) {
 			syslog(LOG_ERR, "Failed to open %s", odev->info.name);
 			delete_stream(thread, stream);
 			return AUDIO_THREAD_OUTPUT_DEV_ERROR;
 		}
+		if (init_mix_buf(thread)) {
+			odev->close_dev(odev);
+			delete_stream(thread, stream);
+			return AUDIO_THREAD_OUTPUT_DEV_ERROR;
+		}
 
 		if (cras_stream_is_unified(stream->direction)) {
 			/* Start unified streams by padding the output.
@@ -465,7 +975,7 @@ int thread_add_stream(struct audio_thread *thread,
 			}
 		}
 	}
-	if (stream_uses_input(stream) && !idev->is_open(idev)) {
+	if (idev && stream_uses_input(stream) && !idev->is_open(idev)) {
 		rc = init_device(idev, stream);
 		if (rc < 0) {
 			syslog(LOG_ERR, "Failed to open %s", idev->info.name);
@@ -473,7 +983,8 @@ int thread_add_stream(struct audio_thread *thread,
 			return AUDIO_THREAD_INPUT_DEV_ERROR;
 		}
 	}
-	if (stream_uses_loopback(stream) && !loop_dev->is_open(loop_dev)) {
+	if (loop_dev && stream_uses_loopback(stream) &&
+	    !loop_dev->is_open(loop_dev)) {
 		rc = init_device(loop_dev, stream);
 		if (rc < 0) {
 			syslog(LOG_ERR, "Failed to open %s", loop_dev->info.name);
@@ -483,12 +994,26 @@ int thread_add_stream(struct audio_thread *thread,
 	}
 
 	if (device_open(odev)) {
+		struct cras_io_stream *curr;
+
+		/* Output streams keep the format of their client, they are
+		 * converted to that of the device as they are mixed. */
+		DL_SEARCH_SCALAR(thread->streams, curr, stream, stream);
+		if (config_stream_conv(thread, curr)) {
+			thread_remove_stream(thread, stream);
+			return AUDIO_THREAD_ERROR_OTHER;
+		}
+
 		min_latency = get_min_latency_stream(thread,
 						     CRAS_STREAM_OUTPUT);
 		cras_iodev_config_params(
 			odev,
-			cras_rstream_get_buffer_size(min_latency->stream),
-			cras_rstream_get_cb_threshold(min_latency->stream));
+			stream_dev_frames(min_latency,
+				cras_rstream_get_buffer_size(
+						min_latency->stream)),
+			stream_dev_frames(min_latency,
+				cras_rstream_get_cb_threshold(
+						min_latency->stream)));
 	}
 
 	if (device_open(idev)) {
@@ -511,6 +1036,12 @@ int thread_add_stream(struct audio_thread *thread,
 	return 0;
 }
 
+int thread_add_stream(struct audio_thread *thread,
+		      struct cras_rstream *stream)
+{
+	return add_io_stream(thread, stream, NULL);
+}
+
 static void apply_dsp(struct cras_iodev *iodev, uint8_t *buf, size_t frames)
 {
 	struct cras_dsp_context *ctx;
@@ -552,20 +1083,31 @@ static int get_dsp_delay(struct cras_iodev *iodev)
 	return delay;
 }
 
-/* Reads any pending audio message from the socket. */
-static void flush_old_aud_messages(struct cras_audio_shm *shm, int fd)
+/* Reads any pending audio message from the socket.  A stream woken through
+ * shm has replied once the counters in shm match, its eventfd is cleared so it
+ * doesn't wake the thread again. */
+static void flush_old_aud_messages(struct cras_audio_shm *shm,
+				   const struct cras_rstream *stream)
 {
 	struct audio_message msg;
-	struct timespec ts = {0, 0};
-	fd_set poll_set;
+	struct pollfd pfd;
 	int err;
 
+	if (cras_rstream_uses_shm_wakeup(stream)) {
+		if (cras_shm_aud_reply_ready(shm, NULL)) {
+			clear_event_fd(cras_rstream_reply_event_fd(stream));
+			cras_shm_set_callback_pending(shm, 0);
+		}
+		return;
+	}
+
+	pfd.fd = cras_rstream_get_audio_fd(stream);
+	pfd.events = POLLIN;
 	do {
-		FD_ZERO(&poll_set);
-		FD_SET(fd, &poll_set);
-		err = pselect(fd + 1, &poll_set, NULL, NULL, &ts, NULL);
-		if (err > 0 && FD_ISSET(fd, &poll_set)) {
-			err = read(fd, &msg, sizeof(msg));
+		pfd.revents = 0;
+		err = poll(&pfd, 1, 0);
+		if (err > 0) {
+			err = read(pfd.fd, &msg, sizeof(msg));
 			cras_shm_set_callback_pending(shm, 0);
 		}
 	} while (err > 0);
@@ -600,7 +1142,7 @@ static int fetch_and_set_timestamp(struct audio_thread *thread,
 			continue;
 
 		if (cras_shm_callback_pending(shm))
-			flush_old_aud_messages(shm, curr->fd);
+			flush_old_aud_messages(shm, curr->stream);
 
 		if (curr->stream->direction != CRAS_STREAM_OUTPUT)
 			continue;
@@ -609,20 +1151,26 @@ static int fetch_and_set_timestamp(struct audio_thread *thread,
 		if (frames_in_buff < 0)
 			return frames_in_buff;
 
+		/* Frames mixed ahead or converted are already queued for the
+		 * device, all counted in its frames. */
+		frames_in_buff = stream_dev_frames(curr, frames_in_buff) +
+				 curr->conv_frames + curr->mix_offset;
+
 		cras_iodev_set_playback_timestamp(fr_rate,
 						  frames_in_buff + delay,
 						  &shm->area->ts);
 
 		/* If we already have enough data, don't poll this stream. */
 		if (frames_in_buff + hw_level >
-		    cras_rstream_get_cb_threshold(curr->stream) +
+		    stream_dev_frames(curr, cras_rstream_get_fetch_level(
+							curr->stream)) +
 				SLEEP_FUZZ_FRAMES)
 			continue;
 
 		if (!cras_shm_callback_pending(shm) &&
 		    cras_shm_is_buffer_available(shm)) {
 			audio_thread_event_log_data2(
-				atlog,
+				thread->atlog,
 				AUDIO_THREAD_FETCH_STREAM,
 				curr->stream->stream_id,
 				cras_rstream_get_cb_threshold(curr->stream));
@@ -639,51 +1187,304 @@ static int fetch_and_set_timestamp(struct audio_thread *thread,
 		}
 	}
 
-	return 0;
+	return 0;
+}
+
+/* Computes the time by which a reply has to arrive to be mixed before the
+ * device plays 'frames' more frames.  Leaves time to mix.
+ * Args:
+ *    now - The current time.
+ *    frames - Frames that play before the reply is needed.
+ *    rate - The frame rate of the device.
+ *    deadline - Filled with the deadline.
+ */
+static void frames_deadline(const struct timespec *now,
+			    size_t frames,
+			    size_t rate,
+			    struct timespec *deadline)
+{
+	uint64_t to_usec;
+
+	/* Timeout on reading before we under-run. Leaving time to mix. */
+	to_usec = (uint64_t)frames * 1000000 / rate;
+	if (to_usec > MIN_PROCESS_TIME_US)
+		to_usec -= MIN_PROCESS_TIME_US;
+	if (to_usec < MIN_READ_WAIT_US)
+		to_usec = MIN_READ_WAIT_US;
+
+	*deadline = *now;
+	add_timespec_ns(deadline, to_usec * 1000);
+}
+
+/* Converts frames of a stream from its shm until 'count' frames are ready for
+ * the device, or the shm runs out, then mixes up to 'count' of them.  What the
+ * rates round up to stays in the conversion buffer for the next mix, and the
+ * shm only gives up the frames the converter used.
+ * Returns the number of frames mixed. */
+static size_t mix_converted_stream(struct cras_io_stream *curr,
+				   struct cras_audio_shm *shm,
+				   size_t channels, float *dst,
+				   size_t count, size_t index)
+{
+	size_t in_frames, room, converted;
+	uint8_t *src;
+	float scaler;
+
+	while (curr->conv_frames < count) {
+		src = (uint8_t *)cras_shm_get_readable_frames(shm, 0,
+							      &in_frames);
+		if (!src || in_frames == 0)
+			break;
+		room = curr->conv_buf_frames - curr->conv_frames;
+		in_frames = min(in_frames, max((size_t)1,
+				cras_fmt_conv_out_frames_to_in(
+					curr->conv,
+					count - curr->conv_frames)));
+		converted = cras_fmt_conv_convert_some_frames(
+				curr->conv, src,
+				(uint8_t *)(curr->conv_buf +
+					    curr->conv_frames * channels),
+				&in_frames, room);
+		curr->conv_frames += converted;
+		cras_shm_buffer_read(shm, in_frames);
+		if (in_frames == 0 && converted == 0)
+			break;
+	}
+
+	count = min(count, (size_t)curr->conv_frames);
+	if (count == 0)
+		return 0;
+
+	scaler = cras_shm_get_mute(shm) ? 0.0f :
+					  cras_shm_get_volume_scaler(shm);
+	cras_mix_add_samples(SND_PCM_FORMAT_FLOAT_LE, dst,
+			     (uint8_t *)curr->conv_buf, count * channels,
+			     scaler, index);
+
+	curr->conv_frames -= count;
+	memmove(curr->conv_buf, curr->conv_buf + count * channels,
+		curr->conv_frames * channels * sizeof(float));
+	return count;
+}
+
+/* Mixes what a stream has into the mix buffer, starting after the frames it
+ * already mixed in.  The mixed region of the thread grows with it, frames past
+ * the end of that region are copied instead of added.
+ * Args:
+ *    thread - The thread the stream is attached to.
+ *    curr - The stream to mix.
+ *    write_limit - The maximum number of frames to mix, from the device write
+ *        pointer.
+ *    num_mixed - Incremented if anything of the stream was mixed.
+ */
+static void mix_stream_ahead(struct audio_thread *thread,
+			     struct cras_io_stream *curr,
+			     size_t write_limit,
+			     size_t *num_mixed)
+{
+	struct cras_iodev *odev = thread->output_dev;
+	struct cras_audio_shm *shm = cras_rstream_output_shm(curr->stream);
+	size_t channels = odev->format->num_channels;
+	size_t count, index, ready;
+	int shm_frames;
+
+	shm_frames = cras_shm_get_frames(shm);
+	if (shm_frames < 0 || curr->mix_offset >= write_limit)
+		return;
+
+	/* Frames ready for the device, a converted stream can have some left
+	 * from its last conversion. */
+	ready = stream_dev_frames(curr, shm_frames) + curr->conv_frames;
+	if (ready == 0)
+		return;
+
+	count = min(ready, write_limit - curr->mix_offset);
+	if (curr->mix_offset == thread->mix_ahead_frames) {
+		index = 0;
+	} else {
+		/* Adding into the mixed region, silence what it extends. */
+		if (curr->mix_offset + count > thread->mix_ahead_frames)
+			memset(thread->mix_buf +
+					thread->mix_ahead_frames * channels, 0,
+			       (curr->mix_offset + count -
+				thread->mix_ahead_frames) * channels *
+					sizeof(float));
+		index = 1;
+	}
+
+	if (curr->conv) {
+		count = mix_converted_stream(
+				curr, shm, channels,
+				thread->mix_buf + curr->mix_offset * channels,
+				count, index);
+		if (!count) {
+			curr->skip_mix = 1;
+			return;
+		}
+	} else {
+		if (!cras_mix_add_stream(shm, curr->stream->format.format,
+					 channels,
+					 thread->mix_buf +
+						curr->mix_offset * channels,
+					 &count, &index)) {
+			curr->skip_mix = 1;
+			return;
+		}
+		cras_shm_buffer_read(shm, count);
+	}
+	curr->mix_offset += count;
+	thread->mix_ahead_frames = max(thread->mix_ahead_frames,
+				       curr->mix_offset);
+	(*num_mixed)++;
+}
+
+/* Returns the pending stream that has the earliest deadline among the ready
+ * events, or NULL if none of them is pending. */
+static struct cras_io_stream *earliest_ready_stream(
+		struct epoll_event *events, int nfds)
+{
+	struct cras_io_stream *curr, *earliest = NULL;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		curr = (struct cras_io_stream *)events[i].data.ptr;
+		if (!curr)
+			continue;
+		if (!earliest ||
+		    timespec_after(&earliest->deadline, &curr->deadline))
+			earliest = curr;
+	}
+	return earliest;
+}
+
+/* Returns the monotonic clock in nanoseconds, to time the render stages. */
+static inline uint64_t monotonic_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Renders the first 'frames' frames of the mix buffer to the output device.
+ * This is done in a single pass, chunk by chunk so that each chunk stays in
+ * cache through all the stages: the loopback tap gets the mix before DSP, then
+ * the DSP runs on the float mix, then mute and software volume are applied
+ * while converting for the device, which is the only clip.  With DSP the
+ * chunk is split in planes of the DSP bus once, the pipeline runs on them in
+ * place and they are interleaved as they are converted.  The time spent in
+ * each stage is added to the stats of the thread. */
+static void render_mix(struct audio_thread *thread, uint8_t *dst,
+		       size_t frames)
+{
+	struct cras_iodev *odev = thread->output_dev;
+	struct cras_iodev *loop_dev = thread->post_mix_loopback_dev;
+	struct audio_post_mix_debug_info *stats = &thread->post_mix_stats;
+	struct cras_dsp_context *ctx = odev->dsp_context;
+	struct pipeline *pipeline = NULL;
+	size_t channels = odev->format->num_channels;
+	size_t frame_bytes = cras_get_format_bytes(odev->format);
+	int tap = device_open(loop_dev);
+	int muted = cras_system_get_mute();
+	float scaler = 1.0f;
+	float *planes[channels];
+	size_t done, chunk, c;
+	uint64_t start, tapped, processed;
+
+	if (frames == 0)
+		return;
+
+	if (cras_iodev_software_volume_needed(odev))
+		scaler = odev->software_volume_scaler;
+	if (ctx && !muted)
+		pipeline = cras_dsp_get_pipeline(ctx);
+	for (c = 0; c < channels; c++)
+		planes[c] = thread->dsp_bus + c * POST_MIX_CHUNK_FRAMES;
+
+	for (done = 0; done < frames; done += chunk) {
+		float *mix = thread->mix_buf + done * channels;
+		uint8_t *out = dst + done * frame_bytes;
+
+		chunk = min(frames - done, (size_t)POST_MIX_CHUNK_FRAMES);
+
+		start = monotonic_ns();
+		/* The loopback device records S16, no wider than the device
+		 * format, so the chunk of the device buffer can hold the tap
+		 * until the chunk is rendered over it. */
+		if (tap) {
+			cras_mix_render(loop_dev->format->format, out, mix,
+					chunk * channels, 1.0f);
+			loopback_iodev_add_audio(loop_dev, out, chunk);
+		}
+		tapped = monotonic_ns();
+
+		if (pipeline) {
+			dsp_util_deinterleave_float(mix, planes, channels,
+						    chunk);
+			cras_dsp_pipeline_apply_planar(pipeline, channels,
+						       planes, chunk);
+		}
+		processed = monotonic_ns();
+
+		if (muted)
+			memset(out, 0, chunk * frame_bytes);
+		else if (pipeline)
+			cras_mix_render_planar(odev->format->format, out,
+					       (const float *const *)planes,
+					       channels, chunk, scaler);
+		else
+			cras_mix_render(odev->format->format, out, mix,
+					chunk * channels, scaler);
+
+		stats->loopback_ns += tapped - start;
+		stats->dsp_ns += processed - tapped;
+		stats->render_ns += monotonic_ns() - processed;
+	}
+	stats->frames += frames;
+
+	if (pipeline)
+		cras_dsp_put_pipeline(ctx);
 }
 
-/* Fill the buffer with samples from the attached streams.
+/* Fill the mix buffer with samples from the attached streams.
+ * Streams that have samples are mixed right away, the ones waiting on their
+ * client are mixed as their replies come in, earliest deadline first.  A
+ * stream that can give more than the others keeps the surplus mixed ahead in
+ * the mix buffer, past the frames returned, and only needs to fill from there
+ * on the next call.
  * Args:
  *    thread - The thread to write streams from.
- *    dst - The buffer to put the samples in (returned from snd_pcm_mmap_begin)
  *    level - The number of frames still in device buffer.
- *    write_limit - The maximum number of frames to write to dst.
+ *    write_limit - The maximum number of frames to mix.
  *
  * Returns:
  *    The number of frames rendered on success, a negative error code otherwise.
  *    This number of frames is the minimum of the amount of frames each stream
- *    could provide which is the maximum that can currently be rendered.
+ *    that made its deadline has mixed, the maximum that can currently be
+ *    rendered.
  */
 static int write_streams(struct audio_thread *thread,
-			 uint8_t *dst,
 			 size_t level,
 			 size_t write_limit)
 {
 	struct cras_iodev *odev = thread->output_dev;
 	struct cras_io_stream *curr;
-	struct timeval to;
-	fd_set poll_set, this_set;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct timespec to, now, deadline;
 	size_t streams_wait, num_mixed;
 	size_t input_write_limit = write_limit;
-	int max_fd;
-	int rc;
-	int max_frames = 0;
+	size_t committed;
+	int nfds, i;
+	int num_limiting = 0;
 
-	/* Timeout on reading before we under-run. Leaving time to mix. */
-	to.tv_sec = 0;
-	to.tv_usec = (level * 1000000 / odev->format->frame_rate);
-	if (to.tv_usec > MIN_PROCESS_TIME_US)
-		to.tv_usec -= MIN_PROCESS_TIME_US;
-	if (to.tv_usec < MIN_READ_WAIT_US)
-		to.tv_usec = MIN_READ_WAIT_US;
-
-	FD_ZERO(&poll_set);
-	max_fd = -1;
 	streams_wait = 0;
 	num_mixed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	/* Check if streams have enough data to fill this request,
-	 * if not, wait for them. Mix all streams we have enough data for. */
+	/* Streams with nothing mixed ahead are needed first, by this time. */
+	frames_deadline(&now, level, odev->format->frame_rate, &deadline);
+
+	/* Mix the streams that have data now, the others are waited for. */
 	DL_FOREACH(thread->streams, curr) {
 		struct cras_audio_shm *shm;
 		int shm_frames;
@@ -696,7 +1497,7 @@ static int write_streams(struct audio_thread *thread,
 		shm = cras_rstream_output_shm(curr->stream);
 
 		shm_frames = cras_shm_get_frames(shm);
-		audio_thread_event_log_data3(atlog,
+		audio_thread_event_log_data3(thread->atlog,
 					     AUDIO_THREAD_WRITE_STREAMS_STREAM,
 					     curr->stream->stream_id,
 					     shm_frames,
@@ -706,32 +1507,44 @@ static int write_streams(struct audio_thread *thread,
 			if (!output_streams_attached(thread))
 				return -EIO;
 		} else if (cras_shm_callback_pending(shm)) {
-			/* Callback pending, wait for a response. */
+			/* Callback pending, wait for a response.  What it
+			 * mixed ahead plays before its reply is needed. */
+			frames_deadline(&now, level + curr->mix_offset,
+					odev->format->frame_rate,
+					&curr->deadline);
 			streams_wait++;
-			FD_SET(curr->fd, &poll_set);
-			if (curr->fd > max_fd)
-				max_fd = curr->fd;
+		} else {
+			mix_stream_ahead(thread, curr, write_limit,
+					 &num_mixed);
 		}
 	}
 
-	/* Wait until all polled clients reply, or a timeout. */
+	/* Wait until all polled clients reply, or the device deadline.  The
+	 * audio fds of the streams stay registered with stream_epoll_fd, only
+	 * the pending ones have a reply to read. */
 	while (streams_wait > 0) {
-		this_set = poll_set;
-		audio_thread_event_log_data2(atlog,
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_after(&deadline, &now))
+			subtract_timespecs(&deadline, &now, &to);
+		else
+			to.tv_sec = to.tv_nsec = 0;
+		audio_thread_event_log_data2(thread->atlog,
 					     AUDIO_THREAD_WRITE_STREAMS_WAIT,
 					     to.tv_sec,
-					     to.tv_usec);
-		rc = select(max_fd + 1, &this_set, NULL, NULL, &to);
-		if (rc < 0) {
-			if (rc == -EINTR)
+					     to.tv_nsec / 1000);
+		nfds = wait_epoll_events(thread->stream_epoll_fd, events,
+					 MAX_EPOLL_EVENTS, &to);
+		if (nfds < 0) {
+			if (nfds == -EINTR)
 				continue;
-			syslog(LOG_ERR, "select error %d", rc);
+			syslog(LOG_ERR, "epoll error %d", nfds);
 			break;
-		} else if (rc == 0) {
+		} else if (nfds == 0) {
 			audio_thread_event_log_tag(
-				atlog,
+				thread->atlog,
 				AUDIO_THREAD_WRITE_STREAMS_WAIT_TO);
-			/* Timeout */
+			/* Timeout, the streams due with the device are late
+			 * and don't hold back the others. */
 			DL_FOREACH(thread->streams, curr) {
 				struct cras_audio_shm *shm;
 
@@ -741,30 +1554,37 @@ static int write_streams(struct audio_thread *thread,
 				shm = cras_rstream_output_shm(curr->stream);
 
 				if (!cras_shm_callback_pending(shm) ||
-				    !FD_ISSET(curr->fd, &poll_set))
+				    timespec_after(&curr->deadline, &deadline))
 					continue;
 
 				cras_shm_inc_cb_timeouts(shm);
-				if (cras_shm_get_frames(shm) == 0)
-					curr->skip_mix = 1;
+				curr->skip_mix = 1;
 			}
 			break;
 		}
-		DL_FOREACH(thread->streams, curr) {
-			struct cras_audio_shm *shm;
 
-			if (!stream_uses_output(curr->stream))
-				continue;
+		/* Take the replies in order of deadline. */
+		while ((curr = earliest_ready_stream(events, nfds))) {
+			struct cras_audio_shm *shm;
+			int rc;
 
-			if (!FD_ISSET(curr->fd, &this_set))
-				continue;
+			for (i = 0; i < nfds; i++)
+				if (events[i].data.ptr == curr)
+					events[i].data.ptr = NULL;
 
 			shm = cras_rstream_output_shm(curr->stream);
 
-			FD_CLR(curr->fd, &poll_set);
+			/* Drop messages that weren't asked for. */
+			if (!cras_shm_callback_pending(shm)) {
+				flush_old_aud_messages(shm, curr->stream);
+				continue;
+			}
+
+			rc = cras_rstream_get_audio_request_reply(curr->stream);
+			if (rc == -EAGAIN)
+				continue; /* Woken for an older reply. */
 			streams_wait--;
 			cras_shm_set_callback_pending(shm, 0);
-			rc = cras_rstream_get_audio_request_reply(curr->stream);
 			if (rc < 0) {
 				thread_remove_stream(thread, curr->stream);
 				if (!output_streams_attached(thread))
@@ -774,58 +1594,42 @@ static int write_streams(struct audio_thread *thread,
 			/* Skip mixing if it returned zero frames. */
 			if (cras_shm_get_frames(shm) == 0)
 				curr->skip_mix = 1;
+			else
+				mix_stream_ahead(thread, curr, write_limit,
+						 &num_mixed);
 		}
 	}
 
-	/* Mix as much as we can, the minimum fill level of any stream. */
+	/* Render as much as all streams on time have mixed. */
+	committed = write_limit;
 	DL_FOREACH(thread->streams, curr) {
-		struct cras_audio_shm *shm;
-		int shm_frames;
-
 		if (!cras_stream_uses_output_hw(curr->stream->direction))
 			continue;
-		shm = cras_rstream_output_shm(curr->stream);
-
-		shm_frames = cras_shm_get_frames(shm);
-		if (shm_frames < 0) {
-			thread_remove_stream(thread, curr->stream);
-			if (!output_streams_attached(thread))
-				return -EIO;
-		} else if (!cras_shm_callback_pending(shm) && !curr->skip_mix) {
-			/* If not in underrun, use this stream. */
-			write_limit = min(shm_frames, write_limit);
-			max_frames = max(max_frames, shm_frames);
-		}
+		if (curr->skip_mix)
+			continue;
+		committed = min(committed, (size_t)curr->mix_offset);
+		num_limiting++;
 	}
 
-	audio_thread_event_log_data(atlog, AUDIO_THREAD_WRITE_STREAMS_MIX,
-				    write_limit);
+	audio_thread_event_log_data(thread->atlog, AUDIO_THREAD_WRITE_STREAMS_MIX,
+				    committed);
 
-	if (max_frames == 0 &&
+	if (thread->mix_ahead_frames == 0 &&
 	    (odev->frames_queued(odev) <= odev->cb_threshold/4)) {
 		/* Nothing to mix from any streams. Under run. */
-		unsigned int frame_bytes = cras_get_format_bytes(odev->format);
+		size_t frame_bytes = odev->format->num_channels * sizeof(float);
 		size_t frames = min(odev->cb_threshold, input_write_limit);
-		return cras_mix_mute_buffer(dst, frame_bytes, frames);
+		return cras_mix_mute_buffer((uint8_t *)thread->mix_buf,
+					    frame_bytes, frames);
 	}
 
-	DL_FOREACH(thread->streams, curr) {
-		struct cras_audio_shm *shm;
-		if (!cras_stream_uses_output_hw(curr->stream->direction))
-			continue;
-		shm = cras_rstream_output_shm(curr->stream);
-		if (cras_mix_add_stream(shm,
-					odev->format->num_channels,
-					dst, &write_limit, &num_mixed))
-			cras_shm_buffer_read(shm, write_limit);
-	}
+	if (num_limiting == 0 || thread->mix_ahead_frames == 0)
+		committed = 0;
 
-	audio_thread_event_log_data2(atlog, AUDIO_THREAD_WRITE_STREAMS_MIXED,
-				     write_limit, num_mixed);
-	if (num_mixed == 0)
-		return num_mixed;
+	audio_thread_event_log_data2(thread->atlog, AUDIO_THREAD_WRITE_STREAMS_MIXED,
+				     committed, num_mixed);
 
-	return write_limit;
+	return committed;
 }
 
 /* Checks if the stream type matches the device.  For input devices, both input
@@ -879,27 +1683,21 @@ static void terminate_pb_thread()
 	pthread_exit(0);
 }
 
-/* Handle a message sent to the playback thread */
-static int handle_playback_thread_message(struct audio_thread *thread)
+/* Runs a command sent to the playback thread, returns its result. */
+static int handle_playback_thread_command(struct audio_thread *thread,
+					  struct audio_thread_msg *msg)
 {
-	uint8_t buf[256];
-	struct audio_thread_msg *msg = (struct audio_thread_msg *)buf;
 	int ret = 0;
-	int err;
-
-	err = audio_thread_read_command(thread, buf, 256);
-	if (err < 0)
-		return err;
 
 	switch (msg->id) {
 	case AUDIO_THREAD_ADD_STREAM: {
 		struct audio_thread_add_rm_stream_msg *amsg;
 		amsg = (struct audio_thread_add_rm_stream_msg *)msg;
 		audio_thread_event_log_data(
-			atlog,
+			thread->atlog,
 			AUDIO_THREAD_WRITE_STREAMS_WAIT,
 			amsg->stream->stream_id);
-		ret = thread_add_stream(thread, amsg->stream);
+		ret = add_io_stream(thread, amsg->stream, amsg->iostream);
 		break;
 	}
 	case AUDIO_THREAD_RM_STREAM: {
@@ -930,11 +1728,8 @@ static int handle_playback_thread_message(struct audio_thread *thread)
 		break;
 	}
 	case AUDIO_THREAD_STOP:
+		/* Handled once the command is completed. */
 		ret = 0;
-		err = audio_thread_send_response(thread, ret);
-		if (err < 0)
-			return err;
-		terminate_pb_thread();
 		break;
 	case AUDIO_THREAD_DUMP_THREAD_INFO: {
 		struct cras_io_stream *curr;
@@ -942,7 +1737,7 @@ static int handle_playback_thread_message(struct audio_thread *thread)
 		struct cras_iodev *odev = thread->output_dev;
 		struct audio_thread_dump_debug_info_msg *dmsg;
 		struct audio_debug_info *info;
-		unsigned int i = 0;
+		unsigned int i;
 
 		ret = 0;
 		dmsg = (struct audio_thread_dump_debug_info_msg *)msg;
@@ -954,11 +1749,10 @@ static int handle_playback_thread_message(struct audio_thread *thread)
 			info->output_buffer_size = odev->buffer_size;
 			info->output_used_size = odev->used_size;
 			info->output_cb_threshold = odev->cb_threshold;
-		} else {
-			info->output_dev_name[0] = '\0';
-			info->output_buffer_size = 0;
-			info->output_used_size = 0;
-			info->output_cb_threshold = 0;
+			info->output_post_mix = thread->post_mix_stats;
+			if (odev->rate_est)
+				info->output_drift_ppm = rate_estimator_get_ppm(
+						odev->rate_est);
 		}
 		if (idev) {
 			strncpy(info->input_dev_name, idev->info.name,
@@ -966,13 +1760,15 @@ static int handle_playback_thread_message(struct audio_thread *thread)
 			info->input_buffer_size = idev->buffer_size;
 			info->input_used_size = idev->used_size;
 			info->input_cb_threshold = idev->cb_threshold;
-		} else {
-			info->output_dev_name[0] = '\0';
-			info->output_buffer_size = 0;
-			info->output_used_size = 0;
-			info->output_cb_threshold = 0;
+			if (idev->rate_est)
+				info->input_drift_ppm = rate_estimator_get_ppm(
+						idev->rate_est);
 		}
 
+		i = info->num_streams;
+		if (i >= MAX_DEBUG_STREAMS)
+			goto dump_log;
+
 		DL_FOREACH(thread->streams, curr) {
 			struct cras_audio_shm *shm;
 			struct audio_stream_debug_info *si;
@@ -1000,7 +1796,8 @@ static int handle_playback_thread_message(struct audio_thread *thread)
 		}
 		info->num_streams = i;
 
-		memcpy(&info->log, atlog, sizeof(info->log));
+dump_log:
+		memcpy(&info->log, thread->atlog, sizeof(info->log));
 		break;
 	}
 	default:
@@ -1008,12 +1805,57 @@ static int handle_playback_thread_message(struct audio_thread *thread)
 		break;
 	}
 
-	err = audio_thread_send_response(thread, ret);
-	if (err < 0)
-		return err;
 	return ret;
 }
 
+/* Runs all the commands queued in the ring.  Called from the playback/capture
+ * thread when the doorbell rings.  Commands are completed in order by moving
+ * read_idx past them, the main thread is only woken if one of them has a
+ * completion or a waiter or the main thread waits for ring space.
+ */
+void handle_playback_thread_message(struct audio_thread *thread)
+{
+	struct audio_thread_cmd_ring *ring = thread->cmds;
+	unsigned int write_idx;
+	int signal_done = 0;
+	int stop = 0;
+
+	clear_event_fd(thread->cmd_event_fd);
+
+	/* Check for new commands again after publishing read_idx, the main
+	 * thread skips the doorbell if it sees commands still pending. */
+	while (ring->read_idx != (write_idx = ring_load_idx(&ring->write_idx))) {
+		/* Pairs with the barrier before write_idx is stored. */
+		__sync_synchronize();
+
+		while (ring->read_idx != write_idx && !stop) {
+			struct audio_thread_msg *msg;
+
+			msg = &ring_slot(ring, ring->read_idx)->header;
+			msg->rc = handle_playback_thread_command(thread, msg);
+			if (msg->completion || msg->result)
+				signal_done = 1;
+			if (msg->id == AUDIO_THREAD_STOP)
+				stop = 1;
+
+			__sync_synchronize();
+			ring->read_idx++;
+		}
+		__sync_synchronize();
+		if (stop)
+			break;
+	}
+
+	if (ring->producer_waiting) {
+		ring->producer_waiting = 0;
+		signal_done = 1;
+	}
+	if (signal_done)
+		signal_event_fd(thread->done_event_fd);
+	if (stop)
+		terminate_pb_thread();
+}
+
 /* Adjusts the hw_level for output only streams.  Account for any extra
  * buffering that is needed and indicated by the min_buffer_level member.
  */
@@ -1061,11 +1903,13 @@ static int get_output_sleep_frames(struct audio_thread *thread)
 		if (curr->stream->direction != CRAS_STREAM_OUTPUT)
 			continue;
 
-		cb_thresh = cras_rstream_get_cb_threshold(curr->stream);
+		cb_thresh = stream_dev_frames(
+				curr, cras_rstream_get_fetch_level(curr->stream));
 		frames_in_buff = cras_shm_get_frames(shm);
 		if (frames_in_buff < 0)
 			return frames_in_buff;
-		frames_in_buff += adjusted_level;
+		frames_in_buff = stream_dev_frames(curr, frames_in_buff) +
+				 curr->conv_frames + adjusted_level;
 		if (frames_in_buff < cb_thresh)
 			sleep_frames = 0;
 		else
@@ -1093,22 +1937,25 @@ int possibly_fill_audio(struct audio_thread *thread,
 	int delay;
 	uint8_t *dst = NULL;
 	struct cras_iodev *odev = thread->output_dev;
-	struct cras_iodev *loop_dev = thread->post_mix_loopback_dev;
-	unsigned int frame_bytes;
 	unsigned int hw_level, adjusted_level;
+	struct timespec now;
 
 	if (!device_open(odev))
 		return 0;
 
-	frame_bytes = cras_get_format_bytes(odev->format);
-
 	rc = odev->frames_queued(odev);
 	if (rc < 0)
 		return rc;
 	hw_level = rc;
+
+	if (odev->rate_est) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (rate_estimator_check(odev->rate_est, hw_level, &now))
+			apply_drift_ratio(thread);
+	}
 	adjusted_level = adjust_level(thread, hw_level);
 
-	audio_thread_event_log_data2(atlog, AUDIO_THREAD_FILL_AUDIO,
+	audio_thread_event_log_data2(thread->atlog, AUDIO_THREAD_FILL_AUDIO,
 				     hw_level, adjusted_level);
 
 	delay = odev->delay_frames(odev);
@@ -1134,7 +1981,6 @@ int possibly_fill_audio(struct audio_thread *thread,
 			return rc;
 
 		written = write_streams(thread,
-					dst,
 					adjusted_level + total_written,
 					frames);
 		if (written < 0) /* pcm has been closed */
@@ -1145,22 +1991,14 @@ int possibly_fill_audio(struct audio_thread *thread,
 			 * won't fill the request. */
 			fr_to_req = 0; /* break out after committing samples */
 
-		loopback_iodev_add_audio(loop_dev, dst, written);
-
-		if (cras_system_get_mute())
-			memset(dst, 0, written * frame_bytes);
-		else
-			apply_dsp(odev, dst, written);
-
-		if (cras_iodev_software_volume_needed(odev)) {
-			cras_scale_buffer((int16_t *)dst,
-					  written * odev->format->num_channels,
-					  odev->software_volume_scaler);
-		}
+		render_mix(thread, dst, written);
+		advance_mix_buf(thread, written);
 
 		rc = odev->put_buffer(odev, written);
 		if (rc < 0)
 			return rc;
+		if (odev->rate_est)
+			rate_estimator_add_frames(odev->rate_est, written);
 		total_written += written;
 	}
 
@@ -1174,7 +2012,7 @@ int possibly_fill_audio(struct audio_thread *thread,
 		return rc;
 	*next_sleep_frames = rc;
 
-	audio_thread_event_log_data(atlog, AUDIO_THREAD_FILL_AUDIO_DONE,
+	audio_thread_event_log_data(thread->atlog, AUDIO_THREAD_FILL_AUDIO_DONE,
 				    total_written);
 
 	return total_written;
@@ -1202,6 +2040,7 @@ int possibly_read_audio(struct audio_thread *thread,
 	unsigned int nread;
 	unsigned int frame_bytes;
 	int delay;
+	struct timespec now;
 
 	if (!device_open(idev))
 		return 0;
@@ -1212,7 +2051,14 @@ int possibly_read_audio(struct audio_thread *thread,
 	hw_level = rc;
 	write_limit = hw_level;
 
-	audio_thread_event_log_data(atlog, AUDIO_THREAD_READ_AUDIO, hw_level);
+	/* Capture drift is measured for the debug info only, the clients get
+	 * the frames as captured. */
+	if (idev->rate_est) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		rate_estimator_check(idev->rate_est, hw_level, &now);
+	}
+
+	audio_thread_event_log_data(thread->atlog, AUDIO_THREAD_READ_AUDIO, hw_level);
 
 	/* Check if the device is still running. */
 	if (!idev->dev_running(idev))
@@ -1265,6 +2111,8 @@ int possibly_read_audio(struct audio_thread *thread,
 		rc = idev->put_buffer(idev, nread);
 		if (rc < 0)
 			return rc;
+		if (idev->rate_est)
+			rate_estimator_add_frames(idev->rate_est, -nread);
 		remainder -= nread;
 	}
 
@@ -1304,6 +2152,14 @@ int possibly_read_audio(struct audio_thread *thread,
 
 		cras_shm_buffer_write_complete(shm);
 
+		/* Unified streams will write audio while handling the captured
+		 * samples, mark them as pending.  Done before the client is
+		 * told so the thread of the output device, which reads the
+		 * reply, never sees a reply it didn't expect. */
+		if (rstream->direction == CRAS_STREAM_UNIFIED)
+			cras_shm_set_callback_pending(
+				cras_rstream_output_shm(rstream), 1);
+
 		/* Tell the client that samples are ready. */
 		rc = cras_rstream_audio_ready(
 			rstream, cras_rstream_get_cb_threshold(rstream));
@@ -1311,12 +2167,6 @@ int possibly_read_audio(struct audio_thread *thread,
 			thread_remove_stream(thread, rstream);
 			return rc;
 		}
-
-		/* Unified streams will write audio while handling the captured
-		 * samples, mark them as pending. */
-		if (rstream->direction == CRAS_STREAM_UNIFIED)
-			cras_shm_set_callback_pending(
-				cras_rstream_output_shm(rstream), 1);
 	}
 
 	if (idev->direction == CRAS_STREAM_POST_MIX_PRE_DSP) {
@@ -1331,7 +2181,7 @@ int possibly_read_audio(struct audio_thread *thread,
 			CAP_REMAINING_FRAMES_TARGET;
 	}
 
-	audio_thread_event_log_data(atlog, AUDIO_THREAD_READ_AUDIO_DONE,
+	audio_thread_event_log_data(thread->atlog, AUDIO_THREAD_READ_AUDIO_DONE,
 				    write_limit);
 
 	return write_limit;
@@ -1346,7 +2196,7 @@ int unified_io(struct audio_thread *thread, struct timespec *ts)
 	int rc;
 	unsigned int cap_sleep_frames, pb_sleep_frames, loop_sleep_frames;
 	struct timespec cap_ts, pb_ts, loop_ts;
-	struct timespec *sleep_ts = NULL;
+	const struct timespec *sleep_ts = NULL;
 
 	ts->tv_sec = 0;
 	ts->tv_nsec = 0;
@@ -1385,17 +2235,7 @@ int unified_io(struct audio_thread *thread, struct timespec *ts)
 						 idev->format->frame_rate,
 						 &cap_ts);
 		sleep_ts = &cap_ts;
-		audio_thread_event_log_data(atlog, AUDIO_THREAD_INPUT_SLEEP,
-					    sleep_ts->tv_nsec);
-	}
-
-	if (device_open(odev)) {
-		cras_iodev_fill_time_from_frames(pb_sleep_frames,
-						 odev->format->frame_rate,
-						 &pb_ts);
-		if (!sleep_ts || timespec_after(sleep_ts, &pb_ts))
-			sleep_ts = &pb_ts;
-		audio_thread_event_log_data(atlog, AUDIO_THREAD_OUTPUT_SLEEP,
+		audio_thread_event_log_data(thread->atlog, AUDIO_THREAD_INPUT_SLEEP,
 					    sleep_ts->tv_nsec);
 	}
 
@@ -1406,7 +2246,16 @@ int unified_io(struct audio_thread *thread, struct timespec *ts)
 			&loop_ts);
 		if (!sleep_ts || timespec_after(sleep_ts, &loop_ts))
 			sleep_ts = &loop_ts;
-		audio_thread_event_log_data(atlog, AUDIO_THREAD_LOOP_SLEEP,
+		audio_thread_event_log_data(thread->atlog, AUDIO_THREAD_LOOP_SLEEP,
+					    sleep_ts->tv_nsec);
+	}
+
+	if (device_open(odev)) {
+		cras_iodev_fill_time_from_frames(pb_sleep_frames,
+						 odev->format->frame_rate,
+						 &pb_ts);
+		sleep_ts = coalesce_wake(sleep_ts, &pb_ts);
+		audio_thread_event_log_data(thread->atlog, AUDIO_THREAD_OUTPUT_SLEEP,
 					    sleep_ts->tv_nsec);
 	}
 
@@ -1425,92 +2274,323 @@ int unified_io(struct audio_thread *thread, struct timespec *ts)
 static void *audio_io_thread(void *arg)
 {
 	struct audio_thread *thread = (struct audio_thread *)arg;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 	struct timespec ts;
-	fd_set poll_set;
-	int msg_fd;
-	int err;
-
-	msg_fd = thread->to_thread_fds[0];
+	int err, i;
 
 	/* Attempt to get realtime scheduling */
 	if (cras_set_rt_scheduling(CRAS_SERVER_RT_THREAD_PRIORITY) == 0)
 		cras_set_thread_priority(CRAS_SERVER_RT_THREAD_PRIORITY);
 
 	while (1) {
-		struct timespec *wait_ts;
 		struct iodev_callback_list *iodev_cb;
-		int max_fd = msg_fd;
-
-		wait_ts = NULL;
+		int msg_pending = 0;
 
+		/* The sleep is bounded by the wake timer, armed on the absolute
+		 * time the devices need service. */
 		if (streams_attached(thread)) {
 			/* device opened */
 			err = unified_io(thread, &ts);
 			if (err < 0)
 				syslog(LOG_ERR, "audio cb error %d", err);
-			wait_ts = &ts;
-		}
-
-		FD_ZERO(&poll_set);
-		FD_SET(msg_fd, &poll_set);
-
-		DL_FOREACH(iodev_callbacks, iodev_cb) {
-			FD_SET(iodev_cb->fd, &poll_set);
-			if (iodev_cb->fd > max_fd)
-				max_fd = iodev_cb->fd;
+			arm_wake_timer(thread, &ts);
+		} else {
+			disarm_wake_timer(thread);
 		}
 
-		audio_thread_event_log_tag(atlog, AUDIO_THREAD_SLEEP);
-		err = pselect(max_fd + 1, &poll_set, NULL, NULL, wait_ts, NULL);
-		audio_thread_event_log_tag(atlog, AUDIO_THREAD_WAKE);
+		audio_thread_event_log_tag(thread->atlog, AUDIO_THREAD_SLEEP);
+		err = wait_epoll_events(thread->epoll_fd, events,
+					MAX_EPOLL_EVENTS, NULL);
+		audio_thread_event_log_tag(thread->atlog, AUDIO_THREAD_WAKE);
 		if (err <= 0)
 			continue;
 
-		if (FD_ISSET(msg_fd, &poll_set)) {
-			err = handle_playback_thread_message(thread);
-			if (err < 0)
-				syslog(LOG_INFO, "handle message %d", err);
+		/* The command doorbell is registered without data, the timer
+		 * with the thread, callbacks with their list entry. Note which
+		 * ones fired before handling the message, it can remove
+		 * callbacks. */
+		for (i = 0; i < err; i++) {
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == thread) {
+				handle_wake_timer(thread);
+			} else if (ptr) {
+				iodev_cb = (struct iodev_callback_list *)ptr;
+				iodev_cb->polled = 1;
+			} else {
+				msg_pending = 1;
+			}
 		}
 
-		DL_FOREACH(iodev_callbacks, iodev_cb)
-			iodev_cb->cb(iodev_cb->cb_data, &ts,
-				     FD_ISSET(iodev_cb->fd, &poll_set));
+		if (msg_pending)
+			handle_playback_thread_message(thread);
+
+		DL_FOREACH(thread->callbacks, iodev_cb) {
+			int polled = iodev_cb->polled;
+
+			iodev_cb->polled = 0;
+			iodev_cb->cb(iodev_cb->cb_data, &ts, polled);
+		}
 	}
 
 	return NULL;
 }
 
+/* Takes the results of the commands the audio thread is done with and frees
+ * their slots.  Synchronous results are stored for their waiter, completions
+ * are only queued so that they never run from inside a call to this API.
+ * Called from the main thread.
+ */
+static void reap_completed_commands(struct audio_thread *thread)
+{
+	struct audio_thread_cmd_ring *ring = thread->cmds;
+	unsigned int read_idx = ring_load_idx(&ring->read_idx);
+
+	/* Pairs with the barrier before read_idx is stored. */
+	__sync_synchronize();
+
+	while (ring->reap_idx != read_idx) {
+		struct audio_thread_msg *msg;
+
+		msg = &ring_slot(ring, ring->reap_idx)->header;
+		if (msg->result) {
+			msg->result->rc = msg->rc;
+			msg->result->done = 1;
+		}
+		if (msg->completion) {
+			msg->completion->rc = msg->rc;
+			DL_APPEND(thread->completions, msg->completion);
+		}
+		ring->reap_idx++;
+	}
+}
+
+/* Calls the queued completions in order.  A completion may queue more
+ * commands, the ones that complete meanwhile are called too.
+ */
+static void run_completions(struct audio_thread *thread)
+{
+	struct audio_thread_completion *completion;
+
+	while ((completion = thread->completions) != NULL) {
+		DL_DELETE(thread->completions, completion);
+		completion->cb(completion->cb_data, completion->rc);
+		free(completion);
+	}
+}
+
+/* Leaves the queued completions to the main loop, the done doorbell may have
+ * been cleared while waiting for the audio thread.
+ */
+static void defer_completions(struct audio_thread *thread)
+{
+	if (thread->completions)
+		signal_event_fd(thread->done_event_fd);
+}
+
+/* Called by the main loop when the audio thread completed commands. */
+void audio_thread_done_event(void *data)
+{
+	struct audio_thread *thread = (struct audio_thread *)data;
+
+	clear_event_fd(thread->done_event_fd);
+	reap_completed_commands(thread);
+	run_completions(thread);
+	free_retired_streams(thread);
+}
+
+/* Blocks the main thread until the audio thread completes a command that has a
+ * completion or frees up ring space, then reaps the completed commands.
+ */
+static int wait_command_completion(struct audio_thread *thread)
+{
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = thread->done_event_fd;
+	pfd.events = POLLIN;
+	rc = poll(&pfd, 1, -1);
+	if (rc < 0 && errno != EINTR)
+		return -errno;
+
+	clear_event_fd(thread->done_event_fd);
+	reap_completed_commands(thread);
+	return 0;
+}
+
+/* Queues a message in the command ring of the thread and rings the doorbell if
+ * the thread might be asleep.  The thread runs the command at its next wake up
+ * and the completion of the message, if any, is called from the main loop with
+ * the result.  Waits for space if the ring is full.
+ * Args:
+ *    thread - thread to receive message.
+ *    msg - The message to send, copied to the ring.
+ * Returns:
+ *    0 if the message was queued, negative error code otherwise.
+ */
+static int audio_thread_queue_message(struct audio_thread *thread,
+				      struct audio_thread_msg *msg)
+{
+	struct audio_thread_cmd_ring *ring = thread->cmds;
+	unsigned int write_idx = ring->write_idx;
+	int rc;
+
+	if (msg->length > sizeof(union audio_thread_cmd))
+		return -EINVAL;
+
+	reap_completed_commands(thread);
+	while (write_idx - ring->reap_idx == AUDIO_THREAD_CMD_RING_SIZE) {
+		ring->producer_waiting = 1;
+		__sync_synchronize();
+		reap_completed_commands(thread);
+		if (write_idx - ring->reap_idx < AUDIO_THREAD_CMD_RING_SIZE)
+			break;
+		rc = wait_command_completion(thread);
+		if (rc < 0) {
+			syslog(LOG_ERR, "Failed to wait for command ring.");
+			defer_completions(thread);
+			return rc;
+		}
+	}
+	ring->producer_waiting = 0;
+	defer_completions(thread);
+
+	memcpy(ring_slot(ring, write_idx), msg, msg->length);
+
+	/* Publish the command, then check if the thread still had commands to
+	 * run.  If it had, it will see this one too before sleeping. */
+	__sync_synchronize();
+	ring->write_idx = write_idx + 1;
+	__sync_synchronize();
+	if (ring_load_idx(&ring->read_idx) == write_idx)
+		signal_event_fd(thread->cmd_event_fd);
+
+	return 0;
+}
+
 /* Write a message to the playback thread and wait for an ack, This keeps these
  * operations synchronous for the main server thread.  For instance when the
  * RM_STREAM message is sent, the stream can be deleted after the function
  * returns.  Making this synchronous also allows the thread to return an error
- * code that can be handled by the caller.
+ * code that can be handled by the caller.  Completions of previously queued
+ * asynchronous commands are left to the main loop.
  * Args:
  *    thread - thread to receive message.
  *    msg - The message to send.
+ *    queued - Set if the thread got the message, NULL if not wanted.
  * Returns:
  *    A return code from the message handler in the thread.
  */
-static int audio_thread_post_message(struct audio_thread *thread,
-				     struct audio_thread_msg *msg)
+static int post_message(struct audio_thread *thread,
+			struct audio_thread_msg *msg,
+			int *queued)
 {
-	int rc, err;
+	struct audio_thread_sync_result result;
+	int err;
+
+	result.done = 0;
+	result.rc = 0;
+	msg->completion = NULL;
+	msg->result = &result;
 
-	err = write(thread->to_thread_fds[1], msg, msg->length);
+	err = audio_thread_queue_message(thread, msg);
+	if (queued)
+		*queued = err == 0;
 	if (err < 0) {
 		syslog(LOG_ERR, "Failed to post message to thread.");
 		return err;
 	}
-	/* Synchronous action, wait for response. */
-	err = read(thread->to_main_fds[0], &rc, sizeof(rc));
-	if (err < 0) {
-		syslog(LOG_ERR, "Failed to read reply from thread.");
-		return err;
+	/* Synchronous action, wait for response.  The result lives on this
+	 * stack so keep waiting until it is written. */
+	while (!result.done) {
+		err = wait_command_completion(thread);
+		if (err < 0)
+			syslog(LOG_ERR, "Failed to read reply from thread.");
+	}
+	defer_completions(thread);
+
+	return result.rc;
+}
+
+static int audio_thread_post_message(struct audio_thread *thread,
+				     struct audio_thread_msg *msg)
+{
+	return post_message(thread, msg, NULL);
+}
+
+/* Fills an add or remove stream message. */
+static void init_add_rm_stream_msg(struct audio_thread_add_rm_stream_msg *msg,
+				   enum AUDIO_THREAD_COMMAND id,
+				   struct cras_rstream *stream)
+{
+	memset(msg, 0, sizeof(*msg));
+	msg->header.id = id;
+	msg->header.length = sizeof(struct audio_thread_add_rm_stream_msg);
+	msg->stream = stream;
+}
+
+/* Queues a message whose result is passed to cb from the main loop.
+ * Args:
+ *    thread - thread to receive message.
+ *    msg - The message to send, copied to the ring.
+ *    cb - Called with the result, NULL if it isn't wanted.
+ *    cb_data - Passed to cb.
+ * Returns:
+ *    0 if the message was queued, negative error code otherwise.
+ */
+static int audio_thread_queue_async(struct audio_thread *thread,
+				    struct audio_thread_msg *msg,
+				    audio_thread_complete_cb cb,
+				    void *cb_data)
+{
+	struct audio_thread_completion *completion = NULL;
+	int rc;
+
+	if (cb) {
+		completion = calloc(1, sizeof(*completion));
+		if (!completion)
+			return -ENOMEM;
+		completion->cb = cb;
+		completion->cb_data = cb_data;
 	}
+	msg->completion = completion;
+	msg->result = NULL;
 
+	rc = audio_thread_queue_message(thread, msg);
+	if (rc < 0)
+		free(completion);
 	return rc;
 }
 
+/* Makes the container of a stream for the audio thread to add, with the
+ * conversion to the format of the output device when it is open.  Otherwise
+ * the device opens for the stream, in about its format, and only the filter
+ * of a resampler that follows drift is designed ahead. */
+static struct cras_io_stream *prepare_io_stream(struct audio_thread *thread,
+						struct cras_rstream *stream)
+{
+	const struct cras_iodev *odev = thread->output_dev;
+	struct cras_io_stream *iostream;
+
+	free_retired_streams(thread);
+	iostream = create_io_stream(stream);
+	if (!iostream || stream->direction != CRAS_STREAM_OUTPUT || !odev)
+		return iostream;
+
+	if (odev->format)
+		create_stream_conv(odev, iostream);
+	else if (odev->compensate_drift)
+		cras_fmt_conv_prepare(&stream->format, &stream->format, 1);
+	return iostream;
+}
+
+/* Frees a container from prepare_io_stream() the audio thread didn't get. */
+static void free_io_stream(struct cras_io_stream *iostream)
+{
+	free_stream_conv(iostream);
+	free(iostream);
+}
+
 /* Remove all streams from the thread.
  * Args:
  *    thread - a pointer to the audio thread.
@@ -1522,10 +2602,10 @@ static void audio_thread_rm_all_streams(struct audio_thread *thread,
 
 	assert(thread);
 
-	msg.header.id = AUDIO_THREAD_RM_ALL_STREAMS;
-	msg.header.length = sizeof(struct audio_thread_add_rm_stream_msg);
+	init_add_rm_stream_msg(&msg, AUDIO_THREAD_RM_ALL_STREAMS, NULL);
 	msg.dir = dir;
 	audio_thread_post_message(thread, &msg.header);
+	free_retired_streams(thread);
 }
 
 /* Exported Interface */
@@ -1534,29 +2614,80 @@ int audio_thread_add_stream(struct audio_thread *thread,
 			    struct cras_rstream *stream)
 {
 	struct audio_thread_add_rm_stream_msg msg;
+	int queued;
+	int rc;
 
 	assert(thread && stream);
 
 	if (!thread->started)
 		return -EINVAL;
 
-	msg.header.id = AUDIO_THREAD_ADD_STREAM;
-	msg.header.length = sizeof(struct audio_thread_add_rm_stream_msg);
-	msg.stream = stream;
-	return audio_thread_post_message(thread, &msg.header);
+	init_add_rm_stream_msg(&msg, AUDIO_THREAD_ADD_STREAM, stream);
+	msg.iostream = prepare_io_stream(thread, stream);
+	if (!msg.iostream)
+		return -ENOMEM;
+	rc = post_message(thread, &msg.header, &queued);
+	if (!queued)
+		free_io_stream(msg.iostream);
+	free_retired_streams(thread);
+	return rc;
+}
+
+int audio_thread_add_stream_async(struct audio_thread *thread,
+				  struct cras_rstream *stream,
+				  audio_thread_complete_cb cb,
+				  void *cb_data)
+{
+	struct audio_thread_add_rm_stream_msg msg;
+	int rc;
+
+	assert(thread && stream);
+
+	if (!thread->started)
+		return -EINVAL;
+
+	init_add_rm_stream_msg(&msg, AUDIO_THREAD_ADD_STREAM, stream);
+	msg.iostream = prepare_io_stream(thread, stream);
+	if (!msg.iostream)
+		return -ENOMEM;
+	rc = audio_thread_queue_async(thread, &msg.header, cb, cb_data);
+	if (rc < 0)
+		free_io_stream(msg.iostream);
+	return rc;
 }
 
 int audio_thread_rm_stream(struct audio_thread *thread,
 			   struct cras_rstream *stream)
 {
 	struct audio_thread_add_rm_stream_msg msg;
+	int rc;
 
 	assert(thread && stream);
 
-	msg.header.id = AUDIO_THREAD_RM_STREAM;
-	msg.header.length = sizeof(struct audio_thread_add_rm_stream_msg);
-	msg.stream = stream;
-	return audio_thread_post_message(thread, &msg.header);
+	if (!thread->started)
+		return -EINVAL;
+
+	init_add_rm_stream_msg(&msg, AUDIO_THREAD_RM_STREAM, stream);
+	rc = audio_thread_post_message(thread, &msg.header);
+	free_retired_streams(thread);
+	return rc;
+}
+
+int audio_thread_rm_stream_async(struct audio_thread *thread,
+				 struct cras_rstream *stream,
+				 audio_thread_complete_cb cb,
+				 void *cb_data)
+{
+	struct audio_thread_add_rm_stream_msg msg;
+
+	assert(thread && stream);
+
+	/* Nothing would run the command and its completion. */
+	if (!thread->started)
+		return -EINVAL;
+
+	init_add_rm_stream_msg(&msg, AUDIO_THREAD_RM_STREAM, stream);
+	return audio_thread_queue_async(thread, &msg.header, cb, cb_data);
 }
 
 int audio_thread_dump_thread_info(struct audio_thread *thread,
@@ -1564,12 +2695,31 @@ int audio_thread_dump_thread_info(struct audio_thread *thread,
 {
 	struct audio_thread_dump_debug_info_msg msg;
 
+	if (!thread->started)
+		return -EINVAL;
+
+	memset(&msg, 0, sizeof(msg));
 	msg.header.id = AUDIO_THREAD_DUMP_THREAD_INFO;
 	msg.header.length = sizeof(msg);
 	msg.info = info;
 	return audio_thread_post_message(thread, &msg.header);
 }
 
+/* Closes the event fds and epoll sets of a thread that are open. */
+static void close_thread_fds(struct audio_thread *thread)
+{
+	if (thread->cmd_event_fd != -1)
+		close(thread->cmd_event_fd);
+	if (thread->done_event_fd != -1)
+		close(thread->done_event_fd);
+	if (thread->epoll_fd != -1)
+		close(thread->epoll_fd);
+	if (thread->stream_epoll_fd != -1)
+		close(thread->stream_epoll_fd);
+	if (thread->timer_fd != -1)
+		close(thread->timer_fd);
+}
+
 struct audio_thread *audio_thread_create()
 {
 	int rc;
@@ -1579,28 +2729,61 @@ struct audio_thread *audio_thread_create()
 	if (!thread)
 		return NULL;
 
-	thread->to_thread_fds[0] = -1;
-	thread->to_thread_fds[1] = -1;
-	thread->to_main_fds[0] = -1;
-	thread->to_main_fds[1] = -1;
+	thread->cmd_event_fd = -1;
+	thread->done_event_fd = -1;
+	thread->epoll_fd = -1;
+	thread->stream_epoll_fd = -1;
+	thread->timer_fd = -1;
+
+	thread->cmds = calloc(1, sizeof(*thread->cmds));
+	if (!thread->cmds)
+		goto error;
+
+	/* Doorbells for the command ring in both directions. */
+	thread->cmd_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	thread->done_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (thread->cmd_event_fd < 0 || thread->done_event_fd < 0) {
+		syslog(LOG_ERR, "Failed to create event fd");
+		goto error;
+	}
+
+	thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	thread->stream_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (thread->epoll_fd < 0 || thread->stream_epoll_fd < 0) {
+		syslog(LOG_ERR, "Failed to create epoll set");
+		goto error;
+	}
 
-	/* Two way pipes for communication with the device's audio thread. */
-	rc = pipe(thread->to_thread_fds);
+	/* Messages are told apart from callbacks by their NULL data. */
+	rc = epoll_add_fd(thread->epoll_fd, thread->cmd_event_fd, NULL);
 	if (rc < 0) {
-		syslog(LOG_ERR, "Failed to pipe");
-		free(thread);
-		return NULL;
+		syslog(LOG_ERR, "Failed to poll command doorbell");
+		goto error;
+	}
+
+	thread->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (thread->timer_fd < 0) {
+		syslog(LOG_ERR, "Failed to create wake timer");
+		goto error;
 	}
-	rc = pipe(thread->to_main_fds);
+	rc = epoll_add_fd(thread->epoll_fd, thread->timer_fd, thread);
 	if (rc < 0) {
-		syslog(LOG_ERR, "Failed to pipe");
-		free(thread);
-		return NULL;
+		syslog(LOG_ERR, "Failed to poll wake timer");
+		goto error;
 	}
 
-	atlog = audio_thread_event_log_init();
+	thread->atlog = audio_thread_event_log_init();
+	if (!thread->atlog)
+		goto error;
 
 	return thread;
+
+error:
+	close_thread_fds(thread);
+	free(thread->cmds);
+	free(thread);
+	return NULL;
 }
 
 void audio_thread_set_output_dev(struct audio_thread *thread,
@@ -1629,6 +2812,12 @@ int audio_thread_start(struct audio_thread *thread)
 
 	thread->started = 1;
 
+	/* Completions of asynchronous commands run from the main loop. */
+	rc = cras_system_add_select_fd(thread->done_event_fd,
+				       audio_thread_done_event, thread);
+	if (rc < 0)
+		syslog(LOG_ERR, "Failed to watch thread completions %d", rc);
+
 	return 0;
 }
 
@@ -1641,31 +2830,41 @@ void audio_thread_remove_streams(struct audio_thread *thread,
 
 void audio_thread_destroy(struct audio_thread *thread)
 {
-	audio_thread_event_log_deinit(atlog);
+	struct iodev_callback_list *iodev_cb;
 
 	if (thread->started) {
 		struct audio_thread_msg msg;
 
+		/* Every command queued before is completed with the stop. */
+		memset(&msg, 0, sizeof(msg));
 		msg.id = AUDIO_THREAD_STOP;
 		msg.length = sizeof(msg);
 		audio_thread_post_message(thread, &msg);
 		pthread_join(thread->tid, NULL);
+		cras_system_rm_select_fd(thread->done_event_fd);
+		run_completions(thread);
 	}
+	free_retired_streams(thread);
 
 	if (thread->input_dev)
 		thread->input_dev->thread = NULL;
 	if (thread->output_dev)
 		thread->output_dev->thread = NULL;
 
-	if (thread->to_thread_fds[0] != -1) {
-		close(thread->to_thread_fds[0]);
-		close(thread->to_thread_fds[1]);
-	}
-	if (thread->to_main_fds[0] != -1) {
-		close(thread->to_main_fds[0]);
-		close(thread->to_main_fds[1]);
+	if (thread->post_mix_loopback_dev)
+		thread->post_mix_loopback_dev->thread = NULL;
+
+	DL_FOREACH(thread->callbacks, iodev_cb) {
+		DL_DELETE(thread->callbacks, iodev_cb);
+		free(iodev_cb);
 	}
 
+	audio_thread_event_log_deinit(thread->atlog);
+	close_thread_fds(thread);
+
+	free(thread->mix_buf);
+	free(thread->dsp_bus);
+	free(thread->cmds);
 	free(thread);
 }
 
@@ -1675,8 +2874,19 @@ void audio_thread_add_loopback_device(struct audio_thread *thread,
 	switch (loop_dev->direction) {
 	case CRAS_STREAM_POST_MIX_PRE_DSP:
 		thread->post_mix_loopback_dev = loop_dev;
+		loop_dev->thread = thread;
 		break;
 	default:
 		return;
 	}
 }
+
+void audio_thread_rm_loopback_device(struct audio_thread *thread,
+				     struct cras_iodev *loop_dev)
+{
+	if (thread->post_mix_loopback_dev != loop_dev)
+		return;
+
+	thread->post_mix_loopback_dev = NULL;
+	loop_dev->thread = NULL;
+}
@@ -11,7 +11,12 @@
 
 #include "cras_types.h"
 
+struct audio_thread_cmd_ring;
+struct audio_thread_completion;
+struct audio_thread_event_log;
+struct cras_fmt_conv;
 struct cras_iodev;
+struct iodev_callback_list;
 
 /* Errors that can be returned from add_stream. */
 enum error_type_from_audio_thread_h {
@@ -21,34 +26,100 @@ enum error_type_from_audio_thread_h {
 	AUDIO_THREAD_LOOPBACK_DEV_ERROR = -3,
 };
 
-/* Linked list of streams of audio from/to a client. */
+/* Linked list of streams of audio from/to a client.  Made by the main thread,
+ * with the conversion of an output stream, and freed by it once the audio
+ * thread retires the stream. */
 struct cras_io_stream {
 	struct cras_rstream *stream;
-	int fd; /* cached here due to frequent access */
+	int fd; /* Polled for replies, cached here due to frequent access. */
 	unsigned int skip_mix; /* Skip this stream next mix cycle. */
+	/* Frames of this stream already mixed past the device write pointer. */
+	unsigned int mix_offset;
+	/* Time the stream reply must arrive by to be mixed in this cycle. */
+	struct timespec deadline;
+	/* Converts an output stream to the rate and channels of the device as
+	 * it is mixed, NULL if the stream plays as it is. */
+	struct cras_fmt_conv *conv;
+	/* Float frames converted for the device and not mixed yet, room for
+	 * conv_buf_frames of them. */
+	float *conv_buf;
+	unsigned int conv_buf_frames;
+	unsigned int conv_frames;
+	/* The output device format conv was made for. */
+	struct cras_audio_format conv_dev_fmt;
+	/* next links the retired streams of a thread once removed. */
 	struct cras_io_stream *prev, *next;
 };
 
 /* Hold communication pipes and pthread info for a thread used to play or record
- * audio.  This maps 1 to 1 with IO devices.
+ * audio.  This maps 1 to 1 with IO devices, each device added to the iodev list
+ * gets its own thread so that a slow device can't delay the others.
  *    odev - The output device to attach this thread to, NULL if none.
  *    idev - The input device to attach this thread to, NULL if none.
- *    post_mix_loopback_dev - Loopback device for post mix feedback.
- *    to_thread_fds - Send a message from main to running thread.
- *    to_main_fds - Send a message to main from running thread.
+ *    post_mix_loopback_dev - Loopback device for post mix feedback, attached
+ *        to the thread of the output device it taps.
+ *    cmds - Ring of commands from the main thread, run by the audio thread.
+ *    cmd_event_fd - Doorbell rung by the main thread when it queues commands
+ *        to an idle ring.
+ *    done_event_fd - Rung by the audio thread when commands that have a
+ *        completion callback are done or when ring space frees up for a
+ *        waiting main thread.  Watched by the main loop, which runs the
+ *        completions.
+ *    completions - Completions of asynchronous commands the audio thread is
+ *        done with, in order, waiting for the main loop to run them.
+ *    epoll_fd - Waited on while the thread sleeps, holds the command doorbell,
+ *        the wake timer and the fds of iodev callbacks.
+ *    stream_epoll_fd - Audio fds of streams that play, waited on for client
+ *        replies while filling the output device.
+ *    timer_fd - CLOCK_MONOTONIC timer armed on the absolute time of the next
+ *        device wake up, polled in epoll_fd.
+ *    timer_armed_ts - Absolute time the timer was last armed for.
+ *    wake_latency_ns - Average of how late the timer fires for this device.
+ *    wake_jitter_ns - Average deviation of the lateness from wake_latency_ns.
+ *    mix_buf - Float mix of the output streams, starting at the device write
+ *        pointer.  Rendered to the device format after post processing.
+ *    mix_buf_samples - Size of mix_buf in samples.
+ *    mix_ahead_frames - Frames of mix_buf that already hold a partial mix,
+ *        past what was rendered, kept for the next write.
+ *    dsp_bus - Planar float copy of a chunk of mix_buf, one plane per
+ *        channel, that the DSP pipeline processes in place.
+ *    dsp_bus_samples - Size of dsp_bus in samples.
+ *    post_mix_stats - Time spent in each stage of rendering mix_buf.
  *    tid - Thread ID of the running playback/capture thread.
  *    started - Non-zero if the thread has started successfully.
  *    streams - List of audio streams serviced by this thread.
+ *    retired_streams - Streams the audio thread removed, left for the main
+ *        thread to free with their conversion.  Pushed by the audio thread,
+ *        taken all at once by the main thread.
+ *    callbacks - List of fds polled and callbacks run by this thread.
+ *    atlog - Event log of this thread, copied out in the debug info.
  */
 struct audio_thread {
 	struct cras_iodev *output_dev;
 	struct cras_iodev *input_dev;
 	struct cras_iodev *post_mix_loopback_dev;
-	int to_thread_fds[2];
-	int to_main_fds[2];
+	struct audio_thread_cmd_ring *cmds;
+	int cmd_event_fd;
+	int done_event_fd;
+	struct audio_thread_completion *completions;
+	int epoll_fd;
+	int stream_epoll_fd;
+	int timer_fd;
+	struct timespec timer_armed_ts;
+	int wake_latency_ns;
+	int wake_jitter_ns;
+	float *mix_buf;
+	size_t mix_buf_samples;
+	unsigned int mix_ahead_frames;
+	float *dsp_bus;
+	size_t dsp_bus_samples;
+	struct audio_post_mix_debug_info post_mix_stats;
 	pthread_t tid;
 	int started;
 	struct cras_io_stream *streams;
+	struct cras_io_stream *retired_streams;
+	struct iodev_callback_list *callbacks;
+	struct audio_thread_event_log *atlog;
 };
 
 /* Callback function to be handled in main loop in audio thread.
@@ -62,6 +133,15 @@ struct audio_thread {
 typedef int (*thread_callback)(void *data, struct timespec *wait_ts,
 			       int polled);
 
+/* Called from the main loop when an asynchronous command completes, never from
+ * within another call to the audio thread API.  It must not destroy the thread
+ * or wait for it, the completions of the thread are still being run.
+ * Args:
+ *    data - The data given when the command was queued.
+ *    rc - The result of the command, as the synchronous version returns it.
+ */
+typedef void (*audio_thread_complete_cb)(void *data, int rc);
+
 /* Creates an audio thread.
  * Args:
  *    iodev - The iodev to attach this thread to.
@@ -90,18 +170,20 @@ void audio_thread_set_input_dev(struct audio_thread *thread,
 
 /* Adds an thread_callback to audio thread.
  * Args:
+ *    thread - The thread to poll the fd and run the callback.
  *    fd - The file descriptor to be polled for the callback.
  *    cb - The callback function.
  *    data - The data for the callback function.
  */
-void audio_thread_add_callback(int fd, thread_callback cb,
-                               void *data);
+void audio_thread_add_callback(struct audio_thread *thread, int fd,
+			       thread_callback cb, void *data);
 
 /* Removes an thread_callback from audio thread.
  * Args:
+ *    thread - The thread the callback was added to.
  *    fd - The file descriptor of the previous added callback.
  */
-void audio_thread_rm_callback(int fd);
+void audio_thread_rm_callback(struct audio_thread *thread, int fd);
 
 /* Starts a thread created with audio_thread_create.
  * Args:
@@ -135,6 +217,39 @@ int audio_thread_add_stream(struct audio_thread *thread,
 int audio_thread_rm_stream(struct audio_thread *thread,
 			   struct cras_rstream *stream);
 
+/* Queues adding a stream to the thread without waiting for it.  Commands queued
+ * back to back are run in one wake up of the thread.
+ * Args:
+ *    thread - a pointer to the audio thread.
+ *    stream - the new stream to add.
+ *    cb - Called with the result of audio_thread_add_stream once the thread
+ *        has run the command, may be NULL.
+ *    cb_data - Passed to cb.
+ * Returns:
+ *    0 if the command was queued, negative error code otherwise.
+ */
+int audio_thread_add_stream_async(struct audio_thread *thread,
+				  struct cras_rstream *stream,
+				  audio_thread_complete_cb cb,
+				  void *cb_data);
+
+/* Queues removing a stream from the thread without waiting for it.  The
+ * stream must stay valid until cb is called.
+ * Args:
+ *    thread - a pointer to the audio thread.
+ *    stream - the stream to remove.
+ *    cb - Called with the result of audio_thread_rm_stream once the thread
+ *        has run the command, may be NULL.
+ *    cb_data - Passed to cb.
+ * Returns:
+ *    0 if the command was queued, negative error code otherwise.  cb is not
+ *    called if the command wasn't queued, as when the thread isn't started.
+ */
+int audio_thread_rm_stream_async(struct audio_thread *thread,
+				 struct cras_rstream *stream,
+				 audio_thread_complete_cb cb,
+				 void *cb_data);
+
 /* Remove all streams of the given direction from a thread.  Used when streams
  * should be re-attached after a device switch.
  * Args:
@@ -152,7 +267,19 @@ void audio_thread_remove_streams(struct audio_thread *thread,
 void audio_thread_add_loopback_device(struct audio_thread *thread,
 				      struct cras_iodev *loop_dev);
 
-/* Dumps information about all active streams to syslog. */
+/* Remove a loopback device from the audio thread.  Streams using it must have
+ * been removed first.
+ * Args:
+ *    thread - The thread to remove the device from.
+ *    loop_dev - The loopback device to remove.
+ */
+void audio_thread_rm_loopback_device(struct audio_thread *thread,
+				     struct cras_iodev *loop_dev);
+
+/* Dumps information about the devices and streams of a thread.  Only the
+ * device fields for the devices owned by the thread are filled, streams are
+ * appended after the info->num_streams already there and the event log of the
+ * thread replaces the one in info. */
 int audio_thread_dump_thread_info(struct audio_thread *thread,
 				  struct audio_debug_info *info);
 
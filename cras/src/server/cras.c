@@ -7,9 +7,11 @@
 #include <syslog.h>
 
 #include "cras_config.h"
+#include "cras_cpu.h"
 #include "cras_empty_iodev.h"
 #include "cras_iodev_list.h"
 #include "cras_loopback_iodev.h"
+#include "cras_mix.h"
 #include "cras_server.h"
 #include "cras_system_state.h"
 #include "cras_dsp.h"
@@ -29,6 +31,7 @@ int main(int argc, char **argv)
 
 	/* Initialize system. */
 	cras_system_state_init();
+	cras_mix_init(cras_cpu_get_flags());
 	cras_dsp_init(CRAS_CONFIG_FILE_DIR "/dsp.ini");
 	cras_iodev_list_init();
 
@@ -357,6 +357,8 @@ struct cras_iodev *a2dp_iodev_create(struct cras_bt_transport *transport)
 	iodev->update_active_node = update_active_node;
 	iodev->software_volume_needed = 1;
 	iodev->software_volume_scaler = 1.0;
+	/* The headset plays at the rate of its own clock. */
+	iodev->compensate_drift = 1;
 
 	/* Create a dummy ionode */
 	node = (struct cras_ionode *)calloc(1, sizeof(*node));
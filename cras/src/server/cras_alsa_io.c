@@ -162,13 +162,12 @@ static int open_dev(struct cras_iodev *iodev)
 	 */
 	if (iodev->format == NULL)
 		return -EINVAL;
-	/* TODO(dgreid) - allow more formats here. */
-	iodev->format->format = SND_PCM_FORMAT_S16_LE;
 	aio->num_underruns = 0;
 
-	syslog(LOG_DEBUG, "Configure alsa device %s rate %zuHz, %zu channels",
+	syslog(LOG_DEBUG,
+	       "Configure alsa device %s rate %zuHz, %zu channels, format %d",
 	       aio->dev, iodev->format->frame_rate,
-	       iodev->format->num_channels);
+	       iodev->format->num_channels, iodev->format->format);
 	handle = 0; /* Avoid unused warning. */
 	rc = cras_alsa_pcm_open(&handle, aio->dev, aio->alsa_stream);
 	if (rc < 0)
@@ -473,6 +472,7 @@ static void free_alsa_iodev_resources(struct alsa_io *aio)
 
 	free(aio->base.supported_rates);
 	free(aio->base.supported_channel_counts);
+	free(aio->base.supported_formats);
 
 	DL_FOREACH(aio->base.nodes, node) {
 		if (aio->base.direction == CRAS_STREAM_OUTPUT) {
@@ -883,7 +883,7 @@ static void set_iodev_name(struct cras_iodev *dev,
 	syslog(LOG_DEBUG, "Add device name=%s", dev->info.name);
 }
 
-/* Updates the supported sample rates and channel counts. */
+/* Updates the supported sample rates, channel counts and sample formats. */
 static int update_supported_formats(struct cras_iodev *iodev)
 {
 	struct alsa_io *aio = (struct alsa_io *)iodev;
@@ -893,10 +893,13 @@ static int update_supported_formats(struct cras_iodev *iodev)
 	iodev->supported_rates = NULL;
 	free(iodev->supported_channel_counts);
 	iodev->supported_channel_counts = NULL;
+	free(iodev->supported_formats);
+	iodev->supported_formats = NULL;
 
 	err = cras_alsa_fill_properties(aio->dev, aio->alsa_stream,
 					&iodev->supported_rates,
-					&iodev->supported_channel_counts);
+					&iodev->supported_channel_counts,
+					&iodev->supported_formats);
 	return err;
 }
 
@@ -978,12 +981,16 @@ struct cras_iodev *alsa_iodev_create(size_t card_index,
 	iodev->dev_running = dev_running;
 	iodev->update_active_node = update_active_node;
 	iodev->update_channel_layout = update_channel_layout;
-	if (card_type == ALSA_CARD_TYPE_USB)
+	/* USB devices run from a clock of their own, the streams follow it. */
+	if (card_type == ALSA_CARD_TYPE_USB) {
 		iodev->min_buffer_level = USB_EXTRA_BUFFER_FRAMES;
+		iodev->compensate_drift = 1;
+	}
 
 	err = cras_alsa_fill_properties(aio->dev, aio->alsa_stream,
 					&iodev->supported_rates,
-					&iodev->supported_channel_counts);
+					&iodev->supported_channel_counts,
+					&iodev->supported_formats);
 	if (err < 0 || iodev->supported_rates[0] == 0 ||
 	    iodev->supported_channel_counts[0] == 0) {
 		syslog(LOG_ERR, "cras_alsa_fill_properties: %s", strerror(err));
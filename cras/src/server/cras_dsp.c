@@ -3,9 +3,11 @@
  * found in the LICENSE file.
  */
 
+#include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <syslog.h>
+#include <time.h>
 #include "dumper.h"
 #include "cras_expr.h"
 #include "cras_dsp_ini.h"
@@ -24,10 +26,23 @@
  * The pipeline is (re-)loaded asynchronously in an internal thread,
  * so the client needs to use cras_dsp_get_pipeline() and
  * cras_dsp_put_pipeline() to safely access the pipeline.
+ *
+ * The audio thread never waits for the loading: a new pipeline is published
+ * with an atomic swap of the pointer, and read_seq is odd while the audio
+ * thread uses the pipeline it read.  The old pipeline is freed once read_seq
+ * shows the audio thread left the section in which it may have read it.
+ *
+ * A reloaded pipeline crossfades from the one it replaces, which it keeps and
+ * runs until the fade is done, so filter states don't restart with a click.
+ * While a fade runs the internal thread checks on it every DSP_FADE_POLL_MS
+ * and frees the old pipeline once it is done.  A reload requested meanwhile
+ * is deferred until then and sets load_pending, so the running fade is never
+ * cut short.
  */
 struct cras_dsp_context {
-	pthread_mutex_t mutex;
 	struct pipeline *pipeline;
+	unsigned int read_seq;
+	int load_pending;
 
 	struct cras_expr_env env;
 	int channels;
@@ -56,11 +71,17 @@ struct dsp_request {
 	struct dsp_request *prev, *next;
 };
 
+/* How long a reloaded pipeline crossfades from the one it replaces. */
+#define DSP_CROSSFADE_MS_DEFAULT 20
+/* How often a running crossfade is checked, to free the old pipeline. */
+#define DSP_FADE_POLL_MS 50
+
 static struct dumper *syslog_dumper;
 static pthread_t dsp_thread;
 static const char *ini_filename;
 static struct ini *ini;
 static struct cras_dsp_context *context_list;
+static unsigned int crossfade_ms = DSP_CROSSFADE_MS_DEFAULT;
 
 /* The request list can be accessed by multiple threads */
 static pthread_mutex_t req_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -130,22 +151,87 @@ static void cmd_set_variable(struct cras_dsp_context *ctx, const char *key,
 	cras_expr_env_set_variable_string(&ctx->env, key, value);
 }
 
+/* Waits until the audio thread is past any use of a pipeline it read before
+ * the last swap.  A section started after the swap reads the new pipeline,
+ * only one in progress at the swap has to end. */
+static void wait_for_reader(struct cras_dsp_context *ctx)
+{
+	const struct timespec poll_interval = { 0, 1000000 };
+	unsigned int seq;
+
+	seq = __atomic_load_n(&ctx->read_seq, __ATOMIC_SEQ_CST);
+	if (!(seq & 1))
+		return;
+	while (__atomic_load_n(&ctx->read_seq, __ATOMIC_ACQUIRE) == seq)
+		nanosleep(&poll_interval, NULL);
+}
+
 static void cmd_load_pipeline(struct cras_dsp_context *ctx)
 {
 	struct pipeline *pipeline, *old_pipeline;
+	int fade_frames;
 
-	pipeline = prepare_pipeline(ctx);
-
-	/* This locking is short to avoild blocking audio thread. */
-	pthread_mutex_lock(&ctx->mutex);
+	/* Replacing a pipeline still fading would drop what it fades from and
+	 * jump, load once the fade is done. */
 	old_pipeline = ctx->pipeline;
-	ctx->pipeline = pipeline;
-	pthread_mutex_unlock(&ctx->mutex);
+	if (old_pipeline &&
+	    cras_dsp_pipeline_has_fade_from(old_pipeline) &&
+	    !cras_dsp_pipeline_fade_done(old_pipeline)) {
+		ctx->load_pending = 1;
+		return;
+	}
+	ctx->load_pending = 0;
+
+	pipeline = prepare_pipeline(ctx);
 
-	if (old_pipeline)
+	fade_frames = (uint64_t)ctx->sample_rate *
+		__atomic_load_n(&crossfade_ms, __ATOMIC_RELAXED) / 1000;
+	if (pipeline && old_pipeline && fade_frames > 0)
+		cras_dsp_pipeline_fade_from(pipeline, old_pipeline,
+					    fade_frames);
+	else
+		fade_frames = 0;
+
+	__atomic_store_n(&ctx->pipeline, pipeline, __ATOMIC_SEQ_CST);
+	if (!old_pipeline)
+		return;
+
+	wait_for_reader(ctx);
+	/* Only the new pipeline runs the old one now.  The fade of the old one
+	 * is done, what it faded from no longer runs. */
+	if (fade_frames)
+		cras_dsp_pipeline_free_fade_from(old_pipeline);
+	else
 		cras_dsp_pipeline_free(old_pipeline);
 }
 
+/* Frees the pipelines faded from that no longer run, then loads the pipelines
+ * deferred until then.  Returns non-zero if a crossfade is still running. */
+static int free_faded_pipelines()
+{
+	struct cras_dsp_context *ctx;
+	int fading = 0;
+
+	DL_FOREACH(context_list, ctx) {
+		if (!ctx->pipeline ||
+		    !cras_dsp_pipeline_has_fade_from(ctx->pipeline))
+			continue;
+		if (!cras_dsp_pipeline_fade_done(ctx->pipeline)) {
+			fading = 1;
+			continue;
+		}
+		/* A section that read the pipeline as the fade ended may still
+		 * be running it, let it finish. */
+		wait_for_reader(ctx);
+		cras_dsp_pipeline_free_fade_from(ctx->pipeline);
+		if (ctx->load_pending) {
+			cmd_load_pipeline(ctx);
+			fading = 1;
+		}
+	}
+	return fading;
+}
+
 static void cmd_add_context(struct cras_dsp_context *ctx)
 {
 	DL_APPEND(context_list, ctx);
@@ -155,7 +241,6 @@ static void cmd_free_context(struct cras_dsp_context *ctx)
 {
 	DL_DELETE(context_list, ctx);
 
-	pthread_mutex_destroy(&ctx->mutex);
 	if (ctx->pipeline) {
 		cras_dsp_pipeline_free(ctx->pipeline);
 		ctx->pipeline = NULL;
@@ -227,18 +312,48 @@ static void send_dsp_request_simple(enum dsp_command code,
 	send_dsp_request(code, ctx, NULL, NULL, NULL);
 }
 
+/* Takes the next request, waiting for one with req_mutex held.  While a
+ * crossfade runs it gives up after DSP_FADE_POLL_MS and returns NULL. */
+static struct dsp_request *wait_request(int fading)
+{
+	struct dsp_request *req;
+	struct timespec deadline;
+
+	if (fading) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += DSP_FADE_POLL_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	while (req_list == NULL) {
+		if (!fading)
+			pthread_cond_wait(&req_cond, &req_mutex);
+		else if (pthread_cond_timedwait(&req_cond, &req_mutex,
+						&deadline) == ETIMEDOUT)
+			return NULL;
+	}
+	req = req_list;
+	DL_DELETE(req_list, req);
+	return req;
+}
+
 static void *dsp_thread_function(void *arg)
 {
 	struct dsp_request *req;
 	int quit = 0;
+	int fading;
 
 	do {
+		fading = free_faded_pipelines();
+
 		pthread_mutex_lock(&req_mutex);
-		while (req_list == NULL)
-			pthread_cond_wait(&req_cond, &req_mutex);
-		req = req_list;
-		DL_DELETE(req_list, req);
+		req = wait_request(fading);
 		pthread_mutex_unlock(&req_mutex);
+		if (!req)
+			continue;
 
 		switch (req->code) {
 		case DSP_CMD_SET_VARIABLE:
@@ -289,6 +404,7 @@ void cras_dsp_stop()
 {
 	send_dsp_request_simple(DSP_CMD_QUIT, NULL);
 	pthread_join(dsp_thread, NULL);
+	cras_dsp_pipeline_stop_workers();
 	syslog_dumper_free(syslog_dumper);
 	free((char *)ini_filename);
 	if (ini) {
@@ -302,7 +418,6 @@ struct cras_dsp_context *cras_dsp_context_new(int channels, int sample_rate,
 {
 	struct cras_dsp_context *ctx = calloc(1, sizeof(*ctx));
 
-	pthread_mutex_init(&ctx->mutex, NULL);
 	initialize_environment(&ctx->env);
 	ctx->channels = channels;
 	ctx->sample_rate = sample_rate;
@@ -330,17 +445,25 @@ void cras_dsp_load_pipeline(struct cras_dsp_context *ctx)
 
 struct pipeline *cras_dsp_get_pipeline(struct cras_dsp_context *ctx)
 {
-	pthread_mutex_lock(&ctx->mutex);
-	if (!ctx->pipeline) {
-		pthread_mutex_unlock(&ctx->mutex);
-		return NULL;
-	}
-	return ctx->pipeline;
+	struct pipeline *pipeline;
+
+	/* Either the swap sees the section started, or the section sees the
+	 * swapped pointer, both are sequentially consistent. */
+	__atomic_add_fetch(&ctx->read_seq, 1, __ATOMIC_SEQ_CST);
+	pipeline = __atomic_load_n(&ctx->pipeline, __ATOMIC_SEQ_CST);
+	if (!pipeline)
+		__atomic_add_fetch(&ctx->read_seq, 1, __ATOMIC_RELEASE);
+	return pipeline;
 }
 
 void cras_dsp_put_pipeline(struct cras_dsp_context *ctx)
 {
-	pthread_mutex_unlock(&ctx->mutex);
+	__atomic_add_fetch(&ctx->read_seq, 1, __ATOMIC_RELEASE);
+}
+
+void cras_dsp_set_crossfade_ms(unsigned int ms)
+{
+	__atomic_store_n(&crossfade_ms, ms, __ATOMIC_RELAXED);
 }
 
 void cras_dsp_reload_ini()
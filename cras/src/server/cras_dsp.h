@@ -27,7 +27,7 @@ void cras_dsp_stop();
 /* Creates a dsp context. The context holds a pipeline and its
  * parameters.  To use the pipeline in the context, first use
  * cras_dsp_load_pipeline() to load it and then use
- * cras_dsp_get_pipeline() to lock it for access.
+ * cras_dsp_get_pipeline() to access it.
  * Args:
  *    channels - The number of audio channels of the pipeline.
  *    sample_rate - The sampling rate of the pipeline.
@@ -51,16 +51,24 @@ void cras_dsp_set_variable(struct cras_dsp_context *ctx, const char *key,
  * blocking the audio thread. */
 void cras_dsp_load_pipeline(struct cras_dsp_context *ctx);
 
-/* Locks the pipeline in the context for access. Returns NULL if the
- * pipeline is still being loaded or cannot be loaded. */
+/* Gets the pipeline in the context for access, without locking, so it never
+ * blocks.  A pipeline loaded meanwhile replaces it for the next call, this one
+ * stays valid until put back.  Returns NULL if the pipeline is still being
+ * loaded or cannot be loaded.  Only one thread, the audio thread, may get the
+ * pipeline of a context, and not twice before putting it back. */
 struct pipeline *cras_dsp_get_pipeline(struct cras_dsp_context *ctx);
 
 /* Releases the pipeline in the context. This must be called in pair
  * with cras_dsp_get_pipeline() once the client finishes using the
- * pipeline. This should be called in the same thread as
- * cras_dsp_get_pipeline() was called. */
+ * pipeline, unless it returned NULL. This should be called in the same
+ * thread as cras_dsp_get_pipeline() was called. */
 void cras_dsp_put_pipeline(struct cras_dsp_context *ctx);
 
+/* Sets how long, in milliseconds, a reloaded pipeline runs alongside the one
+ * it replaces while the audio thread crossfades from the old output to the
+ * new one.  Zero swaps them at once.  Applies to the following loads. */
+void cras_dsp_set_crossfade_ms(unsigned int ms);
+
 /* Re-reads the ini file and reloads all pipelines in the system. */
 void cras_dsp_reload_ini();
 
@@ -3,12 +3,15 @@
  * found in the LICENSE file.
  */
 
+#include <errno.h>
 #include <stdlib.h>
+#include <syslog.h>
 #include "cras_dsp_module.h"
 #include "drc.h"
 #include "dsp_util.h"
 #include "eq.h"
 #include "eq2.h"
+#include "eqn.h"
 
 /*
  *  empty module functions (for source and sink)
@@ -301,7 +304,7 @@ static void drc_run(struct dsp_module *module, unsigned long sample_count)
 	if (!data->drc) {
 		int i;
 		float nyquist = data->sample_rate / 2;
-		struct drc *drc = drc_new(data->sample_rate);
+		struct drc *drc = drc_new(data->sample_rate, 2);
 
 		data->drc = drc;
 		drc->emphasis_disabled = (int) *data->ports[4];
@@ -357,12 +360,312 @@ static void drc_init_module(struct dsp_module *module)
 	module->dump = &empty_dump;
 }
 
+/*
+ *  common functions of the multichannel modules
+ */
+
+/* Returns the number of audio input ports of a plugin, the number of channels
+ * a multichannel module processes. */
+static int plugin_num_channels(struct plugin *plugin)
+{
+	struct port *port;
+	int i, n = 0;
+
+	FOR_ARRAY_ELEMENT(&plugin->ports, i, port)
+		if (port->direction == PORT_INPUT && port->type == PORT_AUDIO)
+			n++;
+	return n;
+}
+
+/* Checks the plugin has its num_channels audio inputs first, followed by as
+ * many audio outputs, which is the port layout eqn and drcn rely on. */
+static int plugin_check_audio_ports(struct plugin *plugin, int num_channels)
+{
+	struct port *port;
+	int i;
+
+	if (ARRAY_COUNT(&plugin->ports) < 2 * num_channels) {
+		syslog(LOG_ERR, "%s needs at least %d ports", plugin->label,
+		       2 * num_channels);
+		return -EINVAL;
+	}
+	for (i = 0; i < 2 * num_channels; i++) {
+		port = ARRAY_ELEMENT(&plugin->ports, i);
+		if (port->type != PORT_AUDIO ||
+		    port->direction != (i < num_channels ? PORT_INPUT
+							 : PORT_OUTPUT)) {
+			syslog(LOG_ERR, "%s port %d isn't an audio %s",
+			       plugin->label, i,
+			       i < num_channels ? "input" : "output");
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/* Copies the input ports to the output ports they are not already shared
+ * with. The inputs are ports[0..num_channels-1], the outputs follow them. */
+static void copy_inputs_to_outputs(float **ports, int num_channels,
+				   unsigned long sample_count)
+{
+	int i;
+
+	for (i = 0; i < num_channels; i++)
+		if (ports[i] != ports[num_channels + i])
+			memcpy(ports[num_channels + i], ports[i],
+			       sizeof(float) * sample_count);
+}
+
+/*
+ *  eqn module functions
+ */
+struct eqn_data {
+	int sample_rate;
+	struct eqn *eqn;  /* Initialized in the first call of eqn_run() */
+	int num_channels;
+
+	/* num_channels ports for input, num_channels for output, and 4
+	 * parameters per eq of each channel. Allocated when the module is
+	 * loaded, as the number of ports depends on the plugin. */
+	unsigned long num_ports;
+	float **ports;
+};
+
+static int eqn_instantiate(struct dsp_module *module, unsigned long sample_rate)
+{
+	struct eqn_data *data = (struct eqn_data *) module->data;
+	data->sample_rate = (int) sample_rate;
+	return 0;
+}
+
+static void eqn_connect_port(struct dsp_module *module,
+			     unsigned long port, float *data_location)
+{
+	struct eqn_data *data = (struct eqn_data *) module->data;
+	if (port < data->num_ports)
+		data->ports[port] = data_location;
+}
+
+static void eqn_run(struct dsp_module *module, unsigned long sample_count)
+{
+	struct eqn_data *data = (struct eqn_data *) module->data;
+	int n = data->num_channels;
+
+	if (!data->eqn) {
+		float nyquist = data->sample_rate / 2;
+		unsigned long i;
+		int channel;
+
+		data->eqn = eqn_new(n);
+		for (i = 2 * n; i + 4 * n <= data->num_ports; i += 4 * n) {
+			for (channel = 0; channel < n; channel++) {
+				int k = i + channel * 4;
+				int type = (int) *data->ports[k];
+				float freq = *data->ports[k+1];
+				float Q = *data->ports[k+2];
+				float gain = *data->ports[k+3];
+				eqn_append_biquad(data->eqn, channel, type,
+						  freq / nyquist, Q, gain);
+			}
+		}
+	}
+
+	copy_inputs_to_outputs(data->ports, n, sample_count);
+	eqn_process(data->eqn, &data->ports[n], (int) sample_count);
+}
+
+static void eqn_deinstantiate(struct dsp_module *module)
+{
+	struct eqn_data *data = (struct eqn_data *) module->data;
+	if (data->eqn)
+		eqn_free(data->eqn);
+	data->eqn = NULL;
+}
+
+static void eqn_free_module(struct dsp_module *module)
+{
+	struct eqn_data *data = (struct eqn_data *) module->data;
+	free(data->ports);
+	free(data);
+	free(module);
+}
+
+static int eqn_init_module(struct dsp_module *module, struct plugin *plugin)
+{
+	struct eqn_data *data;
+	int num_channels = plugin_num_channels(plugin);
+
+	if (num_channels <= 0 || num_channels > EQN_MAX_CHANNELS) {
+		syslog(LOG_ERR, "eqn can't process %d channels", num_channels);
+		return -EINVAL;
+	}
+	if (plugin_check_audio_ports(plugin, num_channels))
+		return -EINVAL;
+
+	data = (struct eqn_data *) calloc(1, sizeof(struct eqn_data));
+	if (!data)
+		return -ENOMEM;
+	data->num_channels = num_channels;
+	data->num_ports = ARRAY_COUNT(&plugin->ports);
+	data->ports = (float **) calloc(data->num_ports, sizeof(float *));
+	if (!data->ports) {
+		free(data);
+		return -ENOMEM;
+	}
+	module->data = data;
+
+	module->instantiate = &eqn_instantiate;
+	module->connect_port = &eqn_connect_port;
+	module->get_delay = &empty_get_delay;
+	module->run = &eqn_run;
+	module->deinstantiate = &eqn_deinstantiate;
+	module->free_module = &eqn_free_module;
+	module->get_properties = &empty_get_properties;
+	module->dump = &empty_dump;
+	return 0;
+}
+
+/*
+ *  drcn module functions
+ */
+struct drcn_data {
+	int sample_rate;
+	struct drc *drc;  /* Initialized in the first call of drcn_run() */
+	int num_channels;
+
+	/* num_channels ports for input, num_channels for output, one for
+	 * disable_emphasis, and 8 parameters each band. Allocated when the
+	 * module is loaded, as the number of ports depends on the plugin. */
+	unsigned long num_ports;
+	float **ports;
+};
+
+static int drcn_instantiate(struct dsp_module *module,
+			    unsigned long sample_rate)
+{
+	struct drcn_data *data = (struct drcn_data *) module->data;
+	data->sample_rate = (int) sample_rate;
+	return 0;
+}
+
+static void drcn_connect_port(struct dsp_module *module,
+			      unsigned long port, float *data_location)
+{
+	struct drcn_data *data = (struct drcn_data *) module->data;
+	if (port < data->num_ports)
+		data->ports[port] = data_location;
+}
+
+static int drcn_get_delay(struct dsp_module *module)
+{
+	struct drcn_data *data = (struct drcn_data *) module->data;
+	return DRC_DEFAULT_PRE_DELAY * data->sample_rate;
+}
+
+static void drcn_run(struct dsp_module *module, unsigned long sample_count)
+{
+	struct drcn_data *data = (struct drcn_data *) module->data;
+	int n = data->num_channels;
+
+	if (!data->drc) {
+		int i;
+		float nyquist = data->sample_rate / 2;
+		struct drc *drc = drc_new(data->sample_rate, n);
+
+		data->drc = drc;
+		drc->emphasis_disabled = (int) *data->ports[2 * n];
+		for (i = 0; i < 3; i++) {
+			int k = 2 * n + 1 + i * 8;
+			float f = *data->ports[k];
+			float enable = *data->ports[k+1];
+			float threshold = *data->ports[k+2];
+			float knee = *data->ports[k+3];
+			float ratio = *data->ports[k+4];
+			float attack = *data->ports[k+5];
+			float release = *data->ports[k+6];
+			float boost = *data->ports[k+7];
+			drc_set_param(drc, i, PARAM_CROSSOVER_LOWER_FREQ,
+				      f / nyquist);
+			drc_set_param(drc, i, PARAM_ENABLED, enable);
+			drc_set_param(drc, i, PARAM_THRESHOLD, threshold);
+			drc_set_param(drc, i, PARAM_KNEE, knee);
+			drc_set_param(drc, i, PARAM_RATIO, ratio);
+			drc_set_param(drc, i, PARAM_ATTACK, attack);
+			drc_set_param(drc, i, PARAM_RELEASE, release);
+			drc_set_param(drc, i, PARAM_POST_GAIN, boost);
+		}
+		drc_init(drc);
+	}
+
+	copy_inputs_to_outputs(data->ports, n, sample_count);
+	drc_process(data->drc, &data->ports[n], (int) sample_count);
+}
+
+static void drcn_deinstantiate(struct dsp_module *module)
+{
+	struct drcn_data *data = (struct drcn_data *) module->data;
+	if (data->drc)
+		drc_free(data->drc);
+	data->drc = NULL;
+}
+
+static void drcn_free_module(struct dsp_module *module)
+{
+	struct drcn_data *data = (struct drcn_data *) module->data;
+	free(data->ports);
+	free(data);
+	free(module);
+}
+
+static int drcn_init_module(struct dsp_module *module, struct plugin *plugin)
+{
+	struct drcn_data *data;
+	int num_channels = plugin_num_channels(plugin);
+
+	if (num_channels <= 0 || num_channels > DRC_MAX_CHANNELS) {
+		syslog(LOG_ERR, "drcn can't process %d channels",
+		       num_channels);
+		return -EINVAL;
+	}
+	if (plugin_check_audio_ports(plugin, num_channels))
+		return -EINVAL;
+	if (ARRAY_COUNT(&plugin->ports) < 2 * num_channels + 1 + 8 * 3) {
+		syslog(LOG_ERR, "drcn needs %d ports",
+		       2 * num_channels + 1 + 8 * 3);
+		return -EINVAL;
+	}
+
+	data = (struct drcn_data *) calloc(1, sizeof(struct drcn_data));
+	if (!data)
+		return -ENOMEM;
+	data->num_channels = num_channels;
+	data->num_ports = ARRAY_COUNT(&plugin->ports);
+	data->ports = (float **) calloc(data->num_ports, sizeof(float *));
+	if (!data->ports) {
+		free(data);
+		return -ENOMEM;
+	}
+	module->data = data;
+
+	module->instantiate = &drcn_instantiate;
+	module->connect_port = &drcn_connect_port;
+	module->get_delay = &drcn_get_delay;
+	module->run = &drcn_run;
+	module->deinstantiate = &drcn_deinstantiate;
+	module->free_module = &drcn_free_module;
+	module->get_properties = &empty_get_properties;
+	module->dump = &empty_dump;
+	return 0;
+}
+
 /*
  *  builtin module dispatcher
  */
 struct dsp_module *cras_dsp_module_load_builtin(struct plugin *plugin)
 {
 	struct dsp_module *module;
+	int rc = 0;
+
 	if (strcmp(plugin->library, "builtin") != 0)
 		return NULL;
 
@@ -376,9 +679,18 @@ struct dsp_module *cras_dsp_module_load_builtin(struct plugin *plugin)
 		eq2_init_module(module);
 	} else if (strcmp(plugin->label, "drc") == 0) {
 		drc_init_module(module);
+	} else if (strcmp(plugin->label, "eqn") == 0) {
+		rc = eqn_init_module(module, plugin);
+	} else if (strcmp(plugin->label, "drcn") == 0) {
+		rc = drcn_init_module(module, plugin);
 	} else {
 		empty_init_module(module);
 	}
 
+	if (rc) {
+		free(module);
+		return NULL;
+	}
+
 	return module;
 }
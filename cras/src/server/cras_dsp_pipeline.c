@@ -3,9 +3,18 @@
  * found in the LICENSE file.
  */
 
+#define _GNU_SOURCE /* For CPU affinity. */
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "cras_config.h"
 #include "cras_util.h"
 #include "cras_dsp_module.h"
 #include "cras_dsp_pipeline.h"
@@ -40,8 +49,33 @@
  * now disabled, in the pipeline we construct there will only be two
  * instances (A and C) and the audio ports on these instances will
  * connect to each other directly, bypassing B.
+ *
+ * Instances are ordered by level, the level of an instance is one more than
+ * the highest level of the instances it takes input from.  Instances of the
+ * same level don't depend on each other, when running a block is expensive
+ * enough the calling thread posts each level to a pool of worker threads
+ * shared by all pipelines.  The workers and the calling thread claim the
+ * instances of the level one at a time, so the calling thread never waits for
+ * a worker that hasn't woken up, only for the instances already being run.
+ * The workers are started when a pipeline that may use them is instantiated,
+ * the calling thread runs serially while there are none.
  */
 
+/* The most worker threads in the pool, besides the calling thread. */
+#define DSP_MAX_WORKERS 3
+
+/* Checks of the instances still running before the calling thread sleeps
+ * until they are done, a worker may share its CPU. */
+#define DSP_WORKER_SPINS 1000
+
+/* Serial blocks timed to estimate the cost of a block, the first one isn't
+ * counted as modules set themselves up in their first run. */
+#define DSP_PARALLEL_PROBE_BLOCKS 8
+
+/* A block has to take longer than this, in nanoseconds, to run in parallel.
+ * Posting a level and waking the workers costs a few microseconds. */
+#define DSP_PARALLEL_THRESHOLD_NS 200000
+
 /* This represents an audio port on an instance. */
 struct audio_port {
 	struct audio_port *peer;  /* the audio port this port connects to */
@@ -91,6 +125,9 @@ struct instance {
 	/* This is the total buffering delay from source to this instance. It is
 	 * in number of frames. */
 	int total_delay;
+
+	/* The level of this instance, see above. */
+	int level;
 };
 
 DECLARE_ARRAY_TYPE(struct instance, instance_array)
@@ -105,7 +142,7 @@ struct pipeline {
 
 	/* All needed instances for this pipeline. It is sorted in an
 	 * order that if instance B depends on instance A, then A will
-	 * appear in front of B. */
+	 * appear in front of B, and by level. */
 	instance_array instances;
 
 	/* The maximum number of audio buffers that will be used at
@@ -124,6 +161,10 @@ struct pipeline {
 	/* The number of audio channels for this pipeline */
 	int channels;
 
+	/* Each channel is in the same buffer at the source and at the sink,
+	 * so a plane of the caller can stand in for that buffer. */
+	int planar_in_place;
+
 	/* The audio sampling rate for this pipleine. It is zero if
 	 * cras_dsp_pipeline_instantiate() has not been called. */
 	int sample_rate;
@@ -140,6 +181,36 @@ struct pipeline {
 
 	/* The total number of sample frames the pipeline processed */
 	int64_t total_samples;
+
+	/* The pipeline this one replaced.  It runs on the same audio until
+	 * fade_frames frames are processed, fading out while this one fades
+	 * in.  fade_pos is the number of frames faded so far. */
+	struct pipeline *fade_from;
+	int fade_frames;
+	int fade_pos;
+
+	/* Set by cras_dsp_pipeline_set_parallel(). */
+	int max_workers;
+	int64_t parallel_threshold_ns;
+
+	/* The parallel schedule, built at instantiate time.  The instances
+	 * run step by step, a step ending at instance step_end[i] and made of
+	 * one level, or of consecutive levels of a single instance.
+	 * num_threads is the calling thread and the workers woken for a step,
+	 * 1 when the pipeline always runs serially.  run_frames is the size of
+	 * the block being run. */
+	int num_threads;
+	int num_steps;
+	int *step_end;
+	int run_frames;
+
+	/* Serial blocks timed so far, and their total time and frames. */
+	int probe_blocks;
+	int64_t probe_time;
+	int64_t probe_frames;
+
+	/* The number of blocks run in parallel. */
+	int64_t parallel_blocks;
 };
 
 static struct instance *find_instance_by_plugin(instance_array *instances,
@@ -368,6 +439,65 @@ static int topological_sort(struct pipeline *pipeline,
 	return 0;
 }
 
+/* Finds the level of an instance from the levels of the instances upstream,
+ * which come before it in the instances array. */
+static int find_level(struct pipeline *pipeline, struct instance *instance)
+{
+	int i;
+	int level = 0;
+	struct audio_port *audio_port;
+	struct control_port *control_port;
+	struct instance *upstream;
+
+	FOR_ARRAY_ELEMENT(&instance->input_audio_ports, i, audio_port) {
+		if (!audio_port->peer)
+			continue;
+		upstream = find_instance_by_plugin(&pipeline->instances,
+						   audio_port->peer->plugin);
+		level = max(level, upstream->level + 1);
+	}
+	FOR_ARRAY_ELEMENT(&instance->input_control_ports, i, control_port) {
+		if (!control_port->peer)
+			continue;
+		upstream = find_instance_by_plugin(&pipeline->instances,
+						   control_port->peer->plugin);
+		level = max(level, upstream->level + 1);
+	}
+
+	return level;
+}
+
+/* Reorders the topologically sorted instances by level, keeping the order of
+ * the instances in the same level. */
+static int sort_by_level(struct pipeline *pipeline)
+{
+	int i, j, k = 0;
+	int n = ARRAY_COUNT(&pipeline->instances);
+	int max_level = 0;
+	struct instance *instance, *sorted;
+
+	if (n == 0)
+		return 0;
+
+	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance) {
+		instance->level = find_level(pipeline, instance);
+		max_level = max(max_level, instance->level);
+	}
+
+	sorted = (struct instance *)calloc(n, sizeof(*sorted));
+	if (!sorted)
+		return -1;
+	for (j = 0; j <= max_level; j++)
+		FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance)
+			if (instance->level == j)
+				sorted[k++] = *instance;
+	memcpy(ARRAY_ELEMENT(&pipeline->instances, 0), sorted,
+	       n * sizeof(*sorted));
+	free(sorted);
+
+	return 0;
+}
+
 static struct plugin *find_enabled_builtin_plugin(struct ini *ini,
 						  const char *label,
 						  const char *purpose,
@@ -404,6 +534,7 @@ struct pipeline *cras_dsp_pipeline_create(struct ini *ini,
 	int n;
 	char *visited;
 	int rc;
+	int cpus;
 	struct plugin *source = find_enabled_builtin_plugin(
 		ini, "source", purpose, env);
 	struct plugin *sink = find_enabled_builtin_plugin(
@@ -429,6 +560,8 @@ struct pipeline *cras_dsp_pipeline_create(struct ini *ini,
 	visited = calloc(1, n);
 	rc = topological_sort(pipeline, env, sink, visited);
 	free(visited);
+	if (rc == 0)
+		rc = sort_by_level(pipeline);
 
 	if (rc < 0) {
 		syslog(LOG_ERR, "failed to construct pipeline");
@@ -449,6 +582,10 @@ struct pipeline *cras_dsp_pipeline_create(struct ini *ini,
 
 	pipeline->channels = ARRAY_COUNT(
 		&pipeline->source_instance->output_audio_ports);
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pipeline->max_workers = min(DSP_MAX_WORKERS, max(0, cpus - 1));
+	pipeline->parallel_threshold_ns = DSP_PARALLEL_THRESHOLD_NS;
+	pipeline->num_threads = 1;
 
 	return pipeline;
 }
@@ -466,6 +603,18 @@ static int load_module(struct plugin *plugin, struct instance *instance)
 	return 0;
 }
 
+static int find_buf_index(audio_port_array *audio_ports, int index)
+{
+	int i;
+	struct audio_port *audio_port;
+
+	FOR_ARRAY_ELEMENT(audio_ports, i, audio_port) {
+		if (audio_port->original_index == index)
+			return audio_port->buf_index;
+	}
+	return -1;
+}
+
 static void use_buffers(char *busy, audio_port_array *audio_ports)
 {
 	int i, k = 0;
@@ -489,56 +638,50 @@ static void unuse_buffers(char *busy, audio_port_array *audio_ports)
 	}
 }
 
+/* Keeps the input buffers this instance freed from other instances of the
+ * same level, which may run at the same time and still read them. */
+static void retire_buffers(char *busy, audio_port_array *audio_ports)
+{
+	int i;
+	struct audio_port *audio_port;
+
+	FOR_ARRAY_ELEMENT(audio_ports, i, audio_port) {
+		if (busy[audio_port->buf_index] == 0)
+			busy[audio_port->buf_index] = 2;
+	}
+}
+
 /* assign which buffer each audio port on each instance should use */
 static int allocate_buffers(struct pipeline *pipeline)
 {
-	int i;
+	int i, k;
 	struct instance *instance;
-	int need_buf = 0, peak_buf = 0;
+	int num_ports = 0, peak_buf = 0, level = 0;
 	char *busy;
 
-	/* first figure out how many buffers do we need */
-	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance) {
-		int in = ARRAY_COUNT(&instance->input_audio_ports);
-		int out = ARRAY_COUNT(&instance->output_audio_ports);
-
-		if (instance->properties & MODULE_INPLACE_BROKEN) {
-			/* We cannot reuse input buffer as output
-			 * buffer, so we need to use extra buffers */
-			need_buf += out;
-			peak_buf = max(peak_buf, need_buf);
-			need_buf -= in;
-		} else {
-			need_buf += out - in;
-			peak_buf = max(peak_buf, need_buf);
-		}
-	}
+	/* There can't be more buffers than output ports. */
+	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance)
+		num_ports += ARRAY_COUNT(&instance->output_audio_ports);
 
-	/* then allocate the buffers */
-	pipeline->peak_buf = peak_buf;
-	pipeline->buffers = (float **)calloc(peak_buf, sizeof(float *));
-
-	if (!pipeline->buffers) {
+	/* Assign buffer index for each instance's input/output ports.  A
+	 * buffer is 0 when free, 1 when used, and 2 when freed by an
+	 * instance of the current level, it is reused from the next level. */
+	busy = calloc(max(num_ports, 1), sizeof(*busy));
+	if (!busy) {
 		syslog(LOG_ERR, "failed to allocate buffers");
 		return -1;
 	}
-
-	for (i = 0; i < peak_buf; i++) {
-		size_t size = DSP_BUFFER_SIZE * sizeof(float);
-		float *buf = calloc(1, size);
-		if (!buf) {
-			syslog(LOG_ERR, "failed to allocate buf");
-			return -1;
-		}
-		pipeline->buffers[i] = buf;
-	}
-
-	/* Now assign buffer index for each instance's input/output ports */
-	busy = calloc(peak_buf, sizeof(*busy));
 	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance) {
 		int j;
 		struct audio_port *audio_port;
 
+		if (instance->level != level) {
+			for (k = 0; k < num_ports; k++)
+				if (busy[k] == 2)
+					busy[k] = 0;
+			level = instance->level;
+		}
+
 		/* Collect input buffers from upstream */
 		FOR_ARRAY_ELEMENT(&instance->input_audio_ports, j, audio_port) {
 			audio_port->buf_index = audio_port->peer->buf_index;
@@ -577,9 +720,45 @@ static int allocate_buffers(struct pipeline *pipeline)
 			unuse_buffers(busy, &instance->input_audio_ports);
 			use_buffers(busy, &instance->output_audio_ports);
 		}
+		retire_buffers(busy, &instance->input_audio_ports);
+
+		FOR_ARRAY_ELEMENT(&instance->output_audio_ports, j,
+				  audio_port) {
+			peak_buf = max(peak_buf, audio_port->buf_index + 1);
+		}
 	}
 	free(busy);
 
+	/* then allocate the buffers */
+	pipeline->peak_buf = peak_buf;
+	pipeline->buffers = (float **)calloc(peak_buf, sizeof(float *));
+
+	if (!pipeline->buffers) {
+		syslog(LOG_ERR, "failed to allocate buffers");
+		return -1;
+	}
+
+	for (i = 0; i < peak_buf; i++) {
+		size_t size = DSP_BUFFER_SIZE * sizeof(float);
+		float *buf = calloc(1, size);
+		if (!buf) {
+			syslog(LOG_ERR, "failed to allocate buf");
+			return -1;
+		}
+		pipeline->buffers[i] = buf;
+	}
+
+	pipeline->planar_in_place = 1;
+	for (i = 0; i < pipeline->channels; i++) {
+		int in = find_buf_index(
+			&pipeline->source_instance->output_audio_ports, i);
+		int out = find_buf_index(
+			&pipeline->sink_instance->input_audio_ports, i);
+
+		if (in < 0 || in != out)
+			pipeline->planar_in_place = 0;
+	}
+
 	return 0;
 }
 
@@ -625,6 +804,293 @@ static void calculate_audio_delay(struct pipeline *pipeline)
 	}
 }
 
+/* The worker threads, started when a pipeline that may run in parallel is
+ * instantiated and shared by all of them.  A step is posted in claim, with the
+ * pipeline it belongs to, and claimed an instance at a time.  The thread
+ * running the last instance of the step posts step_done.  busy is set by the
+ * thread running a step, another pipeline running at the same time runs
+ * serially. */
+static struct {
+	pthread_mutex_t mutex;  /* Held to start or stop workers. */
+	sem_t wake;
+	sem_t step_done;
+	int started;
+	int num_workers;
+	pthread_t tids[DSP_MAX_WORKERS];
+	int quit;
+	int busy;
+	struct pipeline *pipeline;
+	/* The step sequence number in the upper 32 bits, then the instance
+	 * ending the step and the next instance to claim, 16 bits each. */
+	uint64_t claim;
+	int size;  /* The instances in the step. */
+	int done;  /* The instances of the step run so far. */
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define CLAIM_END(claim) ((int)(((claim) >> 16) & 0xffff))
+#define CLAIM_NEXT(claim) ((int)((claim) & 0xffff))
+
+/* Claims the next instance of the step posted to the pool.  Returns its
+ * index, or -1 if they are all claimed. */
+static int claim_instance()
+{
+	uint64_t claim = __atomic_load_n(&pool.claim, __ATOMIC_ACQUIRE);
+
+	do {
+		if (CLAIM_NEXT(claim) >= CLAIM_END(claim))
+			return -1;
+	} while (!__atomic_compare_exchange_n(&pool.claim, &claim, claim + 1,
+					      1, __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+	return CLAIM_NEXT(claim);
+}
+
+/* Runs the instances of the posted step while there are some to claim. */
+static void run_claimed_instances()
+{
+	struct pipeline *pipeline;
+	struct instance *instance;
+	int i;
+
+	while ((i = claim_instance()) >= 0) {
+		/* The step can't end before this instance is done, the
+		 * pipeline stays the one it was posted for. */
+		pipeline = __atomic_load_n(&pool.pipeline, __ATOMIC_RELAXED);
+		instance = ARRAY_ELEMENT(&pipeline->instances, i);
+		instance->module->run(instance->module, pipeline->run_frames);
+		if (__atomic_add_fetch(&pool.done, 1, __ATOMIC_RELEASE) ==
+		    __atomic_load_n(&pool.size, __ATOMIC_RELAXED))
+			sem_post(&pool.step_done);
+	}
+}
+
+/* Pins a worker to a CPU of its own where it can, the workers are spread over
+ * the CPUs after the first one allowed.  The calling thread is left where the
+ * scheduler put it. */
+static void pin_worker(int worker)
+{
+	cpu_set_t allowed, cpuset;
+	int cpu, n;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+	n = CPU_COUNT(&allowed);
+	if (n <= 1)
+		return;
+	worker = (worker + 1) % n;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed))
+			continue;
+		if (worker-- == 0)
+			break;
+	}
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset))
+		syslog(LOG_WARNING, "Failed to pin dsp worker to cpu %d", cpu);
+}
+
+static void *dsp_worker_thread(void *arg)
+{
+	pin_worker((int)(intptr_t)arg);
+	if (cras_set_rt_scheduling(CRAS_SERVER_RT_THREAD_PRIORITY) == 0)
+		cras_set_thread_priority(CRAS_SERVER_RT_THREAD_PRIORITY);
+	dsp_enable_flush_denormal_to_zero();
+
+	while (1) {
+		if (sem_wait(&pool.wake) && errno == EINTR)
+			continue;
+		if (__atomic_load_n(&pool.quit, __ATOMIC_ACQUIRE))
+			break;
+		run_claimed_instances();
+	}
+
+	return NULL;
+}
+
+/* Starts workers until there are num_workers in the pool.  Returns the number
+ * of workers in the pool. */
+static int start_workers(int num_workers)
+{
+	int rc;
+
+	pthread_mutex_lock(&pool.mutex);
+	if (!pool.started) {
+		if (sem_init(&pool.wake, 0, 0)) {
+			syslog(LOG_ERR, "Failed to init dsp worker semaphore");
+			pthread_mutex_unlock(&pool.mutex);
+			return 0;
+		}
+		if (sem_init(&pool.step_done, 0, 0)) {
+			syslog(LOG_ERR, "Failed to init dsp worker semaphore");
+			sem_destroy(&pool.wake);
+			pthread_mutex_unlock(&pool.mutex);
+			return 0;
+		}
+		pool.quit = 0;
+		pool.started = 1;
+	}
+	num_workers = min(num_workers, DSP_MAX_WORKERS);
+	while (pool.num_workers < num_workers) {
+		rc = pthread_create(&pool.tids[pool.num_workers], NULL,
+				    dsp_worker_thread,
+				    (void *)(intptr_t)pool.num_workers);
+		if (rc) {
+			syslog(LOG_ERR, "Failed to start dsp worker: %d", rc);
+			break;
+		}
+		__atomic_add_fetch(&pool.num_workers, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+	return pool.num_workers;
+}
+
+void cras_dsp_pipeline_stop_workers()
+{
+	int i;
+
+	pthread_mutex_lock(&pool.mutex);
+	if (pool.started) {
+		__atomic_store_n(&pool.quit, 1, __ATOMIC_RELEASE);
+		for (i = 0; i < pool.num_workers; i++)
+			sem_post(&pool.wake);
+		for (i = 0; i < pool.num_workers; i++)
+			pthread_join(pool.tids[i], NULL);
+		sem_destroy(&pool.wake);
+		sem_destroy(&pool.step_done);
+		pool.num_workers = 0;
+		pool.started = 0;
+	}
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+/* Posts the instances [begin, end) to the pool, wakes up to helpers workers
+ * and runs the instances no worker claimed.  Returns once they have all run,
+ * waiting only for the ones the workers are running: it spins a while, then
+ * sleeps until step_done is posted. */
+static void run_step(struct pipeline *pipeline, int begin, int end,
+		     int helpers)
+{
+	uint64_t seq = (__atomic_load_n(&pool.claim, __ATOMIC_RELAXED) >> 32)
+			+ 1;
+	unsigned int spins = 0;
+
+	__atomic_store_n(&pool.pipeline, pipeline, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool.size, end - begin, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool.done, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool.claim,
+			 (seq << 32) | ((uint64_t)end << 16) | begin,
+			 __ATOMIC_RELEASE);
+	while (helpers-- > 0)
+		sem_post(&pool.wake);
+
+	run_claimed_instances();
+	while (__atomic_load_n(&pool.done, __ATOMIC_ACQUIRE) < end - begin &&
+	       ++spins < DSP_WORKER_SPINS)
+		;
+	/* Takes the post of the step, even when it's already done. */
+	while (sem_wait(&pool.step_done) && errno == EINTR)
+		;
+}
+
+/* Runs a block over the steps of the schedule, the levels of a single
+ * instance on the calling thread.  Returns 0, or -1 if the pool is running
+ * another pipeline and the block has to run serially. */
+static int run_steps(struct pipeline *pipeline, int sample_count)
+{
+	int i, s, begin = 0, helpers;
+	int num_workers = __atomic_load_n(&pool.num_workers, __ATOMIC_ACQUIRE);
+	struct instance *instance;
+
+	if (__atomic_exchange_n(&pool.busy, 1, __ATOMIC_ACQUIRE))
+		return -1;
+
+	pipeline->run_frames = sample_count;
+	for (s = 0; s < pipeline->num_steps; s++) {
+		int end = pipeline->step_end[s];
+
+		helpers = min(min(end - begin, pipeline->num_threads) - 1,
+			      num_workers);
+		if (helpers > 0) {
+			run_step(pipeline, begin, end, helpers);
+		} else {
+			for (i = begin; i < end; i++) {
+				instance = ARRAY_ELEMENT(&pipeline->instances,
+							 i);
+				instance->module->run(instance->module,
+						      sample_count);
+			}
+		}
+		begin = end;
+	}
+
+	__atomic_store_n(&pool.busy, 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void free_schedule(struct pipeline *pipeline)
+{
+	free(pipeline->step_end);
+	pipeline->step_end = NULL;
+	pipeline->num_threads = 1;
+	pipeline->num_steps = 0;
+}
+
+/* Groups the levels in steps.  A level with a single instance runs on the
+ * calling thread, as do the consecutive levels that only run there.  The
+ * workers the schedule may use are started here, not on the thread running
+ * the pipeline. */
+static void build_schedule(struct pipeline *pipeline)
+{
+	int i, j, width = 0, num_threads = 0;
+	int level = -1, serial = 0;
+	int n = ARRAY_COUNT(&pipeline->instances);
+	struct instance *instance;
+
+	free_schedule(pipeline);
+	pipeline->probe_blocks = 0;
+	pipeline->probe_time = 0;
+	pipeline->probe_frames = 0;
+
+	/* Run on at most as many threads as the widest level. */
+	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance) {
+		if (instance->level != level) {
+			level = instance->level;
+			width = 0;
+		}
+		num_threads = max(num_threads, ++width);
+	}
+	num_threads = min(num_threads,
+			  min(pipeline->max_workers, DSP_MAX_WORKERS) + 1);
+	if (num_threads <= 1 || pipeline->parallel_threshold_ns < 0 ||
+	    n > 0xffff)
+		return;
+
+	pipeline->step_end = (int *)calloc(n, sizeof(*pipeline->step_end));
+	if (!pipeline->step_end)
+		return;
+
+	for (i = 0; i < n; i = j) {
+		level = ARRAY_ELEMENT(&pipeline->instances, i)->level;
+		for (j = i; j < n; j++)
+			if (ARRAY_ELEMENT(&pipeline->instances, j)->level !=
+			    level)
+				break;
+
+		/* Consecutive levels on the calling thread share a step. */
+		width = j - i;
+		if (width == 1 && serial)
+			pipeline->step_end[pipeline->num_steps - 1] = j;
+		else
+			pipeline->step_end[pipeline->num_steps++] = j;
+		serial = width == 1;
+	}
+	pipeline->num_threads = num_threads;
+	start_workers(num_threads - 1);
+}
+
 int cras_dsp_pipeline_instantiate(struct pipeline *pipeline, int sample_rate)
 {
 	int i;
@@ -699,6 +1165,7 @@ int cras_dsp_pipeline_instantiate(struct pipeline *pipeline, int sample_rate)
 	}
 
 	calculate_audio_delay(pipeline);
+	build_schedule(pipeline);
 	return 0;
 }
 
@@ -707,6 +1174,7 @@ void cras_dsp_pipeline_deinstantiate(struct pipeline *pipeline)
 	int i;
 	struct instance *instance;
 
+	free_schedule(pipeline);
 	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance) {
 		struct dsp_module *module = instance->module;
 		if (instance->instantiated) {
@@ -717,9 +1185,24 @@ void cras_dsp_pipeline_deinstantiate(struct pipeline *pipeline)
 	pipeline->sample_rate = 0;
 }
 
+/* Checks if the pipeline faded from still runs.  fade_from isn't read once the
+ * fade is done, it can then be freed while the pipeline is applied. */
+static int fading(struct pipeline *pipeline)
+{
+	return __atomic_load_n(&pipeline->fade_pos, __ATOMIC_RELAXED) <
+		pipeline->fade_frames && pipeline->fade_from;
+}
+
 int cras_dsp_pipeline_get_delay(struct pipeline *pipeline)
 {
-	return pipeline->sink_instance->total_delay;
+	int delay = pipeline->sink_instance->total_delay;
+
+	/* The output mixes both pipelines, the older one can lag more.  It
+	 * runs without its own crossfade, if it had one. */
+	if (fading(pipeline))
+		delay = max(delay,
+			    pipeline->fade_from->sink_instance->total_delay);
+	return delay;
 }
 
 int cras_dsp_pipeline_get_sample_rate(struct pipeline *pipeline)
@@ -741,14 +1224,9 @@ static float *find_buffer(struct pipeline *pipeline,
 			  audio_port_array *audio_ports,
 			  int index)
 {
-	int i;
-	struct audio_port *audio_port;
+	int buf_index = find_buf_index(audio_ports, index);
 
-	FOR_ARRAY_ELEMENT(audio_ports, i, audio_port) {
-		if (audio_port->original_index == index)
-			return pipeline->buffers[audio_port->buf_index];
-	}
-	return NULL;
+	return buf_index < 0 ? NULL : pipeline->buffers[buf_index];
 }
 
 float *cras_dsp_pipeline_get_source_buffer(struct pipeline *pipeline, int index)
@@ -765,15 +1243,101 @@ float *cras_dsp_pipeline_get_sink_buffer(struct pipeline *pipeline, int index)
 			   index);
 }
 
+void cras_dsp_pipeline_set_parallel(struct pipeline *pipeline,
+				    int max_workers, int64_t threshold_ns)
+{
+	pipeline->max_workers = max(max_workers, 0);
+	pipeline->parallel_threshold_ns = threshold_ns;
+}
+
+/* Decides from the serial blocks timed so far whether a block of
+ * sample_count frames is worth running in parallel. */
+static int run_in_parallel(struct pipeline *pipeline, int sample_count)
+{
+	return pipeline->num_threads > 1 &&
+	       pipeline->probe_blocks >= DSP_PARALLEL_PROBE_BLOCKS &&
+	       pipeline->probe_time * sample_count >
+			pipeline->parallel_threshold_ns *
+			pipeline->probe_frames;
+}
+
 void cras_dsp_pipeline_run(struct pipeline *pipeline, int sample_count)
 {
 	int i;
 	struct instance *instance;
+	struct timespec begin, end, delta;
+	int probe;
+
+	/* Without workers, e.g. they failed to start, the block runs
+	 * serially. */
+	if (run_in_parallel(pipeline, sample_count) &&
+	    __atomic_load_n(&pool.num_workers, __ATOMIC_ACQUIRE) > 0 &&
+	    run_steps(pipeline, sample_count) == 0) {
+		pipeline->parallel_blocks++;
+		return;
+	}
+
+	probe = pipeline->num_threads > 1 &&
+		pipeline->probe_blocks < DSP_PARALLEL_PROBE_BLOCKS;
+	if (probe)
+		clock_gettime(CLOCK_MONOTONIC, &begin);
 
 	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance) {
 		struct dsp_module *module = instance->module;
 		module->run(module, sample_count);
 	}
+
+	if (!probe)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	/* The first run includes the setup of the modules. */
+	if (pipeline->probe_blocks++ == 0)
+		return;
+	subtract_timespecs(&end, &begin, &delta);
+	pipeline->probe_time += delta.tv_sec * 1000000000LL + delta.tv_nsec;
+	pipeline->probe_frames += sample_count;
+}
+
+/* Runs the pipeline on a chunk in its source buffers.  While fading from the
+ * pipeline it replaced, that one runs on a copy of the chunk and its output is
+ * mixed into the sink buffers with a gain falling linearly to zero. */
+static void run_chunk(struct pipeline *pipeline, unsigned int channels,
+		      float **source, float **sink, int chunk)
+{
+	struct pipeline *old = pipeline->fade_from;
+	float step;
+	unsigned int c;
+	int i, pos;
+
+	if (!fading(pipeline)) {
+		cras_dsp_pipeline_run(pipeline, chunk);
+		return;
+	}
+
+	for (c = 0; c < channels; c++)
+		memcpy(cras_dsp_pipeline_get_source_buffer(old, c), source[c],
+		       chunk * sizeof(float));
+	cras_dsp_pipeline_run(old, chunk);
+	cras_dsp_pipeline_run(pipeline, chunk);
+
+	step = 1.0f / pipeline->fade_frames;
+	for (c = 0; c < channels; c++) {
+		float *old_sink = cras_dsp_pipeline_get_sink_buffer(old, c);
+
+		for (i = 0; i < chunk; i++) {
+			float gain;
+
+			pos = pipeline->fade_pos + i + 1;
+			gain = pos < pipeline->fade_frames ? pos * step : 1.0f;
+			sink[c][i] = old_sink[i] +
+				     (sink[c][i] - old_sink[i]) * gain;
+		}
+	}
+	/* Releases the last run of the old pipeline to the thread freeing
+	 * it when the fade is done. */
+	__atomic_store_n(&pipeline->fade_pos,
+			 min(pipeline->fade_pos + chunk, pipeline->fade_frames),
+			 __ATOMIC_RELEASE);
 }
 
 void cras_dsp_pipeline_add_statistic(struct pipeline *pipeline,
@@ -832,7 +1396,7 @@ void cras_dsp_pipeline_apply(struct pipeline *pipeline, unsigned int channels,
 		dsp_util_deinterleave(target, source, channels, chunk);
 
 		/* Run the pipeline */
-		cras_dsp_pipeline_run(pipeline, chunk);
+		run_chunk(pipeline, channels, source, sink, chunk);
 
 		/* interleave and convert back to int16_t */
 		dsp_util_interleave(sink, target, channels, chunk);
@@ -846,11 +1410,171 @@ void cras_dsp_pipeline_apply(struct pipeline *pipeline, unsigned int channels,
 	cras_dsp_pipeline_add_statistic(pipeline, &delta, frames);
 }
 
+void cras_dsp_pipeline_apply_float(struct pipeline *pipeline,
+				   unsigned int channels,
+				   float *buf, unsigned int frames)
+{
+	size_t remaining;
+	size_t chunk;
+	size_t i;
+	float *target;
+	float *source[channels], *sink[channels];
+	struct timespec begin, end, delta;
+
+	if (!pipeline || frames == 0)
+		return;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+
+	target = buf;
+
+	/* get pointers to source and sink buffers */
+	for (i = 0; i < channels; i++) {
+		source[i] = cras_dsp_pipeline_get_source_buffer(pipeline, i);
+		sink[i] = cras_dsp_pipeline_get_sink_buffer(pipeline, i);
+	}
+
+	remaining = frames;
+
+	/* process at most DSP_BUFFER_SIZE frames each loop */
+	while (remaining > 0) {
+		chunk = min(remaining, (size_t)DSP_BUFFER_SIZE);
+
+		dsp_util_deinterleave_float(target, source, channels, chunk);
+		run_chunk(pipeline, channels, source, sink, chunk);
+		dsp_util_interleave_float(sink, target, channels, chunk);
+
+		target += chunk * channels;
+		remaining -= chunk;
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	subtract_timespecs(&end, &begin, &delta);
+	cras_dsp_pipeline_add_statistic(pipeline, &delta, frames);
+}
+
+void cras_dsp_pipeline_fade_from(struct pipeline *pipeline,
+				 struct pipeline *old_pipeline,
+				 int fade_frames)
+{
+	pipeline->fade_from = old_pipeline;
+	pipeline->fade_frames = fade_frames;
+	pipeline->fade_pos = 0;
+}
+
+int cras_dsp_pipeline_has_fade_from(struct pipeline *pipeline)
+{
+	return pipeline->fade_from != NULL;
+}
+
+int cras_dsp_pipeline_fade_done(struct pipeline *pipeline)
+{
+	return __atomic_load_n(&pipeline->fade_pos, __ATOMIC_ACQUIRE) >=
+		pipeline->fade_frames;
+}
+
+void cras_dsp_pipeline_free_fade_from(struct pipeline *pipeline)
+{
+	if (pipeline->fade_from) {
+		cras_dsp_pipeline_free(pipeline->fade_from);
+		pipeline->fade_from = NULL;
+	}
+}
+
+/* Connects every audio port using the buffer at buf_index to data. */
+static void connect_buffer(struct pipeline *pipeline, int buf_index,
+			   float *data)
+{
+	int i, j;
+	struct instance *instance;
+	struct audio_port *audio_port;
+
+	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance) {
+		struct dsp_module *module = instance->module;
+
+		FOR_ARRAY_ELEMENT(&instance->input_audio_ports, j, audio_port) {
+			if (audio_port->buf_index == buf_index)
+				module->connect_port(
+					module, audio_port->original_index,
+					data);
+		}
+		FOR_ARRAY_ELEMENT(&instance->output_audio_ports, j,
+				  audio_port) {
+			if (audio_port->buf_index == buf_index)
+				module->connect_port(
+					module, audio_port->original_index,
+					data);
+		}
+	}
+}
+
+void cras_dsp_pipeline_apply_planar(struct pipeline *pipeline,
+				    unsigned int channels,
+				    float *const *planes,
+				    unsigned int frames)
+{
+	size_t done;
+	size_t chunk;
+	size_t i;
+	float *source[channels], *sink[channels];
+	int buf_index[channels];
+	struct timespec begin, end, delta;
+
+	if (!pipeline || frames == 0)
+		return;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+
+	for (i = 0; i < channels; i++) {
+		buf_index[i] = find_buf_index(
+			&pipeline->source_instance->output_audio_ports, i);
+		source[i] = cras_dsp_pipeline_get_source_buffer(pipeline, i);
+		sink[i] = cras_dsp_pipeline_get_sink_buffer(pipeline, i);
+	}
+
+	/* process at most DSP_BUFFER_SIZE frames each loop */
+	for (done = 0; done < frames; done += chunk) {
+		chunk = min(frames - done, (size_t)DSP_BUFFER_SIZE);
+
+		for (i = 0; i < channels; i++) {
+			float *plane = planes[i] + done;
+
+			if (pipeline->planar_in_place) {
+				/* The modules work on the plane itself. */
+				connect_buffer(pipeline, buf_index[i], plane);
+				source[i] = sink[i] = plane;
+			} else {
+				memcpy(source[i], plane,
+				       chunk * sizeof(float));
+			}
+		}
+
+		run_chunk(pipeline, channels, source, sink, chunk);
+
+		if (!pipeline->planar_in_place)
+			for (i = 0; i < channels; i++)
+				memcpy(planes[i] + done, sink[i],
+				       chunk * sizeof(float));
+	}
+
+	if (pipeline->planar_in_place)
+		for (i = 0; i < channels; i++)
+			connect_buffer(pipeline, buf_index[i],
+				       pipeline->buffers[buf_index[i]]);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	subtract_timespecs(&end, &begin, &delta);
+	cras_dsp_pipeline_add_statistic(pipeline, &delta, frames);
+}
+
 void cras_dsp_pipeline_free(struct pipeline *pipeline)
 {
 	int i;
 	struct instance *instance;
 
+	cras_dsp_pipeline_free_fade_from(pipeline);
+	free_schedule(pipeline);
+
 	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance) {
 		struct dsp_module *module = instance->module;
 		instance->plugin = NULL;
@@ -923,6 +1647,15 @@ void cras_dsp_pipeline_dump(struct dumper *d, struct pipeline *pipeline)
 	dumpf(d, "pipeline (%s):\n", pipeline->purpose);
 	dumpf(d, " channels: %d\n", pipeline->channels);
 	dumpf(d, " sample_rate: %d\n", pipeline->sample_rate);
+	dumpf(d, " planar in place: %d\n", pipeline->planar_in_place);
+	dumpf(d, " parallel threads: %d, steps: %d\n",
+	      pipeline->num_threads, pipeline->num_steps);
+	dumpf(d, " parallel blocks: %" PRId64 ", shared workers: %d\n",
+	      pipeline->parallel_blocks,
+	      __atomic_load_n(&pool.num_workers, __ATOMIC_ACQUIRE));
+	if (pipeline->fade_from)
+		dumpf(d, " faded from previous: %d/%d frames\n",
+		      pipeline->fade_pos, pipeline->fade_frames);
 	dumpf(d, " processed samples: %" PRId64 "\n", pipeline->total_samples);
 	dumpf(d, " processed blocks: %" PRId64 "\n", pipeline->total_blocks);
 	dumpf(d, " total processing time: %" PRId64 "ns\n",
@@ -943,9 +1676,9 @@ void cras_dsp_pipeline_dump(struct dumper *d, struct pipeline *pipeline)
 	      ARRAY_COUNT(&pipeline->instances));
 	FOR_ARRAY_ELEMENT(&pipeline->instances, i, instance) {
 		struct dsp_module *module = instance->module;
-		dumpf(d, "  [%d]%s mod=%p, total delay=%d\n",
+		dumpf(d, "  [%d]%s mod=%p, total delay=%d, level=%d\n",
 		      i, instance->plugin->title, module,
-		      instance->total_delay);
+		      instance->total_delay, instance->level);
 		if (module)
 			module->dump(module, d);
 		dump_audio_ports(d, "input_audio_ports",
@@ -55,6 +55,30 @@ void cras_dsp_pipeline_free(struct pipeline *pipeline);
  */
 int cras_dsp_pipeline_load(struct pipeline *pipeline);
 
+/* Instances that don't depend on each other, the bands after a crossover or
+ * the chains of separate channels, can run at the same time on worker threads.
+ * A pipeline starts running serially and measures how long a block takes, it
+ * switches to parallel runs when the estimated cost of a block is above
+ * threshold_ns.  The workers are shared by all pipelines and started by
+ * cras_dsp_pipeline_instantiate() of a pipeline that may run in parallel,
+ * never by the thread running the pipeline.  This sets how, the default is a
+ * worker for each other CPU up to a few, and takes effect at the next
+ * cras_dsp_pipeline_instantiate().
+ * Args:
+ *    pipeline - The pipeline to configure.
+ *    max_workers - Workers to wake besides the thread running the pipeline,
+ *        0 to always run serially.
+ *    threshold_ns - Estimated cost of a block, in nanoseconds, above which
+ *        it runs in parallel.
+ */
+void cras_dsp_pipeline_set_parallel(struct pipeline *pipeline,
+				    int max_workers, int64_t threshold_ns);
+
+/* Stops the worker threads shared by the pipelines.  No pipeline may be
+ * running, they run serially until the next cras_dsp_pipeline_instantiate()
+ * starts the workers again. */
+void cras_dsp_pipeline_stop_workers();
+
 /* Instantiates the pipeline given the sampling rate.
  * Args:
  *    sample_rate - The audio sampling rate.
@@ -69,7 +93,8 @@ int cras_dsp_pipeline_instantiate(struct pipeline *pipeline, int sample_rate);
 void cras_dsp_pipeline_deinstantiate(struct pipeline *pipeline);
 
 /* Returns the buffering delay of the pipeline. This should only be called
- * after a pipeline has been instantiated.
+ * after a pipeline has been instantiated.  While crossfading it is the
+ * larger delay of the two pipelines mixed.
  * Returns:
  *    The buffering delay in frames.
  */
@@ -132,6 +157,63 @@ void cras_dsp_pipeline_add_statistic(struct pipeline *pipeline,
 void cras_dsp_pipeline_apply(struct pipeline *pipeline, unsigned int channels,
 			     uint8_t *buf, unsigned int frames);
 
+/* Runs the specified pipeline across the given interleaved float buffer in
+ * place.  Samples are in the range [-1.0, 1.0], no conversion is done.
+ * Args:
+ *    pipeline - The pipeline to run.
+ *    channels - Number of audio channels in the buffer. (e.g. stereo = 2)
+ *    buf - The samples to be processed, interleaved.
+ *    frames - the number of frames in the buffer.
+ */
+void cras_dsp_pipeline_apply_float(struct pipeline *pipeline,
+				   unsigned int channels,
+				   float *buf, unsigned int frames);
+
+/* Runs the specified pipeline across planar float buffers in place, one per
+ * channel.  Samples are in the range [-1.0, 1.0], no conversion is done.  When
+ * each channel stays in one buffer from the source to the sink, the modules
+ * are connected to the planes for the run and nothing is copied.
+ * Args:
+ *    pipeline - The pipeline to run.
+ *    channels - Number of audio channels, the number of planes.
+ *    planes - The samples to be processed, frames of them in each plane.
+ *    frames - the number of frames in each plane.
+ */
+void cras_dsp_pipeline_apply_planar(struct pipeline *pipeline,
+				    unsigned int channels,
+				    float *const *planes,
+				    unsigned int frames);
+
+/* Crossfades from old_pipeline to this pipeline over fade_frames frames.
+ * Until then cras_dsp_pipeline_apply() and cras_dsp_pipeline_apply_float()
+ * run both pipelines on the same audio and mix their outputs, the output of
+ * old_pipeline fading out as the output of this one fades in.  Both must be
+ * instantiated with the same number of channels.  The pipeline takes
+ * ownership of old_pipeline and frees it with itself, unless it is freed
+ * earlier with cras_dsp_pipeline_free_fade_from().
+ * Args:
+ *    pipeline - The pipeline replacing old_pipeline.
+ *    old_pipeline - The pipeline to fade from.
+ *    fade_frames - The length of the crossfade in frames.
+ */
+void cras_dsp_pipeline_fade_from(struct pipeline *pipeline,
+				 struct pipeline *old_pipeline,
+				 int fade_frames);
+
+/* Returns non-zero if the pipeline holds one given to
+ * cras_dsp_pipeline_fade_from(). */
+int cras_dsp_pipeline_has_fade_from(struct pipeline *pipeline);
+
+/* Returns non-zero once the crossfade is done and the pipeline faded from no
+ * longer runs.  Can be called while the pipeline is applied. */
+int cras_dsp_pipeline_fade_done(struct pipeline *pipeline);
+
+/* Frees the pipeline given to cras_dsp_pipeline_fade_from(), if any.  The
+ * crossfade stops where it was.  This must not race with applying the
+ * pipeline unless cras_dsp_pipeline_fade_done() returned non-zero, it can
+ * with applying a pipeline fading from this one. */
+void cras_dsp_pipeline_free_fade_from(struct pipeline *pipeline);
+
 /* Dumps the current state of the pipeline. For debugging only */
 void cras_dsp_pipeline_dump(struct dumper *d, struct pipeline *pipeline);
 
@@ -19,7 +19,10 @@
 #define HFP_BYTE_RATE 16000
 #define HFP_MTU_BYTES 48
 
-/* Ring buffer storing samples for transmission. */
+/* Ring buffer storing samples for transmission.  The SCO callback and the
+ * iodev on the other end may run on different audio threads, so used_size is
+ * only updated atomically; read_idx and write_idx each have a single owner.
+ */
 struct pcm_buf {
 	uint8_t *buf;
 	size_t read_idx;
@@ -80,7 +83,7 @@ static void put_read_buf_bytes(struct pcm_buf *pb, unsigned nread)
 	pb->read_idx += nread;
 	if (pb->read_idx == HFP_BUF_SIZE_BYTES)
 		pb->read_idx = 0;
-	pb->used_size -= nread;
+	__sync_fetch_and_sub(&pb->used_size, nread);
 }
 
 static void get_write_buf_bytes(struct pcm_buf *pb, uint8_t **b,
@@ -104,7 +107,7 @@ static void put_write_buf_bytes(struct pcm_buf *pb, unsigned nwrite)
 	pb->write_idx += nwrite;
 	if (pb->write_idx == HFP_BUF_SIZE_BYTES)
 		pb->write_idx = 0;
-	pb->used_size += nwrite;
+	__sync_fetch_and_add(&pb->used_size, nwrite);
 }
 
 /* Structure to hold variables for a HFP connection. Since HFP supports
@@ -114,6 +117,7 @@ static void put_write_buf_bytes(struct pcm_buf *pb, unsigned nwrite)
 struct hfp_info {
 	int fd;
 	int started;
+	struct audio_thread *thread;
 
 	struct pcm_buf *capture_buf;
 	struct pcm_buf *playback_buf;
@@ -353,13 +357,16 @@ int hfp_info_running(struct hfp_info *info)
 	return info->started;
 }
 
-int hfp_info_start(int fd, struct hfp_info *info)
+int hfp_info_start(int fd, struct audio_thread *thread,
+		   struct hfp_info *info)
 {
 	info->fd = fd;
+	info->thread = thread;
 	init_buf(info->playback_buf);
 	init_buf(info->capture_buf);
 
-	audio_thread_add_callback(info->fd, hfp_info_callback, info);
+	audio_thread_add_callback(info->thread, info->fd, hfp_info_callback,
+				  info);
 
 	info->started = 1;
 
@@ -368,10 +375,11 @@ int hfp_info_start(int fd, struct hfp_info *info)
 
 int hfp_info_stop(struct hfp_info *info)
 {
-	audio_thread_rm_callback(info->fd);
+	audio_thread_rm_callback(info->thread, info->fd);
 
 	close(info->fd);
 	info->fd = 0;
+	info->thread = NULL;
 	info->started = 0;
 
 	return 0;
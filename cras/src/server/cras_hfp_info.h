@@ -25,9 +25,11 @@ void hfp_info_destroy(struct hfp_info *info);
 int hfp_info_running(struct hfp_info *info);
 
 /* Starts the hfp_info to transmit and reveice samples to and from the file
- * descriptor of a SCO socket.
+ * descriptor of a SCO socket.  The socket is serviced by the given audio
+ * thread, which is the thread of the iodev that opened the connection.
  */
-int hfp_info_start(int fd, struct hfp_info *info);
+int hfp_info_start(int fd, struct audio_thread *thread,
+		   struct hfp_info *info);
 
 /* Stops given hfp_info. This implies sample transmission will
  * stop and socket be closed.
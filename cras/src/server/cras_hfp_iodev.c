@@ -67,7 +67,7 @@ static int open_dev(struct cras_iodev *iodev)
 		goto error;
 
 	/* Start hfp_info */
-	err = hfp_info_start(sk, hfpio->info);
+	err = hfp_info_start(sk, iodev->thread, hfpio->info);
 	if (err)
 		goto error;
 
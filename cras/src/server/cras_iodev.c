@@ -15,8 +15,14 @@
 #include "cras_system_state.h"
 #include "cras_util.h"
 #include "audio_thread.h"
+#include "rate_estimator.h"
 #include "utlist.h"
 
+/* The rate of a device is measured over this long, drift changes slowly. */
+static const struct timespec rate_estimation_window = { 5, 0 };
+/* Weight of the rate measured in a window in the estimate. */
+static const double rate_estimation_smooth_factor = 0.3;
+
 static void cras_iodev_alloc_dsp(struct cras_iodev *iodev);
 
 /*
@@ -77,6 +83,28 @@ static size_t get_best_channel_count(struct cras_iodev *iodev, size_t count)
 	return iodev->supported_channel_counts[0];
 }
 
+/* Finds the best sample format for the device: the requested one if the
+ * device can play it, S16_LE if the device supports that, or else the format
+ * it prefers.  Capture stays in S16_LE, the format of the capture DSP. */
+static snd_pcm_format_t get_best_pcm_format(struct cras_iodev *iodev,
+					    snd_pcm_format_t fmt)
+{
+	size_t i;
+
+	if (iodev->direction == CRAS_STREAM_INPUT ||
+	    !iodev->supported_formats || iodev->supported_formats[0] == 0)
+		return SND_PCM_FORMAT_S16_LE;
+
+	for (i = 0; iodev->supported_formats[i] != 0; i++)
+		if (iodev->supported_formats[i] == fmt)
+			return fmt;
+	for (i = 0; iodev->supported_formats[i] != 0; i++)
+		if (iodev->supported_formats[i] == SND_PCM_FORMAT_S16_LE)
+			return SND_PCM_FORMAT_S16_LE;
+
+	return iodev->supported_formats[0];
+}
+
 int cras_iodev_set_format(struct cras_iodev *iodev,
 			  struct cras_audio_format *fmt)
 {
@@ -110,8 +138,8 @@ int cras_iodev_set_format(struct cras_iodev *iodev,
 		}
 		iodev->format->frame_rate = actual_rate;
 		iodev->format->num_channels = actual_num_channels;
-		/* TODO(dgreid) - allow other formats. */
-		iodev->format->format = SND_PCM_FORMAT_S16_LE;
+		iodev->format->format = get_best_pcm_format(iodev,
+							    fmt->format);
 
 		if (iodev->update_channel_layout) {
 			rc = iodev->update_channel_layout(iodev);
@@ -127,6 +155,14 @@ int cras_iodev_set_format(struct cras_iodev *iodev,
 			}
 		}
 		cras_iodev_alloc_dsp(iodev);
+		iodev->rate_est = rate_estimator_create(
+				iodev->format->frame_rate,
+				&rate_estimation_window,
+				rate_estimation_smooth_factor);
+		if (!iodev->rate_est) {
+			rc = -ENOMEM;
+			goto error;
+		}
 	}
 
 	*fmt = *(iodev->format);
@@ -154,6 +190,10 @@ void cras_iodev_free_format(struct cras_iodev *iodev)
 		free(iodev->format);
 		iodev->format = NULL;
 	}
+	if (iodev->rate_est) {
+		rate_estimator_destroy(iodev->rate_est);
+		iodev->rate_est = NULL;
+	}
 }
 
 static void cras_iodev_alloc_dsp(struct cras_iodev *iodev)
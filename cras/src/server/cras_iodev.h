@@ -22,6 +22,7 @@ struct cras_rstream;
 struct cras_audio_format;
 struct audio_thread;
 struct cras_iodev;
+struct rate_estimator;
 
 /* Holds an output/input node for this device.  An ionode is a control that
  * can be switched on and off such as headphones or speakers.
@@ -75,6 +76,8 @@ struct cras_ionode {
  * direction - Input or Output.
  * supported_rates - Array of sample rates supported by device 0-terminated.
  * supported_channel_counts - List of number of channels supported by device.
+ * supported_formats - List of sample formats supported by device, in order of
+ *     preference, 0 terminated.  S16_LE is used if NULL.
  * buffer_size - Size of the audio buffer in frames.
  * used_size - Number of frames that are used for audio.
  * cb_threshold - Level below which to call back to the client (in frames).
@@ -85,6 +88,9 @@ struct cras_ionode {
  * software_volume_needed - True if volume control is not supported by hardware.
  * software_volume_scaler - The scaler used for software volume mixing. Should
  *     be 1.0 by default.
+ * rate_est - Estimates the actual rate of the device while a format is set.
+ * compensate_drift - True if the clock of the device isn't the one of the
+ *     system, the streams are resampled to follow its estimated rate.
  */
 struct cras_iodev {
 	void (*set_volume)(struct cras_iodev *iodev);
@@ -112,6 +118,7 @@ struct cras_iodev {
 	enum CRAS_STREAM_DIRECTION direction;
 	size_t *supported_rates;
 	size_t *supported_channel_counts;
+	snd_pcm_format_t *supported_formats;
 	snd_pcm_uframes_t buffer_size;
 	snd_pcm_uframes_t used_size;
 	snd_pcm_uframes_t cb_threshold;
@@ -122,6 +129,8 @@ struct cras_iodev {
 	int software_volume_needed;
 	struct cras_iodev *prev, *next;
 	float software_volume_scaler;
+	struct rate_estimator *rate_est;
+	int compensate_drift;
 };
 
 /*
@@ -3,6 +3,8 @@
  * found in the LICENSE file.
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 
 #include "audio_thread.h"
@@ -46,8 +48,6 @@ static struct cras_alert *active_node_changed_alert;
 /* Call when the volume of a node changes. */
 static node_volume_callback_t node_volume_callback;
 static node_volume_callback_t node_input_gain_callback;
-/* Thread that handles audio input and output. */
-static struct audio_thread *audio_thread;
 
 static void nodes_changed_prepare(struct cras_alert *alert);
 static void active_node_changed_prepare(struct cras_alert *alert);
@@ -303,8 +303,6 @@ void cras_iodev_list_init()
 	nodes_changed_alert = cras_alert_create(nodes_changed_prepare);
 	active_node_changed_alert = cras_alert_create(
 		active_node_changed_prepare);
-	audio_thread = audio_thread_create();
-	audio_thread_start(audio_thread);
 }
 
 void cras_iodev_list_deinit()
@@ -317,7 +315,6 @@ void cras_iodev_list_deinit()
 	cras_alert_destroy(active_node_changed_alert);
 	nodes_changed_alert = NULL;
 	active_node_changed_alert = NULL;
-	audio_thread_destroy(audio_thread);
 }
 
 /* Finds the current device for a stream of "type", only default streams are
@@ -351,6 +348,36 @@ int cras_get_iodev_for_stream_type(enum CRAS_STREAM_TYPE type,
 	return 0;
 }
 
+/* Removes all streams of the given direction from the threads of the active
+ * devices.  Unified streams are attached to the threads of both the active
+ * input and output so they are removed from both.
+ */
+static void remove_active_streams(enum CRAS_STREAM_DIRECTION dir)
+{
+	if (active_output)
+		audio_thread_remove_streams(active_output->thread, dir);
+	if (active_input)
+		audio_thread_remove_streams(active_input->thread, dir);
+}
+
+/* Moves the loopback device to the thread of the given output, the loopback
+ * captures what that thread mixes.
+ */
+static void move_loopback_dev(struct cras_iodev *output)
+{
+	if (!loopback_dev)
+		return;
+
+	if (loopback_dev->thread) {
+		audio_thread_remove_streams(loopback_dev->thread,
+					    loopback_dev->direction);
+		audio_thread_rm_loopback_device(loopback_dev->thread,
+						loopback_dev);
+	}
+	if (output)
+		audio_thread_add_loopback_device(output->thread, loopback_dev);
+}
+
 static struct cras_iodev *cras_iodev_set_active(
 		enum CRAS_STREAM_DIRECTION dir,
 		struct cras_iodev *new_active)
@@ -363,23 +390,51 @@ static struct cras_iodev *cras_iodev_set_active(
 
 	cras_iodev_list_notify_active_node_changed();
 
-	audio_thread_remove_streams(audio_thread, dir);
+	remove_active_streams(dir);
 
-	if (dir == CRAS_STREAM_OUTPUT) {
-		curr = &active_output;
-		audio_thread_set_output_dev(audio_thread, new_active);
-	} else {
-		curr = &active_input;
-		audio_thread_set_input_dev(audio_thread, new_active);
-	}
+	curr = (dir == CRAS_STREAM_OUTPUT) ? &active_output : &active_input;
 
 	/* Set current active to the newly requested device. */
 	old_active = *curr;
 	*curr = new_active;
 
+	if (dir == CRAS_STREAM_OUTPUT && old_active != new_active)
+		move_loopback_dev(new_active);
+
 	return old_active;
 }
 
+/* Creates and starts the audio thread that will service dev. */
+static int start_dev_thread(struct cras_iodev *dev)
+{
+	struct audio_thread *thread;
+	int rc;
+
+	thread = audio_thread_create();
+	if (!thread)
+		return -ENOMEM;
+
+	if (dev->direction == CRAS_STREAM_OUTPUT)
+		audio_thread_set_output_dev(thread, dev);
+	else
+		audio_thread_set_input_dev(thread, dev);
+
+	rc = audio_thread_start(thread);
+	if (rc) {
+		audio_thread_destroy(thread);
+		return -rc;
+	}
+
+	return 0;
+}
+
+/* Stops the audio thread servicing dev, the device must be idle. */
+static void stop_dev_thread(struct cras_iodev *dev)
+{
+	if (dev->thread)
+		audio_thread_destroy(dev->thread);
+}
+
 int cras_iodev_list_add_output(struct cras_iodev *output)
 {
 	int rc;
@@ -391,9 +446,16 @@ int cras_iodev_list_add_output(struct cras_iodev *output)
 	if (rc)
 		return rc;
 
+	rc = start_dev_thread(output);
+	if (rc) {
+		rm_dev_from_list(&outputs, output);
+		cras_iodev_list_update_device_list();
+		return rc;
+	}
+
 	if (!active_output) {
 		active_output = output;
-		audio_thread_set_output_dev(audio_thread, output);
+		move_loopback_dev(output);
 	}
 	if (!default_output)
 		default_output = output;
@@ -407,7 +469,7 @@ int cras_iodev_list_add_input(struct cras_iodev *input)
 
 	if (input->direction == CRAS_STREAM_POST_MIX_PRE_DSP) {
 		loopback_dev = input;
-		audio_thread_add_loopback_device(audio_thread, input);
+		move_loopback_dev(active_output);
 		return 0;
 	}
 
@@ -418,10 +480,15 @@ int cras_iodev_list_add_input(struct cras_iodev *input)
 	if (rc)
 		return rc;
 
-	if (!active_input) {
-		active_input = input;
-		audio_thread_set_input_dev(audio_thread, input);
+	rc = start_dev_thread(input);
+	if (rc) {
+		rm_dev_from_list(&inputs, input);
+		cras_iodev_list_update_device_list();
+		return rc;
 	}
+
+	if (!active_input)
+		active_input = input;
 	if (!default_input)
 		default_input = input;
 
@@ -439,8 +506,10 @@ int cras_iodev_list_rm_output(struct cras_iodev *dev)
 		cras_iodev_set_active(CRAS_STREAM_OUTPUT, default_output);
 
 	res = rm_dev_from_list(&outputs, dev);
-	if (res == 0)
+	if (res == 0) {
+		stop_dev_thread(dev);
 		cras_iodev_list_update_device_list();
+	}
 	return res;
 }
 
@@ -455,11 +524,237 @@ int cras_iodev_list_rm_input(struct cras_iodev *dev)
 		cras_iodev_set_active(CRAS_STREAM_INPUT, default_input);
 
 	res = rm_dev_from_list(&inputs, dev);
-	if (res == 0)
+	if (res == 0) {
+		stop_dev_thread(dev);
 		cras_iodev_list_update_device_list();
+	}
 	return res;
 }
 
+struct add_stream_request;
+
+/* Data of the completion of the thread at idx of a request. */
+struct add_stream_part {
+	struct add_stream_request *req;
+	unsigned int idx;
+};
+
+/* A stream being attached to the threads of its devices, the output's first.
+ *    stream - The stream to attach.
+ *    parts - Handed to each thread as the data of its completion.
+ *    threads - The threads attaching the stream.
+ *    rcs - Result of each thread.
+ *    num_threads - Number of threads attaching the stream.
+ *    pending - Number of threads that haven't completed yet, then that
+ *        haven't dropped the stream again after another one failed.
+ *    rc - The first error of a thread, passed to cb.
+ *    cb - Called once all of them have.
+ *    cb_data - Passed to cb.
+ */
+struct add_stream_request {
+	struct cras_rstream *stream;
+	struct add_stream_part parts[2];
+	struct audio_thread *threads[2];
+	int rcs[2];
+	unsigned int num_threads;
+	unsigned int pending;
+	int rc;
+	void (*cb)(void *data, int rc);
+	void *cb_data;
+};
+
+static void add_stream_detached(void *data, int rc)
+{
+	struct add_stream_request *req = (struct add_stream_request *)data;
+
+	if (--req->pending)
+		return;
+	req->cb(req->cb_data, req->rc);
+	free(req);
+}
+
+/* Called once every thread completed.  If one failed, the threads that took
+ * the stream drop it again before cb is called.  This runs from a completion,
+ * so they are only queued to. */
+static void add_stream_finish(struct add_stream_request *req)
+{
+	unsigned int i;
+
+	for (i = 0; i < req->num_threads; i++)
+		if (req->rcs[i] < 0) {
+			req->rc = req->rcs[i];
+			break;
+		}
+
+	/* Hold a count while queueing, as when adding. */
+	req->pending = 1;
+	if (req->rc < 0)
+		for (i = 0; i < req->num_threads; i++)
+			if (req->rcs[i] >= 0 &&
+			    audio_thread_rm_stream_async(req->threads[i],
+							 req->stream,
+							 add_stream_detached,
+							 req) == 0)
+				req->pending++;
+	add_stream_detached(req, 0);
+}
+
+static void add_stream_done(void *data, int rc)
+{
+	struct add_stream_part *part = (struct add_stream_part *)data;
+	struct add_stream_request *req = part->req;
+
+	req->rcs[part->idx] = rc;
+	if (--req->pending)
+		return;
+	add_stream_finish(req);
+}
+
+int cras_iodev_list_add_stream_async(struct cras_rstream *stream,
+				     struct cras_iodev *idev,
+				     struct cras_iodev *odev,
+				     void (*cb)(void *data, int rc),
+				     void *cb_data)
+{
+	struct add_stream_request *req;
+	unsigned int i, queued = 0;
+	int rc = 0;
+
+	if ((odev && !odev->thread) || (idev && !idev->thread))
+		return -ENOMEM;
+
+	req = (struct add_stream_request *)calloc(1, sizeof(*req));
+	if (!req)
+		return -ENOMEM;
+	req->stream = stream;
+	req->cb = cb;
+	req->cb_data = cb_data;
+
+	if (odev)
+		req->threads[req->num_threads++] = odev->thread;
+	if (idev && (!odev || idev->thread != odev->thread))
+		req->threads[req->num_threads++] = idev->thread;
+
+	if (req->num_threads == 0) {
+		free(req);
+		cb(cb_data, 0);
+		return 0;
+	}
+
+	/* Hold a count while queueing so a failure doesn't complete early. */
+	req->pending = req->num_threads + 1;
+	for (i = 0; i < req->num_threads; i++) {
+		req->parts[i].req = req;
+		req->parts[i].idx = i;
+		rc = audio_thread_add_stream_async(req->threads[i], stream,
+						   add_stream_done,
+						   &req->parts[i]);
+		if (rc < 0) {
+			req->rcs[i] = rc;
+			req->pending--;
+		} else {
+			queued++;
+		}
+	}
+
+	/* cb isn't called if nothing could be queued. */
+	if (!queued) {
+		free(req);
+		return rc;
+	}
+
+	if (--req->pending == 0)
+		add_stream_finish(req);
+	return 0;
+}
+
+void cras_iodev_list_rm_stream(struct cras_rstream *stream)
+{
+	struct cras_iodev *idev, *odev;
+
+	if (cras_get_iodev_for_stream_type(stream->stream_type,
+					   stream->direction, &idev, &odev))
+		return;
+
+	if (odev && odev->thread)
+		audio_thread_rm_stream(odev->thread, stream);
+	if (idev && idev->thread && (!odev || idev->thread != odev->thread))
+		audio_thread_rm_stream(idev->thread, stream);
+}
+
+/* A stream being removed from the threads of its devices.
+ *    pending - Number of threads that haven't removed the stream yet.
+ *    cb - Called once all of them have.
+ *    cb_data - Passed to cb.
+ */
+struct rm_stream_request {
+	unsigned int pending;
+	void (*cb)(void *data, int rc);
+	void *cb_data;
+};
+
+static void rm_stream_done(void *data, int rc)
+{
+	struct rm_stream_request *req = (struct rm_stream_request *)data;
+
+	if (--req->pending)
+		return;
+	req->cb(req->cb_data, 0);
+	free(req);
+}
+
+int cras_iodev_list_rm_stream_async(struct cras_rstream *stream,
+				    void (*cb)(void *data, int rc),
+				    void *cb_data)
+{
+	struct cras_iodev *idev, *odev;
+	struct audio_thread *threads[2];
+	struct rm_stream_request *req;
+	unsigned int i, num_threads = 0;
+
+	if (cras_get_iodev_for_stream_type(stream->stream_type,
+					   stream->direction, &idev, &odev))
+		return -EINVAL;
+
+	if (odev && odev->thread)
+		threads[num_threads++] = odev->thread;
+	if (idev && idev->thread && (!odev || idev->thread != odev->thread))
+		threads[num_threads++] = idev->thread;
+
+	if (num_threads == 0) {
+		cb(cb_data, 0);
+		return 0;
+	}
+
+	req = (struct rm_stream_request *)malloc(sizeof(*req));
+	if (!req)
+		return -ENOMEM;
+	/* Hold a count while queueing so a failure doesn't complete early. */
+	req->pending = num_threads + 1;
+	req->cb = cb;
+	req->cb_data = cb_data;
+
+	for (i = 0; i < num_threads; i++)
+		if (audio_thread_rm_stream_async(threads[i], stream,
+						 rm_stream_done, req))
+			req->pending--;
+
+	rm_stream_done(req, 0);
+	return 0;
+}
+
+void cras_iodev_list_dump_thread_info(struct audio_debug_info *info)
+{
+	memset(info, 0, sizeof(*info));
+
+	/* The output thread is dumped last so its log is the one kept, it
+	 * also services the loopback device. */
+	if (active_input && active_input->thread)
+		audio_thread_dump_thread_info(active_input->thread, info);
+	if (active_output && active_output->thread)
+		audio_thread_dump_thread_info(active_output->thread, info);
+}
+
 int cras_iodev_list_get_outputs(struct cras_iodev_info **list_out)
 {
 	return get_dev_list(&outputs, list_out);
@@ -655,11 +950,6 @@ void cras_iodev_list_notify_node_capture_gain(struct cras_ionode *node)
 		node_input_gain_callback(id, node->capture_gain);
 }
 
-struct audio_thread *cras_iodev_list_get_audio_thread()
-{
-	return audio_thread;
-}
-
 void cras_iodev_list_reset()
 {
 	active_output = NULL;
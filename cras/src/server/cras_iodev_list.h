@@ -20,6 +20,7 @@ struct cras_ionode;
 struct cras_rclient;
 struct cras_rstream;
 struct cras_audio_format;
+struct audio_debug_info;
 
 typedef void (*node_volume_callback_t)(cras_node_id_t, int);
 
@@ -189,8 +190,46 @@ void cras_iodev_list_notify_node_volume(struct cras_ionode *node);
 /* Notify the current capture gain of the given node. */
 void cras_iodev_list_notify_node_capture_gain(struct cras_ionode *node);
 
-/* Gets the audio thread used by the devices. */
-struct audio_thread *cras_iodev_list_get_audio_thread();
+/* Queues attaching a stream to the audio threads of its devices without
+ * waiting for them.  A unified stream is attached to the threads of both the
+ * input and the output.  If one of them fails, the stream is detached from the
+ * others before cb is called.
+ * Args:
+ *    stream - The stream to attach.
+ *    idev - The input device the stream captures from, NULL for none.
+ *    odev - The output device the stream plays to, NULL for none.
+ *    cb - Called on the main thread with 0 once all threads attached the
+ *        stream, or with one of the AUDIO_THREAD_* errors if a device failed
+ *        to open, the output's first.
+ *    cb_data - Passed to cb.
+ * Returns:
+ *    0 if the attach was queued or done, cb is called then.  -ENOMEM if a
+ *    device has no thread, negative error code if it couldn't be queued.
+ */
+int cras_iodev_list_add_stream_async(struct cras_rstream *stream,
+				     struct cras_iodev *idev,
+				     struct cras_iodev *odev,
+				     void (*cb)(void *data, int rc),
+				     void *cb_data);
+
+/* Detaches a stream from the audio threads of its devices. */
+void cras_iodev_list_rm_stream(struct cras_rstream *stream);
+
+/* Queues detaching a stream from the audio threads of its devices without
+ * waiting for them.  The stream must stay valid until cb is called.
+ * Args:
+ *    stream - The stream to detach.
+ *    cb - Called on the main thread once all threads dropped the stream.
+ *    cb_data - Passed to cb.
+ * Returns:
+ *    0 if the removal was queued or done, negative error code otherwise.
+ */
+int cras_iodev_list_rm_stream_async(struct cras_rstream *stream,
+				    void (*cb)(void *data, int rc),
+				    void *cb_data);
+
+/* Fills debug info from the threads of the active input and output. */
+void cras_iodev_list_dump_thread_info(struct audio_debug_info *info);
 
 /* For unit test only. */
 void cras_iodev_list_reset();
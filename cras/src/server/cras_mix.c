@@ -3,68 +3,624 @@
  * found in the LICENSE file.
  */
 
+#include <errno.h>
 #include <stdint.h>
 
+#include "cras_audio_format.h"
+#include "cras_cpu.h"
 #include "cras_shm.h"
+#include "cras_mix.h"
 #include "cras_system_state.h"
 
 #define MAX_VOLUME_TO_SCALE 0.9999999
 #define MIN_VOLUME_TO_SCALE 0.0000001
 
-/* Adds src into dst, after scaling by vol.
- * Just hard limits to the min and max S16 value, can be improved later. */
-static void scale_add_clip(int16_t *dst,
-			   const int16_t *src,
-			   size_t count,
-			   float vol)
+/* Scale from int16 samples to the [-1.0, 1.0) range of the mix. */
+#define S16_TO_FLOAT (1.0f / 32768.0f)
+/* Same for int32 samples, S24 ones are shifted up to use it too. */
+#define S32_TO_FLOAT (1.0f / 2147483648.0f)
+
+/* Adds src into dst, after scaling by gain.  The mix is float, it isn't
+ * clipped until it's rendered for the device. */
+static void add_scaled_c(float *dst,
+			 const int16_t *src,
+			 size_t count,
+			 float gain)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] += src[i] * gain;
+}
+
+/* Puts src scaled by gain in dst. */
+static void copy_scaled_c(float *dst,
+			  const int16_t *src,
+			  size_t count,
+			  float gain)
 {
-	int32_t sum;
 	size_t i;
 
-	for (i = 0; i < count; i++) {
-		sum = dst[i] + (int16_t)(src[i] * vol);
-		if (sum > 0x7fff)
-			sum = 0x7fff;
-		else if (sum < -0x8000)
-			sum = -0x8000;
-		dst[i] = sum;
+	for (i = 0; i < count; i++)
+		dst[i] = src[i] * gain;
+}
+
+/* Clips a scaled sample to the int16 range and rounds it to the nearest
+ * sample. */
+static inline int16_t s16_sample(float f)
+{
+	if (f > 32767.0f)
+		f = 32767.0f;
+	else if (f < -32768.0f)
+		f = -32768.0f;
+	f += (f > 0) ? 0.5f : -0.5f;
+	return (int16_t)f;
+}
+
+/* Scales the mix by 'scale', clips it to the int16 range and rounds it to the
+ * nearest sample. */
+static void to_s16_c(int16_t *dst, const float *src, size_t count,
+		     float scale)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = s16_sample(src[i] * scale);
+}
+
+/* Same as to_s16_c for a stereo mix in two planes, interleaving the samples
+ * as they are written. */
+static void to_s16_stereo_c(int16_t *dst, const float *left,
+			    const float *right, size_t frames, float scale)
+{
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		dst[2 * i] = s16_sample(left[i] * scale);
+		dst[2 * i + 1] = s16_sample(right[i] * scale);
 	}
 }
 
-/* Adds the first stream to the mix.  Don't need to mix, just setup to the new
- * values. If volume is 1.0, just memcpy. */
-static void copy_scaled(int16_t *dst,
-			const int16_t *src,
-			size_t count,
-			float volume_scaler)
+/* The SIMD versions below match the C code bit for bit: they do the same
+ * single precision operations in the same order, the rounding adds half a
+ * step away from zero and truncates like the C conversion.  What doesn't
+ * fill a vector is left to the C code. */
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+static void add_scaled_neon(float *dst,
+			    const int16_t *src,
+			    size_t count,
+			    float gain)
 {
-	int i;
+	float32x4_t g = vdupq_n_f32(gain);
+	size_t i;
 
-	if (volume_scaler > MAX_VOLUME_TO_SCALE) {
-		memcpy(dst, src, count * sizeof(*src));
-		return;
+	for (i = 0; i + 8 <= count; i += 8) {
+		int16x8_t s = vld1q_s16(src + i);
+		float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(s)));
+		float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(s)));
+
+		lo = vaddq_f32(vld1q_f32(dst + i), vmulq_f32(lo, g));
+		hi = vaddq_f32(vld1q_f32(dst + i + 4), vmulq_f32(hi, g));
+		vst1q_f32(dst + i, lo);
+		vst1q_f32(dst + i + 4, hi);
+	}
+	add_scaled_c(dst + i, src + i, count - i, gain);
+}
+
+static void copy_scaled_neon(float *dst,
+			     const int16_t *src,
+			     size_t count,
+			     float gain)
+{
+	float32x4_t g = vdupq_n_f32(gain);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		int16x8_t s = vld1q_s16(src + i);
+		float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(s)));
+		float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(s)));
+
+		vst1q_f32(dst + i, vmulq_f32(lo, g));
+		vst1q_f32(dst + i + 4, vmulq_f32(hi, g));
+	}
+	copy_scaled_c(dst + i, src + i, count - i, gain);
+}
+
+static inline int32x4_t round_4_neon(float32x4_t f, float32x4_t scale)
+{
+	const uint32x4_t sign = vdupq_n_u32(0x80000000);
+	const uint32x4_t half = vreinterpretq_u32_f32(vdupq_n_f32(0.5f));
+
+	f = vmulq_f32(f, scale);
+	f = vminq_f32(vmaxq_f32(f, vdupq_n_f32(-32768.0f)),
+		      vdupq_n_f32(32767.0f));
+	f = vaddq_f32(f, vreinterpretq_f32_u32(vorrq_u32(
+		vandq_u32(vreinterpretq_u32_f32(f), sign), half)));
+	return vcvtq_s32_f32(f);
+}
+
+static void to_s16_neon(int16_t *dst, const float *src, size_t count,
+			float scale)
+{
+	float32x4_t s = vdupq_n_f32(scale);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		int16x4_t lo = vqmovn_s32(round_4_neon(vld1q_f32(src + i), s));
+		int16x4_t hi = vqmovn_s32(round_4_neon(vld1q_f32(src + i + 4),
+						       s));
+
+		vst1q_s16(dst + i, vcombine_s16(lo, hi));
+	}
+	to_s16_c(dst + i, src + i, count - i, scale);
+}
+
+static void to_s16_stereo_neon(int16_t *dst, const float *left,
+			       const float *right, size_t frames, float scale)
+{
+	float32x4_t s = vdupq_n_f32(scale);
+	int16x4x2_t lr;
+	size_t i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		lr.val[0] = vqmovn_s32(round_4_neon(vld1q_f32(left + i), s));
+		lr.val[1] = vqmovn_s32(round_4_neon(vld1q_f32(right + i), s));
+		vst2_s16(dst + 2 * i, lr);
+	}
+	to_s16_stereo_c(dst + 2 * i, left + i, right + i, frames - i, scale);
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define MIX_X86_SIMD
+
+/* SSE2 has no sign extension from int16, unpack the samples to the high
+ * half and shift them back down instead. */
+__attribute__((target("sse2")))
+static inline void cvt_8_sse2(__m128i s, __m128 *lo, __m128 *hi)
+{
+	*lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+	*hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+}
+
+__attribute__((target("sse2")))
+static void add_scaled_sse2(float *dst,
+			    const int16_t *src,
+			    size_t count,
+			    float gain)
+{
+	__m128 g = _mm_set1_ps(gain);
+	__m128 lo, hi;
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		cvt_8_sse2(_mm_loadu_si128((const __m128i *)(src + i)),
+			   &lo, &hi);
+		lo = _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(lo, g));
+		hi = _mm_add_ps(_mm_loadu_ps(dst + i + 4), _mm_mul_ps(hi, g));
+		_mm_storeu_ps(dst + i, lo);
+		_mm_storeu_ps(dst + i + 4, hi);
+	}
+	add_scaled_c(dst + i, src + i, count - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void copy_scaled_sse2(float *dst,
+			     const int16_t *src,
+			     size_t count,
+			     float gain)
+{
+	__m128 g = _mm_set1_ps(gain);
+	__m128 lo, hi;
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		cvt_8_sse2(_mm_loadu_si128((const __m128i *)(src + i)),
+			   &lo, &hi);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(lo, g));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(hi, g));
+	}
+	copy_scaled_c(dst + i, src + i, count - i, gain);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i round_4_sse2(__m128 f, __m128 scale)
+{
+	const __m128 sign = _mm_set1_ps(-0.0f);
+
+	f = _mm_mul_ps(f, scale);
+	f = _mm_min_ps(_mm_max_ps(f, _mm_set1_ps(-32768.0f)),
+		       _mm_set1_ps(32767.0f));
+	f = _mm_add_ps(f, _mm_or_ps(_mm_and_ps(f, sign), _mm_set1_ps(0.5f)));
+	return _mm_cvttps_epi32(f);
+}
+
+__attribute__((target("sse2")))
+static void to_s16_sse2(int16_t *dst, const float *src, size_t count,
+			float scale)
+{
+	__m128 s = _mm_set1_ps(scale);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m128i lo = round_4_sse2(_mm_loadu_ps(src + i), s);
+		__m128i hi = round_4_sse2(_mm_loadu_ps(src + i + 4), s);
+
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_packs_epi32(lo, hi));
+	}
+	to_s16_c(dst + i, src + i, count - i, scale);
+}
+
+__attribute__((target("sse2")))
+static void to_s16_stereo_sse2(int16_t *dst, const float *left,
+			       const float *right, size_t frames, float scale)
+{
+	__m128 s = _mm_set1_ps(scale);
+	size_t i;
+
+	for (i = 0; i + 4 <= frames; i += 4) {
+		__m128i l = round_4_sse2(_mm_loadu_ps(left + i), s);
+		__m128i r = round_4_sse2(_mm_loadu_ps(right + i), s);
+
+		_mm_storeu_si128((__m128i *)(dst + 2 * i),
+				 _mm_packs_epi32(_mm_unpacklo_epi32(l, r),
+						 _mm_unpackhi_epi32(l, r)));
 	}
+	to_s16_stereo_c(dst + 2 * i, left + i, right + i, frames - i, scale);
+}
+
+__attribute__((target("sse4.1")))
+static inline void cvt_8_sse41(__m128i s, __m128 *lo, __m128 *hi)
+{
+	*lo = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(s));
+	*hi = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(s, 8)));
+}
+
+__attribute__((target("sse4.1")))
+static void add_scaled_sse41(float *dst,
+			     const int16_t *src,
+			     size_t count,
+			     float gain)
+{
+	__m128 g = _mm_set1_ps(gain);
+	__m128 lo, hi;
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		cvt_8_sse41(_mm_loadu_si128((const __m128i *)(src + i)),
+			    &lo, &hi);
+		lo = _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(lo, g));
+		hi = _mm_add_ps(_mm_loadu_ps(dst + i + 4), _mm_mul_ps(hi, g));
+		_mm_storeu_ps(dst + i, lo);
+		_mm_storeu_ps(dst + i + 4, hi);
+	}
+	add_scaled_c(dst + i, src + i, count - i, gain);
+}
+
+__attribute__((target("sse4.1")))
+static void copy_scaled_sse41(float *dst,
+			      const int16_t *src,
+			      size_t count,
+			      float gain)
+{
+	__m128 g = _mm_set1_ps(gain);
+	__m128 lo, hi;
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		cvt_8_sse41(_mm_loadu_si128((const __m128i *)(src + i)),
+			    &lo, &hi);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(lo, g));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(hi, g));
+	}
+	copy_scaled_c(dst + i, src + i, count - i, gain);
+}
+
+__attribute__((target("avx2")))
+static inline void cvt_16_avx2(__m256i s, __m256 *lo, __m256 *hi)
+{
+	*lo = _mm256_cvtepi32_ps(
+		_mm256_cvtepi16_epi32(_mm256_castsi256_si128(s)));
+	*hi = _mm256_cvtepi32_ps(
+		_mm256_cvtepi16_epi32(_mm256_extracti128_si256(s, 1)));
+}
+
+__attribute__((target("avx2")))
+static void add_scaled_avx2(float *dst,
+			    const int16_t *src,
+			    size_t count,
+			    float gain)
+{
+	__m256 g = _mm256_set1_ps(gain);
+	__m256 lo, hi;
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		cvt_16_avx2(_mm256_loadu_si256((const __m256i *)(src + i)),
+			    &lo, &hi);
+		lo = _mm256_add_ps(_mm256_loadu_ps(dst + i),
+				   _mm256_mul_ps(lo, g));
+		hi = _mm256_add_ps(_mm256_loadu_ps(dst + i + 8),
+				   _mm256_mul_ps(hi, g));
+		_mm256_storeu_ps(dst + i, lo);
+		_mm256_storeu_ps(dst + i + 8, hi);
+	}
+	add_scaled_c(dst + i, src + i, count - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void copy_scaled_avx2(float *dst,
+			     const int16_t *src,
+			     size_t count,
+			     float gain)
+{
+	__m256 g = _mm256_set1_ps(gain);
+	__m256 lo, hi;
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		cvt_16_avx2(_mm256_loadu_si256((const __m256i *)(src + i)),
+			    &lo, &hi);
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(lo, g));
+		_mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(hi, g));
+	}
+	copy_scaled_c(dst + i, src + i, count - i, gain);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i round_8_avx2(__m256 f, __m256 scale)
+{
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+
+	f = _mm256_mul_ps(f, scale);
+	f = _mm256_min_ps(_mm256_max_ps(f, _mm256_set1_ps(-32768.0f)),
+			  _mm256_set1_ps(32767.0f));
+	f = _mm256_add_ps(f, _mm256_or_ps(_mm256_and_ps(f, sign),
+					  _mm256_set1_ps(0.5f)));
+	return _mm256_cvttps_epi32(f);
+}
+
+/* The 256 bit pack works within 128 bit lanes, the permute puts the four
+ * 64 bit quarters back in sample order. */
+__attribute__((target("avx2")))
+static void to_s16_avx2(int16_t *dst, const float *src, size_t count,
+			float scale)
+{
+	__m256 s = _mm256_set1_ps(scale);
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		__m256i lo = round_8_avx2(_mm256_loadu_ps(src + i), s);
+		__m256i hi = round_8_avx2(_mm256_loadu_ps(src + i + 8), s);
+
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				    _mm256_permute4x64_epi64(
+					_mm256_packs_epi32(lo, hi), 0xd8));
+	}
+	to_s16_c(dst + i, src + i, count - i, scale);
+}
+
+/* Unpacking and packing both work within 128 bit lanes, each lane ends up
+ * with four whole frames in order, so no permute is needed. */
+__attribute__((target("avx2")))
+static void to_s16_stereo_avx2(int16_t *dst, const float *left,
+			       const float *right, size_t frames, float scale)
+{
+	__m256 s = _mm256_set1_ps(scale);
+	size_t i;
+
+	for (i = 0; i + 8 <= frames; i += 8) {
+		__m256i l = round_8_avx2(_mm256_loadu_ps(left + i), s);
+		__m256i r = round_8_avx2(_mm256_loadu_ps(right + i), s);
+
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i),
+				    _mm256_packs_epi32(
+					_mm256_unpacklo_epi32(l, r),
+					_mm256_unpackhi_epi32(l, r)));
+	}
+	to_s16_stereo_c(dst + 2 * i, left + i, right + i, frames - i, scale);
+}
+#endif
+
+/* Kernels used to mix, the C ones until cras_mix_init picks others. */
+static void (*add_scaled)(float *dst, const int16_t *src, size_t count,
+			  float gain) = add_scaled_c;
+static void (*copy_scaled)(float *dst, const int16_t *src, size_t count,
+			   float gain) = copy_scaled_c;
+static void (*to_s16)(int16_t *dst, const float *src, size_t count,
+		       float scale) = to_s16_c;
+static void (*to_s16_stereo)(int16_t *dst, const float *left,
+			     const float *right, size_t frames,
+			     float scale) = to_s16_stereo_c;
+
+void cras_mix_init(unsigned int cpu_flags)
+{
+	add_scaled = add_scaled_c;
+	copy_scaled = copy_scaled_c;
+	to_s16 = to_s16_c;
+	to_s16_stereo = to_s16_stereo_c;
+
+#if defined(__ARM_NEON__)
+	if (cpu_flags & CRAS_CPU_NEON) {
+		add_scaled = add_scaled_neon;
+		copy_scaled = copy_scaled_neon;
+		to_s16 = to_s16_neon;
+		to_s16_stereo = to_s16_stereo_neon;
+	}
+#elif defined(MIX_X86_SIMD)
+	if (cpu_flags & CRAS_CPU_AVX2) {
+		add_scaled = add_scaled_avx2;
+		copy_scaled = copy_scaled_avx2;
+		to_s16 = to_s16_avx2;
+		to_s16_stereo = to_s16_stereo_avx2;
+	} else if (cpu_flags & CRAS_CPU_SSE4_1) {
+		add_scaled = add_scaled_sse41;
+		copy_scaled = copy_scaled_sse41;
+		to_s16 = to_s16_sse2;
+		to_s16_stereo = to_s16_stereo_sse2;
+	} else if (cpu_flags & CRAS_CPU_SSE2) {
+		add_scaled = add_scaled_sse2;
+		copy_scaled = copy_scaled_sse2;
+		to_s16 = to_s16_sse2;
+		to_s16_stereo = to_s16_stereo_sse2;
+	}
+#endif
+}
+
+/* Kernels for the samples wider than 16 bits.  These formats are rare enough
+ * on the devices that they aren't worth SIMD versions.  S24 samples sit in the
+ * low three bytes of 32 bit words, 'shift' moves them to the top so that they
+ * can be read as S32 ones. */
+static void add_scaled_s32(float *dst, const int32_t *src, size_t count,
+			   float gain, unsigned int shift)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] += (int32_t)((uint32_t)src[i] << shift) * gain;
+}
+
+static void copy_scaled_s32(float *dst, const int32_t *src, size_t count,
+			    float gain, unsigned int shift)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = (int32_t)((uint32_t)src[i] << shift) * gain;
+}
+
+static void add_scaled_float(float *dst, const float *src, size_t count,
+			     float gain)
+{
+	size_t i;
 
 	for (i = 0; i < count; i++)
-		dst[i] = src[i] * volume_scaler;
+		dst[i] += src[i] * gain;
+}
+
+static void copy_scaled_float(float *dst, const float *src, size_t count,
+			      float gain)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = src[i] * gain;
+}
+
+/* Clips a sample scaled to 'max' + 1 and rounds it like s16_sample.  Done in
+ * double, float can't hold the largest S32 sample. */
+static inline int32_t s32_sample(double d, double max)
+{
+	if (d > max)
+		d = max;
+	else if (d < -max - 1.0)
+		d = -max - 1.0;
+	d += (d > 0) ? 0.5 : -0.5;
+	return (int32_t)d;
+}
+
+static inline float float_sample(float f)
+{
+	if (f > 1.0f)
+		f = 1.0f;
+	else if (f < -1.0f)
+		f = -1.0f;
+	return f;
+}
+
+/* Scales the mix to 'bits' wide samples, clips and rounds them like to_s16_c.
+ */
+static void to_s32(int32_t *dst, const float *src, size_t count,
+		   float scaler, unsigned int bits)
+{
+	double scale = scaler * (double)(1U << (bits - 1));
+	double max = (double)(1U << (bits - 1)) - 1.0;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = s32_sample(src[i] * scale, max);
+}
+
+static void to_float(float *dst, const float *src, size_t count,
+		     float scaler)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = float_sample(src[i] * scaler);
+}
+
+/* Mixes num_samples samples of format fmt from src into dst. */
+static int mix_samples(snd_pcm_format_t fmt, float *dst, const uint8_t *src,
+		       size_t num_samples, float gain, int copy)
+{
+	switch (fmt) {
+	case SND_PCM_FORMAT_S16_LE:
+		if (copy)
+			copy_scaled(dst, (const int16_t *)src, num_samples,
+				    gain * S16_TO_FLOAT);
+		else
+			add_scaled(dst, (const int16_t *)src, num_samples,
+				   gain * S16_TO_FLOAT);
+		return 0;
+	case SND_PCM_FORMAT_S24_LE:
+	case SND_PCM_FORMAT_S32_LE:
+		if (copy)
+			copy_scaled_s32(dst, (const int32_t *)src, num_samples,
+					gain * S32_TO_FLOAT,
+					fmt == SND_PCM_FORMAT_S24_LE ? 8 : 0);
+		else
+			add_scaled_s32(dst, (const int32_t *)src, num_samples,
+				       gain * S32_TO_FLOAT,
+				       fmt == SND_PCM_FORMAT_S24_LE ? 8 : 0);
+		return 0;
+	case SND_PCM_FORMAT_FLOAT_LE:
+		if (copy)
+			copy_scaled_float(dst, (const float *)src, num_samples,
+					  gain);
+		else
+			add_scaled_float(dst, (const float *)src, num_samples,
+					 gain);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+int cras_mix_format_supported(snd_pcm_format_t fmt)
+{
+	return fmt == SND_PCM_FORMAT_S16_LE ||
+	       fmt == SND_PCM_FORMAT_S24_LE ||
+	       fmt == SND_PCM_FORMAT_S32_LE ||
+	       fmt == SND_PCM_FORMAT_FLOAT_LE;
 }
 
 /* Renders count frames from shm into dst.  Updates count if anything is
  * written. If it's muted and the only stream zero memory. */
 size_t cras_mix_add_stream(struct cras_audio_shm *shm,
+			   snd_pcm_format_t fmt,
 			   size_t num_channels,
-			   uint8_t *dst,
+			   float *dst,
 			   size_t *count,
 			   size_t *index)
 {
-	int16_t *src;
-	int16_t *target = (int16_t *)dst;
+	uint8_t *src;
+	float *target = dst;
 	size_t fr_written;
 	int fr_in_buf;
 	size_t num_samples;
 	size_t frames = 0;
 	float mix_vol;
 
+	if (!cras_mix_format_supported(fmt))
+		return 0;
+
 	fr_in_buf = cras_shm_get_frames(shm);
 	if (fr_in_buf <= 0)
 		return 0;
@@ -78,23 +634,19 @@ size_t cras_mix_add_stream(struct cras_audio_shm *shm,
 	    mix_vol < MIN_VOLUME_TO_SCALE) {
 		/* Muted, if first then zero fill, otherwise, nop. */
 		if (*index == 0)
-			memset(dst, 0, *count * num_channels * sizeof(*src));
+			memset(dst, 0, *count * num_channels * sizeof(*dst));
 	} else {
 		fr_written = 0;
 		while (fr_written < *count) {
-			src = cras_shm_get_readable_frames(shm, fr_written,
-					&frames);
+			src = (uint8_t *)cras_shm_get_readable_frames(
+					shm, fr_written, &frames);
 			if (frames > *count - fr_written)
 				frames = *count - fr_written;
 			if (frames == 0)
 				break;
 			num_samples = frames * num_channels;
-			if (*index == 0)
-				copy_scaled(target, src, num_samples, mix_vol);
-			else
-				scale_add_clip(target, src,
-					       num_samples,
-					       mix_vol);
+			mix_samples(fmt, target, src, num_samples, mix_vol,
+				    *index == 0);
 			fr_written += frames;
 			target += num_samples;
 		}
@@ -105,9 +657,23 @@ size_t cras_mix_add_stream(struct cras_audio_shm *shm,
 	return *count;
 }
 
-void cras_scale_buffer(int16_t *buffer, unsigned int count, float scaler)
+int cras_mix_add_samples(snd_pcm_format_t fmt, float *dst, const uint8_t *src,
+			 size_t count, float scaler, size_t index)
+{
+	if (!cras_mix_format_supported(fmt))
+		return -EINVAL;
+
+	if (scaler < MIN_VOLUME_TO_SCALE) {
+		if (index == 0)
+			memset(dst, 0, count * sizeof(*dst));
+		return 0;
+	}
+	return mix_samples(fmt, dst, src, count, scaler, index == 0);
+}
+
+void cras_scale_buffer(float *buffer, unsigned int count, float scaler)
 {
-	int i;
+	unsigned int i;
 
 	if (scaler > MAX_VOLUME_TO_SCALE)
 		return;
@@ -116,6 +682,86 @@ void cras_scale_buffer(int16_t *buffer, unsigned int count, float scaler)
 		buffer[i] *= scaler;
 }
 
+void cras_mix_render_s16(int16_t *dst, const float *src, size_t count,
+			 float scaler)
+{
+	to_s16(dst, src, count, scaler * 32768.0f);
+}
+
+int cras_mix_render(snd_pcm_format_t fmt, uint8_t *dst, const float *src,
+		    size_t count, float scaler)
+{
+	switch (fmt) {
+	case SND_PCM_FORMAT_S16_LE:
+		cras_mix_render_s16((int16_t *)dst, src, count, scaler);
+		return 0;
+	case SND_PCM_FORMAT_S24_LE:
+		to_s32((int32_t *)dst, src, count, scaler, 24);
+		return 0;
+	case SND_PCM_FORMAT_S32_LE:
+		to_s32((int32_t *)dst, src, count, scaler, 32);
+		return 0;
+	case SND_PCM_FORMAT_FLOAT_LE:
+		to_float((float *)dst, src, count, scaler);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+int cras_mix_render_planar(snd_pcm_format_t fmt, uint8_t *dst,
+			   const float *const *planes, size_t channels,
+			   size_t frames, float scaler)
+{
+	unsigned int bits = fmt == SND_PCM_FORMAT_S24_LE ? 24 : 32;
+	float s16_scale = scaler * 32768.0f;
+	double scale = scaler * (double)(1U << (bits - 1));
+	double max = (double)(1U << (bits - 1)) - 1.0;
+	size_t c, i;
+
+	/* A single plane is already in device order. */
+	if (channels == 1)
+		return cras_mix_render(fmt, dst, planes[0], frames, scaler);
+
+	/* Each sample is written to its place in the frame as it is
+	 * converted, the interleaving takes no pass of its own.  The frames
+	 * are written in order, a sample from each plane at a time. */
+	switch (fmt) {
+	case SND_PCM_FORMAT_S16_LE: {
+		int16_t *out = (int16_t *)dst;
+
+		if (channels == 2) {
+			to_s16_stereo(out, planes[0], planes[1], frames,
+				      s16_scale);
+			return 0;
+		}
+		for (i = 0; i < frames; i++)
+			for (c = 0; c < channels; c++)
+				*out++ = s16_sample(planes[c][i] * s16_scale);
+		return 0;
+	}
+	case SND_PCM_FORMAT_S24_LE:
+	case SND_PCM_FORMAT_S32_LE: {
+		int32_t *out = (int32_t *)dst;
+
+		for (i = 0; i < frames; i++)
+			for (c = 0; c < channels; c++)
+				*out++ = s32_sample(planes[c][i] * scale, max);
+		return 0;
+	}
+	case SND_PCM_FORMAT_FLOAT_LE: {
+		float *out = (float *)dst;
+
+		for (i = 0; i < frames; i++)
+			for (c = 0; c < channels; c++)
+				*out++ = float_sample(planes[c][i] * scaler);
+		return 0;
+	}
+	default:
+		return -EINVAL;
+	}
+}
+
 size_t cras_mix_mute_buffer(uint8_t *dst,
 			    size_t frame_bytes,
 			    size_t count)
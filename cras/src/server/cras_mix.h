@@ -6,12 +6,29 @@
 #ifndef _CRAS_MIX_H
 #define _CRAS_MIX_H
 
+#include "cras_audio_format.h"
+
 struct cras_audio_shm;
 
+/* Picks the mixing kernels for the CPU features in cpu_flags, a mask of
+ * CRAS_CPU_FLAGS.  The C kernels are used until this is called, or when
+ * cpu_flags is zero.  Not thread safe, call before starting to mix.
+ * Args:
+ *    cpu_flags - SIMD extensions the kernels may use.
+ */
+void cras_mix_init(unsigned int cpu_flags);
+
+/* Returns non-zero if samples of format fmt can be mixed and rendered.  These
+ * are S16_LE, S24_LE, S32_LE and FLOAT_LE. */
+int cras_mix_format_supported(snd_pcm_format_t fmt);
+
 /* Renders count frames from shm into dst.  Updates count if anything is
  * written.  If the system is muted, this will render zeros to the output.
+ * Samples are mixed in float, in the range [-1.0, 1.0), and aren't clipped.
  * Args:
  *    shm - Area to mix samples from.
+ *    fmt - Format of the samples in shm, nothing is mixed if it isn't
+ *        supported.
  *    num_channel - Number of channels in data.
  *    dst - Output buffer.  Add samples to this.
  *    count - The number of samples to render, on return holds the number
@@ -19,11 +36,27 @@ struct cras_audio_shm;
  *    index - The index of the stream.  This will be incremented after mixing.
  */
 size_t cras_mix_add_stream(struct cras_audio_shm *shm,
+			   snd_pcm_format_t fmt,
 			   size_t num_channels,
-			   uint8_t *dst,
+			   float *dst,
 			   size_t *count,
 			   size_t *index);
 
+/* Mixes samples that aren't in shm, like those of a stream converted for the
+ * device, the same way as cras_mix_add_stream.
+ * Args:
+ *    fmt - Format of the samples in src.
+ *    dst - Output buffer.  Add samples to this.
+ *    src - Samples to mix.
+ *    count - The number of samples to mix.
+ *    scaler - Volume of the samples, zero when muted.
+ *    index - The index of the stream, the first one is copied to dst.
+ * Returns:
+ *    0 on success, -EINVAL if fmt isn't supported.
+ */
+int cras_mix_add_samples(snd_pcm_format_t fmt, float *dst, const uint8_t *src,
+			 size_t count, float scaler, size_t index);
+
 /* Scale the given buffer with the provided scaler.
  * Args:
  *    buffer - Buffer of samples to scale.
@@ -31,7 +64,50 @@ size_t cras_mix_add_stream(struct cras_audio_shm *shm,
  *    count - The number of samples to render, on return holds the number
  *        actually mixed.
  */
-void cras_scale_buffer(int16_t *buffer, unsigned int count, float scaler);
+void cras_scale_buffer(float *buffer, unsigned int count, float scaler);
+
+/* Renders mixed samples for an S16 device.  This is where the mix is clipped.
+ * Software volume is applied in the same pass.
+ * Args:
+ *    dst - Buffer of the device to render to.
+ *    src - The mixed samples.
+ *    count - The number of samples to render.
+ *    scaler - Amount to scale samples by, 1.0 to render them as they are.
+ */
+void cras_mix_render_s16(int16_t *dst, const float *src, size_t count,
+			 float scaler);
+
+/* Renders mixed samples for a device using format fmt, clipping them and
+ * applying software volume as cras_mix_render_s16 does.  S24_LE samples are
+ * written in the low bytes of 32 bit words.
+ * Args:
+ *    fmt - The sample format of the device.
+ *    dst - Buffer of the device to render to.
+ *    src - The mixed samples.
+ *    count - The number of samples to render.
+ *    scaler - Amount to scale samples by, 1.0 to render them as they are.
+ * Returns:
+ *    0 on success, -EINVAL if fmt isn't supported.
+ */
+int cras_mix_render(snd_pcm_format_t fmt, uint8_t *dst, const float *src,
+		    size_t count, float scaler);
+
+/* Renders a planar mix, one buffer per channel, to a device using format fmt,
+ * interleaving the samples while they are scaled, clipped and rounded the
+ * same as cras_mix_render does.
+ * Args:
+ *    fmt - The sample format of the device.
+ *    dst - Buffer of the device to render to.
+ *    planes - The mixed samples, frames of them for each channel.
+ *    channels - The number of planes, and of channels in dst.
+ *    frames - The number of frames to render.
+ *    scaler - Amount to scale samples by, 1.0 to render them as they are.
+ * Returns:
+ *    0 on success, -EINVAL if fmt isn't supported.
+ */
+int cras_mix_render_planar(snd_pcm_format_t fmt, uint8_t *dst,
+			   const float *const *planes, size_t channels,
+			   size_t frames, float scaler);
 
 /* Mutes the given buffer.
  * Args:
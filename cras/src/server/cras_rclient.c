@@ -16,41 +16,180 @@
 #include "cras_rclient.h"
 #include "cras_rstream.h"
 #include "cras_system_state.h"
+#include "cras_tm.h"
 #include "cras_types.h"
 #include "cras_util.h"
 #include "utlist.h"
 
 /* An attached client.  This has a list of audio connections and a file
- * descriptor for communication with the client that isn't time critical. */
+ * descriptor for communication with the client that isn't time critical.
+ *    pending - Stream connects waiting for the audio threads. */
 struct cras_rclient {
 	size_t id;
 	int fd; /* Connection for client communication. */
 	struct cras_rstream *streams;
+	struct pending_connect *pending;
 };
 
-/* Handles a message from the client to connect a new stream */
-static int handle_client_stream_connect(struct cras_rclient *client,
-					const struct cras_connect_message *msg,
-					int aud_fd)
+/* A stream connect waiting for the audio threads to attach the stream.  The
+ * client is only told about the stream once they have.
+ *    client - The client connecting the stream, NULL once it is destroyed.
+ *    stream - The stream being attached, NULL once the client disconnected it.
+ *    msg - Copy of the connect message from the client.
+ *    aud_fd - Audio fd sent with the message, the stream closes it once
+ *        created.
+ *    fmt - Format the stream is created with, sent back to the client.
+ *    idev - Input device of the stream, removed if it fails to open.
+ *    odev - Output device of the stream, removed if it fails to open.
+ *    dev_error - The device error the stream failed to attach with, the
+ *        device is removed and the connect retried from the main loop.
+ */
+struct pending_connect {
+	struct cras_rclient *client;
+	struct cras_rstream *stream;
+	struct cras_connect_message msg;
+	int aud_fd;
+	struct cras_audio_format fmt;
+	struct cras_iodev *idev;
+	struct cras_iodev *odev;
+	int dev_error;
+	struct pending_connect *prev, *next;
+};
+
+/* Sends the error code of a failed connect to the client and closes the audio
+ * fd of the stream. */
+static void reply_connect_error(struct cras_rclient *client,
+				const struct cras_connect_message *msg,
+				int aud_fd, int rc)
+{
+	struct cras_client_stream_connected reply;
+
+	cras_fill_client_stream_connected(&reply, rc, msg->stream_id,
+					  msg->format, 0);
+	cras_rclient_send_message(client, &reply.header);
+
+	if (aud_fd >= 0)
+		close(aud_fd);
+}
+
+/* Tells the client about the stream setup and passes it the fds of the
+ * stream. */
+static int send_stream_connected(struct cras_rclient *client,
+				 const struct pending_connect *conn)
+{
+	struct cras_rstream *stream = conn->stream;
+	struct cras_client_stream_connected reply;
+	int fds[CRAS_MAX_SEND_FDS];
+	unsigned int num_fds = 0;
+
+	syslog(LOG_DEBUG, "Send connected for stream %x\n",
+	       conn->msg.stream_id);
+	cras_fill_client_stream_connected(
+			&reply,
+			0, /* No error. */
+			conn->msg.stream_id,
+			conn->fmt,
+			cras_rstream_get_total_shm_size(stream));
+	if (cras_rstream_input_shm_fd(stream) >= 0)
+		fds[num_fds++] = cras_rstream_input_shm_fd(stream);
+	if (cras_rstream_output_shm_fd(stream) >= 0)
+		fds[num_fds++] = cras_rstream_output_shm_fd(stream);
+	/* The eventfds follow the shm fds if the stream is woken via shm. */
+	if (cras_rstream_uses_shm_wakeup(stream)) {
+		fds[num_fds++] = cras_rstream_request_event_fd(stream);
+		fds[num_fds++] = cras_rstream_reply_event_fd(stream);
+	}
+	return cras_send_with_fds(client->fd, &reply, reply.header.length,
+				  fds, num_fds);
+}
+
+static void free_pending_connect(struct pending_connect *conn)
+{
+	if (conn->client)
+		DL_DELETE(conn->client->pending, conn);
+	free(conn);
+}
+
+static int connect_stream(struct pending_connect *conn);
+
+/* Removes the device a stream failed to attach to and connects the stream
+ * again.  Runs from a timer as removing the device destroys its audio thread,
+ * which can't be done from the completion of one of its commands. */
+static void retry_connect(struct cras_timer *timer, void *data)
+{
+	struct pending_connect *conn = (struct pending_connect *)data;
+
+	if (conn->dev_error == AUDIO_THREAD_OUTPUT_DEV_ERROR)
+		cras_iodev_list_rm_output(conn->odev);
+	else
+		cras_iodev_list_rm_input(conn->idev);
+
+	/* Destroyed meanwhile, nobody to connect the stream for. */
+	if (!conn->client) {
+		close(conn->aud_fd);
+		free_pending_connect(conn);
+		return;
+	}
+	connect_stream(conn);
+}
+
+/* Called from the main loop once the audio threads attached the stream of a
+ * connect, or failed to. */
+static void stream_attached(void *data, int rc)
 {
+	struct pending_connect *conn = (struct pending_connect *)data;
+	struct cras_rclient *client = conn->client;
+	struct cras_rstream *stream = conn->stream;
+
+	/* Disconnected meanwhile, the removal frees the stream. */
+	if (!stream) {
+		free_pending_connect(conn);
+		return;
+	}
+
+	if (rc < 0) {
+		syslog(LOG_ERR, "Attach stream failed.\n");
+		DL_DELETE(client->streams, stream);
+		cras_system_state_stream_removed();
+		cras_rstream_destroy(stream);
+		conn->stream = NULL;
+		if ((rc == AUDIO_THREAD_OUTPUT_DEV_ERROR ||
+		     rc == AUDIO_THREAD_INPUT_DEV_ERROR) &&
+		    cras_tm_create_timer(cras_system_state_get_tm(), 0,
+					 retry_connect, conn)) {
+			conn->dev_error = rc;
+			return;
+		}
+		reply_connect_error(client, &conn->msg, conn->aud_fd, rc);
+		free_pending_connect(conn);
+		return;
+	}
+
+	rc = send_stream_connected(client, conn);
+	if (rc < 0) {
+		syslog(LOG_ERR, "Failed to send connected messaged\n");
+		cras_iodev_list_rm_stream(stream);
+		DL_DELETE(client->streams, stream);
+		cras_system_state_stream_removed();
+		reply_connect_error(client, &conn->msg, conn->aud_fd, rc);
+		cras_rstream_destroy(stream);
+	}
+	free_pending_connect(conn);
+}
+
+/* Creates the stream of a connect and queues attaching it to the threads of
+ * its devices, stream_attached replies to the client.  On failure the error
+ * is sent to the client and conn is freed. */
+static int connect_stream(struct pending_connect *conn)
+{
+	struct cras_rclient *client = conn->client;
+	const struct cras_connect_message *msg = &conn->msg;
 	struct cras_rstream *stream = NULL;
 	struct cras_iodev *idev, *odev;
-	struct cras_client_stream_connected reply;
 	struct cras_audio_format fmt;
-	struct audio_thread *thread;
 	int rc;
 	size_t buffer_frames, cb_threshold, min_cb_level;
 
-	/* check the aud_fd is valid. */
-	if (aud_fd < 0) {
-		syslog(LOG_ERR, "Invalid fd in stream connect.\n");
-		rc = -EINVAL;
-		goto reply_err;
-	}
-	/* When full, getting an error is preferable to blocking. */
-	cras_make_fd_nonblocking(aud_fd);
-
-try_again:
 	/* Find the iodev for this new connection and connect to it. */
 	rc = cras_get_iodev_for_stream_type(msg->stream_type,
 					    msg->direction,
@@ -75,6 +214,12 @@ try_again:
 		goto reply_err;
 	}
 
+	/* The audio thread converts output streams as it mixes them, so they
+	 * stay in the format of the client, whatever the device plays.  The
+	 * client writes its samples straight to shm. */
+	if (msg->direction == CRAS_STREAM_OUTPUT)
+		fmt = msg->format;
+
 	/* Scale parameters to the frame rate of the device. */
 	buffer_frames = cras_frames_at_rate(msg->format.frame_rate,
 					    msg->buffer_frames,
@@ -98,6 +243,7 @@ try_again:
 				 cb_threshold,
 				 min_cb_level,
 				 msg->flags,
+				 msg->num_periods,
 				 client,
 				 &stream);
 	if (rc < 0) {
@@ -105,84 +251,99 @@ try_again:
 		goto reply_err;
 	}
 
-	cras_rstream_set_audio_fd(stream, aud_fd);
-
-	/* Now can pass the stream to the thread. */
-	thread = cras_iodev_list_get_audio_thread();
-	if (thread == NULL) {
-		rc = -ENOMEM;
-		goto reply_err;
-	}
+	cras_rstream_set_audio_fd(stream, conn->aud_fd);
 
 	if (odev && idev)
 		cras_iodev_set_format(odev, &fmt);
 
+	conn->stream = stream;
+	conn->fmt = fmt;
+	conn->idev = idev;
+	conn->odev = odev;
+
+	/* Now can pass the stream to the threads of its devices.  It is listed
+	 * right away so that a disconnect can cancel it. */
 	DL_APPEND(client->streams, stream);
-	rc = audio_thread_add_stream(thread, stream);
+	cras_system_state_stream_added();
+	rc = cras_iodev_list_add_stream_async(stream, idev, odev,
+					      stream_attached, conn);
 	if (rc < 0) {
 		syslog(LOG_ERR, "Attach stream failed.\n");
 		DL_DELETE(client->streams, stream);
-		if (rc == AUDIO_THREAD_OUTPUT_DEV_ERROR) {
-			cras_iodev_list_rm_output(odev);
-			goto try_again;
-		} else if (rc == AUDIO_THREAD_INPUT_DEV_ERROR) {
-			cras_iodev_list_rm_input(idev);
-			goto try_again;
-		} else {
-			goto reply_err;
-		}
-	}
-
-	/* Tell client about the stream setup. */
-	syslog(LOG_DEBUG, "Send connected for stream %x\n", msg->stream_id);
-	cras_fill_client_stream_connected(
-			&reply,
-			0, /* No error. */
-			msg->stream_id,
-			fmt,
-			cras_rstream_input_shm_key(stream),
-			cras_rstream_output_shm_key(stream),
-			cras_rstream_get_total_shm_size(stream));
-	rc = cras_rclient_send_message(client, &reply.header);
-	if (rc < 0) {
-		syslog(LOG_ERR, "Failed to send connected messaged\n");
-		audio_thread_rm_stream(thread, stream);
-		DL_DELETE(client->streams, stream);
+		cras_system_state_stream_removed();
+		conn->stream = NULL;
 		goto reply_err;
 	}
 
-	cras_system_state_stream_added();
-
+	/* conn may already be freed if the stream had no thread to attach. */
 	return 0;
 
 reply_err:
-	/* Send the error code to the client. */
-	cras_fill_client_stream_connected(&reply, rc, msg->stream_id,
-					  msg->format, 0, 0, 0);
-	cras_rclient_send_message(client, &reply.header);
-
-	if (aud_fd >= 0)
-		close(aud_fd);
-
+	reply_connect_error(client, msg, conn->aud_fd, rc);
 	if (stream)
 		cras_rstream_destroy(stream);
-
+	free_pending_connect(conn);
 	return rc;
 }
 
-/* Removes the stream from the current device it is being played/captured on and
- * from the list of streams for the client. */
-static int disconnect_client_stream(struct cras_rclient *client,
-				    struct cras_rstream *stream)
+/* Handles a message from the client to connect a new stream */
+static int handle_client_stream_connect(struct cras_rclient *client,
+					const struct cras_connect_message *msg,
+					int aud_fd)
 {
-	struct audio_thread *thread = cras_iodev_list_get_audio_thread();
+	struct pending_connect *conn;
+
+	/* check the aud_fd is valid. */
+	if (aud_fd < 0) {
+		syslog(LOG_ERR, "Invalid fd in stream connect.\n");
+		reply_connect_error(client, msg, aud_fd, -EINVAL);
+		return -EINVAL;
+	}
+	/* When full, getting an error is preferable to blocking. */
+	cras_make_fd_nonblocking(aud_fd);
+
+	conn = (struct pending_connect *)calloc(1, sizeof(*conn));
+	if (!conn) {
+		reply_connect_error(client, msg, aud_fd, -ENOMEM);
+		return -ENOMEM;
+	}
+	conn->client = client;
+	conn->msg = *msg;
+	conn->aud_fd = aud_fd;
+	DL_APPEND(client->pending, conn);
+
+	return connect_stream(conn);
+}
 
-	if (thread)
-		audio_thread_rm_stream(thread, stream);
+/* Frees a stream once no audio thread uses it anymore. */
+static void destroy_detached_stream(void *data, int rc)
+{
+	struct cras_rstream *stream = (struct cras_rstream *)data;
 
 	close(cras_rstream_get_audio_fd(stream));
-	DL_DELETE(client->streams, stream);
 	cras_rstream_destroy(stream);
+}
+
+/* Removes a stream from the client.  The audio threads drop the stream
+ * asynchronously so that a client closing many streams doesn't wait for a
+ * round trip to the threads for each of them. */
+static int disconnect_client_stream(struct cras_rclient *client,
+				    struct cras_rstream *stream)
+{
+	struct pending_connect *conn;
+
+	DL_DELETE(client->streams, stream);
+
+	/* A connect still attaching the stream is told to drop it. */
+	DL_FOREACH(client->pending, conn)
+		if (conn->stream == stream)
+			conn->stream = NULL;
+
+	if (cras_iodev_list_rm_stream_async(stream, destroy_detached_stream,
+					    stream)) {
+		cras_iodev_list_rm_stream(stream);
+		destroy_detached_stream(stream, 0);
+	}
 
 	cras_system_state_stream_removed();
 
@@ -223,8 +384,7 @@ static void dump_audio_thread_info(struct cras_rclient *client)
 
 	cras_fill_client_audio_debug_info_ready(&msg);
 	state = cras_system_state_get_no_lock();
-	audio_thread_dump_thread_info(cras_iodev_list_get_audio_thread(),
-				      &state->audio_debug_info);
+	cras_iodev_list_dump_thread_info(&state->audio_debug_info);
 	cras_rclient_send_message(client, &msg.header);
 }
 
@@ -238,6 +398,7 @@ struct cras_rclient *cras_rclient_create(int fd, size_t id)
 {
 	struct cras_rclient *client;
 	struct cras_client_connected msg;
+	int shm_fd = cras_sys_state_shm_fd();
 
 	client = calloc(1, sizeof(struct cras_rclient));
 	if (!client)
@@ -246,19 +407,27 @@ struct cras_rclient *cras_rclient_create(int fd, size_t id)
 	client->fd = fd;
 	client->id = id;
 
-	cras_fill_client_connected(&msg, client->id, cras_sys_state_shm_key());
-	cras_rclient_send_message(client, &msg.header);
+	cras_fill_client_connected(&msg, client->id);
+	cras_send_with_fds(client->fd, &msg, msg.header.length,
+			   &shm_fd, 1);
 
 	return client;
 }
 
-/* Removes all streams that the client owns and destroys it. */
+/* Removes all streams that the client owns and destroys it.  Connects still
+ * pending are completed without the client. */
 void cras_rclient_destroy(struct cras_rclient *client)
 {
 	struct cras_rstream *stream;
+	struct pending_connect *conn;
+
 	DL_FOREACH(client->streams, stream) {
 		disconnect_client_stream(client, stream);
 	}
+	DL_FOREACH(client->pending, conn) {
+		DL_DELETE(client->pending, conn);
+		conn->client = NULL;
+	}
 	free(client);
 }
 
@@ -2,9 +2,11 @@
  * Use of this source code is governed by a BSD-style license that can be
  * found in the LICENSE file.
  */
+#include <errno.h>
 #include <stdint.h>
-#include <sys/shm.h>
+#include <sys/eventfd.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include "cras_config.h"
 #include "cras_messages.h"
@@ -20,7 +22,6 @@ static int setup_shm(struct cras_rstream *stream,
 		     struct rstream_shm_info *shm_info)
 {
 	size_t used_size, samples_size, total_size, frame_bytes;
-	int loops = 0;
 	const struct cras_audio_format *fmt = &stream->format;
 
 	if (shm->area != NULL) /* already setup */
@@ -29,26 +30,19 @@ static int setup_shm(struct cras_rstream *stream,
 	frame_bytes = snd_pcm_format_physical_width(fmt->format) / 8 *
 			fmt->num_channels;
 	used_size = stream->buffer_frames * frame_bytes;
-	samples_size = used_size * CRAS_NUM_SHM_BUFFERS;
+	shm->config.num_periods = stream->num_periods;
+	samples_size = used_size * cras_shm_num_slots(shm);
 	total_size = sizeof(struct cras_audio_shm_area) + samples_size;
 
-	/* Find an available shm key. */
-	do {
-		shm_info->shm_key = getpid() + stream->stream_id + loops;
-		shm_info->shm_id = shmget(shm_info->shm_key,
-					  total_size,
-					  IPC_CREAT | IPC_EXCL | 0660);
-	} while (shm_info->shm_id < 0 && loops++ < 100);
-	if (shm_info->shm_id < 0) {
-		syslog(LOG_ERR, "shmget");
-		return shm_info->shm_id;
-	}
-
-	/* Attach to shm and clear it. */
-	shm->area = shmat(shm_info->shm_id, NULL, 0);
-	if (shm->area == (void *)-1)
+	/* The area is a new file, it reads as zeros. */
+	shm_info->shm_fd = cras_shm_create("cras_stream", total_size);
+	if (shm_info->shm_fd < 0)
+		return shm_info->shm_fd;
+	shm->area = cras_shm_map(shm_info->shm_fd, total_size, 1);
+	if (shm->area == NULL)
 		return -ENOMEM;
-	memset(shm->area, 0, total_size);
+	shm_info->size = total_size;
+	shm->area->layout_version = CRAS_SHM_LAYOUT_VERSION;
 	cras_shm_set_volume_scaler(shm, 1.0);
 	/* Set up config and copy to shared area. */
 	cras_shm_set_frame_bytes(shm, frame_bytes);
@@ -58,6 +52,18 @@ static int setup_shm(struct cras_rstream *stream,
 	return 0;
 }
 
+/* Releases a shm area from setup_shm(). */
+static void free_shm(struct cras_audio_shm *shm,
+		     struct rstream_shm_info *shm_info)
+{
+	if (shm->area != NULL)
+		cras_shm_unmap(shm->area, shm_info->size);
+	if (shm_info->shm_fd >= 0)
+		close(shm_info->shm_fd);
+	shm->area = NULL;
+	shm_info->shm_fd = -1;
+}
+
 /* Setup the shared memory area used for audio samples. */
 static inline int setup_shm_area(struct cras_rstream *stream)
 {
@@ -77,6 +83,55 @@ static inline int setup_shm_area(struct cras_rstream *stream)
 	return rc;
 }
 
+/* Creates the eventfds of a stream woken through shm.  Non-blocking, an fd is
+ * only read after it polled readable or to clear it. */
+static int setup_wakeup_fds(struct cras_rstream *stream)
+{
+	stream->request_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stream->request_fd < 0)
+		return -errno;
+	stream->reply_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stream->reply_fd < 0) {
+		close(stream->request_fd);
+		stream->request_fd = -1;
+		return -errno;
+	}
+	return 0;
+}
+
+/* The shm area requests and replies go through, the output one if the client
+ * replies to requests. */
+static struct cras_audio_shm *wakeup_shm(const struct cras_rstream *stream)
+{
+	if (stream_uses_output(stream))
+		return (struct cras_audio_shm *)&stream->output_shm;
+	return (struct cras_audio_shm *)&stream->input_shm;
+}
+
+/* Posts frames to the shm area and wakes the client. */
+static int post_shm_request(const struct cras_rstream *stream, size_t frames)
+{
+	uint64_t one = 1;
+
+	cras_shm_post_aud_request(wakeup_shm(stream), frames);
+	if (write(stream->request_fd, &one, sizeof(one)) < 0)
+		return -errno;
+	return 0;
+}
+
+/* Rounds the requested periods of a ring up to a power of two, in the range
+ * the shm supports.  Zero stays a double buffer. */
+static unsigned int ring_num_periods(unsigned int requested)
+{
+	unsigned int num_periods = 2;
+
+	if (requested == 0)
+		return 0;
+	while (num_periods < requested && num_periods < CRAS_SHM_MAX_PERIODS)
+		num_periods *= 2;
+	return num_periods;
+}
+
 static inline int buffer_meets_size_limit(size_t buffer_size, size_t rate)
 {
 	return buffer_size > (CRAS_MIN_BUFFER_TIME_IN_US * rate) / 1000000;
@@ -107,7 +162,8 @@ static int verify_rstream_parameters(enum CRAS_STREAM_DIRECTION direction,
 	if ((format->format != SND_PCM_FORMAT_S16_LE) &&
 	    (format->format != SND_PCM_FORMAT_S32_LE) &&
 	    (format->format != SND_PCM_FORMAT_U8) &&
-	    (format->format != SND_PCM_FORMAT_S24_LE)) {
+	    (format->format != SND_PCM_FORMAT_S24_LE) &&
+	    (format->format != SND_PCM_FORMAT_FLOAT_LE)) {
 		syslog(LOG_ERR, "rstream: format %d not supported\n",
 		       format->format);
 		return -EINVAL;
@@ -140,6 +196,7 @@ int cras_rstream_create(cras_stream_id_t stream_id,
 			size_t cb_threshold,
 			size_t min_cb_level,
 			uint32_t flags,
+			unsigned int num_periods,
 			struct cras_rclient *client,
 			struct cras_rstream **stream_out)
 {
@@ -164,35 +221,41 @@ int cras_rstream_create(cras_stream_id_t stream_id,
 	stream->cb_threshold = cb_threshold;
 	stream->min_cb_level = min_cb_level;
 	stream->flags = flags;
+	stream->num_periods = ring_num_periods(num_periods);
 	stream->client = client;
 	stream->output_shm.area = NULL;
 	stream->input_shm.area = NULL;
+	stream->output_shm_info.shm_fd = -1;
+	stream->input_shm_info.shm_fd = -1;
+	stream->request_fd = -1;
+	stream->reply_fd = -1;
 
 	rc = setup_shm_area(stream);
 	if (rc < 0) {
 		syslog(LOG_ERR, "failed to setup shm %d\n", rc);
-		free(stream);
+		cras_rstream_destroy(stream);
 		return rc;
 	}
 
-	syslog(LOG_DEBUG, "stream %x frames %zu, cb_thresh %zu",
-	       stream_id, buffer_frames, cb_threshold);
+	/* Without the eventfds the stream still works over the socket. */
+	if ((flags & CRAS_STREAM_FLAG_SHM_WAKEUP) && setup_wakeup_fds(stream))
+		syslog(LOG_WARNING, "stream %x: no shm wakeup, using socket",
+		       stream_id);
+
+	syslog(LOG_DEBUG, "stream %x frames %zu, cb_thresh %zu, periods %u",
+	       stream_id, buffer_frames, cb_threshold, stream->num_periods);
 	*stream_out = stream;
 	return 0;
 }
 
 void cras_rstream_destroy(struct cras_rstream *stream)
 {
-	if (stream->input_shm.area != NULL) {
-		shmdt(stream->input_shm.area);
-		shmctl(stream->input_shm_info.shm_id, IPC_RMID,
-		       (void *)stream->input_shm.area);
-	}
-	if (stream->output_shm.area != NULL) {
-		shmdt(stream->output_shm.area);
-		shmctl(stream->output_shm_info.shm_id, IPC_RMID,
-		       (void *)stream->output_shm.area);
-	}
+	free_shm(&stream->input_shm, &stream->input_shm_info);
+	free_shm(&stream->output_shm, &stream->output_shm_info);
+	if (stream->request_fd >= 0)
+		close(stream->request_fd);
+	if (stream->reply_fd >= 0)
+		close(stream->reply_fd);
 	free(stream);
 }
 
@@ -206,6 +269,9 @@ int cras_rstream_request_audio(const struct cras_rstream *stream)
 	if (stream->direction != CRAS_STREAM_OUTPUT)
 		return 0;
 
+	if (cras_rstream_uses_shm_wakeup(stream))
+		return post_shm_request(stream, stream->min_cb_level);
+
 	msg.id = AUDIO_MESSAGE_REQUEST_DATA;
 	msg.frames = stream->min_cb_level;
 	rc = write(stream->fd, &msg, sizeof(msg));
@@ -217,6 +283,9 @@ int cras_rstream_audio_ready(const struct cras_rstream *stream, size_t count)
 	struct audio_message msg;
 	int rc;
 
+	if (cras_rstream_uses_shm_wakeup(stream))
+		return post_shm_request(stream, count);
+
 	msg.id = (stream->direction == CRAS_STREAM_UNIFIED) ?
 		AUDIO_MESSAGE_UNIFIED : AUDIO_MESSAGE_DATA_READY;
 	msg.frames = count;
@@ -229,6 +298,20 @@ int cras_rstream_get_audio_request_reply(const struct cras_rstream *stream)
 	struct audio_message msg;
 	int rc;
 
+	if (cras_rstream_uses_shm_wakeup(stream)) {
+		uint64_t count;
+		int32_t value;
+
+		/* Clear the wake up first, a reply posted after it is
+		 * signaled again. */
+		if (read(stream->reply_fd, &count, sizeof(count)) < 0 &&
+		    errno != EAGAIN)
+			return -EIO;
+		if (!cras_shm_aud_reply_ready(wakeup_shm(stream), &value))
+			return -EAGAIN;
+		return value < 0 ? -EIO : 0;
+	}
+
 	rc = read(stream->fd, &msg, sizeof(msg));
 	if (rc < 0 || msg.error < 0)
 		return -EIO;
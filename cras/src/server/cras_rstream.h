@@ -14,13 +14,13 @@
 
 struct cras_rclient;
 
-/* Holds identifiers for an shm segment.
- *  shm_key - Key shared with client to access shm.
- *  shm_id - Returned from shmget.
+/* Holds identifiers for an shm area.
+ *  shm_fd - The fd of the area, passed to the client to map it.
+ *  size - Size of the area in bytes.
  */
 struct rstream_shm_info {
-	int shm_key;
-	int shm_id;
+	int shm_fd;
+	size_t size;
 };
 
 /* cras_rstream is used to manage an active audio stream from
@@ -36,11 +36,16 @@ struct cras_rstream {
 	size_t cb_threshold; /* Callback client when this much is left. */
 	size_t min_cb_level; /* Don't callback unless this much is avail. */
 	uint32_t flags;
+	unsigned int num_periods; /* Periods of a ring shm, 0 double buffers. */
 	struct cras_rclient *client;
 	struct rstream_shm_info input_shm_info;
 	struct rstream_shm_info output_shm_info;
 	struct cras_audio_shm output_shm;
 	struct cras_audio_shm input_shm;
+	/* eventfd waking the client, -1 unless woken via shm. */
+	int request_fd;
+	/* eventfd the client replies on, -1 unless woken via shm. */
+	int reply_fd;
 	struct cras_rstream *prev, *next;
 	struct cras_audio_format format;
 };
@@ -53,7 +58,10 @@ struct cras_rstream {
  *    buffer_frames - Total number of audio frames to buffer.
  *    cb_threshold - # of frames when to request more from the client.
  *    min_cb_level - Minimum # of frames to request from the client.
- *    flags - Unused.
+ *    flags - CRAS_STREAM_FLAG_* bits.  With CRAS_STREAM_FLAG_SHM_WAKEUP the
+ *      stream is woken through its shm area and eventfds if they can be made.
+ *    num_periods - Zero to double buffer the samples in shm, otherwise the
+ *      periods of buffer_frames in a ring, rounded up to a supported size.
  *    client - The client that owns this stream.
  *    stream_out - Filled with the newly created stream pointer.
  * Returns:
@@ -68,6 +76,7 @@ int cras_rstream_create(cras_stream_id_t stream_id,
 			size_t cb_threshold,
 			size_t min_cb_level,
 			uint32_t flags,
+			unsigned int num_periods,
 			struct cras_rclient *client,
 			struct cras_rstream **stream_out);
 /* Destroys an rstream. */
@@ -136,16 +145,48 @@ static inline int cras_rstream_get_audio_fd(const struct cras_rstream *stream)
 	return stream->fd;
 }
 
-/* Gets the shm key used to find the outputshm region. */
-static inline int cras_rstream_output_shm_key(const struct cras_rstream *stream)
+/* Gets the fd of the output shm region, -1 if the stream has no output. */
+static inline int cras_rstream_output_shm_fd(const struct cras_rstream *stream)
 {
-	return stream->output_shm_info.shm_key;
+	return stream->output_shm_info.shm_fd;
 }
 
-/* Gets the shm key used to find the input shm region. */
-static inline int cras_rstream_input_shm_key(const struct cras_rstream *stream)
+/* Gets the fd of the input shm region, -1 if the stream has no input. */
+static inline int cras_rstream_input_shm_fd(const struct cras_rstream *stream)
 {
-	return stream->input_shm_info.shm_key;
+	return stream->input_shm_info.shm_fd;
+}
+
+/* Gets the eventfd signaled when a request is posted to the shm area, -1 if
+ * the stream isn't woken through shm. */
+static inline int cras_rstream_request_event_fd(
+		const struct cras_rstream *stream)
+{
+	return stream->request_fd;
+}
+
+/* Gets the eventfd the client signals when it posted a reply to the shm area,
+ * -1 if the stream isn't woken through shm. */
+static inline int cras_rstream_reply_event_fd(
+		const struct cras_rstream *stream)
+{
+	return stream->reply_fd;
+}
+
+/* Checks if requests and replies of audio go through the shm area instead of
+ * the audio socket. */
+static inline int cras_rstream_uses_shm_wakeup(
+		const struct cras_rstream *stream)
+{
+	return stream->reply_fd >= 0;
+}
+
+/* Gets the fd that becomes readable when the client replies. */
+static inline int cras_rstream_get_reply_fd(const struct cras_rstream *stream)
+{
+	if (cras_rstream_uses_shm_wakeup(stream))
+		return stream->reply_fd;
+	return stream->fd;
 }
 
 /* Gets the total size of shm memory allocated. */
@@ -159,6 +200,16 @@ static inline size_t cras_rstream_get_total_shm_size(
 	return cras_shm_total_size(&stream->input_shm);
 }
 
+/* Gets the level of the output shm under which more samples are requested
+ * from the client.  A ring is kept all but one period full, so the client can
+ * write that far ahead. */
+static inline size_t cras_rstream_get_fetch_level(
+		const struct cras_rstream *stream)
+{
+	return stream->cb_threshold *
+		(cras_shm_num_periods(&stream->output_shm) - 1);
+}
+
 /* Gets shared memory region for this stream. */
 static inline
 struct cras_audio_shm *cras_rstream_output_shm(struct cras_rstream *stream)
@@ -196,7 +247,11 @@ int cras_rstream_request_audio(const struct cras_rstream *stream);
 
 /* Tells a capture client that count frames are ready. */
 int cras_rstream_audio_ready(const struct cras_rstream *stream, size_t count);
-/* Waits for the response to a request for audio. */
+/* Reads the response to a request for audio.
+ * Returns:
+ *    0 on success, -EAGAIN if a stream woken through shm was woken up for an
+ *    older reply, or -EIO if the client replied with an error.
+ */
 int cras_rstream_get_audio_request_reply(const struct cras_rstream *stream);
 /* Sends a message to the client telling him to re-attach the stream. Used when
  * moving a stream between io devices. */
@@ -6,13 +6,14 @@
 #include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sys/shm.h>
 #include <sys/stat.h>
 #include <syslog.h>
+#include <unistd.h>
 
 #include "cras_alsa_card.h"
 #include "cras_config.h"
 #include "cras_device_blacklist.h"
+#include "cras_shm.h"
 #include "cras_system_state.h"
 #include "cras_tm.h"
 #include "cras_types.h"
@@ -27,8 +28,8 @@ struct card_list {
 /* The system state.
  * Members:
  *    exp_state - The exported system state shared with clients.
- *    shm_key - Key for shm area of system_state struct.
- *    shm_id - Id for shm area of system_state struct.
+ *    shm_fd - The fd of the shm area of system_state struct, sealed so that
+ *      clients can only map it read only.
  *    device_blacklist - Blacklist of device the server will ignore.
  *    volume_alert - Called when the system volume changes.
  *    mute_alert - Called when the system mute state changes.
@@ -43,8 +44,7 @@ struct card_list {
  */
 static struct {
 	struct cras_server_state *exp_state;
-	key_t shm_key;
-	int shm_id;
+	int shm_fd;
 	struct cras_device_blacklist *device_blacklist;
 	struct cras_alert *volume_alert;
 	struct cras_alert *mute_alert;
@@ -69,24 +69,15 @@ static struct {
 void cras_system_state_init()
 {
 	struct cras_server_state *exp_state;
-	unsigned loops = 0;
 	int rc;
 
-	/* Find an available shm key. */
-	do {
-		state.shm_key = getpid() + rand();
-		state.shm_id = shmget(state.shm_key, sizeof(*exp_state),
-				      IPC_CREAT | IPC_EXCL | 0640);
-	} while (state.shm_id < 0 && loops++ < 100);
-	if (state.shm_id < 0) {
-		syslog(LOG_ERR, "Fatal: system state can't shmget");
-		exit(state.shm_id);
-	}
-
-	exp_state = shmat(state.shm_id, NULL, 0);
-	if (exp_state == (void *)-1) {
-		syslog(LOG_ERR, "Fatal: system state can't shmat");
-		exit(-ENOMEM);
+	/* Clients only get to read the state. */
+	state.shm_fd = cras_shm_create_ro("cras_server_state",
+					  sizeof(*exp_state),
+					  (void **)&exp_state);
+	if (state.shm_fd < 0) {
+		syslog(LOG_ERR, "Fatal: system state can't create shm");
+		exit(state.shm_fd);
 	}
 
 	/* Initial system state. */
@@ -138,8 +129,8 @@ void cras_system_state_deinit()
 	cras_tm_deinit(state.tm);
 
 	if (state.exp_state) {
-		shmdt(state.exp_state);
-		shmctl(state.shm_id, IPC_RMID, (void *)state.exp_state);
+		cras_shm_unmap(state.exp_state, sizeof(*state.exp_state));
+		close(state.shm_fd);
 	}
 
 	cras_alert_destroy(state.volume_alert);
@@ -521,9 +512,9 @@ struct cras_server_state *cras_system_state_get_no_lock()
 	return state.exp_state;
 }
 
-key_t cras_sys_state_shm_key()
+int cras_sys_state_shm_fd()
 {
-	return state.shm_key;
+	return state.shm_fd;
 }
 
 struct cras_tm *cras_system_state_get_tm()
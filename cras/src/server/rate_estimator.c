@@ -0,0 +1,168 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "cras_util.h"
+#include "rate_estimator.h"
+
+/* A window measuring a rate further off than this is taken as a glitch, like
+ * an underrun or a stalled device, not as drift of the clock. */
+#define MAX_DRIFT_PPM 5000
+
+/* Sums to fit the frames transferred by the device to a line of time. */
+struct least_square {
+	double sum_x;
+	double sum_y;
+	double sum_xx;
+	double sum_xy;
+	unsigned int num_points;
+};
+
+/* The state of a rate estimator.
+ * nominal_rate - The rate the device was configured for.
+ * window_size - How long to measure a rate over.
+ * smooth_factor - Weight of a new measurement in the estimated rate.
+ * window_start - When the current window started, zero before the first level.
+ * frames - Frames transferred by the device since the window started, as
+ *     known from what was added to the buffer, without the level.
+ * start_level - The level at the start of the window.
+ * lsq - The sums of the current window.
+ * estimated_rate - The smoothed rate of the device.
+ */
+struct rate_estimator {
+	unsigned int nominal_rate;
+	struct timespec window_size;
+	double smooth_factor;
+	struct timespec window_start;
+	int frames;
+	int start_level;
+	struct least_square lsq;
+	double estimated_rate;
+};
+
+static void least_square_reset(struct least_square *lsq)
+{
+	lsq->sum_x = lsq->sum_y = lsq->sum_xx = lsq->sum_xy = 0;
+	lsq->num_points = 0;
+}
+
+static void least_square_add(struct least_square *lsq, double x, double y)
+{
+	lsq->sum_x += x;
+	lsq->sum_y += y;
+	lsq->sum_xx += x * x;
+	lsq->sum_xy += x * y;
+	lsq->num_points++;
+}
+
+/* Slope of the line that fits the points best, 0 if there are too few. */
+static double least_square_slope(const struct least_square *lsq)
+{
+	double n = lsq->num_points;
+	double denom = n * lsq->sum_xx - lsq->sum_x * lsq->sum_x;
+
+	if (lsq->num_points < 2 || denom <= 0)
+		return 0;
+	return (n * lsq->sum_xy - lsq->sum_x * lsq->sum_y) / denom;
+}
+
+static void start_window(struct rate_estimator *re, int level,
+			 const struct timespec *now)
+{
+	re->window_start = *now;
+	re->start_level = level;
+	re->frames = 0;
+	least_square_reset(&re->lsq);
+	least_square_add(&re->lsq, 0, 0);
+}
+
+/*
+ * Exported interface
+ */
+
+struct rate_estimator *rate_estimator_create(unsigned int rate,
+					     const struct timespec *window_size,
+					     double smooth_factor)
+{
+	struct rate_estimator *re;
+
+	re = calloc(1, sizeof(*re));
+	if (re == NULL)
+		return NULL;
+
+	re->window_size = *window_size;
+	re->smooth_factor = smooth_factor;
+	rate_estimator_reset_rate(re, rate);
+
+	return re;
+}
+
+void rate_estimator_destroy(struct rate_estimator *re)
+{
+	free(re);
+}
+
+void rate_estimator_add_frames(struct rate_estimator *re, int fr)
+{
+	re->frames += fr;
+}
+
+int rate_estimator_check(struct rate_estimator *re, int level,
+			 const struct timespec *now)
+{
+	struct timespec elapsed;
+	double slope, max_diff;
+
+	if (re->window_start.tv_sec == 0 && re->window_start.tv_nsec == 0) {
+		start_window(re, level, now);
+		return 0;
+	}
+
+	/* Output devices take frames out of the buffer, input devices put
+	 * them in, either way this counts those transferred. */
+	subtract_timespecs(now, &re->window_start, &elapsed);
+	least_square_add(&re->lsq,
+			 elapsed.tv_sec + elapsed.tv_nsec / 1000000000.0,
+			 abs(re->start_level + re->frames - level));
+
+	if (timespec_after(&re->window_size, &elapsed))
+		return 0;
+
+	slope = least_square_slope(&re->lsq);
+	start_window(re, level, now);
+
+	max_diff = (double)re->nominal_rate * MAX_DRIFT_PPM / 1000000;
+	if (fabs(slope - re->nominal_rate) > max_diff)
+		return 0;
+
+	re->estimated_rate = re->estimated_rate * (1 - re->smooth_factor) +
+			     slope * re->smooth_factor;
+	return 1;
+}
+
+void rate_estimator_reset_rate(struct rate_estimator *re, unsigned int rate)
+{
+	re->nominal_rate = rate;
+	re->estimated_rate = rate;
+	re->window_start.tv_sec = 0;
+	re->window_start.tv_nsec = 0;
+	re->frames = 0;
+	least_square_reset(&re->lsq);
+}
+
+double rate_estimator_get_rate(const struct rate_estimator *re)
+{
+	return re->estimated_rate;
+}
+
+double rate_estimator_get_ppm(const struct rate_estimator *re)
+{
+	if (re->nominal_rate == 0)
+		return 0;
+	return (re->estimated_rate - re->nominal_rate) * 1000000 /
+		re->nominal_rate;
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Estimates the actual rate of an audio device from the frames it plays or
+ * captures against CLOCK_MONOTONIC.  The frames the device has transferred,
+ * known from the level of its buffer and what was written to or read from it,
+ * are fit to a line over a window of time.  The slope of that line is the
+ * rate measured in the window, it is smoothed into the estimated rate.
+ */
+#ifndef RATE_ESTIMATOR_H_
+#define RATE_ESTIMATOR_H_
+
+#include <time.h>
+
+struct rate_estimator;
+
+/* Creates a rate estimator.
+ * Args:
+ *    rate - The nominal rate of the device, the estimate starts from it.
+ *    window_size - The time to measure the rate over.
+ *    smooth_factor - Weight of the rate measured in a window, from 0 to 1,
+ *      the estimate keeps the rest.
+ * Returns:
+ *    The new estimator or NULL if out of memory.
+ */
+struct rate_estimator *rate_estimator_create(unsigned int rate,
+					     const struct timespec *window_size,
+					     double smooth_factor);
+
+/* Destroys a rate estimator. */
+void rate_estimator_destroy(struct rate_estimator *re);
+
+/* Accounts for frames written to the buffer of an output device, or read
+ * from the buffer of an input device as a negative count.
+ * Args:
+ *    re - The rate estimator.
+ *    fr - Frames added to the buffer.
+ */
+void rate_estimator_add_frames(struct rate_estimator *re, int fr);
+
+/* Adds a sample of the buffer level and, once the window is over, updates
+ * the estimated rate.
+ * Args:
+ *    re - The rate estimator.
+ *    level - Frames in the buffer of the device now.
+ *    now - The CLOCK_MONOTONIC time the level was read at.
+ * Returns:
+ *    1 if the estimated rate was updated, 0 otherwise.
+ */
+int rate_estimator_check(struct rate_estimator *re, int level,
+			 const struct timespec *now);
+
+/* Restarts the measurement from the nominal rate, for when the device starts
+ * again or the level jumped, as after an underrun.
+ * Args:
+ *    re - The rate estimator.
+ *    rate - The nominal rate of the device.
+ */
+void rate_estimator_reset_rate(struct rate_estimator *re, unsigned int rate);
+
+/* Returns the estimated rate of the device in frames per second. */
+double rate_estimator_get_rate(const struct rate_estimator *re);
+
+/* Returns how far the estimated rate is from the nominal one, in parts per
+ * million. */
+double rate_estimator_get_ppm(const struct rate_estimator *re);
+
+#endif /* RATE_ESTIMATOR_H_ */
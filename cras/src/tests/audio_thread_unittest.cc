@@ -3,8 +3,12 @@
 // found in the LICENSE file.
 
 #include <stdio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/select.h>
 #include <gtest/gtest.h>
+#include <vector>
 
 extern "C" {
 
@@ -20,20 +24,51 @@ int thread_add_stream(audio_thread* thread,
 int thread_remove_stream(audio_thread* thread,
                          cras_rstream* stream);
 int unified_io(audio_thread* thread, timespec* ts);
+void handle_playback_thread_message(struct audio_thread* thread);
+void audio_thread_done_event(void* data);
+long wake_timer_advance_ns(const struct audio_thread* thread);
+void update_wake_latency(struct audio_thread* thread, long late_ns);
+const struct timespec* coalesce_wake(const struct timespec* sleep_ts,
+                                     const struct timespec* pb_ts);
 
 static int cras_mix_add_stream_dont_fill_next;
 static unsigned int cras_mix_add_stream_count;
+static snd_pcm_format_t cras_mix_add_stream_format;
 static unsigned int cras_mix_mute_count;
+static unsigned int cras_mix_render_called;
+static unsigned int cras_mix_render_planar_called;
+static float cras_mix_render_scaler;
+static snd_pcm_format_t cras_mix_render_format;
+static unsigned int cras_mix_add_samples_called;
+static snd_pcm_format_t cras_mix_add_samples_format;
+static size_t cras_mix_add_samples_count;
+static unsigned int cras_fmt_conv_create_called;
+static struct cras_audio_format cras_fmt_conv_create_in_fmt;
+static struct cras_audio_format cras_fmt_conv_create_out_fmt;
+static size_t cras_fmt_conv_convert_frames_in_frames;
+static size_t cras_fmt_conv_convert_frames_held;
+static struct cras_fmt_conv *fake_conv =
+    reinterpret_cast<struct cras_fmt_conv *>(0x123);
+static unsigned int cras_fmt_conv_create_adjustable_called;
+static unsigned int cras_fmt_conv_destroy_called;
+static double cras_fmt_conv_set_ratio_ratio;
+static struct rate_estimator *fake_rate_est =
+    reinterpret_cast<struct rate_estimator *>(0x456);
+static int rate_estimator_check_return;
+static unsigned int rate_estimator_check_called;
+static int rate_estimator_add_frames_total;
+static double rate_estimator_rate;
 static int cras_rstream_audio_ready_count;
 static unsigned int cras_rstream_request_audio_called;
 static unsigned int cras_rstream_audio_ready_called;
-static int select_return_value;
-static struct timeval select_timeval;
-static int select_max_fd;
-static fd_set select_in_fds;
-static fd_set select_out_fds;
-static size_t *select_write_ptr;
-static size_t select_write_value;
+static int ppoll_called;
+static struct timespec ppoll_timeout;
+static fd_set epoll_registered_fds;
+static void *epoll_registered_data[FD_SETSIZE];
+static fd_set epoll_wait_fds;
+static fd_set epoll_ready_fds;
+static size_t *epoll_write_ptr;
+static size_t epoll_write_value;
 static unsigned int cras_iodev_config_params_for_streams_called;
 static unsigned int cras_iodev_config_params_for_streams_buffer_size;
 static unsigned int cras_iodev_config_params_for_streams_threshold;
@@ -129,6 +164,8 @@ class ReadStreamSuite : public testing::Test {
       *rstream = (struct cras_rstream *)calloc(1, sizeof(**rstream));
       memcpy(&(*rstream)->format, &fmt_, sizeof(fmt_));
       (*rstream)->direction = CRAS_STREAM_INPUT;
+      (*rstream)->request_fd = -1;
+      (*rstream)->reply_fd = -1;
       (*rstream)->cb_threshold = iodev_.cb_threshold;
 
       shm = cras_rstream_input_shm(*rstream);
@@ -715,6 +752,7 @@ class WriteStreamSuite : public testing::Test {
       SetupRstream(&rstream2_, 2);
       shm2_ = cras_rstream_output_shm(rstream2_);
 
+      FD_ZERO(&epoll_registered_fds);
       thread_ = audio_thread_create();
       ASSERT_TRUE(thread_);
       audio_thread_set_output_dev(thread_, &iodev_);
@@ -725,8 +763,9 @@ class WriteStreamSuite : public testing::Test {
 
       cras_mix_add_stream_dont_fill_next = 0;
       cras_mix_add_stream_count = 0;
-      select_max_fd = -1;
-      select_write_ptr = NULL;
+      ppoll_called = 0;
+      epoll_write_ptr = NULL;
+      FD_ZERO(&epoll_ready_fds);
       cras_rstream_request_audio_called = 0;
       cras_dsp_get_pipeline_called = 0;
       is_open_ = 0;
@@ -743,6 +782,24 @@ class WriteStreamSuite : public testing::Test {
       cras_dsp_pipeline_get_delay_called = 0;
       cras_dsp_pipeline_apply_called = 0;
       cras_dsp_pipeline_apply_sample_count = 0;
+      cras_mix_render_called = 0;
+      cras_mix_render_planar_called = 0;
+      cras_mix_render_scaler = 0;
+      cras_mix_render_format = SND_PCM_FORMAT_UNKNOWN;
+      cras_mix_add_stream_format = SND_PCM_FORMAT_UNKNOWN;
+      cras_mix_add_samples_called = 0;
+      cras_mix_add_samples_format = SND_PCM_FORMAT_UNKNOWN;
+      cras_mix_add_samples_count = 0;
+      cras_fmt_conv_create_called = 0;
+      cras_fmt_conv_convert_frames_in_frames = 0;
+      cras_fmt_conv_convert_frames_held = 0;
+      cras_fmt_conv_create_adjustable_called = 0;
+      cras_fmt_conv_destroy_called = 0;
+      cras_fmt_conv_set_ratio_ratio = 0;
+      rate_estimator_check_return = 0;
+      rate_estimator_check_called = 0;
+      rate_estimator_add_frames_total = 0;
+      rate_estimator_rate = 44100;
 
       dev_running_called_ = 0;
       frames_written_ = 0;
@@ -765,6 +822,8 @@ class WriteStreamSuite : public testing::Test {
       *rstream = (struct cras_rstream *)calloc(1, sizeof(**rstream));
       memcpy(&(*rstream)->format, &fmt_, sizeof(fmt_));
       (*rstream)->fd = fd;
+      (*rstream)->request_fd = -1;
+      (*rstream)->reply_fd = -1;
       (*rstream)->cb_threshold = 96;
 
       shm = cras_rstream_output_shm(*rstream);
@@ -899,9 +958,7 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromStreamFull) {
   // shm has plenty of data in it.
   shm_->area->write_offset[0] = iodev_.cb_threshold * 4;
 
-  FD_ZERO(&select_out_fds);
-  FD_SET(rstream_->fd, &select_out_fds);
-  select_return_value = 1;
+  FD_SET(rstream_->fd, &epoll_ready_fds);
   is_open_ = 1;
 
   rc = unified_io(thread_, &ts);
@@ -911,7 +968,7 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromStreamFull) {
   EXPECT_LE(ts.tv_nsec, nsec_expected + 1000);
   EXPECT_EQ(iodev_.cb_threshold, cras_mix_add_stream_count);
   EXPECT_EQ(0, cras_rstream_request_audio_called);
-  EXPECT_EQ(-1, select_max_fd);
+  EXPECT_EQ(0, ppoll_called);
 }
 
 TEST_F(WriteStreamSuite, PossiblyFillGetFromStreamMinSet) {
@@ -928,13 +985,11 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromStreamMinSet) {
   // shm has is empty.
   shm_->area->write_offset[0] = 0;
 
-  FD_ZERO(&select_out_fds);
-  FD_SET(rstream_->fd, &select_out_fds);
-  select_return_value = 1;
+  FD_SET(rstream_->fd, &epoll_ready_fds);
   is_open_ = 1;
-  // Set write offset after call to select.
-  select_write_ptr = &shm_->area->write_offset[0];
-  select_write_value = iodev_.cb_threshold * 4;
+  // Set write offset after the wait for the client.
+  epoll_write_ptr = &shm_->area->write_offset[0];
+  epoll_write_value = iodev_.cb_threshold * 4;
 
   // After the callback there will be cb_thresh of data in the buffer and
   // cb_thresh x 2 data in the hardware (frames_queued_) = 3 cb_thresh total.
@@ -983,15 +1038,13 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromStreamOneEmpty) {
   // Test that nothing breaks if there is an empty stream.
   cras_mix_add_stream_dont_fill_next = 1;
 
-  FD_ZERO(&select_out_fds);
-  FD_SET(rstream_->fd, &select_out_fds);
-  select_return_value = 1;
+  FD_SET(rstream_->fd, &epoll_ready_fds);
 
   is_open_ = 1;
   rc = unified_io(thread_, &ts);
   EXPECT_EQ(0, rc);
   EXPECT_EQ(0, cras_rstream_request_audio_called);
-  EXPECT_EQ(-1, select_max_fd);
+  EXPECT_EQ(0, ppoll_called);
   EXPECT_EQ(0, shm_->area->read_offset[0]);
   EXPECT_EQ(0, shm_->area->read_offset[1]);
   EXPECT_EQ(cras_shm_used_size(shm_), shm_->area->write_offset[0]);
@@ -1010,12 +1063,10 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromStreamNeedFill) {
   //  shm is out of data.
   shm_->area->write_offset[0] = 0;
 
-  FD_ZERO(&select_out_fds);
-  FD_SET(rstream_->fd, &select_out_fds);
-  select_return_value = 1;
-  // Set write offset after call to select.
-  select_write_ptr = &shm_->area->write_offset[0];
-  select_write_value = (iodev_.used_size - iodev_.cb_threshold) * 4;
+  FD_SET(rstream_->fd, &epoll_ready_fds);
+  // Set write offset after the wait for the client.
+  epoll_write_ptr = &shm_->area->write_offset[0];
+  epoll_write_value = (iodev_.used_size - iodev_.cb_threshold) * 4;
 
   nsec_expected = (iodev_.used_size - iodev_.cb_threshold) *
       1000000000ULL / (uint64_t)fmt_.frame_rate;
@@ -1028,8 +1079,8 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromStreamNeedFill) {
   EXPECT_LE(ts.tv_nsec, nsec_expected + 1000);
   EXPECT_EQ(iodev_.used_size - iodev_.cb_threshold, cras_mix_add_stream_count);
   EXPECT_EQ(1, cras_rstream_request_audio_called);
-  EXPECT_NE(-1, select_max_fd);
-  EXPECT_EQ(0, memcmp(&select_out_fds, &select_in_fds, sizeof(select_in_fds)));
+  EXPECT_NE(0, ppoll_called);
+  EXPECT_TRUE(FD_ISSET(rstream_->fd, &epoll_wait_fds));
   EXPECT_EQ(0, shm_->area->read_offset[0]);
 }
 
@@ -1048,13 +1099,11 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromStreamNeedFillWithScaler) {
   //  shm is out of data.
   shm_->area->write_offset[0] = 0;
 
-  FD_ZERO(&select_out_fds);
-  FD_SET(rstream_->fd, &select_out_fds);
-  select_return_value = 1;
+  FD_SET(rstream_->fd, &epoll_ready_fds);
 
-  // Set write offset after call to select.
-  select_write_ptr = &shm_->area->write_offset[0];
-  select_write_value = (iodev_.used_size - iodev_.cb_threshold) * 4;
+  // Set write offset after the wait for the client.
+  epoll_write_ptr = &shm_->area->write_offset[0];
+  epoll_write_value = (iodev_.used_size - iodev_.cb_threshold) * 4;
 
   nsec_expected = (iodev_.used_size - iodev_.cb_threshold) *
       1000000000ULL / (uint64_t)fmt_.frame_rate;
@@ -1068,8 +1117,8 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromStreamNeedFillWithScaler) {
   EXPECT_EQ(iodev_.used_size - iodev_.cb_threshold,
             cras_mix_add_stream_count);
   EXPECT_EQ(1, cras_rstream_request_audio_called);
-  EXPECT_NE(-1, select_max_fd);
-  EXPECT_EQ(0, memcmp(&select_out_fds, &select_in_fds, sizeof(select_in_fds)));
+  EXPECT_NE(0, ppoll_called);
+  EXPECT_TRUE(FD_ISSET(rstream_->fd, &epoll_wait_fds));
   EXPECT_EQ(0, shm_->area->read_offset[0]);
 }
 
@@ -1099,7 +1148,7 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromTwoStreamsFull) {
   EXPECT_EQ(cras_rstream_get_cb_threshold(rstream_),
             cras_mix_add_stream_count);
   EXPECT_EQ(0, cras_rstream_request_audio_called);
-  EXPECT_EQ(-1, select_max_fd);
+  EXPECT_EQ(0, ppoll_called);
 }
 
 TEST_F(WriteStreamSuite, PossiblyFillGetFromTwoStreamsFullOneMixes) {
@@ -1143,17 +1192,15 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromTwoStreamsNeedFill) {
 
   thread_add_stream(thread_, rstream2_);
 
-  FD_ZERO(&select_out_fds);
-  FD_SET(rstream_->fd, &select_out_fds);
-  FD_SET(rstream2_->fd, &select_out_fds);
-  select_return_value = 2;
+  FD_SET(rstream_->fd, &epoll_ready_fds);
+  FD_SET(rstream2_->fd, &epoll_ready_fds);
 
   is_open_ = 1;
   rc = unified_io(thread_, &ts);
   EXPECT_EQ(0, rc);
   EXPECT_EQ(0, cras_mix_mute_count);
   EXPECT_EQ(2, cras_rstream_request_audio_called);
-  EXPECT_NE(-1, select_max_fd);
+  EXPECT_NE(0, ppoll_called);
 
   /* should only mute buffer if underrun in imminent. */
   frames_queued_ = 0;
@@ -1182,9 +1229,7 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromTwoStreamsOneLimited) {
 
   thread_add_stream(thread_, rstream2_);
 
-  FD_ZERO(&select_out_fds);
-  FD_SET(rstream_->fd, &select_out_fds);
-  select_return_value = 1;
+  FD_SET(rstream_->fd, &epoll_ready_fds);
 
   is_open_ = 1;
   rc = unified_io(thread_, &ts);
@@ -1194,7 +1239,85 @@ TEST_F(WriteStreamSuite, PossiblyFillGetFromTwoStreamsOneLimited) {
   EXPECT_LE(ts.tv_nsec, nsec_expected + 1000);
   EXPECT_EQ(smaller_frames, cras_mix_add_stream_count);
   EXPECT_EQ(1, cras_rstream_request_audio_called);
-  EXPECT_NE(-1, select_max_fd);
+  EXPECT_NE(0, ppoll_called);
+}
+
+TEST_F(WriteStreamSuite, PossiblyFillLateStreamDoesntHoldBackOthers) {
+  struct timespec ts;
+  int rc;
+  size_t written_expected;
+
+  //  Have cb_threshold samples left.
+  frames_queued_ = iodev_.cb_threshold;
+  audio_buffer_size_ = iodev_.used_size - frames_queued_;
+  written_expected = (iodev_.used_size - iodev_.cb_threshold);
+
+  //  The first stream is empty and won't reply, the second is full.
+  shm_->area->write_offset[0] = 0;
+  shm2_->area->write_offset[0] = cras_shm_used_size(shm2_);
+  shm2_->area->write_buf_idx = 1;
+
+  thread_add_stream(thread_, rstream2_);
+
+  is_open_ = 1;
+  rc = unified_io(thread_, &ts);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(1, cras_rstream_request_audio_called);
+  EXPECT_NE(0, ppoll_called);
+  EXPECT_EQ(1, cras_shm_num_cb_timeouts(shm_));
+  EXPECT_EQ(0, cras_shm_num_cb_timeouts(shm2_));
+  EXPECT_EQ(written_expected, frames_written_);
+  EXPECT_EQ(0, thread_->mix_ahead_frames);
+}
+
+TEST_F(WriteStreamSuite, PossiblyFillKeepsSurplusMixedAhead) {
+  struct timespec ts;
+  int rc;
+  static const unsigned int smaller_frames = 10;
+  struct cras_io_stream *full;
+  size_t mixed_frames;
+
+  //  Have cb_threshold samples left.
+  frames_queued_ = iodev_.cb_threshold;
+  audio_buffer_size_ = iodev_.used_size - frames_queued_;
+
+  //  One has too little the other is full.
+  shm_->area->write_offset[0] = smaller_frames * 4;
+  shm_->area->write_buf_idx = 1;
+  shm2_->area->write_offset[0] = cras_shm_used_size(shm2_);
+  shm2_->area->write_buf_idx = 1;
+  mixed_frames = cras_shm_get_frames(shm2_);
+  if (mixed_frames > audio_buffer_size_)
+    mixed_frames = audio_buffer_size_;
+
+  thread_add_stream(thread_, rstream2_);
+
+  FD_SET(rstream_->fd, &epoll_ready_fds);
+
+  is_open_ = 1;
+  rc = unified_io(thread_, &ts);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(smaller_frames, frames_written_);
+
+  //  What the full stream had past the short one stays mixed.
+  EXPECT_EQ(mixed_frames * 4, shm2_->area->read_offset[0]);
+  full = thread_->streams->next;
+  ASSERT_EQ(rstream2_, full->stream);
+  EXPECT_EQ(mixed_frames - smaller_frames, full->mix_offset);
+  EXPECT_EQ(0, thread_->streams->mix_offset);
+  EXPECT_EQ(mixed_frames - smaller_frames, thread_->mix_ahead_frames);
+}
+
+TEST_F(WriteStreamSuite, StreamFdPolledWhileAttached) {
+  EXPECT_TRUE(FD_ISSET(rstream_->fd, &epoll_registered_fds));
+  EXPECT_FALSE(FD_ISSET(rstream2_->fd, &epoll_registered_fds));
+
+  thread_add_stream(thread_, rstream2_);
+  EXPECT_TRUE(FD_ISSET(rstream2_->fd, &epoll_registered_fds));
+
+  thread_remove_stream(thread_, rstream2_);
+  EXPECT_FALSE(FD_ISSET(rstream2_->fd, &epoll_registered_fds));
+  EXPECT_TRUE(FD_ISSET(rstream_->fd, &epoll_registered_fds));
 }
 
 TEST_F(WriteStreamSuite, PossiblyFillWithoutPipeline) {
@@ -1208,9 +1331,7 @@ TEST_F(WriteStreamSuite, PossiblyFillWithoutPipeline) {
   //  shm has plenty of data in it.
   shm_->area->write_offset[0] = cras_shm_used_size(shm_);
 
-  FD_ZERO(&select_out_fds);
-  FD_SET(rstream_->fd, &select_out_fds);
-  select_return_value = 1;
+  FD_SET(rstream_->fd, &epoll_ready_fds);
 
   is_open_ = 1;
   rc = unified_io(thread_, &ts);
@@ -1238,9 +1359,7 @@ TEST_F(WriteStreamSuite, PossiblyFillWithPipeline) {
   //  shm has plenty of data in it.
   shm_->area->write_offset[0] = cras_shm_used_size(shm_);
 
-  FD_ZERO(&select_out_fds);
-  FD_SET(rstream_->fd, &select_out_fds);
-  select_return_value = 1;
+  FD_SET(rstream_->fd, &epoll_ready_fds);
 
   is_open_ = 1;
   rc = unified_io(thread_, &ts);
@@ -1253,8 +1372,232 @@ TEST_F(WriteStreamSuite, PossiblyFillWithPipeline) {
   EXPECT_EQ(1, cras_dsp_pipeline_apply_called);
   EXPECT_EQ(iodev_.used_size - iodev_.cb_threshold,
             cras_dsp_pipeline_apply_sample_count);
+  //  The planes the pipeline ran on are rendered straight to the device.
+  EXPECT_EQ(1, cras_mix_render_planar_called);
+  EXPECT_EQ(0, cras_mix_render_called);
+}
+
+TEST_F(WriteStreamSuite, PossiblyFillAppliesVolumeWhileRendering) {
+  struct timespec ts;
+  int rc;
+
+  //  Have cb_threshold samples left.
+  frames_queued_ = iodev_.cb_threshold;
+  audio_buffer_size_ = iodev_.used_size - frames_queued_;
+  iodev_.software_volume_needed = 1;
+  iodev_.software_volume_scaler = 0.5;
+
+  //  shm has plenty of data in it.
+  shm_->area->write_offset[0] = cras_shm_used_size(shm_);
+
+  is_open_ = 1;
+  rc = unified_io(thread_, &ts);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(1, cras_mix_render_called);
+  EXPECT_EQ(0.5, cras_mix_render_scaler);
+  EXPECT_EQ(frames_written_, thread_->post_mix_stats.frames);
+  EXPECT_NE(0, thread_->post_mix_stats.render_ns);
 }
 
+TEST_F(WriteStreamSuite, PossiblyFillMixesEachStreamInItsFormat) {
+  struct timespec ts;
+  int rc;
+
+  //  Have cb_threshold samples left.
+  frames_queued_ = iodev_.cb_threshold;
+  audio_buffer_size_ = iodev_.used_size - frames_queued_;
+  fmt_.format = SND_PCM_FORMAT_S24_LE;
+  rstream_->format.format = SND_PCM_FORMAT_S32_LE;
+
+  //  shm has plenty of data in it.
+  shm_->area->write_offset[0] = cras_shm_used_size(shm_);
+
+  is_open_ = 1;
+  rc = unified_io(thread_, &ts);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(SND_PCM_FORMAT_S32_LE, cras_mix_add_stream_format);
+  EXPECT_EQ(1, cras_mix_render_called);
+  EXPECT_EQ(SND_PCM_FORMAT_S24_LE, cras_mix_render_format);
+}
+
+TEST_F(WriteStreamSuite, PossiblyFillConvertsStreamAtOtherRate) {
+  struct timespec ts;
+  struct cras_io_stream *curr;
+  int rc;
+
+  //  The second stream plays at 48kHz on the 44.1kHz device.
+  is_open_ = 1;
+  thread_remove_stream(thread_, rstream_);
+  rstream2_->format.frame_rate = 48000;
+  thread_add_stream(thread_, rstream2_);
+  ASSERT_EQ(1, cras_fmt_conv_create_called);
+  EXPECT_EQ(48000, cras_fmt_conv_create_in_fmt.frame_rate);
+  EXPECT_EQ(44100, cras_fmt_conv_create_out_fmt.frame_rate);
+  EXPECT_EQ(SND_PCM_FORMAT_FLOAT_LE, cras_fmt_conv_create_out_fmt.format);
+  DL_SEARCH_SCALAR(thread_->streams, curr, stream, rstream2_);
+  ASSERT_NE((void *)NULL, curr);
+  EXPECT_EQ(fake_conv, curr->conv);
+
+  //  Have cb_threshold samples left.
+  frames_queued_ = iodev_.cb_threshold;
+  audio_buffer_size_ = iodev_.used_size - frames_queued_;
+
+  //  shm has plenty of data in it.
+  shm2_->area->write_offset[0] = cras_shm_used_size(shm2_);
+
+  rc = unified_io(thread_, &ts);
+  EXPECT_EQ(0, rc);
+  //  The device frames come from the converted stream, not its shm.
+  EXPECT_EQ(0, cras_mix_add_stream_count);
+  EXPECT_EQ(SND_PCM_FORMAT_FLOAT_LE, cras_mix_add_samples_format);
+  EXPECT_EQ(frames_written_ * 2, cras_mix_add_samples_count);
+  EXPECT_EQ(iodev_.used_size - cras_fmt_conv_convert_frames_in_frames,
+            cras_shm_get_frames(shm2_));
+  EXPECT_LT(frames_written_, cras_fmt_conv_convert_frames_in_frames);
+  EXPECT_EQ(1, cras_mix_render_called);
+}
+
+TEST_F(WriteStreamSuite, StreamConvMadeAndFreedByMainThread) {
+  struct cras_io_stream *curr;
+  int rc;
+
+  //  The second stream plays at 48kHz on the 44.1kHz device.
+  is_open_ = 1;
+  thread_remove_stream(thread_, rstream_);
+  audio_thread_done_event(thread_);
+  rstream2_->format.frame_rate = 48000;
+  thread_->started = 1;
+
+  rc = audio_thread_add_stream_async(thread_, rstream2_, NULL, NULL);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(1, cras_fmt_conv_create_called);
+  handle_playback_thread_message(thread_);
+  //  The audio thread takes the conversion as it is.
+  EXPECT_EQ(1, cras_fmt_conv_create_called);
+  DL_SEARCH_SCALAR(thread_->streams, curr, stream, rstream2_);
+  ASSERT_NE((void *)NULL, curr);
+  EXPECT_EQ(fake_conv, curr->conv);
+  EXPECT_NE((void *)NULL, curr->conv_buf);
+
+  rc = audio_thread_rm_stream_async(thread_, rstream2_, NULL, NULL);
+  EXPECT_EQ(0, rc);
+  handle_playback_thread_message(thread_);
+  //  Only retired by the audio thread, freed from the main loop.
+  EXPECT_EQ(0, cras_fmt_conv_destroy_called);
+  audio_thread_done_event(thread_);
+  EXPECT_EQ(1, cras_fmt_conv_destroy_called);
+  thread_->started = 0;
+}
+
+TEST_F(WriteStreamSuite, PossiblyFillReadsWhatTheConverterUsed) {
+  struct timespec ts;
+  int rc;
+
+  //  The second stream plays at 48kHz on the 44.1kHz device.
+  is_open_ = 1;
+  thread_remove_stream(thread_, rstream_);
+  rstream2_->format.frame_rate = 48000;
+  thread_add_stream(thread_, rstream2_);
+  cras_fmt_conv_convert_frames_held = 7;
+
+  frames_queued_ = iodev_.cb_threshold;
+  audio_buffer_size_ = iodev_.used_size - frames_queued_;
+  shm2_->area->write_offset[0] = cras_shm_used_size(shm2_);
+
+  rc = unified_io(thread_, &ts);
+  EXPECT_EQ(0, rc);
+  //  The frames the converter didn't use are still in the shm.
+  EXPECT_NE(0, cras_fmt_conv_convert_frames_in_frames);
+  EXPECT_EQ(iodev_.used_size - cras_fmt_conv_convert_frames_in_frames,
+            cras_shm_get_frames(shm2_));
+}
+
+TEST_F(WriteStreamSuite, PossiblyFillFollowsDriftingDevice) {
+  struct timespec ts;
+  struct cras_io_stream *curr;
+  int rc;
+
+  //  A device 1000 ppm fast resamples even the stream at its rate.
+  is_open_ = 1;
+  iodev_.compensate_drift = 1;
+  iodev_.rate_est = fake_rate_est;
+  rate_estimator_rate = 44144.1;
+  thread_remove_stream(thread_, rstream_);
+  thread_add_stream(thread_, rstream_);
+  ASSERT_EQ(1, cras_fmt_conv_create_adjustable_called);
+  EXPECT_EQ(0, cras_fmt_conv_create_called);
+  EXPECT_DOUBLE_EQ(1.001, cras_fmt_conv_set_ratio_ratio);
+  DL_SEARCH_SCALAR(thread_->streams, curr, stream, rstream_);
+  ASSERT_NE((void *)NULL, curr);
+  EXPECT_EQ(fake_conv, curr->conv);
+
+  //  Have cb_threshold samples left.
+  frames_queued_ = iodev_.cb_threshold;
+  audio_buffer_size_ = iodev_.used_size - frames_queued_;
+
+  //  shm has plenty of data in it.
+  shm_->area->write_offset[0] = cras_shm_used_size(shm_);
+
+  //  A new estimate is given to the stream.
+  rate_estimator_check_return = 1;
+  rate_estimator_rate = 44055.9;
+  rc = unified_io(thread_, &ts);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(1, rate_estimator_check_called);
+  EXPECT_DOUBLE_EQ(0.999, cras_fmt_conv_set_ratio_ratio);
+  EXPECT_EQ(frames_written_, rate_estimator_add_frames_total);
+}
+
+TEST_F(WriteStreamSuite, PossiblyFillResamplesWideStreamForDrift) {
+  struct timespec ts;
+  struct cras_io_stream *curr;
+  int rc;
+
+  //  An S32 stream at the device rate follows the drift like the others.
+  is_open_ = 1;
+  iodev_.compensate_drift = 1;
+  iodev_.rate_est = fake_rate_est;
+  rate_estimator_rate = 44144.1;
+  thread_remove_stream(thread_, rstream_);
+  rstream_->format.format = SND_PCM_FORMAT_S32_LE;
+  thread_add_stream(thread_, rstream_);
+  ASSERT_EQ(1, cras_fmt_conv_create_adjustable_called);
+  EXPECT_EQ(0, cras_fmt_conv_create_called);
+  EXPECT_EQ(SND_PCM_FORMAT_S32_LE, cras_fmt_conv_create_in_fmt.format);
+  EXPECT_DOUBLE_EQ(1.001, cras_fmt_conv_set_ratio_ratio);
+  DL_SEARCH_SCALAR(thread_->streams, curr, stream, rstream_);
+  ASSERT_NE((void *)NULL, curr);
+  EXPECT_EQ(fake_conv, curr->conv);
+
+  //  Have cb_threshold samples left.
+  frames_queued_ = iodev_.cb_threshold;
+  audio_buffer_size_ = iodev_.used_size - frames_queued_;
+
+  //  shm has plenty of data in it.
+  shm_->area->write_offset[0] = cras_shm_used_size(shm_);
+
+  //  The stream is mixed as converted float.
+  rc = unified_io(thread_, &ts);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(0, cras_mix_add_stream_count);
+  EXPECT_EQ(SND_PCM_FORMAT_FLOAT_LE, cras_mix_add_samples_format);
+  EXPECT_EQ(1, cras_mix_render_called);
+}
+
+TEST_F(WriteStreamSuite, PossiblyFillResamplesWideStreamAtOtherRate) {
+  //  An S32 stream converted for its rate anyway also follows the drift.
+  is_open_ = 1;
+  iodev_.compensate_drift = 1;
+  iodev_.rate_est = fake_rate_est;
+  rate_estimator_rate = 44144.1;
+  thread_remove_stream(thread_, rstream_);
+  rstream_->format.format = SND_PCM_FORMAT_S32_LE;
+  rstream_->format.frame_rate = 48000;
+  thread_add_stream(thread_, rstream_);
+  EXPECT_EQ(1, cras_fmt_conv_create_adjustable_called);
+  EXPECT_EQ(0, cras_fmt_conv_create_called);
+  EXPECT_DOUBLE_EQ(1.001, cras_fmt_conv_set_ratio_ratio);
+}
 
 //  Test adding and removing streams.
 class AddStreamSuite : public testing::Test {
@@ -1330,6 +1673,8 @@ class AddStreamSuite : public testing::Test {
       iodev_.direction = direction;
       new_stream = (struct cras_rstream *)calloc(1, sizeof(*new_stream));
       new_stream->fd = 55;
+      new_stream->request_fd = -1;
+      new_stream->reply_fd = -1;
       new_stream->buffer_frames = 65;
       new_stream->cb_threshold = 80;
       new_stream->direction = direction;
@@ -1353,6 +1698,8 @@ class AddStreamSuite : public testing::Test {
 
       second_stream = (struct cras_rstream *)calloc(1, sizeof(*second_stream));
       second_stream->fd = 56;
+      second_stream->request_fd = -1;
+      second_stream->reply_fd = -1;
       second_stream->buffer_frames = 25;
       second_stream->cb_threshold = 12;
       second_stream->direction = direction;
@@ -1406,6 +1753,8 @@ TEST_F(AddStreamSuite, SimpleAddOutputStream) {
   iodev_.thread = &thread;
   new_stream = (struct cras_rstream *)calloc(1, sizeof(*new_stream));
   new_stream->fd = 55;
+  new_stream->request_fd = -1;
+  new_stream->reply_fd = -1;
   new_stream->buffer_frames = 65;
   new_stream->cb_threshold = 80;
   memcpy(&new_stream->format, &fmt_, sizeof(fmt_));
@@ -1440,6 +1789,10 @@ TEST_F(AddStreamSuite, AddStreamOpenFail) {
   iodev_.thread = thread;
 
   open_dev_return_val_ = -1;
+  memset(&new_stream, 0, sizeof(new_stream));
+  new_stream.fd = 55;
+  new_stream.request_fd = -1;
+  new_stream.reply_fd = -1;
   new_stream.direction = CRAS_STREAM_OUTPUT;
   EXPECT_EQ(AUDIO_THREAD_OUTPUT_DEV_ERROR,
             thread_add_stream(thread, &new_stream));
@@ -1457,6 +1810,226 @@ TEST_F(AddStreamSuite, AddRmTwoInputStreams) {
   add_rm_two_streams(CRAS_STREAM_INPUT);
 }
 
+TEST_F(AddStreamSuite, AddUnifiedStreamToInputThread) {
+  int rc;
+  cras_rstream* new_stream;
+  struct audio_thread thread;
+
+  memset(&thread, 0, sizeof(thread));
+
+  // The thread of the input device only owns the input half.
+  iodev_.direction = CRAS_STREAM_INPUT;
+  thread.input_dev = &iodev_;
+  iodev_.thread = &thread;
+  new_stream = (struct cras_rstream *)calloc(1, sizeof(*new_stream));
+  new_stream->fd = 55;
+  new_stream->request_fd = -1;
+  new_stream->reply_fd = -1;
+  new_stream->buffer_frames = 65;
+  new_stream->cb_threshold = 80;
+  new_stream->direction = CRAS_STREAM_UNIFIED;
+  memcpy(&new_stream->format, &fmt_, sizeof(fmt_));
+
+  FD_ZERO(&epoll_registered_fds);
+  rc = thread_add_stream(&thread, new_stream);
+  ASSERT_EQ(0, rc);
+  EXPECT_EQ(1, open_dev_called_);
+  EXPECT_EQ(1, cras_iodev_config_params_for_streams_called);
+  // The replies are left to the thread of the output device.
+  EXPECT_FALSE(FD_ISSET(cras_rstream_get_reply_fd(new_stream),
+                        &epoll_registered_fds));
+
+  is_open_ = 1;
+
+  rc = thread_remove_stream(&thread, new_stream);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(1, close_dev_called_);
+
+  free(new_stream);
+}
+
+TEST(WakeTimerSuite, SteadyLatencyIsAdvanced) {
+  struct audio_thread thread;
+
+  memset(&thread, 0, sizeof(thread));
+  for (int i = 0; i < 100; i++)
+    update_wake_latency(&thread, 80000);
+  // Converges on the lateness, the jitter decays to the rounding error.
+  EXPECT_NEAR(80000, thread.wake_latency_ns, 8);
+  EXPECT_GE(16, thread.wake_jitter_ns);
+  EXPECT_NEAR(80000, wake_timer_advance_ns(&thread), 40);
+}
+
+TEST(WakeTimerSuite, JitterAddsSlack) {
+  struct audio_thread thread;
+
+  memset(&thread, 0, sizeof(thread));
+  for (int i = 0; i < 100; i++)
+    update_wake_latency(&thread, i % 2 ? 120000 : 40000);
+  // Twice the deviation from the average is added on top of it.
+  EXPECT_NEAR(80000, thread.wake_latency_ns, 10000);
+  EXPECT_NEAR(40000, thread.wake_jitter_ns, 5000);
+  EXPECT_EQ(thread.wake_latency_ns + 2 * thread.wake_jitter_ns,
+            wake_timer_advance_ns(&thread));
+}
+
+TEST(WakeTimerSuite, AdvanceIsBounded) {
+  struct audio_thread thread;
+
+  memset(&thread, 0, sizeof(thread));
+  for (int i = 0; i < 100; i++)
+    update_wake_latency(&thread, 5000000);
+  EXPECT_EQ(1000000, wake_timer_advance_ns(&thread));
+
+  memset(&thread, 0, sizeof(thread));
+  EXPECT_EQ(0, wake_timer_advance_ns(&thread));
+}
+
+TEST(WakeTimerSuite, CaptureShortlyBeforePlaybackIsCoalesced) {
+  struct timespec cap_ts, pb_ts;
+
+  pb_ts.tv_sec = 0;
+  pb_ts.tv_nsec = 5000000;
+
+  // Due 200us before playback, both are serviced at the playback wake up.
+  cap_ts.tv_sec = 0;
+  cap_ts.tv_nsec = 4800000;
+  EXPECT_EQ(&pb_ts, coalesce_wake(&cap_ts, &pb_ts));
+
+  // Right at the 300us margin still waits.
+  cap_ts.tv_nsec = 4700000;
+  EXPECT_EQ(&pb_ts, coalesce_wake(&cap_ts, &pb_ts));
+
+  // Earlier than that it wakes on its own.
+  cap_ts.tv_nsec = 4500000;
+  EXPECT_EQ(&cap_ts, coalesce_wake(&cap_ts, &pb_ts));
+  cap_ts.tv_sec = 0;
+  pb_ts.tv_sec = 1;
+  cap_ts.tv_nsec = 4900000;
+  EXPECT_EQ(&cap_ts, coalesce_wake(&cap_ts, &pb_ts));
+
+  // A capture due after the playback never delays it.
+  cap_ts.tv_sec = 2;
+  EXPECT_EQ(&pb_ts, coalesce_wake(&cap_ts, &pb_ts));
+  EXPECT_EQ(&pb_ts, coalesce_wake(NULL, &pb_ts));
+}
+
+// Completion results in the order they were called.
+static std::vector<intptr_t> completed_cmds;
+// Tells run_commands to return.
+static int stop_consumer;
+
+static void record_completion(void* data, int rc) {
+  completed_cmds.push_back(reinterpret_cast<intptr_t>(data));
+}
+
+// Runs the commands of a thread as its audio thread would.
+static void* run_commands(void* data) {
+  struct audio_thread* thread = static_cast<struct audio_thread*>(data);
+  struct pollfd pfd;
+
+  pfd.fd = thread->cmd_event_fd;
+  pfd.events = POLLIN;
+  while (!__atomic_load_n(&stop_consumer, __ATOMIC_ACQUIRE)) {
+    if (poll(&pfd, 1, 10) > 0)
+      handle_playback_thread_message(thread);
+  }
+  return NULL;
+}
+
+class CommandRingSuite : public testing::Test {
+  protected:
+    virtual void SetUp() {
+      completed_cmds.clear();
+      stop_consumer = 0;
+      memset(&stream_, 0, sizeof(stream_));
+      thread_ = audio_thread_create();
+      ASSERT_TRUE(thread_);
+      // Commands are run by hand instead of by a started thread.
+      thread_->started = 1;
+    }
+
+    virtual void TearDown() {
+      thread_->started = 0;
+      audio_thread_destroy(thread_);
+    }
+
+    struct audio_thread* thread_;
+    struct cras_rstream stream_;
+};
+
+TEST_F(CommandRingSuite, CompletionRunsFromMainLoop) {
+  int rc;
+
+  rc = audio_thread_rm_stream_async(thread_, &stream_, record_completion,
+                                    reinterpret_cast<void*>(7));
+  EXPECT_EQ(0, rc);
+  handle_playback_thread_message(thread_);
+  EXPECT_EQ(0, completed_cmds.size());
+
+  audio_thread_done_event(thread_);
+  ASSERT_EQ(1, completed_cmds.size());
+  EXPECT_EQ(7, completed_cmds[0]);
+}
+
+TEST_F(CommandRingSuite, RmStreamAsyncOnStoppedThreadFails) {
+  int rc;
+
+  thread_->started = 0;
+  rc = audio_thread_rm_stream_async(thread_, &stream_, record_completion,
+                                    NULL);
+  EXPECT_GT(0, rc);
+  EXPECT_EQ(-EINVAL, audio_thread_rm_stream(thread_, &stream_));
+  audio_thread_done_event(thread_);
+  EXPECT_EQ(0, completed_cmds.size());
+}
+
+TEST_F(CommandRingSuite, CommandsWrapAroundTheRing) {
+  intptr_t i;
+  int rc;
+
+  // More commands than slots, run a batch at a time.
+  for (i = 0; i < 200; i++) {
+    rc = audio_thread_rm_stream_async(thread_, &stream_, record_completion,
+                                      reinterpret_cast<void*>(i));
+    ASSERT_EQ(0, rc);
+    if (i % 50 == 49)
+      handle_playback_thread_message(thread_);
+  }
+  EXPECT_EQ(0, completed_cmds.size());
+
+  audio_thread_done_event(thread_);
+  ASSERT_EQ(200, completed_cmds.size());
+  for (i = 0; i < 200; i++)
+    EXPECT_EQ(i, completed_cmds[i]);
+}
+
+TEST_F(CommandRingSuite, SyncCommandLeavesCompletionsToMainLoop) {
+  struct pollfd pfd;
+  pthread_t consumer;
+  int rc;
+
+  rc = audio_thread_rm_stream_async(thread_, &stream_, record_completion,
+                                    reinterpret_cast<void*>(3));
+  EXPECT_EQ(0, rc);
+
+  ASSERT_EQ(0, pthread_create(&consumer, NULL, run_commands, thread_));
+  rc = audio_thread_rm_stream(thread_, &stream_);
+  __atomic_store_n(&stop_consumer, 1, __ATOMIC_RELEASE);
+  pthread_join(consumer, NULL);
+  EXPECT_EQ(0, rc);
+
+  // Reaped while waiting but not called from inside the sync command.
+  EXPECT_EQ(0, completed_cmds.size());
+  pfd.fd = thread_->done_event_fd;
+  pfd.events = POLLIN;
+  EXPECT_EQ(1, poll(&pfd, 1, 0));
+
+  audio_thread_done_event(thread_);
+  ASSERT_EQ(1, completed_cmds.size());
+  EXPECT_EQ(3, completed_cmds[0]);
+}
+
 extern "C" {
 int cras_iodev_get_thread_poll_fd(const struct cras_iodev *iodev) {
   return 0;
@@ -1516,12 +2089,13 @@ int cras_iodev_set_format(struct cras_iodev *iodev,
 
 //  From mixer.
 size_t cras_mix_add_stream(struct cras_audio_shm *shm,
+                           snd_pcm_format_t fmt,
                            size_t num_channels,
-                           uint8_t *dst,
+                           float *dst,
                            size_t *count,
                            size_t *index) {
   int16_t *src;
-  int16_t *target = (int16_t *)dst;
+  float *target = dst;
   size_t fr_written, fr_in_buf;
   size_t num_samples;
   size_t frames = 0;
@@ -1531,6 +2105,7 @@ size_t cras_mix_add_stream(struct cras_audio_shm *shm,
     return 0;
   }
   cras_mix_add_stream_count = *count;
+  cras_mix_add_stream_format = fmt;
 
   /* We only copy the data from shm to dst, not actually mix them. */
   fr_in_buf = cras_shm_get_frames(shm);
@@ -1546,7 +2121,8 @@ size_t cras_mix_add_stream(struct cras_audio_shm *shm,
     if (frames > *count - fr_written)
       frames = *count - fr_written;
     num_samples = frames * num_channels;
-    memcpy(target, src, num_samples * 2);
+    for (size_t i = 0; i < num_samples; i++)
+      target[i] = src[i] / 32768.0f;
     fr_written += frames;
     target += num_samples;
   }
@@ -1555,7 +2131,36 @@ size_t cras_mix_add_stream(struct cras_audio_shm *shm,
   return *count;
 }
 
-void cras_scale_buffer(int16_t *buffer, unsigned int count, float scaler) {
+int cras_mix_add_samples(snd_pcm_format_t fmt, float *dst, const uint8_t *src,
+                         size_t count, float scaler, size_t index) {
+  cras_mix_add_samples_called++;
+  cras_mix_add_samples_format = fmt;
+  cras_mix_add_samples_count += count;
+  return 0;
+}
+
+int cras_mix_format_supported(snd_pcm_format_t fmt) {
+  return fmt != SND_PCM_FORMAT_U8;
+}
+
+void cras_scale_buffer(float *buffer, unsigned int count, float scaler) {
+}
+
+int cras_mix_render(snd_pcm_format_t fmt, uint8_t *dst, const float *src,
+                    size_t count, float scaler) {
+  cras_mix_render_called++;
+  cras_mix_render_format = fmt;
+  cras_mix_render_scaler = scaler;
+  return 0;
+}
+
+int cras_mix_render_planar(snd_pcm_format_t fmt, uint8_t *dst,
+                           const float *const *planes, size_t channels,
+                           size_t frames, float scaler) {
+  cras_mix_render_planar_called++;
+  cras_mix_render_format = fmt;
+  cras_mix_render_scaler = scaler;
+  return 0;
 }
 
 size_t cras_mix_mute_buffer(uint8_t *dst,
@@ -1565,6 +2170,95 @@ size_t cras_mix_mute_buffer(uint8_t *dst,
   return count;
 }
 
+//  From format converter.
+struct cras_fmt_conv *cras_fmt_conv_create(const struct cras_audio_format *in,
+                                           const struct cras_audio_format *out,
+                                           size_t max_frames) {
+  cras_fmt_conv_create_called++;
+  cras_fmt_conv_create_in_fmt = *in;
+  cras_fmt_conv_create_out_fmt = *out;
+  return fake_conv;
+}
+
+struct cras_fmt_conv *cras_fmt_conv_create_adjustable(
+    const struct cras_audio_format *in,
+    const struct cras_audio_format *out,
+    size_t max_frames) {
+  cras_fmt_conv_create_adjustable_called++;
+  cras_fmt_conv_create_in_fmt = *in;
+  cras_fmt_conv_create_out_fmt = *out;
+  return fake_conv;
+}
+
+int cras_fmt_conv_set_ratio(struct cras_fmt_conv *conv, double ratio) {
+  cras_fmt_conv_set_ratio_ratio = ratio;
+  return 0;
+}
+
+void cras_fmt_conv_prepare(const struct cras_audio_format *in,
+                           const struct cras_audio_format *out,
+                           int adjustable) {
+}
+
+void cras_fmt_conv_destroy(struct cras_fmt_conv *conv) {
+  cras_fmt_conv_destroy_called++;
+}
+
+size_t cras_fmt_conv_in_frames_to_out(struct cras_fmt_conv *conv,
+                                      size_t in_frames) {
+  return in_frames * cras_fmt_conv_create_out_fmt.frame_rate /
+         cras_fmt_conv_create_in_fmt.frame_rate;
+}
+
+size_t cras_fmt_conv_out_frames_to_in(struct cras_fmt_conv *conv,
+                                      size_t out_frames) {
+  return out_frames * cras_fmt_conv_create_in_fmt.frame_rate /
+         cras_fmt_conv_create_out_fmt.frame_rate;
+}
+
+size_t cras_fmt_conv_convert_some_frames(struct cras_fmt_conv *conv,
+                                         uint8_t *in_buf,
+                                         uint8_t *out_buf,
+                                         size_t *in_frames,
+                                         size_t out_frames) {
+  size_t frames;
+
+  //  Like a resampler filling its window, keep some of the input back.
+  if (*in_frames > cras_fmt_conv_convert_frames_held)
+    *in_frames -= cras_fmt_conv_convert_frames_held;
+  frames = cras_fmt_conv_in_frames_to_out(conv, *in_frames);
+  cras_fmt_conv_convert_frames_in_frames += *in_frames;
+  frames = frames < out_frames ? frames : out_frames;
+  memset(out_buf, 0, frames * cras_get_format_bytes(
+      &cras_fmt_conv_create_out_fmt));
+  return frames;
+}
+
+int cras_fmt_conversion_needed(const struct cras_audio_format *a,
+                               const struct cras_audio_format *b) {
+  return a->format != b->format || a->num_channels != b->num_channels ||
+         a->frame_rate != b->frame_rate;
+}
+
+//  From rate_estimator.
+void rate_estimator_add_frames(struct rate_estimator *re, int fr) {
+  rate_estimator_add_frames_total += fr;
+}
+
+int rate_estimator_check(struct rate_estimator *re, int level,
+                         const struct timespec *now) {
+  rate_estimator_check_called++;
+  return rate_estimator_check_return;
+}
+
+double rate_estimator_get_rate(const struct rate_estimator *re) {
+  return rate_estimator_rate;
+}
+
+double rate_estimator_get_ppm(const struct rate_estimator *re) {
+  return (rate_estimator_rate - 44100) * 1000000 / 44100;
+}
+
 //  From util.
 int cras_set_rt_scheduling(int rt_lim) {
   return 0;
@@ -1628,6 +2322,28 @@ void cras_dsp_pipeline_apply(struct pipeline *pipeline, unsigned int channels,
   cras_dsp_pipeline_apply_sample_count = frames;
 }
 
+void cras_dsp_pipeline_apply_float(struct pipeline *pipeline,
+                                   unsigned int channels,
+                                   float *buf, unsigned int frames)
+{
+  cras_dsp_pipeline_apply_called++;
+  cras_dsp_pipeline_apply_sample_count += frames;
+}
+
+void cras_dsp_pipeline_apply_planar(struct pipeline *pipeline,
+                                    unsigned int channels,
+                                    float *const *planes,
+                                    unsigned int frames)
+{
+  cras_dsp_pipeline_apply_called++;
+  cras_dsp_pipeline_apply_sample_count += frames;
+}
+
+void dsp_util_deinterleave_float(const float *input, float *const *output,
+                                 int channels, int frames)
+{
+}
+
 void cras_rstream_send_client_reattach(const struct cras_rstream *stream)
 {
 }
@@ -1653,6 +2369,15 @@ size_t cras_system_get_capture_mute() {
   return 0;
 }
 
+int cras_system_add_select_fd(int fd,
+                              void (*callback)(void *data),
+                              void *callback_data) {
+  return 0;
+}
+
+void cras_system_rm_select_fd(int fd) {
+}
+
 void loopback_iodev_set_format(struct loopback_iodev *loopback_dev,
                                const struct cras_audio_format *fmt) {
 }
@@ -1669,20 +2394,45 @@ int loopback_iodev_add_zeros(struct cras_iodev *dev,
   return 0;
 }
 
-//  Override select so it can be stubbed.
-int select(int nfds,
-           fd_set *readfds,
-           fd_set *writefds,
-           fd_set *exceptfds,
-           struct timeval *timeout) {
-  select_max_fd = nfds;
-  select_timeval.tv_sec = timeout->tv_sec;
-  select_timeval.tv_usec = timeout->tv_usec;
-  select_in_fds = *readfds;
-  *readfds = select_out_fds;
-  if (select_write_ptr)
-	  *select_write_ptr = select_write_value;
-  return select_return_value;
+//  Fake the epoll sets, fds are tracked as they are added and removed and the
+//  ones in epoll_ready_fds are returned once from the next wait.
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+  if (op == EPOLL_CTL_ADD) {
+    FD_SET(fd, &epoll_registered_fds);
+    epoll_registered_data[fd] = event->data.ptr;
+  } else if (op == EPOLL_CTL_DEL) {
+    FD_CLR(fd, &epoll_registered_fds);
+  }
+  return 0;
+}
+
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout,
+          const sigset_t *sigmask) {
+  ppoll_called++;
+  ppoll_timeout = *timeout;
+  epoll_wait_fds = epoll_registered_fds;
+  if (epoll_write_ptr)
+	  *epoll_write_ptr = epoll_write_value;
+  for (int fd = 0; fd < FD_SETSIZE; fd++)
+    if (FD_ISSET(fd, &epoll_ready_fds) && FD_ISSET(fd, &epoll_registered_fds))
+      return 1;
+  return 0;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events,
+               int maxevents, int timeout) {
+  int n = 0;
+
+  for (int fd = 0; fd < FD_SETSIZE && n < maxevents; fd++) {
+    if (!FD_ISSET(fd, &epoll_ready_fds) ||
+        !FD_ISSET(fd, &epoll_registered_fds))
+      continue;
+    FD_CLR(fd, &epoll_ready_fds);
+    events[n].events = EPOLLIN;
+    events[n].data.ptr = epoll_registered_data[fd];
+    n++;
+  }
+  return n;
 }
 
 }  // extern "C"
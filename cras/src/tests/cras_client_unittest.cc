@@ -19,6 +19,8 @@ static size_t cras_fmt_conv_convert_frames_in_frames_val;
 static size_t cras_fmt_conv_convert_frames_out_frames_val;
 static struct cras_fmt_conv *fake_conv =
     reinterpret_cast<struct cras_fmt_conv *>(0x123);
+static cras_stream_id_t capture_cb_ids[2];
+static unsigned int capture_cb_called;
 
 namespace {
 
@@ -101,6 +103,164 @@ TEST_F(CrasClientTestSuite, CompletePlaybackWrite) {
             shm_writable_frames_);
 }
 
+TEST(CrasClientSharedThread, QueueReadyStreamsByDeadline) {
+  struct ready_stream ready[3];
+  struct ready_stream entry;
+  struct client_stream streams[3];
+  unsigned int num_ready = 0;
+
+  memset(&entry, 0, sizeof(entry));
+  entry.stream = &streams[0];
+  entry.deadline.tv_sec = 2;
+  num_ready = queue_ready_stream(ready, num_ready, &entry);
+  entry.stream = &streams[1];
+  entry.deadline.tv_sec = 3;
+  num_ready = queue_ready_stream(ready, num_ready, &entry);
+  entry.stream = &streams[2];
+  entry.deadline.tv_sec = 1;
+  num_ready = queue_ready_stream(ready, num_ready, &entry);
+
+  ASSERT_EQ(3, num_ready);
+  EXPECT_EQ(&streams[2], ready[0].stream);
+  EXPECT_EQ(&streams[0], ready[1].stream);
+  EXPECT_EQ(&streams[1], ready[2].stream);
+}
+
+static int capture_cb(struct cras_client *client,
+                      cras_stream_id_t stream_id,
+                      uint8_t *captured_samples,
+                      size_t frames,
+                      const struct timespec *sample_time,
+                      void *user_arg) {
+  if (capture_cb_called < 2)
+    capture_cb_ids[capture_cb_called] = stream_id;
+  __atomic_add_fetch(&capture_cb_called, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+class CrasClientSharedThreadSuite : public testing::Test {
+  protected:
+    virtual void SetUp() {
+      memset(&client_, 0, sizeof(client_));
+      client_.use_shared_audio_thread = 1;
+      pthread_mutex_init(&client_.audio_thread.lock, NULL);
+      for (int i = 0; i < 2; i++)
+        SetupStream(&streams_[i], &config_[i], i + 1, socks_[i]);
+      capture_cb_called = 0;
+    }
+
+    virtual void TearDown() {
+      for (int i = 0; i < 2; i++) {
+        stop_aud_thread(&client_, &streams_[i]);
+        free(streams_[i].capture_shm.area);
+        close(socks_[i][0]);
+        close(socks_[i][1]);
+      }
+      stop_shared_audio_thread(&client_);
+      pthread_mutex_destroy(&client_.audio_thread.lock);
+    }
+
+    void SetupStream(struct client_stream *stream,
+                     struct cras_stream_params *config,
+                     cras_stream_id_t id,
+                     int *sock) {
+      struct cras_audio_shm *shm = &stream->capture_shm;
+
+      memset(config, 0, sizeof(*config));
+      config->buffer_frames = 480;
+      config->min_cb_level = 480;
+      config->format.frame_rate = 48000;
+      config->aud_cb = capture_cb;
+
+      memset(stream, 0, sizeof(*stream));
+      stream->id = id;
+      stream->direction = CRAS_STREAM_INPUT;
+      stream->client = &client_;
+      stream->config = config;
+      stream->request_fd = -1;
+      stream->reply_fd = -1;
+      ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sock));
+      stream->aud_fd = sock[0];
+      shm->area = static_cast<cras_audio_shm_area *>(
+          calloc(1, sizeof(*shm->area) + 480 * 4 * 2));
+      cras_shm_set_frame_bytes(shm, 4);
+      cras_shm_set_used_size(shm, 480 * 4);
+    }
+
+    void SendDataReady(int i) {
+      struct audio_message msg;
+
+      memset(&msg, 0, sizeof(msg));
+      msg.id = AUDIO_MESSAGE_DATA_READY;
+      msg.frames = 480;
+      ASSERT_EQ(sizeof(msg), write(socks_[i][1], &msg, sizeof(msg)));
+    }
+
+    struct cras_client client_;
+    struct client_stream streams_[2];
+    struct cras_stream_params config_[2];
+    int socks_[2][2];
+};
+
+TEST_F(CrasClientSharedThreadSuite, ServicesEarliestDeadlineFirst) {
+  struct shared_audio_thread *at = &client_.audio_thread;
+  struct epoll_event ev;
+
+  // The second stream overruns its buffer first.
+  streams_[0].capture_shm.area->ts.tv_sec = 10;
+  streams_[1].capture_shm.area->ts.tv_sec = 5;
+
+  // Hold the thread until both streams are ready, so one wake up sees them.
+  pthread_mutex_lock(&at->lock);
+  ASSERT_EQ(0, start_shared_audio_thread(&client_));
+  for (int i = 0; i < 2; i++) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = &streams_[i];
+    ASSERT_EQ(0, epoll_ctl(at->epoll_fd, EPOLL_CTL_ADD, socks_[i][0], &ev));
+    streams_[i].thread.running = 1;
+    SendDataReady(i);
+  }
+  pthread_mutex_unlock(&at->lock);
+
+  for (int i = 0; i < 1000; i++) {
+    if (__atomic_load_n(&capture_cb_called, __ATOMIC_ACQUIRE) >= 2)
+      break;
+    usleep(1000);
+  }
+  ASSERT_EQ(2, capture_cb_called);
+  EXPECT_EQ(2, capture_cb_ids[0]);
+  EXPECT_EQ(1, capture_cb_ids[1]);
+}
+
+TEST_F(CrasClientSharedThreadSuite, AddAndRemoveStreams) {
+  for (int i = 0; i < 2; i++)
+    ASSERT_EQ(0, shared_thread_add_stream(&client_, &streams_[i]));
+  EXPECT_TRUE(client_.audio_thread.thread.running);
+
+  SendDataReady(1);
+  for (int i = 0; i < 1000; i++) {
+    if (__atomic_load_n(&capture_cb_called, __ATOMIC_ACQUIRE) >= 1)
+      break;
+    usleep(1000);
+  }
+  ASSERT_EQ(1, capture_cb_called);
+  EXPECT_EQ(2, capture_cb_ids[0]);
+
+  // A removed stream isn't serviced anymore.
+  stop_aud_thread(&client_, &streams_[1]);
+  EXPECT_FALSE(streams_[1].thread.running);
+  SendDataReady(1);
+  SendDataReady(0);
+  for (int i = 0; i < 1000; i++) {
+    if (__atomic_load_n(&capture_cb_called, __ATOMIC_ACQUIRE) >= 2)
+      break;
+    usleep(1000);
+  }
+  usleep(10000);
+  ASSERT_EQ(2, capture_cb_called);
+  EXPECT_EQ(1, capture_cb_ids[1]);
+}
+
 } // namepsace
 
 int main(int argc, char **argv) {
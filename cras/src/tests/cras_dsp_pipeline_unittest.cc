@@ -2,13 +2,15 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <dirent.h>
 #include <gtest/gtest.h>
+#include <pthread.h>
 
 #include "cras_config.h"
 #include "cras_dsp_module.h"
 #include "cras_dsp_pipeline.h"
 
-#define MAX_MODULES 10
+#define MAX_MODULES 12
 #define MAX_MOCK_PORTS 30
 #define FILENAME_TEMPLATE "DspIniTest.XXXXXX"
 
@@ -18,6 +20,21 @@ static void fill_test_data(int16_t *data, size_t size)
     data[i] = i;
 }
 
+static int count_threads()
+{
+  DIR *dir = opendir("/proc/self/task");
+  struct dirent *entry;
+  int n = 0;
+
+  if (!dir)
+    return -1;
+  while ((entry = readdir(dir)))
+    if (entry->d_name[0] != '.')
+      n++;
+  closedir(dir);
+  return n;
+}
+
 static void verify_processed_data(int16_t *data, size_t size, int times)
 {
   /* Each time the audio data flow through the mock plugin, the data
@@ -56,6 +73,7 @@ struct data {
   float output[MAX_MOCK_PORTS];
 
   int sample_count;
+  pthread_t run_thread;
 
   int get_delay_called;
   int deinstantiate_called;
@@ -95,6 +113,7 @@ static void run(struct dsp_module *module, unsigned long sample_count)
   struct data *data =  (struct data *)module->data;
   data->run_called++;
   data->sample_count = sample_count;
+  data->run_thread = pthread_self();
 
   for (int i = 0; i < data->nr_ports; i++) {
     if (data->port_dir[i] == PORT_INPUT)
@@ -504,6 +523,301 @@ TEST_F(DspPipelineTestSuite, Complex) {
   really_free_module(m5);
 }
 
+TEST_F(DspPipelineTestSuite, ApplyPlanar) {
+  const char *content =
+      "[M0]\n"
+      "library=builtin\n"
+      "label=source\n"
+      "purpose=playback\n"
+      "output_0={a0}\n"
+      "output_1={a1}\n"
+      "[M1]\n"
+      "library=builtin\n"
+      "label=foo\n"
+      "input_0={a0}\n"
+      "input_1={a1}\n"
+      "output_2={b0}\n"
+      "output_3={b1}\n"
+      "[M2]\n"
+      "library=builtin\n"
+      "label=inplace_broken\n"
+      "disable=(not (equal? copy \"yes\"))\n"
+      "input_0={b0}\n"
+      "input_1={b1}\n"
+      "output_2={c0}\n"
+      "output_3={c1}\n"
+      "[M3]\n"
+      "library=builtin\n"
+      "label=sink\n"
+      "purpose=playback\n"
+      "input_0={c0}\n"
+      "input_1={c1}\n";
+  fprintf(fp, "%s", content);
+  CloseFile();
+
+  struct cras_expr_env env = CRAS_EXPR_ENV_INIT;
+  cras_expr_env_install_builtins(&env);
+  struct ini *ini = cras_dsp_ini_create(filename);
+  ASSERT_TRUE(ini);
+
+  float left[3000], right[3000];
+  float *planes[2] = { left, right };
+
+  /* Without M2 every channel stays in its buffer, M1 runs on the planes
+   * and is connected back to the pipeline buffers after. */
+  cras_expr_env_set_variable_string(&env, "copy", "no");
+  struct pipeline *p = cras_dsp_pipeline_create(ini, &env, "playback");
+  ASSERT_TRUE(p);
+  ASSERT_EQ(0, cras_dsp_pipeline_load(p));
+  ASSERT_EQ(0, cras_dsp_pipeline_instantiate(p, 48000));
+  struct data *d1 = (struct data *)find_module("m1")->data;
+
+  for (int i = 0; i < 3000; i++) {
+    left[i] = i;
+    right[i] = -i;
+  }
+  cras_dsp_pipeline_apply_planar(p, 2, planes, 3000);
+  for (int i = 0; i < 3000; i++) {
+    EXPECT_EQ(2.0f * i, left[i]);
+    EXPECT_EQ(-2.0f * i, right[i]);
+  }
+  EXPECT_EQ(2, d1->run_called);
+  EXPECT_EQ(3000 - DSP_BUFFER_SIZE, d1->sample_count);
+  EXPECT_EQ(cras_dsp_pipeline_get_source_buffer(p, 0), d1->data_location[0]);
+  EXPECT_EQ(cras_dsp_pipeline_get_sink_buffer(p, 1), d1->data_location[3]);
+  cras_dsp_pipeline_free(p);
+
+  /* M2 can't write over its input, the planes are copied through the
+   * pipeline buffers instead. */
+  cras_expr_env_set_variable_string(&env, "copy", "yes");
+  p = cras_dsp_pipeline_create(ini, &env, "playback");
+  ASSERT_TRUE(p);
+  ASSERT_EQ(0, cras_dsp_pipeline_load(p));
+  ASSERT_EQ(0, cras_dsp_pipeline_instantiate(p, 48000));
+
+  for (int i = 0; i < 3000; i++) {
+    left[i] = i;
+    right[i] = -i;
+  }
+  cras_dsp_pipeline_apply_planar(p, 2, planes, 3000);
+  for (int i = 0; i < 3000; i++) {
+    EXPECT_EQ(4.0f * i, left[i]);
+    EXPECT_EQ(-4.0f * i, right[i]);
+  }
+  cras_dsp_pipeline_free(p);
+
+  cras_dsp_ini_free(ini);
+  cras_expr_env_free(&env);
+  for (int i = 0; i < num_modules; i++)
+    really_free_module(modules[i]);
+}
+
+TEST_F(DspPipelineTestSuite, Crossfade) {
+  const char *content =
+      "[M0]\n"
+      "library=builtin\n"
+      "label=source\n"
+      "purpose=playback\n"
+      "output_0={a}\n"
+      "[M1]\n"
+      "library=builtin\n"
+      "label=foo\n"
+      "disable=(equal? stage \"old\")\n"
+      "input_0={a}\n"
+      "output_1={b}\n"
+      "[M3]\n"
+      "library=builtin\n"
+      "label=foo\n"
+      "disable=(equal? stage \"new\")\n"
+      "input_0={b}\n"
+      "output_1={c}\n"
+      "[M2]\n"
+      "library=builtin\n"
+      "label=sink\n"
+      "purpose=playback\n"
+      "input_0={c}\n";
+  fprintf(fp, "%s", content);
+  CloseFile();
+
+  struct cras_expr_env env = CRAS_EXPR_ENV_INIT;
+  cras_expr_env_install_builtins(&env);
+  struct ini *ini = cras_dsp_ini_create(filename);
+  ASSERT_TRUE(ini);
+
+  /* Both M1 and M3 double the samples, the old pipeline quadruples them
+   * with a delay of 1 + 3 + 2 frames. */
+  cras_expr_env_set_variable_string(&env, "stage", "both");
+  struct pipeline *old_p = cras_dsp_pipeline_create(ini, &env, "playback");
+  ASSERT_TRUE(old_p);
+  ASSERT_EQ(0, cras_dsp_pipeline_load(old_p));
+  ASSERT_EQ(0, cras_dsp_pipeline_instantiate(old_p, 48000));
+  ASSERT_EQ(6, cras_dsp_pipeline_get_delay(old_p));
+  ASSERT_EQ(4, num_modules);
+  struct dsp_module *old_m1 = find_module("m1");
+  ASSERT_TRUE(old_m1);
+
+  /* The new one, without M3, only doubles them. */
+  cras_expr_env_set_variable_string(&env, "stage", "new");
+  struct pipeline *p = cras_dsp_pipeline_create(ini, &env, "playback");
+  ASSERT_TRUE(p);
+  ASSERT_EQ(0, cras_dsp_pipeline_load(p));
+  ASSERT_EQ(0, cras_dsp_pipeline_instantiate(p, 48000));
+  ASSERT_EQ(3, cras_dsp_pipeline_get_delay(p));
+  ASSERT_EQ(7, num_modules);
+  struct dsp_module *m1 = NULL;
+  for (int i = 4; i < num_modules; i++)
+    if (strcmp("m1", ((struct data *)modules[i]->data)->title) == 0)
+      m1 = modules[i];
+  ASSERT_TRUE(m1);
+  struct data *old_d1 = (struct data *)old_m1->data;
+  struct data *d1 = (struct data *)m1->data;
+
+  cras_dsp_pipeline_fade_from(p, old_p, 100);
+  EXPECT_EQ(6, cras_dsp_pipeline_get_delay(p));
+
+  /* Both run on the same input, the output goes linearly from the old to
+   * the new one, across two blocks. */
+  float samples[150];
+  for (int i = 0; i < 150; i++)
+    samples[i] = 1.0f;
+  cras_dsp_pipeline_apply_float(p, 1, samples, 60);
+  cras_dsp_pipeline_apply_float(p, 1, samples + 60, 90);
+  for (int i = 0; i < 100; i++)
+    EXPECT_FLOAT_EQ(4.0f - 2.0f * (i + 1) / 100, samples[i]);
+  for (int i = 100; i < 150; i++)
+    EXPECT_FLOAT_EQ(2.0f, samples[i]);
+  EXPECT_EQ(2, old_d1->run_called);
+  EXPECT_EQ(2, d1->run_called);
+
+  /* The old pipeline stops running once faded out. */
+  cras_dsp_pipeline_apply_float(p, 1, samples, 10);
+  EXPECT_EQ(2, old_d1->run_called);
+  EXPECT_EQ(3, d1->run_called);
+  EXPECT_EQ(3, cras_dsp_pipeline_get_delay(p));
+
+  /* Freeing the new pipeline frees the old one. */
+  cras_dsp_pipeline_free(p);
+  EXPECT_EQ(1, old_d1->free_module_called);
+  EXPECT_EQ(1, d1->free_module_called);
+
+  cras_dsp_ini_free(ini);
+  cras_expr_env_free(&env);
+  for (int i = 0; i < num_modules; i++)
+    really_free_module(modules[i]);
+}
+
+TEST_F(DspPipelineTestSuite, ParallelBranches) {
+  /*
+   *         / --(l0)-- ML1 --(l1)-- ML2 --(l2)-- \
+   *   SRC                                          SINK
+   *         \ --(r0)-- MR1 --(r1)-- MR2 --(r2)-- /
+   */
+  const char *content =
+      "[SRC]\n"
+      "library=builtin\n"
+      "label=source\n"
+      "purpose=playback\n"
+      "output_0={l0}\n"
+      "output_1={r0}\n"
+      "[ML1]\n"
+      "library=builtin\n"
+      "label=foo\n"
+      "input_0={l0}\n"
+      "output_1={l1}\n"
+      "[ML2]\n"
+      "library=builtin\n"
+      "label=foo\n"
+      "input_0={l1}\n"
+      "output_1={l2}\n"
+      "[MR1]\n"
+      "library=builtin\n"
+      "label=foo\n"
+      "input_0={r0}\n"
+      "output_1={r1}\n"
+      "[MR2]\n"
+      "library=builtin\n"
+      "label=foo\n"
+      "input_0={r1}\n"
+      "output_1={r2}\n"
+      "[SINK]\n"
+      "library=builtin\n"
+      "label=sink\n"
+      "purpose=playback\n"
+      "input_0={l2}\n"
+      "input_1={r2}\n";
+  fprintf(fp, "%s", content);
+  CloseFile();
+
+  struct cras_expr_env env = CRAS_EXPR_ENV_INIT;
+  struct ini *ini = cras_dsp_ini_create(filename);
+  ASSERT_TRUE(ini);
+  struct pipeline *p = cras_dsp_pipeline_create(ini, &env, "playback");
+  ASSERT_TRUE(p);
+  ASSERT_EQ(0, cras_dsp_pipeline_load(p));
+  ASSERT_EQ(6, num_modules);
+  struct pipeline *p2 = cras_dsp_pipeline_create(ini, &env, "playback");
+  ASSERT_TRUE(p2);
+  ASSERT_EQ(0, cras_dsp_pipeline_load(p2));
+
+  /* One worker, run in parallel as soon as the first blocks are timed. */
+  int threads = count_threads();
+  cras_dsp_pipeline_set_parallel(p, 1, 0);
+  ASSERT_EQ(0, cras_dsp_pipeline_instantiate(p, 48000));
+  cras_dsp_pipeline_set_parallel(p2, 1, 0);
+  ASSERT_EQ(0, cras_dsp_pipeline_instantiate(p2, 48000));
+
+  /* The worker is started at instantiate time, and shared. */
+  EXPECT_EQ(threads + 1, count_threads());
+
+  struct data *dl1 = (struct data *)find_module("ml1")->data;
+  struct data *dl2 = (struct data *)find_module("ml2")->data;
+  struct data *dr1 = (struct data *)find_module("mr1")->data;
+  struct data *dr2 = (struct data *)find_module("mr2")->data;
+
+  /* Modules of the same level may run together, they can't share a
+   * buffer. */
+  EXPECT_NE(dl1->data_location[0], dr1->data_location[1]);
+  EXPECT_NE(dl1->data_location[1], dr1->data_location[0]);
+  EXPECT_NE(dl2->data_location[1], dr2->data_location[1]);
+
+  int16_t samples[200];
+  for (int i = 0; i < 20; i++) {
+    fill_test_data(samples, 200);
+    cras_dsp_pipeline_apply(p, 2, (uint8_t *)samples, 100);
+    verify_processed_data(samples, 200, 2);
+  }
+  EXPECT_EQ(20, dl1->run_called);
+  EXPECT_EQ(20, dr2->run_called);
+  EXPECT_EQ(threads + 1, count_threads());
+
+  /* The other pipeline runs on the same worker. */
+  for (int i = 0; i < 20; i++) {
+    fill_test_data(samples, 200);
+    cras_dsp_pipeline_apply(p2, 2, (uint8_t *)samples, 100);
+    verify_processed_data(samples, 200, 2);
+  }
+  EXPECT_EQ(threads + 1, count_threads());
+
+  cras_dsp_pipeline_stop_workers();
+  EXPECT_EQ(threads, count_threads());
+
+  /* Without workers the pipeline runs serially, it doesn't start them. */
+  for (int i = 0; i < 20; i++) {
+    fill_test_data(samples, 200);
+    cras_dsp_pipeline_apply(p, 2, (uint8_t *)samples, 100);
+    verify_processed_data(samples, 200, 2);
+  }
+  EXPECT_EQ(40, dl1->run_called);
+  EXPECT_EQ(threads, count_threads());
+
+  cras_dsp_pipeline_free(p2);
+  cras_dsp_pipeline_free(p);
+  cras_dsp_ini_free(ini);
+  cras_expr_env_free(&env);
+  for (int i = 0; i < num_modules; i++)
+    really_free_module(modules[i]);
+}
+
 }  //  namespace
 
 int main(int argc, char **argv) {
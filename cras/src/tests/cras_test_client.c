@@ -416,11 +416,22 @@ static void audio_debug_info(struct cras_client *client)
 	       (unsigned int)info->output_buffer_size,
 	       (unsigned int)info->output_used_size,
 	       (unsigned int)info->output_cb_threshold);
+	if (info->output_post_mix.frames)
+		printf("post mix ns per frame: loopback %.1f dsp %.1f "
+		       "render %.1f\n",
+		       (double)info->output_post_mix.loopback_ns /
+				info->output_post_mix.frames,
+		       (double)info->output_post_mix.dsp_ns /
+				info->output_post_mix.frames,
+		       (double)info->output_post_mix.render_ns /
+				info->output_post_mix.frames);
+	printf("drift: %d ppm\n", info->output_drift_ppm);
 	printf("input dev: %s\n", info->input_dev_name);
 	printf("%u %u %u\n",
 	       (unsigned int)info->input_buffer_size,
 	       (unsigned int)info->input_used_size,
 	       (unsigned int)info->input_cb_threshold);
+	printf("drift: %d ppm\n", info->input_drift_ppm);
 	printf("-------------stream_dump------------\n");
 	if (info->num_streams > MAX_DEBUG_STREAMS)
 		return;
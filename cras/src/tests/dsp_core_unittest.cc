@@ -6,10 +6,12 @@
 #include <math.h>
 #include "crossover.h"
 #include "crossover2.h"
+#include "crossovern.h"
 #include "drc.h"
 #include "dsp_util.h"
 #include "eq.h"
 #include "eq2.h"
+#include "eqn.h"
 
 namespace {
 
@@ -74,6 +76,48 @@ TEST(InterleaveTest, All) {
   }
 }
 
+TEST(InterleaveTest, Float) {
+  const int FRAMES = 5;
+  const int CHANNELS = 3;
+  float input[FRAMES * CHANNELS];
+  float planar[CHANNELS][FRAMES];
+  float *planar_ptr[] = {planar[0], planar[1], planar[2]};
+  float output[FRAMES * CHANNELS];
+
+  for (int i = 0; i < FRAMES * CHANNELS; i++)
+    input[i] = i * 0.25f - 2.0f;
+
+  dsp_util_deinterleave_float(input, planar_ptr, CHANNELS, FRAMES);
+  for (int i = 0; i < FRAMES; i++)
+    for (int j = 0; j < CHANNELS; j++)
+      EXPECT_EQ(input[i * CHANNELS + j], planar[j][i]);
+
+  /* Samples past full scale pass through untouched. */
+  dsp_util_interleave_float(planar_ptr, output, CHANNELS, FRAMES);
+  EXPECT_EQ(0, memcmp(input, output, sizeof(input)));
+}
+
+TEST(InterleaveTest, FloatStereo) {
+  /* Enough frames for the neon/sse loops and a tail. */
+  const int FRAMES = 11;
+  float input[FRAMES * 2];
+  float planar[2][FRAMES];
+  float *planar_ptr[] = {planar[0], planar[1]};
+  float output[FRAMES * 2];
+
+  for (int i = 0; i < FRAMES * 2; i++)
+    input[i] = i * 0.25f - 2.0f;
+
+  dsp_util_deinterleave_float(input, planar_ptr, 2, FRAMES);
+  for (int i = 0; i < FRAMES; i++) {
+    EXPECT_EQ(input[i * 2], planar[0][i]);
+    EXPECT_EQ(input[i * 2 + 1], planar[1][i]);
+  }
+
+  dsp_util_interleave_float(planar_ptr, output, 2, FRAMES);
+  EXPECT_EQ(0, memcmp(input, output, sizeof(input)));
+}
+
 TEST(EqTest, All) {
   struct eq *eq;
   size_t len = 44100;
@@ -339,7 +383,7 @@ TEST(DrcTest, All) {
   struct drc *drc;
 
   dsp_enable_flush_denormal_to_zero();
-  drc = drc_new(44100);
+  drc = drc_new(44100, 2);
 
   drc_set_param(drc, 0, PARAM_CROSSOVER_LOWER_FREQ, 0);
   drc_set_param(drc, 0, PARAM_ENABLED, 1);
@@ -403,6 +447,225 @@ TEST(DrcTest, All) {
   free(data_right);
 }
 
+TEST(EqnTest, MatchesMonoEq) {
+  const int channels = 6;
+  size_t len = 44100;
+  float NQ = len / 2;
+  float f_low = 10 / NQ;
+  float f_mid = 100 / NQ;
+  float f_high = 1000 / NQ;
+  float *data[channels];
+  float *ref[channels];
+  struct eq *eq[channels];
+  struct eqn *eqn;
+
+  dsp_enable_flush_denormal_to_zero();
+  EXPECT_EQ((void *)NULL, eqn_new(0));
+  EXPECT_EQ((void *)NULL, eqn_new(EQN_MAX_CHANNELS + 1));
+
+  /* Channel 4 has no biquad, the others one or two different ones. */
+  eqn = eqn_new(channels);
+  for (int c = 0; c < channels; c++) {
+    data[c] = (float *)calloc(len, sizeof(float));
+    ref[c] = (float *)calloc(len, sizeof(float));
+    add_sine(data[c], len, f_low, c, 1);
+    add_sine(data[c], len, f_high, 0, 1);
+    memcpy(ref[c], data[c], sizeof(float) * len);
+    eq[c] = eq_new();
+  }
+  for (int c = 0; c < 4; c++) {
+    enum biquad_type type = (c % 2) ? BQ_HIGHPASS : BQ_LOWPASS;
+    EXPECT_EQ(0, eqn_append_biquad(eqn, c, type, f_mid, 0, 0));
+    eq_append_biquad(eq[c], type, f_mid, 0, 0);
+  }
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(0, eqn_append_biquad(eqn, 5, BQ_LOWSHELF, f_mid, 0, -6));
+    eq_append_biquad(eq[5], BQ_LOWSHELF, f_mid, 0, -6);
+  }
+
+  /* Blocks that don't fill the vectors of a chunk. */
+  for (size_t start = 0; start < len; start += 1000) {
+    int chunk = std::min(len - start, (size_t)1000);
+    float *block[channels];
+
+    for (int c = 0; c < channels; c++) {
+      block[c] = data[c] + start;
+      eq_process(eq[c], ref[c] + start, chunk);
+    }
+    eqn_process(eqn, block, chunk);
+  }
+
+  for (int c = 0; c < channels; c++)
+    for (size_t i = 0; i < len; i++)
+      ASSERT_NEAR(ref[c][i], data[c][i], 1e-4) << c << " " << i;
+  EXPECT_NEAR(1, magnitude_at(data[0], len, f_low), 0.01);
+  EXPECT_NEAR(0, magnitude_at(data[0], len, f_high), 0.01);
+  EXPECT_NEAR(1, magnitude_at(data[1], len, f_high), 0.01);
+  EXPECT_NEAR(1, magnitude_at(data[4], len, f_low), 0.01);
+  EXPECT_NEAR(0.25, magnitude_at(data[5], len, f_low), 0.01);
+
+  /* Test for empty input */
+  eqn_process(eqn, data, 0);
+  eqn_free(eqn);
+
+  for (int c = 0; c < channels; c++) {
+    eq_free(eq[c]);
+    free(data[c]);
+    free(ref[c]);
+  }
+
+  /* Too many biquads */
+  eqn = eqn_new(channels);
+  for (int i = 0; i < MAX_BIQUADS_PER_EQN; i++)
+    EXPECT_EQ(0, eqn_append_biquad(eqn, 5, BQ_PEAKING, f_high, 5, 6));
+  EXPECT_EQ(-1, eqn_append_biquad(eqn, 5, BQ_PEAKING, f_high, 5, 6));
+  eqn_free(eqn);
+}
+
+TEST(CrossovernTest, MatchesMonoCrossover) {
+  const int channels = 6;
+  struct crossovern xon;
+  struct crossover xo[channels];
+  size_t len = 44100;
+  float NQ = len / 2;
+  float f0 = 62.5 / NQ;
+  float f1 = 250 / NQ;
+  float f2 = 1000 / NQ;
+  float f3 = 4000 / NQ;
+  float f4 = 16000 / NQ;
+  float *data0[channels], *data1[channels], *data2[channels];
+  float *ref0[channels], *ref1[channels], *ref2[channels];
+
+  dsp_enable_flush_denormal_to_zero();
+  EXPECT_EQ(-1, crossovern_init(&xon, CROSSOVERN_MAX_CHANNELS + 1, f1, f3));
+  EXPECT_EQ(0, crossovern_init(&xon, channels, f1, f3));
+  for (int c = 0; c < channels; c++) {
+    crossover_init(&xo[c], f1, f3);
+    data0[c] = (float *)calloc(len, sizeof(float));
+    data1[c] = (float *)calloc(len, sizeof(float));
+    data2[c] = (float *)calloc(len, sizeof(float));
+    ref0[c] = (float *)calloc(len, sizeof(float));
+    ref1[c] = (float *)calloc(len, sizeof(float));
+    ref2[c] = (float *)calloc(len, sizeof(float));
+    add_sine(data0[c], len, f0, c, 1);
+    add_sine(data0[c], len, f2, 0, 1.0 / (c + 1));
+    add_sine(data0[c], len, f4, 0, 1);
+    memcpy(ref0[c], data0[c], sizeof(float) * len);
+  }
+
+  for (size_t start = 0; start < len; start += 1000) {
+    int chunk = std::min(len - start, (size_t)1000);
+    float *block0[channels], *block1[channels], *block2[channels];
+
+    for (int c = 0; c < channels; c++) {
+      block0[c] = data0[c] + start;
+      block1[c] = data1[c] + start;
+      block2[c] = data2[c] + start;
+      crossover_process(&xo[c], chunk, ref0[c] + start, ref1[c] + start,
+                        ref2[c] + start);
+    }
+    crossovern_process(&xon, chunk, block0, block1, block2);
+  }
+
+  for (int c = 0; c < channels; c++) {
+    for (size_t i = 0; i < len; i++) {
+      ASSERT_NEAR(ref0[c][i], data0[c][i], 1e-4) << c << " " << i;
+      ASSERT_NEAR(ref1[c][i], data1[c][i], 1e-4) << c << " " << i;
+      ASSERT_NEAR(ref2[c][i], data2[c][i], 1e-4) << c << " " << i;
+    }
+  }
+  EXPECT_NEAR(1, magnitude_at(data0[5], len, f0), 0.01);
+  EXPECT_NEAR(1.0 / 6, magnitude_at(data1[5], len, f2), 0.01);
+  EXPECT_NEAR(1, magnitude_at(data2[5], len, f4), 0.01);
+
+  for (int c = 0; c < channels; c++) {
+    free(data0[c]);
+    free(data1[c]);
+    free(data2[c]);
+    free(ref0[c]);
+    free(ref1[c]);
+    free(ref2[c]);
+  }
+}
+
+/* Sets the parameters of the three kernels used by the DRC tests. */
+static void set_drc_params(struct drc *drc, float f1, float f3)
+{
+  for (int i = 0; i < DRC_NUM_KERNELS; i++) {
+    drc_set_param(drc, i, PARAM_ENABLED, i != 1);
+    drc_set_param(drc, i, PARAM_THRESHOLD, -30);
+    drc_set_param(drc, i, PARAM_KNEE, 0);
+    drc_set_param(drc, i, PARAM_RATIO, i == 2 ? 1 : 3);
+    drc_set_param(drc, i, PARAM_ATTACK, 0.02);
+    drc_set_param(drc, i, PARAM_RELEASE, 0.2);
+    drc_set_param(drc, i, PARAM_POST_GAIN, i == 2 ? 20 : 0);
+  }
+  drc_set_param(drc, 0, PARAM_CROSSOVER_LOWER_FREQ, 0);
+  drc_set_param(drc, 1, PARAM_CROSSOVER_LOWER_FREQ, f1);
+  drc_set_param(drc, 2, PARAM_CROSSOVER_LOWER_FREQ, f3);
+}
+
+TEST(DrcTest, MultichannelMatchesStereo) {
+  const int channels = 6;
+  size_t len = 44100;
+  float NQ = len / 2;
+  float f0 = 62.5 / NQ;
+  float f1 = 250 / NQ;
+  float f2 = 1000 / NQ;
+  float f3 = 4000 / NQ;
+  float f4 = 16000 / NQ;
+  float *data[channels];
+  float *stereo[2];
+  struct drc *drc, *drc2;
+
+  dsp_enable_flush_denormal_to_zero();
+  EXPECT_EQ((void *)NULL, drc_new(44100, DRC_MAX_CHANNELS + 1));
+
+  drc = drc_new(44100, channels);
+  drc2 = drc_new(44100, 2);
+  set_drc_params(drc, f1, f3);
+  set_drc_params(drc2, f1, f3);
+  drc_init(drc);
+  drc_init(drc2);
+
+  /* The loudest channel sets the gain of all, in both DRCs that's the
+   * first one, the others are quieter copies. */
+  for (int c = 0; c < channels; c++) {
+    data[c] = (float *)calloc(len, sizeof(float));
+    add_sine(data[c], len, f0, 0, c ? 0.5 : 1);
+    add_sine(data[c], len, f2, 0, c ? 0.5 : 1);
+    add_sine(data[c], len, f4, 0, c ? 0.5 : 1);
+  }
+  for (int c = 0; c < 2; c++) {
+    stereo[c] = (float *)malloc(sizeof(float) * len);
+    memcpy(stereo[c], data[c], sizeof(float) * len);
+  }
+
+  for (size_t start = 0; start < len; start += DRC_PROCESS_MAX_FRAMES) {
+    int chunk = std::min(len - start, (size_t)DRC_PROCESS_MAX_FRAMES);
+    float *block[channels];
+
+    for (int c = 0; c < channels; c++)
+      block[c] = data[c] + start;
+    drc_process(drc, block, chunk);
+    block[0] = stereo[0] + start;
+    block[1] = stereo[1] + start;
+    drc_process(drc2, block, chunk);
+  }
+
+  for (int c = 0; c < channels; c++)
+    for (size_t i = 0; i < len; i++)
+      ASSERT_NEAR(stereo[c ? 1 : 0][i], data[c][i], 1e-3) << c << " " << i;
+  EXPECT_NEAR(10, magnitude_at(data[0], len, f4), 1);
+
+  drc_free(drc);
+  drc_free(drc2);
+  for (int c = 0; c < channels; c++)
+    free(data[c]);
+  free(stereo[0]);
+  free(stereo[1]);
+}
+
 }  //  namespace
 
 int main(int argc, char **argv) {
@@ -0,0 +1,101 @@
+// Copyright (c) 2015 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <gtest/gtest.h>
+
+#include "cras_dsp_module.h"
+
+namespace {
+
+class DspModBuiltinTestSuite : public testing::Test {
+  protected:
+    virtual void SetUp() {
+      memset(&plugin_, 0, sizeof(plugin_));
+      plugin_.library = "builtin";
+    }
+
+    virtual void TearDown() {
+      ARRAY_FREE(&plugin_.ports);
+    }
+
+    void AddPorts(port_direction direction, port_type type, int count) {
+      for (int i = 0; i < count; i++) {
+        struct port *port = ARRAY_APPEND_ZERO(&plugin_.ports);
+        port->direction = direction;
+        port->type = type;
+        port->flow_id = INVALID_FLOW_ID;
+      }
+    }
+
+    // Loads the plugin, checks it loaded or not, and frees it.
+    void ExpectLoads(bool loads) {
+      struct dsp_module *module = cras_dsp_module_load_builtin(&plugin_);
+      EXPECT_EQ(loads, module != NULL);
+      if (module)
+        module->free_module(module);
+    }
+
+    struct plugin plugin_;
+};
+
+TEST_F(DspModBuiltinTestSuite, EqnLoadsStereo) {
+  plugin_.label = "eqn";
+  AddPorts(PORT_INPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_OUTPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_INPUT, PORT_CONTROL, 8);
+  ExpectLoads(true);
+}
+
+TEST_F(DspModBuiltinTestSuite, EqnRejectsMissingOutputs) {
+  plugin_.label = "eqn";
+  AddPorts(PORT_INPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_OUTPUT, PORT_AUDIO, 1);
+  ExpectLoads(false);
+}
+
+TEST_F(DspModBuiltinTestSuite, EqnRejectsControlInPlaceOfOutput) {
+  plugin_.label = "eqn";
+  AddPorts(PORT_INPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_OUTPUT, PORT_AUDIO, 1);
+  AddPorts(PORT_INPUT, PORT_CONTROL, 8);
+  ExpectLoads(false);
+}
+
+TEST_F(DspModBuiltinTestSuite, EqnRejectsOutputsBeforeInputs) {
+  plugin_.label = "eqn";
+  AddPorts(PORT_OUTPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_INPUT, PORT_AUDIO, 2);
+  ExpectLoads(false);
+}
+
+TEST_F(DspModBuiltinTestSuite, DrcnLoadsStereo) {
+  plugin_.label = "drcn";
+  AddPorts(PORT_INPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_OUTPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_INPUT, PORT_CONTROL, 1 + 8 * 3);
+  ExpectLoads(true);
+}
+
+TEST_F(DspModBuiltinTestSuite, DrcnRejectsControlInPlaceOfOutput) {
+  plugin_.label = "drcn";
+  AddPorts(PORT_INPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_OUTPUT, PORT_AUDIO, 1);
+  AddPorts(PORT_INPUT, PORT_CONTROL, 2 + 8 * 3);
+  ExpectLoads(false);
+}
+
+TEST_F(DspModBuiltinTestSuite, DrcnRejectsMissingParameters) {
+  plugin_.label = "drcn";
+  AddPorts(PORT_INPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_OUTPUT, PORT_AUDIO, 2);
+  AddPorts(PORT_INPUT, PORT_CONTROL, 8 * 3);
+  ExpectLoads(false);
+}
+
+}  //  namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -3,9 +3,12 @@
 // found in the LICENSE file.
 
 #include <gtest/gtest.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "cras_dsp.h"
 #include "cras_dsp_module.h"
+#include "cras_dsp_pipeline.h"
 
 #define FILENAME_TEMPLATE "DspTest.XXXXXX"
 
@@ -105,6 +108,171 @@ TEST_F(DspTestSuite, Simple) {
   cras_dsp_stop();
 }
 
+static void *SyncThread(void *arg)
+{
+  cras_dsp_sync();
+  *(int *)arg = 1;
+  return NULL;
+}
+
+TEST_F(DspTestSuite, ReloadWaitsForPipelineInUse) {
+  const char *content =
+      "[M1]\n"
+      "library=builtin\n"
+      "label=source\n"
+      "purpose=playback\n"
+      "output_0={audio}\n"
+      "[M2]\n"
+      "library=builtin\n"
+      "label=sink\n"
+      "purpose=playback\n"
+      "input_0={audio}\n"
+      "\n";
+  fprintf(fp, "%s", content);
+  CloseFile();
+
+  cras_dsp_init(filename);
+  struct cras_dsp_context *ctx = cras_dsp_context_new(1, 48000, "playback");
+  cras_dsp_load_pipeline(ctx);
+  cras_dsp_sync();
+
+  /* Hold the pipeline as the audio thread would while a reload happens. */
+  struct pipeline *old_pipeline = cras_dsp_get_pipeline(ctx);
+  ASSERT_TRUE(old_pipeline);
+  cras_dsp_load_pipeline(ctx);
+
+  pthread_t tid;
+  volatile int synced = 0;
+  ASSERT_EQ(0, pthread_create(&tid, NULL, SyncThread, (void *)&synced));
+  usleep(20000);
+  /* The old pipeline can't be freed, so the reload is still pending. */
+  EXPECT_EQ(0, synced);
+
+  cras_dsp_put_pipeline(ctx);
+  pthread_join(tid, NULL);
+  EXPECT_EQ(1, synced);
+
+  /* The next access gets the new pipeline. */
+  struct pipeline *pipeline = cras_dsp_get_pipeline(ctx);
+  ASSERT_TRUE(pipeline);
+  EXPECT_NE(old_pipeline, pipeline);
+  cras_dsp_put_pipeline(ctx);
+
+  cras_dsp_context_free(ctx);
+  cras_dsp_stop();
+}
+
+static int modules_freed;
+
+TEST_F(DspTestSuite, FreesOldPipelineOnceFaded) {
+  const char *content =
+      "[M1]\n"
+      "library=builtin\n"
+      "label=source\n"
+      "purpose=playback\n"
+      "output_0={audio}\n"
+      "[M2]\n"
+      "library=builtin\n"
+      "label=sink\n"
+      "purpose=playback\n"
+      "input_0={audio}\n"
+      "\n";
+  fprintf(fp, "%s", content);
+  CloseFile();
+
+  cras_dsp_init(filename);
+  cras_dsp_set_crossfade_ms(10);
+  struct cras_dsp_context *ctx = cras_dsp_context_new(1, 48000, "playback");
+  cras_dsp_load_pipeline(ctx);
+  cras_dsp_sync();
+  cras_dsp_load_pipeline(ctx);
+  cras_dsp_sync();
+
+  /* The new pipeline fades from the old one, which is kept meanwhile. */
+  struct pipeline *pipeline = cras_dsp_get_pipeline(ctx);
+  ASSERT_TRUE(pipeline);
+  EXPECT_TRUE(cras_dsp_pipeline_has_fade_from(pipeline));
+  __atomic_store_n(&modules_freed, 0, __ATOMIC_RELAXED);
+
+  /* Run the 480 frames of the fade. */
+  int16_t buf[480] = {0};
+  cras_dsp_pipeline_apply(pipeline, 1, (uint8_t *)buf, 240);
+  EXPECT_FALSE(cras_dsp_pipeline_fade_done(pipeline));
+  cras_dsp_pipeline_apply(pipeline, 1, (uint8_t *)buf, 240);
+  EXPECT_TRUE(cras_dsp_pipeline_fade_done(pipeline));
+  cras_dsp_put_pipeline(ctx);
+
+  /* The two modules of the old pipeline are freed soon after. */
+  for (int i = 0; i < 100; i++) {
+    if (__atomic_load_n(&modules_freed, __ATOMIC_RELAXED) == 2)
+      break;
+    usleep(10000);
+  }
+  EXPECT_EQ(2, __atomic_load_n(&modules_freed, __ATOMIC_RELAXED));
+  cras_dsp_sync();
+  EXPECT_FALSE(cras_dsp_pipeline_has_fade_from(pipeline));
+
+  cras_dsp_context_free(ctx);
+  cras_dsp_stop();
+  cras_dsp_set_crossfade_ms(20);
+}
+
+TEST_F(DspTestSuite, DefersReloadDuringFade) {
+  const char *content =
+      "[M1]\n"
+      "library=builtin\n"
+      "label=source\n"
+      "purpose=playback\n"
+      "output_0={audio}\n"
+      "[M2]\n"
+      "library=builtin\n"
+      "label=sink\n"
+      "purpose=playback\n"
+      "input_0={audio}\n"
+      "\n";
+  fprintf(fp, "%s", content);
+  CloseFile();
+
+  cras_dsp_init(filename);
+  cras_dsp_set_crossfade_ms(10);
+  struct cras_dsp_context *ctx = cras_dsp_context_new(1, 48000, "playback");
+  cras_dsp_load_pipeline(ctx);
+  cras_dsp_sync();
+  cras_dsp_load_pipeline(ctx);
+  cras_dsp_sync();
+
+  struct pipeline *pipeline = cras_dsp_get_pipeline(ctx);
+  ASSERT_TRUE(pipeline);
+  int16_t buf[480] = {0};
+  cras_dsp_pipeline_apply(pipeline, 1, (uint8_t *)buf, 240);
+  cras_dsp_put_pipeline(ctx);
+
+  /* A reload in the middle of the fade keeps the fading pipeline. */
+  cras_dsp_load_pipeline(ctx);
+  cras_dsp_sync();
+  ASSERT_EQ(pipeline, cras_dsp_get_pipeline(ctx));
+  EXPECT_TRUE(cras_dsp_pipeline_has_fade_from(pipeline));
+  EXPECT_FALSE(cras_dsp_pipeline_fade_done(pipeline));
+
+  /* Once the fade is done, the deferred reload fades from it. */
+  cras_dsp_pipeline_apply(pipeline, 1, (uint8_t *)buf, 240);
+  EXPECT_TRUE(cras_dsp_pipeline_fade_done(pipeline));
+  cras_dsp_put_pipeline(ctx);
+
+  struct pipeline *reloaded = pipeline;
+  for (int i = 0; i < 100 && reloaded == pipeline; i++) {
+    usleep(10000);
+    reloaded = cras_dsp_get_pipeline(ctx);
+    cras_dsp_put_pipeline(ctx);
+  }
+  ASSERT_NE(pipeline, reloaded);
+  EXPECT_TRUE(cras_dsp_pipeline_has_fade_from(reloaded));
+
+  cras_dsp_context_free(ctx);
+  cras_dsp_stop();
+  cras_dsp_set_crossfade_ms(20);
+}
+
 static int empty_instantiate(struct dsp_module *module,
                              unsigned long sample_rate)
 {
@@ -125,6 +293,7 @@ static void empty_deinstantiate(struct dsp_module *module) {}
 
 static void empty_free_module(struct dsp_module *module)
 {
+  __atomic_add_fetch(&modules_freed, 1, __ATOMIC_RELAXED);
   free(module);
 }
 
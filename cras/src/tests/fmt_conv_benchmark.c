@@ -0,0 +1,185 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures the throughput of the sample format and channel converters with
+ * each set of SIMD extensions the CPU has.  Prints the MB/s read from the
+ * input buffer.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cras_audio_format.h"
+#include "cras_cpu.h"
+#include "cras_fmt_conv.h"
+#include "cras_util.h"
+
+#define BENCH_FRAMES 4096
+#define BENCH_CHANNELS 2
+#define BENCH_MAX_CHANNELS 8
+#define BENCH_SECONDS 0.5
+
+static const struct {
+	const char *name;
+	unsigned int cpu_flags;
+} cpu_flag_sets[] = {
+	{ "c", 0 },
+	{ "sse2", CRAS_CPU_SSE2 },
+	{ "avx2", CRAS_CPU_SSE2 | CRAS_CPU_AVX2 },
+	{ "neon", CRAS_CPU_NEON },
+};
+
+static const struct {
+	const char *name;
+	snd_pcm_format_t format;
+} formats[] = {
+	{ "u8", SND_PCM_FORMAT_U8 },
+	{ "s24le", SND_PCM_FORMAT_S24_LE },
+	{ "s32le", SND_PCM_FORMAT_S32_LE },
+	{ "floatle", SND_PCM_FORMAT_FLOAT_LE },
+};
+
+/* Channel conversions of S16LE, by channel layouts. */
+static const struct {
+	const char *name;
+	size_t in_channels;
+	size_t out_channels;
+	int8_t in_layout[CRAS_CH_MAX];
+	int8_t out_layout[CRAS_CH_MAX];
+} channel_convs[] = {
+	{ "51_to_stereo", 6, 2,
+	  { 0, 1, 2, 3, 4, 5, -1, -1, -1, -1, -1 },
+	  { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 } },
+	{ "51_reorder", 6, 6,
+	  { 0, 1, 2, 3, 4, 5, -1, -1, -1, -1, -1 },
+	  { 0, 1, 4, 5, 2, 3, -1, -1, -1, -1, -1 } },
+	{ "71_reorder", 8, 8,
+	  { 0, 1, 2, 3, 4, 5, 6, 7, -1, -1, -1 },
+	  { 0, 1, 4, 5, 2, 3, 6, 7, -1, -1, -1 } },
+};
+
+static double tp_diff(struct timespec *tp2, struct timespec *tp1)
+{
+	return (tp2->tv_sec - tp1->tv_sec)
+		+ (tp2->tv_nsec - tp1->tv_nsec) * 1e-9;
+}
+
+/* Runs one conversion over and over for BENCH_SECONDS, returns MB/s. */
+static double bench(const struct cras_audio_format *in_fmt,
+		    const struct cras_audio_format *out_fmt,
+		    uint8_t *in_buf, uint8_t *out_buf)
+{
+	struct cras_fmt_conv *conv;
+	struct timespec tp1, tp2;
+	size_t rounds = 0;
+	double elapsed;
+
+	conv = cras_fmt_conv_create(in_fmt, out_fmt, BENCH_FRAMES);
+	if (!conv)
+		return 0;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp1);
+	do {
+		cras_fmt_conv_convert_frames(conv, in_buf, out_buf,
+					     BENCH_FRAMES, BENCH_FRAMES);
+		rounds++;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp2);
+		elapsed = tp_diff(&tp2, &tp1);
+	} while (elapsed < BENCH_SECONDS);
+
+	cras_fmt_conv_destroy(conv);
+
+	return rounds * BENCH_FRAMES * cras_get_format_bytes(in_fmt)
+		/ elapsed / 1e6;
+}
+
+/* Prints the MB/s of a conversion with each set of SIMD extensions. */
+static void bench_all(const char *name,
+		      const struct cras_audio_format *in_fmt,
+		      const struct cras_audio_format *out_fmt,
+		      uint8_t *in_buf, uint8_t *out_buf)
+{
+	unsigned int cpu = cras_cpu_get_flags();
+	size_t f;
+
+	printf("%-18s", name);
+	for (f = 0; f < ARRAY_SIZE(cpu_flag_sets); f++) {
+		if ((cpu & cpu_flag_sets[f].cpu_flags) !=
+				cpu_flag_sets[f].cpu_flags)
+			continue;
+		cras_fmt_conv_set_cpu_flags(cpu_flag_sets[f].cpu_flags);
+		printf("%10.0f", bench(in_fmt, out_fmt, in_buf, out_buf));
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int cpu = cras_cpu_get_flags();
+	struct cras_audio_format in_fmt, out_fmt;
+	uint8_t *in_buf, *out_buf;
+	size_t size, i, f;
+
+	/* Big enough for the widest sample and the most channels. */
+	size = BENCH_FRAMES * BENCH_MAX_CHANNELS * 4;
+	in_buf = malloc(size);
+	out_buf = malloc(size);
+
+	printf("%-18s", "converter");
+	for (f = 0; f < ARRAY_SIZE(cpu_flag_sets); f++)
+		if ((cpu & cpu_flag_sets[f].cpu_flags) ==
+				cpu_flag_sets[f].cpu_flags)
+			printf("%10s", cpu_flag_sets[f].name);
+	printf("\n");
+
+	in_fmt.frame_rate = out_fmt.frame_rate = 48000;
+	for (i = 0; i < CRAS_CH_MAX; i++)
+		in_fmt.channel_layout[i] = out_fmt.channel_layout[i] = -1;
+
+	for (i = 0; i < 2 * ARRAY_SIZE(formats); i++) {
+		snd_pcm_format_t other = formats[i / 2].format;
+		int to_s16 = !(i & 1);
+		char name[32];
+
+		in_fmt.format = to_s16 ? other : SND_PCM_FORMAT_S16_LE;
+		out_fmt.format = to_s16 ? SND_PCM_FORMAT_S16_LE : other;
+		in_fmt.num_channels = out_fmt.num_channels = BENCH_CHANNELS;
+
+		/* Random samples, in range for float input. */
+		for (f = 0; f < size / 2; f++)
+			((int16_t *)in_buf)[f] = rand();
+		if (in_fmt.format == SND_PCM_FORMAT_FLOAT_LE)
+			for (f = 0; f < size / 4; f++)
+				((float *)in_buf)[f] =
+					2.0f * rand() / RAND_MAX - 1.0f;
+
+		snprintf(name, sizeof(name), "%s_to_%s",
+			 to_s16 ? formats[i / 2].name : "s16le",
+			 to_s16 ? "s16le" : formats[i / 2].name);
+		bench_all(name, &in_fmt, &out_fmt, in_buf, out_buf);
+	}
+
+	in_fmt.format = out_fmt.format = SND_PCM_FORMAT_S16_LE;
+	for (f = 0; f < size / 2; f++)
+		((int16_t *)in_buf)[f] = rand();
+	for (i = 0; i < ARRAY_SIZE(channel_convs); i++) {
+		in_fmt.num_channels = channel_convs[i].in_channels;
+		out_fmt.num_channels = channel_convs[i].out_channels;
+		for (f = 0; f < CRAS_CH_MAX; f++) {
+			in_fmt.channel_layout[f] = channel_convs[i].in_layout[f];
+			out_fmt.channel_layout[f] =
+				channel_convs[i].out_layout[f];
+		}
+		bench_all(channel_convs[i].name, &in_fmt, &out_fmt,
+			  in_buf, out_buf);
+	}
+
+	free(in_buf);
+	free(out_buf);
+	return 0;
+}
@@ -5,12 +5,15 @@
 #include <gtest/gtest.h>
 
 extern "C" {
+#include "cras_cpu.h"
 #include "cras_fmt_conv.h"
 #include "cras_types.h"
+#include "cras_util.h"
 }
 
 static int surround_channel_layout[CRAS_CH_MAX] =
 	{0, 1, 2, 3, 4, 5, -1, -1, -1, -1, -1};
+static float stub_conv_mtx[CRAS_CH_MAX][CRAS_CH_MAX];
 
 // Like malloc or calloc, but fill the memory with random bytes.
 static void *ralloc(size_t size) {
@@ -438,6 +441,43 @@ TEST(FormatConverterTest, ConvertS24LEToS16LE) {
   free(out_buff);
 }
 
+// Test 24 to 32 bit conversion, neither side is 16 bit.
+TEST(FormatConverterTest, ConvertS24LEToS32LE) {
+  struct cras_fmt_conv *c;
+  struct cras_audio_format in_fmt;
+  struct cras_audio_format out_fmt;
+
+  size_t out_frames;
+  int32_t *in_buff;
+  int32_t *out_buff;
+  const size_t buf_size = 4096;
+
+  in_fmt.format = SND_PCM_FORMAT_S24_LE;
+  out_fmt.format = SND_PCM_FORMAT_S32_LE;
+  in_fmt.num_channels = out_fmt.num_channels = 2;
+  in_fmt.frame_rate = 48000;
+  out_fmt.frame_rate = 48000;
+
+  c = cras_fmt_conv_create(&in_fmt, &out_fmt, buf_size);
+  ASSERT_NE(c, (void *)NULL);
+
+  in_buff = (int32_t *)ralloc(buf_size * cras_get_format_bytes(&in_fmt));
+  out_buff = (int32_t *)ralloc(buf_size * cras_get_format_bytes(&out_fmt));
+  out_frames = cras_fmt_conv_convert_frames(c,
+                                            (uint8_t *)in_buff,
+                                            (uint8_t *)out_buff,
+                                            buf_size,
+                                            buf_size);
+  EXPECT_EQ(buf_size, out_frames);
+  for (unsigned int i = 0; i < buf_size * 2; i++)
+    EXPECT_EQ((int32_t)((uint32_t)(int16_t)(in_buff[i] >> 8) << 16),
+              out_buff[i]);
+
+  cras_fmt_conv_destroy(c);
+  free(in_buff);
+  free(out_buff);
+}
+
 // Test 8 to 16 bit conversion.
 TEST(FormatConverterTest, ConvertU8LEToS16LE) {
   struct cras_fmt_conv *c;
@@ -950,6 +990,458 @@ TEST(FormatConverterTest, ConvertS32LEToS16LEDownmix51ToStereo96To48Short) {
   free(out_buff);
 }
 
+// Converts with the plain C sample converters and with those allowed by
+// cpu_flags and checks they agree.  The odd frame count leaves a tail for the
+// C code.
+static void CheckSimdSampleConversion(snd_pcm_format_t in_format,
+                                      snd_pcm_format_t out_format,
+                                      unsigned int cpu_flags) {
+  struct cras_audio_format in_fmt;
+  struct cras_audio_format out_fmt;
+  struct cras_fmt_conv *c;
+  const size_t buf_size = 1021;
+  uint8_t *in_buff;
+  uint8_t *c_buff;
+  uint8_t *simd_buff;
+  size_t out_bytes;
+
+  in_fmt.format = in_format;
+  out_fmt.format = out_format;
+  in_fmt.num_channels = out_fmt.num_channels = 1;
+  in_fmt.frame_rate = out_fmt.frame_rate = 48000;
+  out_bytes = buf_size * cras_get_format_bytes(&out_fmt);
+
+  in_buff = (uint8_t *)ralloc(buf_size * cras_get_format_bytes(&in_fmt));
+  if (in_format == SND_PCM_FORMAT_FLOAT_LE) {
+    // Past full scale on both sides to exercise the clipping.
+    for (size_t i = 0; i < buf_size; i++)
+      ((float *)in_buff)[i] = (rand() / (float)RAND_MAX - 0.5f) * 3.0f;
+  }
+  c_buff = (uint8_t *)calloc(1, out_bytes);
+  simd_buff = (uint8_t *)calloc(1, out_bytes);
+
+  cras_fmt_conv_set_cpu_flags(0);
+  c = cras_fmt_conv_create(&in_fmt, &out_fmt, buf_size);
+  ASSERT_NE(c, (void *)NULL);
+  EXPECT_EQ(buf_size, cras_fmt_conv_convert_frames(c, in_buff, c_buff,
+                                                   buf_size, buf_size));
+  cras_fmt_conv_destroy(c);
+
+  cras_fmt_conv_set_cpu_flags(cpu_flags);
+  c = cras_fmt_conv_create(&in_fmt, &out_fmt, buf_size);
+  ASSERT_NE(c, (void *)NULL);
+  EXPECT_EQ(buf_size, cras_fmt_conv_convert_frames(c, in_buff, simd_buff,
+                                                   buf_size, buf_size));
+  cras_fmt_conv_destroy(c);
+
+  EXPECT_EQ(0, memcmp(c_buff, simd_buff, out_bytes));
+
+  cras_fmt_conv_set_cpu_flags(~0U);
+  free(in_buff);
+  free(c_buff);
+  free(simd_buff);
+}
+
+TEST(FormatConverterTest, SimdSampleConvertersMatchC) {
+  static const snd_pcm_format_t formats[] = {
+    SND_PCM_FORMAT_U8,
+    SND_PCM_FORMAT_S24_LE,
+    SND_PCM_FORMAT_S32_LE,
+    SND_PCM_FORMAT_FLOAT_LE,
+  };
+
+  static const unsigned int cpu_flags[] = {
+    CRAS_CPU_SSE2,
+    CRAS_CPU_SSE2 | CRAS_CPU_AVX2,
+    CRAS_CPU_NEON,
+  };
+
+  // Flag sets the CPU lacks fall back to C and trivially pass.
+  for (size_t f = 0; f < ARRAY_SIZE(cpu_flags); f++) {
+    for (size_t i = 0; i < ARRAY_SIZE(formats); i++) {
+      CheckSimdSampleConversion(formats[i], SND_PCM_FORMAT_S16_LE,
+                                cpu_flags[f]);
+      CheckSimdSampleConversion(SND_PCM_FORMAT_S16_LE, formats[i],
+                                cpu_flags[f]);
+    }
+  }
+}
+
+// Converts in_frames of in_buff from in_fmt to out_fmt with a single
+// converter, or copies them if no conversion is needed.  Returns the frames
+// written to out_buff.
+static size_t ConvertOneStep(const struct cras_audio_format *in_fmt,
+                             const struct cras_audio_format *out_fmt,
+                             uint8_t *in_buff, size_t in_frames,
+                             uint8_t *out_buff) {
+  struct cras_fmt_conv *c;
+  size_t out_frames;
+
+  if (!cras_fmt_conversion_needed(in_fmt, out_fmt)) {
+    memcpy(out_buff, in_buff, in_frames * cras_get_format_bytes(in_fmt));
+    return in_frames;
+  }
+  c = cras_fmt_conv_create(in_fmt, out_fmt, in_frames);
+  out_frames = cras_fmt_conv_convert_frames(
+      c, in_buff, out_buff, in_frames,
+      cras_fmt_conv_in_frames_to_out(c, in_frames));
+  cras_fmt_conv_destroy(c);
+  return out_frames;
+}
+
+static bool IsWideFormat(snd_pcm_format_t format) {
+  return format == SND_PCM_FORMAT_S24_LE ||
+         format == SND_PCM_FORMAT_S32_LE ||
+         format == SND_PCM_FORMAT_FLOAT_LE;
+}
+
+// Checks the fused converter for a conversion against the chain of single
+// stages: sample format to S16, then channels and rate, then the output
+// format.
+static void CheckFusedConversion(snd_pcm_format_t in_format,
+                                 size_t in_channels,
+                                 snd_pcm_format_t out_format,
+                                 size_t out_channels,
+                                 size_t out_rate) {
+  struct cras_audio_format in_fmt, out_fmt, s16_in_fmt, s16_out_fmt;
+  struct cras_fmt_conv *c;
+  const size_t buf_size = 1021;
+  const size_t max_bytes = buf_size * 2 * 4 * 6;
+  uint8_t *in_buff, *tmp_buff, *tmp2_buff, *chain_buff, *fused_buff;
+  size_t frames, fused_frames;
+
+  in_fmt.format = in_format;
+  in_fmt.num_channels = in_channels;
+  in_fmt.frame_rate = 48000;
+  out_fmt.format = out_format;
+  out_fmt.num_channels = out_channels;
+  out_fmt.frame_rate = out_rate;
+  for (size_t i = 0; i < CRAS_CH_MAX; i++)
+    in_fmt.channel_layout[i] = out_fmt.channel_layout[i] = -1;
+  s16_in_fmt = in_fmt;
+  s16_in_fmt.format = SND_PCM_FORMAT_S16_LE;
+  s16_out_fmt = out_fmt;
+  s16_out_fmt.format = SND_PCM_FORMAT_S16_LE;
+  if (!cras_fmt_conversion_needed(&in_fmt, &out_fmt))
+    return;
+  // Wider formats convert channels and rate in float, with nothing fused.
+  if ((IsWideFormat(in_format) || IsWideFormat(out_format)) &&
+      (in_channels != out_channels || out_rate != in_fmt.frame_rate))
+    return;
+
+  in_buff = (uint8_t *)ralloc(buf_size * cras_get_format_bytes(&in_fmt));
+  if (in_format == SND_PCM_FORMAT_FLOAT_LE) {
+    for (size_t i = 0; i < buf_size * in_channels; i++)
+      ((float *)in_buff)[i] = (rand() / (float)RAND_MAX - 0.5f) * 3.0f;
+  }
+  tmp_buff = (uint8_t *)calloc(1, max_bytes);
+  tmp2_buff = (uint8_t *)calloc(1, max_bytes);
+  chain_buff = (uint8_t *)calloc(1, max_bytes);
+  fused_buff = (uint8_t *)calloc(1, max_bytes);
+
+  frames = ConvertOneStep(&in_fmt, &s16_in_fmt, in_buff, buf_size, tmp_buff);
+  frames = ConvertOneStep(&s16_in_fmt, &s16_out_fmt, tmp_buff, frames,
+                          tmp2_buff);
+  frames = ConvertOneStep(&s16_out_fmt, &out_fmt, tmp2_buff, frames,
+                          chain_buff);
+
+  c = cras_fmt_conv_create(&in_fmt, &out_fmt, buf_size);
+  ASSERT_NE(c, (void *)NULL);
+  fused_frames = cras_fmt_conv_convert_frames(
+      c, in_buff, fused_buff, buf_size,
+      cras_fmt_conv_in_frames_to_out(c, buf_size));
+  cras_fmt_conv_destroy(c);
+
+  EXPECT_EQ(frames, fused_frames);
+  EXPECT_EQ(0, memcmp(chain_buff, fused_buff,
+                      frames * cras_get_format_bytes(&out_fmt)));
+
+  free(in_buff);
+  free(tmp_buff);
+  free(tmp2_buff);
+  free(chain_buff);
+  free(fused_buff);
+}
+
+TEST(FormatConverterTest, FusedConvertersMatchChain) {
+  static const snd_pcm_format_t formats[] = {
+    SND_PCM_FORMAT_U8,
+    SND_PCM_FORMAT_S16_LE,
+    SND_PCM_FORMAT_S24_LE,
+    SND_PCM_FORMAT_S32_LE,
+    SND_PCM_FORMAT_FLOAT_LE,
+  };
+
+  // Without SIMD converters every fused converter is used.
+  static const unsigned int cpu_flags[] = { 0, ~0U };
+
+  for (size_t f = 0; f < ARRAY_SIZE(cpu_flags); f++) {
+    cras_fmt_conv_set_cpu_flags(cpu_flags[f]);
+    for (size_t i = 0; i < ARRAY_SIZE(formats); i++) {
+      for (size_t o = 0; o < ARRAY_SIZE(formats); o++) {
+        CheckFusedConversion(formats[i], 1, formats[o], 2, 48000);
+        CheckFusedConversion(formats[i], 2, formats[o], 1, 48000);
+        CheckFusedConversion(formats[i], 2, formats[o], 2, 48000);
+        CheckFusedConversion(formats[i], 6, formats[o], 6, 48000);
+        CheckFusedConversion(formats[i], 2, formats[o], 1, 96000);
+      }
+    }
+  }
+  cras_fmt_conv_set_cpu_flags(~0U);
+}
+
+// Channels of S32 samples are converted without dropping their low bits.
+TEST(FormatConverterTest, ConvertChannelsKeepsS32LowBits) {
+  struct cras_audio_format in_fmt;
+  struct cras_audio_format out_fmt;
+  struct cras_fmt_conv *c;
+  const size_t buf_size = 64;
+  int32_t in_buff[buf_size];
+  int32_t out_buff[buf_size * 2];
+  size_t out_frames;
+
+  in_fmt.format = out_fmt.format = SND_PCM_FORMAT_S32_LE;
+  in_fmt.num_channels = 1;
+  out_fmt.num_channels = 2;
+  in_fmt.frame_rate = out_fmt.frame_rate = 48000;
+  for (size_t i = 0; i < CRAS_CH_MAX; i++)
+    in_fmt.channel_layout[i] = out_fmt.channel_layout[i] = -1;
+  // Values a float holds exactly, with bits below the top 16 set.
+  for (size_t i = 0; i < buf_size; i++)
+    in_buff[i] = ((int32_t)i - 32) * 0x10101;
+
+  c = cras_fmt_conv_create(&in_fmt, &out_fmt, buf_size);
+  ASSERT_NE(c, (void *)NULL);
+  out_frames = cras_fmt_conv_convert_frames(c, (uint8_t *)in_buff,
+                                            (uint8_t *)out_buff,
+                                            buf_size, buf_size);
+  EXPECT_EQ(buf_size, out_frames);
+  for (size_t i = 0; i < buf_size; i++) {
+    EXPECT_EQ(in_buff[i], out_buff[2 * i]);
+    EXPECT_EQ(in_buff[i], out_buff[2 * i + 1]);
+  }
+  cras_fmt_conv_destroy(c);
+}
+
+// Resampling S32 from 44.1 to 48 kHz keeps the bits below the top 16: inputs
+// differing only there give outputs that differ as much.
+TEST(FormatConverterTest, Convert44to48KeepsS32LowBits) {
+  struct cras_audio_format in_fmt;
+  struct cras_audio_format out_fmt;
+  struct cras_fmt_conv *c;
+  const size_t in_frames = 441;
+  const size_t out_frames = 480;
+  const int32_t base = 0x10000000;
+  const int32_t low = 0x8000;
+  int32_t in_buff[in_frames];
+  int32_t out_base[out_frames];
+  int32_t out_low[out_frames];
+  size_t frames;
+
+  in_fmt.format = out_fmt.format = SND_PCM_FORMAT_S32_LE;
+  in_fmt.num_channels = out_fmt.num_channels = 1;
+  in_fmt.frame_rate = 44100;
+  out_fmt.frame_rate = 48000;
+  for (size_t i = 0; i < CRAS_CH_MAX; i++)
+    in_fmt.channel_layout[i] = out_fmt.channel_layout[i] = -1;
+
+  for (size_t i = 0; i < in_frames; i++)
+    in_buff[i] = base;
+  c = cras_fmt_conv_create(&in_fmt, &out_fmt, out_frames);
+  ASSERT_NE(c, (void *)NULL);
+  frames = cras_fmt_conv_convert_frames(c, (uint8_t *)in_buff,
+                                        (uint8_t *)out_base,
+                                        in_frames, out_frames);
+  cras_fmt_conv_destroy(c);
+  ASSERT_GT(frames, out_frames / 2);
+
+  for (size_t i = 0; i < in_frames; i++)
+    in_buff[i] = base + low;
+  c = cras_fmt_conv_create(&in_fmt, &out_fmt, out_frames);
+  ASSERT_NE(c, (void *)NULL);
+  EXPECT_EQ(frames, cras_fmt_conv_convert_frames(c, (uint8_t *)in_buff,
+                                                 (uint8_t *)out_low,
+                                                 in_frames, out_frames));
+  cras_fmt_conv_destroy(c);
+
+  // Past the filter's rise from silence the outputs are steady.
+  for (size_t i = frames / 2; i < frames; i++) {
+    EXPECT_NEAR(base, out_base[i], base / 100);
+    EXPECT_NEAR(low, out_low[i] - out_base[i], low / 100);
+  }
+}
+
+// With the output full the resampler uses only part of the input, and says
+// how much.
+TEST(FormatConverterTest, ConvertSomeFramesReportsInputUsed) {
+  struct cras_audio_format in_fmt;
+  struct cras_audio_format out_fmt;
+  struct cras_fmt_conv *c;
+  const size_t buf_size = 4096;
+  int16_t *in_buff;
+  int16_t *out_buff;
+  size_t in_frames, out_frames, total_in = 0;
+
+  in_fmt.format = out_fmt.format = SND_PCM_FORMAT_S16_LE;
+  in_fmt.num_channels = out_fmt.num_channels = 2;
+  in_fmt.frame_rate = 48000;
+  out_fmt.frame_rate = 44100;
+  for (size_t i = 0; i < CRAS_CH_MAX; i++)
+    in_fmt.channel_layout[i] = out_fmt.channel_layout[i] = -1;
+  in_buff = (int16_t *)ralloc(buf_size * 4);
+  out_buff = (int16_t *)malloc(buf_size * 4);
+
+  c = cras_fmt_conv_create(&in_fmt, &out_fmt, buf_size);
+  ASSERT_NE(c, (void *)NULL);
+  in_frames = buf_size;
+  out_frames = cras_fmt_conv_convert_some_frames(
+      c, (uint8_t *)in_buff, (uint8_t *)out_buff, &in_frames, 256);
+  EXPECT_EQ(256, out_frames);
+  EXPECT_LT(in_frames, buf_size);
+  total_in += in_frames;
+
+  // The rest of the input is taken as the output makes room.
+  while (total_in < buf_size) {
+    in_frames = buf_size - total_in;
+    out_frames = cras_fmt_conv_convert_some_frames(
+        c, (uint8_t *)(in_buff + total_in * 2), (uint8_t *)out_buff,
+        &in_frames, 256);
+    ASSERT_GT(in_frames + out_frames, 0);
+    total_in += in_frames;
+  }
+  EXPECT_EQ(buf_size, total_in);
+
+  cras_fmt_conv_destroy(c);
+  free(in_buff);
+  free(out_buff);
+}
+
+// Converts channels with stub_conv_mtx and checks every set of matrix
+// converters against the arithmetic of the original convert_channels.
+static void CheckChannelMatrix(size_t num_channels) {
+  static const unsigned int cpu_flags[] = {
+    0,
+    CRAS_CPU_SSE2,
+    CRAS_CPU_SSE2 | CRAS_CPU_AVX2,
+    CRAS_CPU_NEON,
+  };
+  struct cras_audio_format in_fmt;
+  struct cras_audio_format out_fmt;
+  struct cras_fmt_conv *c;
+  const size_t buf_size = 1021;
+  int16_t *in_buff;
+  int16_t *expected;
+  int16_t *out_buff;
+
+  in_fmt.format = out_fmt.format = SND_PCM_FORMAT_S16_LE;
+  in_fmt.num_channels = out_fmt.num_channels = num_channels;
+  in_fmt.frame_rate = out_fmt.frame_rate = 48000;
+  for (size_t i = 0; i < CRAS_CH_MAX; i++) {
+    in_fmt.channel_layout[i] = i < num_channels ? i : -1;
+    out_fmt.channel_layout[i] = i < num_channels ? num_channels - 1 - i : -1;
+  }
+
+  in_buff = (int16_t *)ralloc(buf_size * num_channels * 2);
+  expected = (int16_t *)malloc(buf_size * num_channels * 2);
+  out_buff = (int16_t *)malloc(buf_size * num_channels * 2);
+  for (size_t fr = 0; fr < buf_size; fr++) {
+    for (size_t o = 0; o < num_channels; o++) {
+      int32_t sum = 0;
+      for (size_t i = 0; i < num_channels; i++)
+        sum += stub_conv_mtx[o][i] * in_buff[fr * num_channels + i];
+      if (sum > 0x7fff)
+        sum = 0x7fff;
+      if (sum < -0x8000)
+        sum = -0x8000;
+      expected[fr * num_channels + o] = sum;
+    }
+  }
+
+  for (size_t f = 0; f < ARRAY_SIZE(cpu_flags); f++) {
+    cras_fmt_conv_set_cpu_flags(cpu_flags[f]);
+    c = cras_fmt_conv_create(&in_fmt, &out_fmt, buf_size);
+    ASSERT_NE(c, (void *)NULL);
+    memset(out_buff, 0x55, buf_size * num_channels * 2);
+    EXPECT_EQ(buf_size, cras_fmt_conv_convert_frames(
+        c, (uint8_t *)in_buff, (uint8_t *)out_buff, buf_size, buf_size));
+    EXPECT_EQ(0, memcmp(expected, out_buff, buf_size * num_channels * 2));
+    cras_fmt_conv_destroy(c);
+  }
+  cras_fmt_conv_set_cpu_flags(~0U);
+
+  free(in_buff);
+  free(expected);
+  free(out_buff);
+}
+
+TEST(FormatConverterTest, ChannelMatrixConverters) {
+  static const size_t channels[] = { 3, 6, 8, 10 };
+
+  for (size_t n = 0; n < ARRAY_SIZE(channels); n++) {
+    size_t num_channels = channels[n];
+
+    // Sparse mix, loud enough to clip.
+    memset(stub_conv_mtx, 0, sizeof(stub_conv_mtx));
+    for (size_t o = 0; o < num_channels; o++)
+      for (size_t i = 0; i < num_channels; i++)
+        if (rand() % 3)
+          stub_conv_mtx[o][i] = (rand() / (float)RAND_MAX - 0.5f) * 3.0f;
+    CheckChannelMatrix(num_channels);
+
+    // Reversed channels with the last one silent.
+    memset(stub_conv_mtx, 0, sizeof(stub_conv_mtx));
+    for (size_t o = 0; o + 1 < num_channels; o++)
+      stub_conv_mtx[o][num_channels - 1 - o] = 1.0f;
+    CheckChannelMatrix(num_channels);
+  }
+  memset(stub_conv_mtx, 0, sizeof(stub_conv_mtx));
+}
+
+// An adjustable converter resamples equal rates and follows its ratio.
+TEST(FormatConverterTest, AdjustableRatio) {
+  struct cras_fmt_conv *c;
+  struct cras_audio_format in_fmt;
+  struct cras_audio_format out_fmt;
+  const size_t buf_size = 4800;
+  size_t out_frames, ret_frames;
+  int16_t *in_buff, *out_buff;
+
+  in_fmt.format = out_fmt.format = SND_PCM_FORMAT_S16_LE;
+  in_fmt.num_channels = out_fmt.num_channels = 2;
+  in_fmt.frame_rate = out_fmt.frame_rate = 48000;
+  for (int i = 0; i < CRAS_CH_MAX; i++)
+    in_fmt.channel_layout[i] = out_fmt.channel_layout[i] = -1;
+
+  // Without a resampler the rate can't be adjusted.
+  c = cras_fmt_conv_create(&in_fmt, &out_fmt, 2 * buf_size);
+  ASSERT_NE(c, (void *)NULL);
+  EXPECT_EQ(-EINVAL, cras_fmt_conv_set_ratio(c, 1.001));
+  cras_fmt_conv_destroy(c);
+
+  c = cras_fmt_conv_create_adjustable(&in_fmt, &out_fmt, 2 * buf_size);
+  ASSERT_NE(c, (void *)NULL);
+  EXPECT_EQ(buf_size, cras_fmt_conv_in_frames_to_out(c, buf_size));
+  EXPECT_EQ(0, cras_fmt_conv_set_ratio(c, 1.001));
+  EXPECT_EQ(4805, cras_fmt_conv_in_frames_to_out(c, buf_size));
+  EXPECT_EQ(4796, cras_fmt_conv_out_frames_to_in(c, buf_size));
+
+  in_buff = (int16_t *)ralloc(buf_size * cras_get_format_bytes(&in_fmt));
+  out_buff = (int16_t *)ralloc(2 * buf_size * cras_get_format_bytes(&out_fmt));
+  out_frames = cras_fmt_conv_in_frames_to_out(c, buf_size);
+  ret_frames = cras_fmt_conv_convert_frames(c,
+                                            (uint8_t *)in_buff,
+                                            (uint8_t *)out_buff,
+                                            buf_size,
+                                            out_frames);
+  // Half the filter length is held back at the start.
+  EXPECT_LE(ret_frames, out_frames);
+  EXPECT_GT(ret_frames, out_frames - 32);
+
+  cras_fmt_conv_destroy(c);
+  free(in_buff);
+  free(out_buff);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -975,7 +1467,10 @@ void cras_channel_conv_matrix_destroy(float **mtx, size_t out_ch)
 float **cras_channel_conv_matrix_create(const struct cras_audio_format *in,
 					const struct cras_audio_format *out)
 {
-  return cras_channel_conv_matrix_alloc(in->num_channels,
-					out->num_channels);
+  float **mtx = cras_channel_conv_matrix_alloc(in->num_channels,
+                                               out->num_channels);
+  for (int i = 0; i < CRAS_CH_MAX; i++)
+    memcpy(mtx[i], stub_conv_mtx[i], sizeof(stub_conv_mtx[i]));
+  return mtx;
 }
 } // extern "C"
@@ -210,7 +210,7 @@ TEST(HfpInfo, StartHfpInfo) {
   info = hfp_info_create();
   ASSERT_NE(info, (void *)NULL);
 
-  hfp_info_start(sock[0], info);
+  hfp_info_start(sock[0], NULL, info);
   ASSERT_EQ(1, hfp_info_running(info));
   ASSERT_EQ(cb_data, (void *)info);
 
@@ -234,7 +234,7 @@ TEST(HfpInfo, StartHfpInfoAndRead) {
   ASSERT_NE(info, (void *)NULL);
 
   /* Start and send two chunk of fake data */
-  hfp_info_start(sock[1], info);
+  hfp_info_start(sock[1], NULL, info);
   send(sock[0], sample ,48, 0);
   send(sock[0], sample ,48, 0);
 
@@ -276,7 +276,7 @@ TEST(HfpInfo, StartHfpInfoAndWrite) {
   info = hfp_info_create();
   ASSERT_NE(info, (void *)NULL);
 
-  hfp_info_start(sock[1], info);
+  hfp_info_start(sock[1], NULL, info);
   send(sock[0], sample ,48, 0);
   send(sock[0], sample ,48, 0);
 
@@ -306,15 +306,15 @@ TEST(HfpInfo, StartHfpInfoAndWrite) {
 
 extern "C" {
 
-void audio_thread_add_callback(int fd, thread_callback cb,
-                               void *data)
+void audio_thread_add_callback(struct audio_thread *thread, int fd,
+                               thread_callback cb, void *data)
 {
   thread_cb = cb;
   cb_data = data;
   return;
 }
 
-void audio_thread_rm_callback(int fd)
+void audio_thread_rm_callback(struct audio_thread *thread, int fd)
 {
   thread_cb = NULL;
   cb_data = NULL;
@@ -255,7 +255,8 @@ int hfp_info_running(struct hfp_info *info)
   return hfp_info_running_return_val;
 }
 
-int hfp_info_start(int fd, struct hfp_info *info)
+int hfp_info_start(int fd, struct audio_thread *thread,
+                   struct hfp_info *info)
 {
   hfp_info_start_called++;
   return 0;
@@ -6,6 +6,7 @@
 #include <gtest/gtest.h>
 
 extern "C" {
+#include "audio_thread.h"
 #include "cras_iodev.h"
 #include "cras_iodev_list.h"
 #include "cras_rstream.h"
@@ -45,10 +46,16 @@ static int cras_alert_create_called;
 static int cras_alert_destroy_called;
 static int cras_alert_pending_called;
 static cras_iodev *audio_thread_remove_streams_odev;
-static cras_iodev *audio_thread_last_output_dev;
 static unsigned int cras_system_get_volume_return;
 static int cras_iodev_set_software_volume_called;
 static float cras_iodev_set_software_volume_value;
+static audio_thread_complete_cb rm_stream_async_cb[2];
+static void *rm_stream_async_cb_data[2];
+static unsigned int stream_removed_called;
+static audio_thread_complete_cb add_stream_async_cb[2];
+static void *add_stream_async_cb_data[2];
+static unsigned int stream_attached_called;
+static int stream_attached_rc;
 
 class IoDevTestSuite : public testing::Test {
   protected:
@@ -129,6 +136,9 @@ class IoDevTestSuite : public testing::Test {
       remove_capture_mute_changed_cb_called = 0;
       add_stream_called = 0;
       rm_stream_called = 0;
+      stream_removed_called = 0;
+      stream_attached_called = 0;
+      stream_attached_rc = 0;
       set_node_attr_called = 0;
       cras_alert_create_called = 0;
       cras_alert_destroy_called = 0;
@@ -362,6 +372,118 @@ TEST_F(IoDevTestSuite, UnifiedFillsBoth) {
   EXPECT_EQ(0, rc);
 }
 
+static void stream_removed(void *data, int rc) {
+  stream_removed_called++;
+}
+
+TEST_F(IoDevTestSuite, UnifiedRemovedFromBothThreads) {
+  struct cras_rstream stream;
+  int rc;
+
+  d1_.direction = CRAS_STREAM_OUTPUT;
+  d2_.direction = CRAS_STREAM_INPUT;
+  memset(&stream, 0, sizeof(stream));
+  stream.stream_type = CRAS_STREAM_TYPE_DEFAULT;
+  stream.direction = CRAS_STREAM_UNIFIED;
+
+  rc = cras_iodev_list_add_output(&d1_);
+  EXPECT_EQ(0, rc);
+  rc = cras_iodev_list_add_input(&d2_);
+  EXPECT_EQ(0, rc);
+
+  rc = cras_iodev_list_rm_stream_async(&stream, stream_removed, NULL);
+  EXPECT_EQ(0, rc);
+  ASSERT_EQ(2, rm_stream_called);
+  EXPECT_EQ(0, stream_removed_called);
+
+  // Done only once both threads dropped the stream.
+  rm_stream_async_cb[0](rm_stream_async_cb_data[0], 0);
+  EXPECT_EQ(0, stream_removed_called);
+  rm_stream_async_cb[1](rm_stream_async_cb_data[1], 0);
+  EXPECT_EQ(1, stream_removed_called);
+
+  rc = cras_iodev_list_rm_output(&d1_);
+  EXPECT_EQ(0, rc);
+  rc = cras_iodev_list_rm_input(&d2_);
+  EXPECT_EQ(0, rc);
+}
+
+static void stream_attached(void *data, int rc) {
+  stream_attached_called++;
+  stream_attached_rc = rc;
+}
+
+TEST_F(IoDevTestSuite, UnifiedAddedToBothThreads) {
+  struct cras_rstream stream;
+  int rc;
+
+  d1_.direction = CRAS_STREAM_OUTPUT;
+  d2_.direction = CRAS_STREAM_INPUT;
+  memset(&stream, 0, sizeof(stream));
+  stream.direction = CRAS_STREAM_UNIFIED;
+
+  rc = cras_iodev_list_add_output(&d1_);
+  EXPECT_EQ(0, rc);
+  rc = cras_iodev_list_add_input(&d2_);
+  EXPECT_EQ(0, rc);
+
+  rc = cras_iodev_list_add_stream_async(&stream, &d2_, &d1_,
+                                        stream_attached, NULL);
+  EXPECT_EQ(0, rc);
+  ASSERT_EQ(2, add_stream_called);
+  EXPECT_EQ(0, stream_attached_called);
+
+  // Done only once both threads attached the stream.
+  add_stream_async_cb[0](add_stream_async_cb_data[0], 0);
+  EXPECT_EQ(0, stream_attached_called);
+  add_stream_async_cb[1](add_stream_async_cb_data[1], 0);
+  EXPECT_EQ(1, stream_attached_called);
+  EXPECT_EQ(0, stream_attached_rc);
+  EXPECT_EQ(0, rm_stream_called);
+
+  rc = cras_iodev_list_rm_output(&d1_);
+  EXPECT_EQ(0, rc);
+  rc = cras_iodev_list_rm_input(&d2_);
+  EXPECT_EQ(0, rc);
+}
+
+TEST_F(IoDevTestSuite, UnifiedAddFailsOnInput) {
+  struct cras_rstream stream;
+  int rc;
+
+  d1_.direction = CRAS_STREAM_OUTPUT;
+  d2_.direction = CRAS_STREAM_INPUT;
+  memset(&stream, 0, sizeof(stream));
+  stream.direction = CRAS_STREAM_UNIFIED;
+
+  rc = cras_iodev_list_add_output(&d1_);
+  EXPECT_EQ(0, rc);
+  rc = cras_iodev_list_add_input(&d2_);
+  EXPECT_EQ(0, rc);
+
+  rc = cras_iodev_list_add_stream_async(&stream, &d2_, &d1_,
+                                        stream_attached, NULL);
+  EXPECT_EQ(0, rc);
+  ASSERT_EQ(2, add_stream_called);
+
+  // The output thread that took the stream drops it again.
+  add_stream_async_cb[1](add_stream_async_cb_data[1],
+                         AUDIO_THREAD_INPUT_DEV_ERROR);
+  add_stream_async_cb[0](add_stream_async_cb_data[0], 0);
+  ASSERT_EQ(1, rm_stream_called);
+  EXPECT_EQ(0, stream_attached_called);
+
+  // The failure is reported once the output thread dropped the stream.
+  rm_stream_async_cb[0](rm_stream_async_cb_data[0], 0);
+  EXPECT_EQ(1, stream_attached_called);
+  EXPECT_EQ(AUDIO_THREAD_INPUT_DEV_ERROR, stream_attached_rc);
+
+  rc = cras_iodev_list_rm_output(&d1_);
+  EXPECT_EQ(0, rc);
+  rc = cras_iodev_list_rm_input(&d2_);
+  EXPECT_EQ(0, rc);
+}
+
 // Test removing the last input.
 TEST_F(IoDevTestSuite, RemoveLastInput) {
   struct cras_iodev_info *dev_info;
@@ -800,8 +922,9 @@ void cras_alert_destroy(struct cras_alert *alert) {
   cras_alert_destroy_called++;
 }
 
+/* Each fake thread remembers the device it was given. */
 struct audio_thread *audio_thread_create() {
-  return NULL;
+  return reinterpret_cast<audio_thread *>(calloc(1, sizeof(cras_iodev *)));
 }
 
 int audio_thread_start(struct audio_thread *thread) {
@@ -809,23 +932,74 @@ int audio_thread_start(struct audio_thread *thread) {
 }
 
 void audio_thread_destroy(struct audio_thread *thread) {
+  free(thread);
 }
 
 void audio_thread_set_output_dev(struct audio_thread *thread,
                                  struct cras_iodev *odev) {
-  audio_thread_last_output_dev = odev;
+  *reinterpret_cast<cras_iodev **>(thread) = odev;
+  odev->thread = thread;
 }
 
 void audio_thread_set_input_dev(struct audio_thread *thread,
                                 struct cras_iodev *idev) {
+  *reinterpret_cast<cras_iodev **>(thread) = idev;
+  idev->thread = thread;
 }
 
-void audio_thread_remove_streams(struct audio_thread *thread) {
-  audio_thread_remove_streams_odev = audio_thread_last_output_dev;
+void audio_thread_remove_streams(struct audio_thread *thread,
+                                 enum CRAS_STREAM_DIRECTION dir) {
+  audio_thread_remove_streams_odev = *reinterpret_cast<cras_iodev **>(thread);
 }
 
 void audio_thread_add_loopback_device(struct audio_thread *thread,
 				      struct cras_iodev *loop_dev) {
+  loop_dev->thread = thread;
+}
+
+void audio_thread_rm_loopback_device(struct audio_thread *thread,
+				     struct cras_iodev *loop_dev) {
+  loop_dev->thread = NULL;
+}
+
+int audio_thread_add_stream(struct audio_thread *thread,
+                            struct cras_rstream *stream) {
+  return 0;
+}
+
+int audio_thread_add_stream_async(struct audio_thread *thread,
+                                  struct cras_rstream *stream,
+                                  audio_thread_complete_cb cb,
+                                  void *cb_data) {
+  if (add_stream_called < 2) {
+    add_stream_async_cb[add_stream_called] = cb;
+    add_stream_async_cb_data[add_stream_called] = cb_data;
+  }
+  add_stream_called++;
+  return 0;
+}
+
+int audio_thread_rm_stream(struct audio_thread *thread,
+                           struct cras_rstream *stream) {
+  rm_stream_called++;
+  return 0;
+}
+
+int audio_thread_rm_stream_async(struct audio_thread *thread,
+                                 struct cras_rstream *stream,
+                                 audio_thread_complete_cb cb,
+                                 void *cb_data) {
+  if (rm_stream_called < 2) {
+    rm_stream_async_cb[rm_stream_called] = cb;
+    rm_stream_async_cb_data[rm_stream_called] = cb_data;
+  }
+  rm_stream_called++;
+  return 0;
+}
+
+int audio_thread_dump_thread_info(struct audio_thread *thread,
+                                  struct audio_debug_info *info) {
+  return 0;
 }
 
 int cras_ionode_better(struct cras_ionode *a, struct cras_ionode *b)
@@ -8,6 +8,7 @@
 extern "C" {
 #include "cras_iodev.h"
 #include "cras_rstream.h"
+#include "rate_estimator.h"
 #include "utlist.h"
 }
 
@@ -24,6 +25,10 @@ static int dsp_context_new_sample_rate;
 static const char *dsp_context_new_purpose;
 static int update_channel_layout_called;
 static int update_channel_layout_return_val;
+static unsigned int rate_estimator_create_rate;
+static int rate_estimator_destroy_called;
+static struct rate_estimator *dummy_rate_est =
+    reinterpret_cast<struct rate_estimator *>(0x123);
 
 // Iodev callback
 int update_channel_layout(struct cras_iodev *iodev) {
@@ -40,6 +45,8 @@ void ResetStubData() {
   dsp_context_new_channels = 0;
   dsp_context_new_sample_rate = 0;
   dsp_context_new_purpose = NULL;
+  rate_estimator_create_rate = 0;
+  rate_estimator_destroy_called = 0;
 }
 
 namespace {
@@ -209,6 +216,7 @@ class IoDevSetFormatTestSuite : public testing::Test {
     struct cras_iodev iodev_;
     size_t sample_rates_[3];
     size_t channel_counts_[3];
+    snd_pcm_format_t formats_[3];
 };
 
 TEST_F(IoDevSetFormatTestSuite, SupportedFormatSecondary) {
@@ -228,6 +236,12 @@ TEST_F(IoDevSetFormatTestSuite, SupportedFormatSecondary) {
   EXPECT_EQ(dsp_context_new_channels, 2);
   EXPECT_EQ(dsp_context_new_sample_rate, 48000);
   EXPECT_STREQ(dsp_context_new_purpose, "playback");
+  EXPECT_EQ(48000, rate_estimator_create_rate);
+  EXPECT_EQ(dummy_rate_est, iodev_.rate_est);
+
+  cras_iodev_free_format(&iodev_);
+  EXPECT_EQ(1, rate_estimator_destroy_called);
+  EXPECT_EQ((void *)NULL, iodev_.rate_est);
 }
 
 TEST_F(IoDevSetFormatTestSuite, SupportedFormatPrimary) {
@@ -291,6 +305,73 @@ TEST_F(IoDevSetFormatTestSuite, SupportedFormatFallbackDefault) {
   EXPECT_EQ(2, fmt.num_channels);
 }
 
+TEST_F(IoDevSetFormatTestSuite, SupportedSampleFormat) {
+  struct cras_audio_format fmt;
+  int rc;
+
+  formats_[0] = SND_PCM_FORMAT_S16_LE;
+  formats_[1] = SND_PCM_FORMAT_S24_LE;
+  formats_[2] = (snd_pcm_format_t)0;
+  iodev_.supported_formats = formats_;
+  iodev_.direction = CRAS_STREAM_OUTPUT;
+  fmt.format = SND_PCM_FORMAT_S24_LE;
+  fmt.frame_rate = 48000;
+  fmt.num_channels = 2;
+  rc = cras_iodev_set_format(&iodev_, &fmt);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(SND_PCM_FORMAT_S24_LE, fmt.format);
+}
+
+TEST_F(IoDevSetFormatTestSuite, UnsupportedSampleFormatUsesS16) {
+  struct cras_audio_format fmt;
+  int rc;
+
+  formats_[0] = SND_PCM_FORMAT_S24_LE;
+  formats_[1] = SND_PCM_FORMAT_S16_LE;
+  formats_[2] = (snd_pcm_format_t)0;
+  iodev_.supported_formats = formats_;
+  iodev_.direction = CRAS_STREAM_OUTPUT;
+  fmt.format = SND_PCM_FORMAT_S32_LE;
+  fmt.frame_rate = 48000;
+  fmt.num_channels = 2;
+  rc = cras_iodev_set_format(&iodev_, &fmt);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(SND_PCM_FORMAT_S16_LE, fmt.format);
+}
+
+TEST_F(IoDevSetFormatTestSuite, NoS16UsesPreferredFormat) {
+  struct cras_audio_format fmt;
+  int rc;
+
+  formats_[0] = SND_PCM_FORMAT_S32_LE;
+  formats_[1] = SND_PCM_FORMAT_S24_LE;
+  formats_[2] = (snd_pcm_format_t)0;
+  iodev_.supported_formats = formats_;
+  iodev_.direction = CRAS_STREAM_OUTPUT;
+  fmt.format = SND_PCM_FORMAT_S16_LE;
+  fmt.frame_rate = 48000;
+  fmt.num_channels = 2;
+  rc = cras_iodev_set_format(&iodev_, &fmt);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(SND_PCM_FORMAT_S32_LE, fmt.format);
+}
+
+TEST_F(IoDevSetFormatTestSuite, CaptureSampleFormatIsS16) {
+  struct cras_audio_format fmt;
+  int rc;
+
+  formats_[0] = SND_PCM_FORMAT_S24_LE;
+  formats_[1] = (snd_pcm_format_t)0;
+  iodev_.supported_formats = formats_;
+  iodev_.direction = CRAS_STREAM_INPUT;
+  fmt.format = SND_PCM_FORMAT_S24_LE;
+  fmt.frame_rate = 48000;
+  fmt.num_channels = 2;
+  rc = cras_iodev_set_format(&iodev_, &fmt);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(SND_PCM_FORMAT_S16_LE, fmt.format);
+}
+
 TEST_F(IoDevSetFormatTestSuite, UpdateChannelLayoutSuccess) {
   struct cras_audio_format fmt;
   int rc;
@@ -530,6 +611,20 @@ void cras_dsp_set_variable(struct cras_dsp_context *ctx, const char *key,
 {
 }
 
+// From rate_estimator
+struct rate_estimator *rate_estimator_create(unsigned int rate,
+                                             const struct timespec *window_size,
+                                             double smooth_factor)
+{
+  rate_estimator_create_rate = rate;
+  return dummy_rate_est;
+}
+
+void rate_estimator_destroy(struct rate_estimator *re)
+{
+  rate_estimator_destroy_called++;
+}
+
 // From audio thread
 int audio_thread_post_message(struct audio_thread *thread,
                               struct audio_thread_msg *msg) {
@@ -2,10 +2,14 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <gtest/gtest.h>
 
 extern "C" {
+#include "cras_cpu.h"
 #include "cras_shm.h"
 #include "cras_mix.h"
 #include "cras_types.h"
@@ -25,8 +29,10 @@ class MixTestSuite : public testing::Test{
       int16_t *buf;
 
       mix_buffer_ = (int16_t *)malloc(kBufferFrames * 4);
+      mix_ = (float *)malloc(kBufferFrames * kNumChannels * sizeof(float));
       mix_index_ = 0;
 
+      memset(&shm_, 0, sizeof(shm_));
       shm_.area = static_cast<struct cras_audio_shm_area *>(
           calloc(1, kBufferFrames * 4 + sizeof(cras_audio_shm_area)));
       cras_shm_set_frame_bytes(&shm_, 4);
@@ -36,7 +42,7 @@ class MixTestSuite : public testing::Test{
       buf = (int16_t *)shm_.area->samples;
       for (size_t i = 0; i < kBufferFrames * 2; i++) {
         buf[i] = i;
-        mix_buffer_[i] = -i;
+        mix_[i] = -1.0f;
       }
       shm_.area->write_offset[0] = kBufferFrames * 4;
       cras_shm_set_mute(&shm_, 0);
@@ -47,11 +53,19 @@ class MixTestSuite : public testing::Test{
 
     virtual void TearDown() {
       free(mix_buffer_);
+      free(mix_);
       free(compare_buffer_);
       free(shm_.area);
     }
 
+    // Renders the float mix to mix_buffer_.
+    void Render() {
+      cras_mix_render_s16(mix_buffer_, mix_, kBufferFrames * kNumChannels,
+                          1.0);
+    }
+
   int16_t *mix_buffer_;
+  float *mix_;
   size_t mix_index_;
   int16_t *compare_buffer_;
   struct cras_audio_shm shm_;
@@ -61,9 +75,10 @@ TEST_F(MixTestSuite, MixFirst) {
   size_t count = kBufferFrames;
   cras_system_get_mute_return = 0;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(1, mix_index_);
+  Render();
   EXPECT_EQ(0, memcmp(mix_buffer_, shm_.area->samples, kBufferFrames*4));
 }
 
@@ -71,9 +86,10 @@ TEST_F(MixTestSuite, MixFirstSystemMuted) {
   size_t count = kBufferFrames;
   cras_system_get_mute_return = 1;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(1, mix_index_);
+  Render();
   EXPECT_EQ(0, memcmp(mix_buffer_, shm_.area->samples, kBufferFrames*4));
 }
 
@@ -83,15 +99,16 @@ TEST_F(MixTestSuite, MixTwo) {
 
   cras_system_get_mute_return = 0;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(2, mix_index_);
 
   buf = (int16_t *)shm_.area->samples;
   for (size_t i = 0; i < kBufferFrames * 2; i++)
     compare_buffer_[i] = buf[i] * 2;
+  Render();
   EXPECT_EQ(0, memcmp(mix_buffer_, compare_buffer_, kBufferFrames*4));
 }
 
@@ -101,12 +118,13 @@ TEST_F(MixTestSuite, MixFirstMuted) {
   shm_.area->mute = 1;
   cras_system_get_mute_return = 0;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(1, mix_index_);
 
   for (size_t i = 0; i < kBufferFrames * 2; i++)
     compare_buffer_[i] = 0;
+  Render();
   EXPECT_EQ(0, memcmp(mix_buffer_, compare_buffer_, kBufferFrames*4));
 }
 TEST_F(MixTestSuite, MixFirstMutedSystemMuted) {
@@ -116,11 +134,12 @@ TEST_F(MixTestSuite, MixFirstMutedSystemMuted) {
   shm_.area->mute = 1;
   cras_system_get_mute_return = 1;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(1, mix_index_);
 
   memset(compare_buffer_, 0, kBufferFrames * 4);
+  Render();
   EXPECT_EQ(0, memcmp(mix_buffer_, compare_buffer_, kBufferFrames*4));
 }
 
@@ -130,12 +149,13 @@ TEST_F(MixTestSuite, MixFirstZeroVolume) {
   cras_shm_set_volume_scaler(&shm_, 0.0);
   cras_system_get_mute_return = 0;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(1, mix_index_);
 
   for (size_t i = 0; i < kBufferFrames * 2; i++)
     compare_buffer_[i] = 0;
+  Render();
   EXPECT_EQ(0, memcmp(mix_buffer_, compare_buffer_, kBufferFrames*4));
 }
 
@@ -146,13 +166,14 @@ TEST_F(MixTestSuite, MixFirstHalfVolume) {
   cras_shm_set_volume_scaler(&shm_, 0.5);
   cras_system_get_mute_return = 0;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(1, mix_index_);
 
   buf = (int16_t *)shm_.area->samples;
   for (size_t i = 0; i < kBufferFrames * 2; i++)
-    compare_buffer_[i] = buf[i] * 0.5;
+    compare_buffer_[i] = lround(buf[i] * 0.5);
+  Render();
   EXPECT_EQ(0, memcmp(mix_buffer_, compare_buffer_, kBufferFrames*4));
 }
 
@@ -163,14 +184,29 @@ TEST_F(MixTestSuite, MixFirstHalfSystemVolume) {
   cras_shm_set_volume_scaler(&shm_, 1.0);
   cras_system_get_mute_return = 0;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(1, mix_index_);
-  cras_scale_buffer(mix_buffer_, count * 2, 0.5);
+  cras_scale_buffer(mix_, count * 2, 0.5);
 
   buf = (int16_t *)shm_.area->samples;
   for (size_t i = 0; i < kBufferFrames * 2; i++)
-    compare_buffer_[i] = buf[i] * 0.5;
+    compare_buffer_[i] = lround(buf[i] * 0.5);
+  Render();
+  EXPECT_EQ(0, memcmp(mix_buffer_, compare_buffer_, kBufferFrames*4));
+}
+
+TEST_F(MixTestSuite, MixFirstRenderHalfVolume) {
+  size_t count = kBufferFrames;
+  int16_t *buf;
+
+  cras_mix_add_stream(
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
+  cras_mix_render_s16(mix_buffer_, mix_, count * 2, 0.5);
+
+  buf = (int16_t *)shm_.area->samples;
+  for (size_t i = 0; i < kBufferFrames * 2; i++)
+    compare_buffer_[i] = lround(buf[i] * 0.5);
   EXPECT_EQ(0, memcmp(mix_buffer_, compare_buffer_, kBufferFrames*4));
 }
 
@@ -181,15 +217,16 @@ TEST_F(MixTestSuite, MixFirstHalfStreamHalfSystemVolume) {
   cras_shm_set_volume_scaler(&shm_, 0.15);
   cras_system_get_mute_return = 0;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(1, mix_index_);
-  cras_scale_buffer(mix_buffer_, count * 2, 0.5);
+  cras_scale_buffer(mix_, count * 2, 0.5);
 
+  Render();
   buf = (int16_t *)shm_.area->samples;
   for (size_t i = 0; i < kBufferFrames * 2; i++) {
-    EXPECT_GE((int16_t)(buf[i] * 0.17 * 0.5), mix_buffer_[i]);
-    EXPECT_LE((int16_t)(buf[i] * 0.13 * 0.5), mix_buffer_[i]);
+    EXPECT_GE(lround(buf[i] * 0.17 * 0.5), mix_buffer_[i]);
+    EXPECT_LE(lround(buf[i] * 0.13 * 0.5), mix_buffer_[i]);
   }
 }
 
@@ -200,18 +237,19 @@ TEST_F(MixTestSuite, MixTwoSecondHalfVolume) {
   cras_shm_set_volume_scaler(&shm_, 1.0);
   cras_system_get_mute_return = 0;
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(1, mix_index_);
   cras_shm_set_volume_scaler(&shm_, 0.5);
   cras_mix_add_stream(
-      &shm_, kNumChannels, (uint8_t *)mix_buffer_, &count, &mix_index_);
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
   EXPECT_EQ(kBufferFrames, count);
   EXPECT_EQ(2, mix_index_);
 
   buf = (int16_t *)shm_.area->samples;
   for (size_t i = 0; i < kBufferFrames * 2; i++)
-    compare_buffer_[i] = buf[i] + (int16_t)(buf[i] * 0.5);
+    compare_buffer_[i] = lround(buf[i] * 1.5);
+  Render();
   EXPECT_EQ(0, memcmp(mix_buffer_, compare_buffer_, kBufferFrames*4));
 }
 
@@ -225,6 +263,353 @@ TEST_F(MixTestSuite, MuteBufferNoStreams) {
     EXPECT_EQ(0, mix_buffer_[i]);
 }
 
+TEST_F(MixTestSuite, MixClipsOnlyWhenRendered) {
+  size_t count = kBufferFrames;
+  int16_t *buf;
+
+  //  Twice full scale doesn't clip in the mix, halving it afterwards gives
+  //  back the samples.
+  buf = (int16_t *)shm_.area->samples;
+  for (size_t i = 0; i < kBufferFrames * 2; i++)
+    buf[i] = 30000;
+  cras_mix_add_stream(
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
+  cras_mix_add_stream(
+      &shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, mix_, &count, &mix_index_);
+  Render();
+  for (size_t i = 0; i < kBufferFrames * 2; i++)
+    EXPECT_EQ(32767, mix_buffer_[i]);
+
+  cras_scale_buffer(mix_, count * 2, 0.5);
+  Render();
+  EXPECT_EQ(0, memcmp(mix_buffer_, buf, kBufferFrames * 4));
+}
+
+static const size_t kFormatFrames = 64;
+
+// Mixes and renders samples wider than 16 bits.
+class MixFormatTestSuite : public testing::Test {
+  protected:
+    virtual void SetUp() {
+      memset(&shm_, 0, sizeof(shm_));
+      shm_.area = static_cast<struct cras_audio_shm_area *>(
+          calloc(1, kFormatFrames * 8 + sizeof(cras_audio_shm_area)));
+      cras_shm_set_frame_bytes(&shm_, 8);
+      cras_shm_set_used_size(&shm_, kFormatFrames * 8);
+      shm_.area->write_offset[0] = kFormatFrames * 8;
+      cras_shm_set_volume_scaler(&shm_, 1.0);
+      index_ = 0;
+    }
+
+    virtual void TearDown() {
+      free(shm_.area);
+    }
+
+    // Mixes the stream twice, the second time added to the first.
+    void MixTwice(snd_pcm_format_t fmt) {
+      size_t count = kFormatFrames;
+
+      EXPECT_EQ(kFormatFrames, cras_mix_add_stream(&shm_, fmt, kNumChannels,
+                                                   mix_, &count, &index_));
+      EXPECT_EQ(kFormatFrames, cras_mix_add_stream(&shm_, fmt, kNumChannels,
+                                                   mix_, &count, &index_));
+    }
+
+  float mix_[kFormatFrames * kNumChannels];
+  size_t index_;
+  struct cras_audio_shm shm_;
+};
+
+TEST_F(MixFormatTestSuite, S24KeepsAllBits) {
+  int32_t *buf = (int32_t *)shm_.area->samples;
+  int32_t out[kFormatFrames * kNumChannels];
+
+  // Samples are in the low three bytes, the top one isn't sign extended.
+  for (size_t i = 0; i < kFormatFrames * kNumChannels; i++)
+    buf[i] = (i * 0x20801 + 1) & 0xffffff;
+  MixTwice(SND_PCM_FORMAT_S24_LE);
+  EXPECT_EQ(0, cras_mix_render(SND_PCM_FORMAT_S24_LE, (uint8_t *)out, mix_,
+                               kFormatFrames * kNumChannels, 0.5));
+
+  for (size_t i = 0; i < kFormatFrames * kNumChannels; i++)
+    EXPECT_EQ((int32_t)(buf[i] << 8) >> 8, out[i]);
+}
+
+TEST_F(MixFormatTestSuite, S32Clips) {
+  int32_t *buf = (int32_t *)shm_.area->samples;
+  int32_t out[kFormatFrames * kNumChannels];
+
+  for (size_t i = 0; i < kFormatFrames * kNumChannels; i++)
+    buf[i] = (i & 1) ? 0x7fffff00 : -0x40000000;
+  MixTwice(SND_PCM_FORMAT_S32_LE);
+  EXPECT_EQ(0, cras_mix_render(SND_PCM_FORMAT_S32_LE, (uint8_t *)out, mix_,
+                               kFormatFrames * kNumChannels, 1.0));
+
+  for (size_t i = 0; i < kFormatFrames * kNumChannels; i++)
+    EXPECT_EQ((i & 1) ? INT32_MAX : INT32_MIN, out[i]);
+}
+
+TEST_F(MixFormatTestSuite, FloatScaledAndClipped) {
+  float *buf = (float *)shm_.area->samples;
+  float out[kFormatFrames * kNumChannels];
+
+  for (size_t i = 0; i < kFormatFrames * kNumChannels; i++)
+    buf[i] = (i & 1) ? 0.25f : -0.75f;
+  MixTwice(SND_PCM_FORMAT_FLOAT_LE);
+  EXPECT_EQ(0, cras_mix_render(SND_PCM_FORMAT_FLOAT_LE, (uint8_t *)out, mix_,
+                               kFormatFrames * kNumChannels, 0.5));
+
+  for (size_t i = 0; i < kFormatFrames * kNumChannels; i++)
+    EXPECT_FLOAT_EQ((i & 1) ? 0.25f : -0.75f, out[i]);
+
+  EXPECT_EQ(0, cras_mix_render(SND_PCM_FORMAT_FLOAT_LE, (uint8_t *)out, mix_,
+                               kFormatFrames * kNumChannels, 1.0));
+  for (size_t i = 0; i < kFormatFrames * kNumChannels; i++)
+    EXPECT_FLOAT_EQ((i & 1) ? 0.5f : -1.0f, out[i]);
+}
+
+TEST_F(MixFormatTestSuite, UnsupportedFormat) {
+  size_t count = kFormatFrames;
+  uint8_t out[kFormatFrames * kNumChannels];
+
+  EXPECT_EQ(0, cras_mix_add_stream(&shm_, SND_PCM_FORMAT_U8, kNumChannels,
+                                   mix_, &count, &index_));
+  EXPECT_EQ(-EINVAL, cras_mix_render(SND_PCM_FORMAT_U8, out, mix_,
+                                     kFormatFrames * kNumChannels, 1.0));
+}
+
+TEST_F(MixFormatTestSuite, RenderPlanarMatchesInterleaved) {
+  static const snd_pcm_format_t kFormats[] = {
+    SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S24_LE, SND_PCM_FORMAT_S32_LE,
+    SND_PCM_FORMAT_FLOAT_LE,
+  };
+  float planes[kNumChannels][kFormatFrames];
+  const float *plane_ptrs[kNumChannels];
+  int32_t expected[kFormatFrames * kNumChannels];
+  int32_t actual[kFormatFrames * kNumChannels];
+
+  // Some samples out of range, to be clipped.
+  for (size_t i = 0; i < kFormatFrames * kNumChannels; i++)
+    mix_[i] = ((float)i - kFormatFrames) / (kFormatFrames / 2 + 3);
+  for (size_t c = 0; c < kNumChannels; c++) {
+    for (size_t i = 0; i < kFormatFrames; i++)
+      planes[c][i] = mix_[i * kNumChannels + c];
+    plane_ptrs[c] = planes[c];
+  }
+
+  for (size_t f = 0; f < ARRAY_SIZE(kFormats); f++) {
+    memset(expected, 0, sizeof(expected));
+    memset(actual, 0, sizeof(actual));
+    EXPECT_EQ(0, cras_mix_render(kFormats[f], (uint8_t *)expected, mix_,
+                                 kFormatFrames * kNumChannels, 0.75));
+    EXPECT_EQ(0, cras_mix_render_planar(kFormats[f], (uint8_t *)actual,
+                                        plane_ptrs, kNumChannels,
+                                        kFormatFrames, 0.75));
+    EXPECT_EQ(0, memcmp(expected, actual, sizeof(expected)))
+        << "format " << kFormats[f];
+  }
+
+  EXPECT_EQ(-EINVAL, cras_mix_render_planar(SND_PCM_FORMAT_U8,
+                                            (uint8_t *)actual, plane_ptrs,
+                                            kNumChannels, kFormatFrames,
+                                            1.0));
+}
+
+TEST_F(MixFormatTestSuite, AddSamplesNotInShm) {
+  float src[kFormatFrames * kNumChannels];
+  const size_t count = kFormatFrames * kNumChannels;
+
+  for (size_t i = 0; i < count; i++)
+    src[i] = (i & 1) ? 0.25f : -0.5f;
+
+  // The first stream is copied, the next ones added, scaled by volume.
+  EXPECT_EQ(0, cras_mix_add_samples(SND_PCM_FORMAT_FLOAT_LE, mix_,
+                                    (uint8_t *)src, count, 1.0, 0));
+  EXPECT_EQ(0, cras_mix_add_samples(SND_PCM_FORMAT_FLOAT_LE, mix_,
+                                    (uint8_t *)src, count, 0.5, 1));
+  for (size_t i = 0; i < count; i++)
+    EXPECT_FLOAT_EQ(1.5f * src[i], mix_[i]);
+
+  // Muted adds nothing, or silence as the first stream.
+  EXPECT_EQ(0, cras_mix_add_samples(SND_PCM_FORMAT_FLOAT_LE, mix_,
+                                    (uint8_t *)src, count, 0.0, 1));
+  EXPECT_FLOAT_EQ(1.5f * src[0], mix_[0]);
+  EXPECT_EQ(0, cras_mix_add_samples(SND_PCM_FORMAT_FLOAT_LE, mix_,
+                                    (uint8_t *)src, count, 0.0, 0));
+  for (size_t i = 0; i < count; i++)
+    EXPECT_EQ(0, mix_[i]);
+
+  EXPECT_EQ(-EINVAL, cras_mix_add_samples(SND_PCM_FORMAT_U8, mix_,
+                                          (uint8_t *)src, count, 1.0, 0));
+}
+
+// Checks the SIMD kernels against the C ones and times them.
+class MixSimdTestSuite : public testing::Test {
+  protected:
+    virtual void SetUp() {
+      int16_t *buf;
+      size_t samples = kBufferFrames * kNumChannels;
+
+      // Odd so the kernels have to finish with the C code.
+      frames_ = kBufferFrames - 3;
+      memset(&shm_, 0, sizeof(shm_));
+      shm_.area = static_cast<struct cras_audio_shm_area *>(
+          calloc(1, kBufferFrames * 4 + sizeof(cras_audio_shm_area)));
+      cras_shm_set_frame_bytes(&shm_, 4);
+      cras_shm_set_used_size(&shm_,
+                             kBufferFrames * cras_shm_frame_bytes(&shm_));
+      shm_.area->write_offset[0] = frames_ * 4;
+      cras_shm_set_mute(&shm_, 0);
+
+      dst_ = (float *)malloc(samples * sizeof(float));
+      expected_ = (float *)malloc(samples * sizeof(float));
+      actual_ = (float *)malloc(samples * sizeof(float));
+      expected_s16_ = (int16_t *)malloc(samples * sizeof(int16_t));
+      actual_s16_ = (int16_t *)malloc(samples * sizeof(int16_t));
+
+      // Full scale noise, with the extremes.  The mix it is added to goes
+      // past full scale so rendering clips both ways.
+      srand(1234);
+      buf = (int16_t *)shm_.area->samples;
+      for (size_t i = 0; i < samples; i++) {
+        buf[i] = rand() & 0xffff;
+        dst_[i] = ((rand() & 0xffff) - 32768) / 16384.0f;
+      }
+      buf[0] = -0x8000;
+      buf[1] = 0x7fff;
+      dst_[0] = -1.0f;
+      dst_[1] = 32767.0f / 32768.0f;
+    }
+
+    virtual void TearDown() {
+      cras_mix_init(0);
+      free(dst_);
+      free(expected_);
+      free(actual_);
+      free(expected_s16_);
+      free(actual_s16_);
+      free(shm_.area);
+    }
+
+    // Mixes the samples with the kernels for cpu_flags into out.
+    void Mix(unsigned int cpu_flags, float volume, size_t index,
+             float *out) {
+      size_t count = frames_;
+
+      cras_mix_init(cpu_flags);
+      memcpy(out, dst_, kBufferFrames * kNumChannels * sizeof(float));
+      cras_shm_set_volume_scaler(&shm_, volume);
+      shm_.area->read_offset[0] = 0;
+      cras_mix_add_stream(&shm_, SND_PCM_FORMAT_S16_LE, kNumChannels, out,
+                          &count, &index);
+      EXPECT_EQ(frames_, count);
+    }
+
+  size_t frames_;
+  float *dst_;
+  float *expected_;
+  float *actual_;
+  int16_t *expected_s16_;
+  int16_t *actual_s16_;
+  struct cras_audio_shm shm_;
+};
+
+static const unsigned int kSimdFlags[] = {
+  CRAS_CPU_SSE2, CRAS_CPU_SSE4_1, CRAS_CPU_AVX2, CRAS_CPU_NEON,
+};
+static const float kVolumes[] = { 1.0, 0.99, 0.75, 0.5, 0.3333, 0.001 };
+
+TEST_F(MixSimdTestSuite, MatchesC) {
+  unsigned int supported = cras_cpu_get_flags();
+
+  for (size_t f = 0; f < ARRAY_SIZE(kSimdFlags); f++) {
+    if (!(supported & kSimdFlags[f]))
+      continue;
+    for (size_t v = 0; v < ARRAY_SIZE(kVolumes); v++) {
+      for (size_t index = 0; index < 2; index++) {
+        Mix(0, kVolumes[v], index, expected_);
+        Mix(kSimdFlags[f], kVolumes[v], index, actual_);
+        EXPECT_EQ(0, memcmp(expected_, actual_,
+                            frames_ * kNumChannels * sizeof(float)))
+            << "flags " << kSimdFlags[f] << " volume " << kVolumes[v]
+            << " index " << index;
+      }
+    }
+  }
+}
+
+TEST_F(MixSimdTestSuite, RenderMatchesC) {
+  unsigned int supported = cras_cpu_get_flags();
+  size_t samples = frames_ * kNumChannels;
+
+  cras_mix_init(0);
+  cras_mix_render_s16(expected_s16_, dst_, samples, 0.75);
+
+  for (size_t f = 0; f < ARRAY_SIZE(kSimdFlags); f++) {
+    if (!(supported & kSimdFlags[f]))
+      continue;
+    cras_mix_init(kSimdFlags[f]);
+    cras_mix_render_s16(actual_s16_, dst_, samples, 0.75);
+    EXPECT_EQ(0, memcmp(expected_s16_, actual_s16_,
+                        samples * sizeof(int16_t)))
+        << "flags " << kSimdFlags[f];
+  }
+}
+
+TEST_F(MixSimdTestSuite, RenderPlanarMatchesC) {
+  unsigned int supported = cras_cpu_get_flags();
+  const float *planes[] = { dst_, dst_ + frames_ };
+  size_t samples = frames_ * kNumChannels;
+
+  cras_mix_init(0);
+  cras_mix_render_planar(SND_PCM_FORMAT_S16_LE, (uint8_t *)expected_s16_,
+                         planes, kNumChannels, frames_, 0.75);
+
+  for (size_t f = 0; f < ARRAY_SIZE(kSimdFlags); f++) {
+    if (!(supported & kSimdFlags[f]))
+      continue;
+    cras_mix_init(kSimdFlags[f]);
+    memset(actual_s16_, 0, samples * sizeof(int16_t));
+    cras_mix_render_planar(SND_PCM_FORMAT_S16_LE, (uint8_t *)actual_s16_,
+                           planes, kNumChannels, frames_, 0.75);
+    EXPECT_EQ(0, memcmp(expected_s16_, actual_s16_,
+                        samples * sizeof(int16_t)))
+        << "flags " << kSimdFlags[f];
+  }
+}
+
+// Not a pass/fail test, prints the throughput of each kernel.
+TEST_F(MixSimdTestSuite, Benchmark) {
+  static const int kIterations = 500;
+  static const unsigned int kAllFlags[] = {
+    0, CRAS_CPU_SSE2, CRAS_CPU_SSE4_1, CRAS_CPU_AVX2, CRAS_CPU_NEON,
+  };
+  unsigned int supported = cras_cpu_get_flags();
+  size_t samples = frames_ * kNumChannels;
+
+  for (size_t f = 0; f < ARRAY_SIZE(kAllFlags); f++) {
+    struct timespec start, mixed, end;
+    double mix_sec, render_sec;
+
+    if (kAllFlags[f] && !(supported & kAllFlags[f]))
+      continue;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < kIterations; i++)
+      Mix(kAllFlags[f], 0.5, 1, actual_);
+    clock_gettime(CLOCK_MONOTONIC, &mixed);
+    for (int i = 0; i < kIterations; i++)
+      cras_mix_render_s16(actual_s16_, actual_, samples, 0.5);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    mix_sec = mixed.tv_sec - start.tv_sec +
+              (mixed.tv_nsec - start.tv_nsec) / 1e9;
+    render_sec = end.tv_sec - mixed.tv_sec +
+                 (end.tv_nsec - mixed.tv_nsec) / 1e9;
+    printf("flags 0x%x: mix %.1f, render %.1f Msamples/s\n", kAllFlags[f],
+           kIterations * samples / mix_sec / 1e6,
+           kIterations * samples / render_sec / 1e6);
+  }
+}
+
 /* Stubs */
 extern "C" {
 
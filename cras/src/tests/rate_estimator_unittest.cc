@@ -0,0 +1,108 @@
+// Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "rate_estimator.h"
+}
+
+static const struct timespec kWindowSize = { 1, 0 };
+
+namespace {
+
+// Runs a device at actual_rate for seconds, waking up every 10 ms.  Output
+// devices are refilled to 2000 frames, input devices are read empty.
+static void RunDevice(struct rate_estimator *re, double actual_rate,
+                      int seconds, int output, struct timespec *now) {
+  double level = 2000;
+
+  for (int i = 0; i < seconds * 100; i++) {
+    // A few frames of jitter on when the level is read.
+    int jitter = (i * 7) % 5 - 2;
+    int read_level;
+
+    now->tv_nsec += 10000000;
+    if (now->tv_nsec >= 1000000000) {
+      now->tv_nsec -= 1000000000;
+      now->tv_sec++;
+    }
+    level += (output ? -1 : 1) * actual_rate / 100;
+    read_level = (int)level + jitter;
+    rate_estimator_check(re, read_level, now);
+    if (output) {
+      rate_estimator_add_frames(re, 2000 - read_level);
+      level += 2000 - read_level;
+    } else {
+      rate_estimator_add_frames(re, -read_level);
+      level -= read_level;
+    }
+  }
+}
+
+TEST(RateEstimator, NominalRate) {
+  struct rate_estimator *re;
+  struct timespec now = { 10, 0 };
+
+  re = rate_estimator_create(48000, &kWindowSize, 0.5);
+  ASSERT_NE((void *)NULL, re);
+  EXPECT_EQ(48000, rate_estimator_get_rate(re));
+
+  RunDevice(re, 48000, 10, 1, &now);
+  EXPECT_NEAR(48000, rate_estimator_get_rate(re), 1);
+  EXPECT_NEAR(0, rate_estimator_get_ppm(re), 20);
+
+  rate_estimator_destroy(re);
+}
+
+TEST(RateEstimator, FollowsDriftingOutput) {
+  struct rate_estimator *re;
+  struct timespec now = { 10, 0 };
+
+  // A clock 500 ppm fast.
+  re = rate_estimator_create(48000, &kWindowSize, 0.5);
+  RunDevice(re, 48024, 10, 1, &now);
+  EXPECT_NEAR(48024, rate_estimator_get_rate(re), 1);
+  EXPECT_NEAR(500, rate_estimator_get_ppm(re), 20);
+
+  rate_estimator_destroy(re);
+}
+
+TEST(RateEstimator, FollowsDriftingInput) {
+  struct rate_estimator *re;
+  struct timespec now = { 10, 0 };
+
+  // A clock 300 ppm slow.
+  re = rate_estimator_create(44100, &kWindowSize, 0.5);
+  RunDevice(re, 44086.77, 10, 0, &now);
+  EXPECT_NEAR(-300, rate_estimator_get_ppm(re), 20);
+
+  rate_estimator_destroy(re);
+}
+
+TEST(RateEstimator, IgnoresGlitchAndResets) {
+  struct rate_estimator *re;
+  struct timespec now = { 10, 0 };
+
+  re = rate_estimator_create(48000, &kWindowSize, 0.5);
+  RunDevice(re, 48024, 10, 1, &now);
+
+  // A device stalled for windows isn't drift, the estimate stays close,
+  // only the window straddling the change moves it a little.
+  RunDevice(re, 40000, 3, 1, &now);
+  EXPECT_NEAR(500, rate_estimator_get_ppm(re), 100);
+
+  rate_estimator_reset_rate(re, 44100);
+  EXPECT_EQ(44100, rate_estimator_get_rate(re));
+  EXPECT_EQ(0, rate_estimator_get_ppm(re));
+
+  rate_estimator_destroy(re);
+}
+
+}  //  namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
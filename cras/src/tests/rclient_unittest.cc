@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <gtest/gtest.h>
+#include <poll.h>
 #include <unistd.h>
 
 extern "C" {
@@ -12,6 +13,7 @@ extern "C" {
 #include "cras_rclient.h"
 #include "cras_rstream.h"
 #include "cras_system_state.h"
+#include "cras_util.h"
 }
 
 //  Stub data.
@@ -40,10 +42,22 @@ static size_t cras_make_fd_nonblocking_called;
 static audio_thread* iodev_get_thread_return;
 static int audio_thread_add_stream_return;
 static unsigned int audio_thread_add_stream_called;
+static int add_stream_defer;
+static void (*add_stream_cb)(void *data, int rc);
+static void *add_stream_cb_data;
 static unsigned int audio_thread_rm_stream_called;
 static unsigned int cras_iodev_list_rm_input_called;
 static unsigned int cras_iodev_list_rm_output_called;
+static unsigned int cras_tm_create_timer_called;
+static void (*cras_tm_create_timer_cb)(struct cras_timer *t, void *data);
+static void *cras_tm_create_timer_cb_data;
 static unsigned int cras_iodev_set_format_frame_rate;
+static snd_pcm_format_t cras_iodev_set_format_format;
+static snd_pcm_format_t cras_rstream_create_format;
+static size_t cras_rstream_create_frame_rate;
+static size_t cras_rstream_create_buffer_frames;
+static unsigned int cras_send_with_fds_num_fds;
+static int cras_send_with_fds_fds[CRAS_MAX_SEND_FDS];
 
 void ResetStubData() {
   get_iodev_retval = 0;
@@ -69,10 +83,21 @@ void ResetStubData() {
   iodev_get_thread_return = reinterpret_cast<audio_thread*>(0xad);
   audio_thread_add_stream_return = 0;
   audio_thread_add_stream_called = 0;
+  add_stream_defer = 0;
+  add_stream_cb = NULL;
+  add_stream_cb_data = NULL;
   audio_thread_rm_stream_called = 0;
   cras_iodev_list_rm_output_called = 0;
   cras_iodev_list_rm_input_called = 0;
+  cras_tm_create_timer_called = 0;
+  cras_tm_create_timer_cb = NULL;
+  cras_tm_create_timer_cb_data = NULL;
   cras_iodev_set_format_frame_rate = 0;
+  cras_iodev_set_format_format = SND_PCM_FORMAT_UNKNOWN;
+  cras_rstream_create_format = SND_PCM_FORMAT_UNKNOWN;
+  cras_rstream_create_frame_rate = 0;
+  cras_rstream_create_buffer_frames = 0;
+  cras_send_with_fds_num_fds = 0;
 }
 
 namespace {
@@ -94,7 +119,10 @@ TEST(RClientSuite, CreateSendMessage) {
   rc = read(pipe_fds[0], &msg, sizeof(msg));
   EXPECT_EQ(sizeof(msg), rc);
   EXPECT_EQ(CRAS_CLIENT_CONNECTED, msg.header.id);
-  EXPECT_EQ(CRAS_CLIENT_CONNECTED, msg.header.id);
+  EXPECT_EQ(800, msg.client_id);
+  // The server state is shared with the connected message.
+  ASSERT_EQ(1, cras_send_with_fds_num_fds);
+  EXPECT_EQ(55, cras_send_with_fds_fds[0]);
 
   cras_rclient_destroy(rclient);
   close(pipe_fds[0]);
@@ -116,6 +144,10 @@ class RClientMessagesSuite : public testing::Test {
         return;
 
       rstream_ = (struct cras_rstream *)calloc(1, sizeof(*rstream_));
+      rstream_->input_shm_info.shm_fd = -1;
+      rstream_->output_shm_info.shm_fd = 66;
+      rstream_->request_fd = -1;
+      rstream_->reply_fd = -1;
 
       stream_id_ = 0x10002;
       connect_msg_.header.id = CRAS_SERVER_CONNECT_STREAM;
@@ -216,16 +248,60 @@ TEST_F(RClientMessagesSuite, AudThreadAttachFailRetry) {
   rc = cras_rclient_message_from_client(rclient_, &connect_msg_.header, 100);
   EXPECT_EQ(0, rc);
 
+  // Removing the device destroys its thread, so it isn't done from the
+  // completion of the attach.
+  EXPECT_EQ(1, cras_rstream_destroy_called);
+  EXPECT_EQ(0, cras_iodev_list_rm_output_called);
+  ASSERT_EQ(1, cras_tm_create_timer_called);
+  cras_tm_create_timer_cb(NULL, cras_tm_create_timer_cb_data);
+
   rc = read(pipe_fds_[0], &out_msg, sizeof(out_msg));
   EXPECT_EQ(sizeof(out_msg), rc);
   EXPECT_EQ(stream_id_, out_msg.stream_id);
   EXPECT_NE(0, out_msg.err);
-  EXPECT_EQ(1, cras_rstream_destroy_called);
+  // The stream of each attempt is freed.
+  EXPECT_EQ(2, cras_rstream_destroy_called);
   EXPECT_EQ(1, cras_iodev_list_rm_output_called);
   EXPECT_EQ(2, audio_thread_add_stream_called);
   EXPECT_EQ(0, audio_thread_rm_stream_called);
 }
 
+TEST_F(RClientMessagesSuite, AudThreadAttachFailDestroyBeforeRetry) {
+  struct cras_client_connected msg;
+  struct cras_rclient *rclient;
+  struct pollfd pfd;
+  int fds[2];
+  int rc;
+
+  rc = pipe(fds);
+  ASSERT_EQ(0, rc);
+  rclient = cras_rclient_create(fds[1], 801);
+  rc = read(fds[0], &msg, sizeof(msg));
+  EXPECT_EQ(sizeof(msg), rc);
+
+  get_iodev_idev = (struct cras_iodev *)0xbaba;
+  cras_rstream_create_stream_out = rstream_;
+  audio_thread_add_stream_return = AUDIO_THREAD_INPUT_DEV_ERROR;
+  connect_msg_.direction = CRAS_STREAM_INPUT;
+
+  rc = cras_rclient_message_from_client(rclient, &connect_msg_.header, 100);
+  EXPECT_EQ(0, rc);
+  ASSERT_EQ(1, cras_tm_create_timer_called);
+  cras_rclient_destroy(rclient);
+
+  // The device is still removed, the stream isn't connected again.
+  cras_tm_create_timer_cb(NULL, cras_tm_create_timer_cb_data);
+  EXPECT_EQ(1, cras_iodev_list_rm_input_called);
+  EXPECT_EQ(1, audio_thread_add_stream_called);
+  EXPECT_EQ(1, cras_rstream_destroy_called);
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  EXPECT_EQ(0, poll(&pfd, 1, 0));
+  get_iodev_idev = NULL;
+  close(fds[0]);
+  close(fds[1]);
+}
+
 TEST_F(RClientMessagesSuite, AudThreadAttachFail) {
   struct cras_client_stream_connected out_msg;
   int rc;
@@ -317,6 +393,174 @@ TEST_F(RClientMessagesSuite, SuccessReply) {
   EXPECT_EQ(0, cras_rstream_destroy_called);
   EXPECT_EQ(1, audio_thread_add_stream_called);
   EXPECT_EQ(0, audio_thread_rm_stream_called);
+  // Only the output shm of an output stream is sent.
+  ASSERT_EQ(1, cras_send_with_fds_num_fds);
+  EXPECT_EQ(66, cras_send_with_fds_fds[0]);
+}
+
+TEST_F(RClientMessagesSuite, ReplyOnceAttached) {
+  struct cras_client_stream_connected out_msg;
+  struct pollfd pfd;
+  int rc;
+
+  get_iodev_odev = (struct cras_iodev *)0xbaba;
+  cras_rstream_create_stream_out = rstream_;
+  add_stream_defer = 1;
+
+  rc = cras_rclient_message_from_client(rclient_, &connect_msg_.header, 100);
+  EXPECT_EQ(0, rc);
+  ASSERT_NE((void *)NULL, add_stream_cb);
+
+  // Nothing is sent until the audio threads attached the stream.
+  pfd.fd = pipe_fds_[0];
+  pfd.events = POLLIN;
+  EXPECT_EQ(0, poll(&pfd, 1, 0));
+
+  add_stream_cb(add_stream_cb_data, 0);
+  rc = read(pipe_fds_[0], &out_msg, sizeof(out_msg));
+  EXPECT_EQ(sizeof(out_msg), rc);
+  EXPECT_EQ(stream_id_, out_msg.stream_id);
+  EXPECT_EQ(0, out_msg.err);
+  EXPECT_EQ(0, cras_rstream_destroy_called);
+}
+
+TEST_F(RClientMessagesSuite, DisconnectWhileAttaching) {
+  struct cras_disconnect_stream_message disconnect_msg;
+  struct pollfd pfd;
+  int rc;
+
+  get_iodev_odev = (struct cras_iodev *)0xbaba;
+  cras_rstream_create_stream_out = rstream_;
+  rstream_->stream_id = stream_id_;
+  add_stream_defer = 1;
+
+  rc = cras_rclient_message_from_client(rclient_, &connect_msg_.header, 100);
+  EXPECT_EQ(0, rc);
+  ASSERT_NE((void *)NULL, add_stream_cb);
+
+  cras_fill_disconnect_stream_message(&disconnect_msg, stream_id_);
+  rc = cras_rclient_message_from_client(rclient_, &disconnect_msg.header,
+                                        -1);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(1, audio_thread_rm_stream_called);
+  EXPECT_EQ(1, cras_rstream_destroy_called);
+
+  // The late attach neither replies nor frees the stream again.
+  add_stream_cb(add_stream_cb_data, 0);
+  pfd.fd = pipe_fds_[0];
+  pfd.events = POLLIN;
+  EXPECT_EQ(0, poll(&pfd, 1, 0));
+  EXPECT_EQ(1, cras_rstream_destroy_called);
+}
+
+TEST_F(RClientMessagesSuite, DestroyWhileAttaching) {
+  struct cras_client_connected msg;
+  struct cras_rclient *rclient;
+  int fds[2];
+  int rc;
+
+  rc = pipe(fds);
+  ASSERT_EQ(0, rc);
+  rclient = cras_rclient_create(fds[1], 801);
+  rc = read(fds[0], &msg, sizeof(msg));
+  EXPECT_EQ(sizeof(msg), rc);
+
+  get_iodev_odev = (struct cras_iodev *)0xbaba;
+  cras_rstream_create_stream_out = rstream_;
+  add_stream_defer = 1;
+
+  rc = cras_rclient_message_from_client(rclient, &connect_msg_.header, 100);
+  EXPECT_EQ(0, rc);
+  ASSERT_NE((void *)NULL, add_stream_cb);
+
+  cras_rclient_destroy(rclient);
+  EXPECT_EQ(1, audio_thread_rm_stream_called);
+  EXPECT_EQ(1, cras_rstream_destroy_called);
+
+  add_stream_cb(add_stream_cb_data, 0);
+  EXPECT_EQ(1, cras_rstream_destroy_called);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST_F(RClientMessagesSuite, SuccessReplyShmWakeup) {
+  struct cras_client_stream_connected out_msg;
+  int rc;
+
+  get_iodev_odev = (struct cras_iodev *)0xbaba;
+  cras_rstream_create_stream_out = rstream_;
+  cras_iodev_attach_stream_retval = 0;
+  rstream_->request_fd = 67;
+  rstream_->reply_fd = 68;
+
+  rc = cras_rclient_message_from_client(rclient_, &connect_msg_.header, 100);
+  EXPECT_EQ(0, rc);
+  rc = read(pipe_fds_[0], &out_msg, sizeof(out_msg));
+  EXPECT_EQ(sizeof(out_msg), rc);
+  EXPECT_EQ(0, out_msg.err);
+  // The eventfds follow the shm fd.
+  ASSERT_EQ(3, cras_send_with_fds_num_fds);
+  EXPECT_EQ(66, cras_send_with_fds_fds[0]);
+  EXPECT_EQ(67, cras_send_with_fds_fds[1]);
+  EXPECT_EQ(68, cras_send_with_fds_fds[2]);
+}
+
+TEST_F(RClientMessagesSuite, OutputKeepsClientSampleFormat) {
+  struct cras_client_stream_connected out_msg;
+  int rc;
+
+  get_iodev_odev = (struct cras_iodev *)0xbaba;
+  cras_rstream_create_stream_out = rstream_;
+  cras_iodev_set_format_format = SND_PCM_FORMAT_S16_LE;
+  connect_msg_.format.format = SND_PCM_FORMAT_S32_LE;
+
+  rc = cras_rclient_message_from_client(rclient_, &connect_msg_.header, 100);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(SND_PCM_FORMAT_S32_LE, cras_rstream_create_format);
+
+  rc = read(pipe_fds_[0], &out_msg, sizeof(out_msg));
+  EXPECT_EQ(sizeof(out_msg), rc);
+  EXPECT_EQ(0, out_msg.err);
+  EXPECT_EQ(SND_PCM_FORMAT_S32_LE, out_msg.format.format);
+}
+
+TEST_F(RClientMessagesSuite, OutputKeepsClientRate) {
+  struct cras_client_stream_connected out_msg;
+  int rc;
+
+  get_iodev_odev = (struct cras_iodev *)0xbaba;
+  cras_rstream_create_stream_out = rstream_;
+  cras_iodev_set_format_frame_rate = 44100;
+
+  rc = cras_rclient_message_from_client(rclient_, &connect_msg_.header, 100);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(48000, cras_rstream_create_frame_rate);
+  EXPECT_EQ(480, cras_rstream_create_buffer_frames);
+
+  rc = read(pipe_fds_[0], &out_msg, sizeof(out_msg));
+  EXPECT_EQ(sizeof(out_msg), rc);
+  EXPECT_EQ(0, out_msg.err);
+  EXPECT_EQ(48000, out_msg.format.frame_rate);
+}
+
+TEST_F(RClientMessagesSuite, InputUsesDeviceSampleFormat) {
+  struct cras_client_stream_connected out_msg;
+  int rc;
+
+  get_iodev_idev = (struct cras_iodev *)0xbabb;
+  cras_rstream_create_stream_out = rstream_;
+  cras_iodev_set_format_format = SND_PCM_FORMAT_S16_LE;
+  connect_msg_.direction = CRAS_STREAM_INPUT;
+  connect_msg_.format.format = SND_PCM_FORMAT_S32_LE;
+
+  rc = cras_rclient_message_from_client(rclient_, &connect_msg_.header, 100);
+  EXPECT_EQ(0, rc);
+  EXPECT_EQ(SND_PCM_FORMAT_S16_LE, cras_rstream_create_format);
+
+  rc = read(pipe_fds_[0], &out_msg, sizeof(out_msg));
+  EXPECT_EQ(sizeof(out_msg), rc);
+  EXPECT_EQ(0, out_msg.err);
+  EXPECT_EQ(SND_PCM_FORMAT_S16_LE, out_msg.format.format);
 }
 
 TEST_F(RClientMessagesSuite, AddTwoUnified) {
@@ -468,24 +712,38 @@ int main(int argc, char **argv) {
 /* stubs */
 extern "C" {
 
-struct audio_thread* cras_iodev_list_get_audio_thread() {
-  return iodev_get_thread_return;
-}
-
-int audio_thread_add_stream(audio_thread* thread,
-                            cras_rstream* stream) {
+int cras_iodev_list_add_stream_async(struct cras_rstream *stream,
+                                     struct cras_iodev *idev,
+                                     struct cras_iodev *odev,
+                                     void (*cb)(void *data, int rc),
+                                     void *cb_data) {
   int ret;
 
+  if (iodev_get_thread_return == NULL)
+    return -ENOMEM;
+
   audio_thread_add_stream_called++;
+  if (add_stream_defer) {
+    add_stream_cb = cb;
+    add_stream_cb_data = cb_data;
+    return 0;
+  }
   ret = audio_thread_add_stream_return;
   if (ret)
     audio_thread_add_stream_return = AUDIO_THREAD_ERROR_OTHER;
-  return ret;
+  cb(cb_data, ret);
+  return 0;
 }
 
-int audio_thread_rm_stream(audio_thread* thread,
-			   cras_rstream* stream) {
+void cras_iodev_list_rm_stream(struct cras_rstream *stream) {
   audio_thread_rm_stream_called++;
+}
+
+int cras_iodev_list_rm_stream_async(struct cras_rstream *stream,
+                                    void (*cb)(void *data, int rc),
+                                    void *cb_data) {
+  audio_thread_rm_stream_called++;
+  cb(cb_data, 0);
   return 0;
 }
 
@@ -494,10 +752,8 @@ void audio_thread_add_output_dev(struct audio_thread *thread,
 {
 }
 
-int audio_thread_dump_thread_info(struct audio_thread *thread,
-				  struct audio_debug_info *info)
+void cras_iodev_list_dump_thread_info(struct audio_debug_info *info)
 {
-  return 0;
 }
 
 const char *cras_config_get_socket_file_dir()
@@ -520,6 +776,8 @@ int cras_iodev_set_format(struct cras_iodev *iodev,
 {
   if (cras_iodev_set_format_frame_rate)
     fmt->frame_rate = cras_iodev_set_format_frame_rate;
+  if (cras_iodev_set_format_format != SND_PCM_FORMAT_UNKNOWN)
+    fmt->format = cras_iodev_set_format_format;
   return 0;
 }
 
@@ -531,9 +789,13 @@ int cras_rstream_create(cras_stream_id_t stream_id,
 			size_t cb_threshold,
 			size_t min_cb_level,
 			uint32_t flags,
+			unsigned int num_periods,
 			struct cras_rclient *client,
 			struct cras_rstream **stream_out)
 {
+  cras_rstream_create_format = format->format;
+  cras_rstream_create_frame_rate = format->frame_rate;
+  cras_rstream_create_buffer_frames = buffer_frames;
   *stream_out = cras_rstream_create_stream_out;
   return cras_rstream_create_return;
 }
@@ -558,6 +820,23 @@ int cras_iodev_list_rm_input(struct cras_iodev *input) {
   return 0;
 }
 
+struct cras_tm *cras_system_state_get_tm()
+{
+  return NULL;
+}
+
+struct cras_timer *cras_tm_create_timer(
+    struct cras_tm *tm,
+    unsigned int ms,
+    void (*cb)(struct cras_timer *t, void *data),
+    void *cb_data)
+{
+  cras_tm_create_timer_called++;
+  cras_tm_create_timer_cb = cb;
+  cras_tm_create_timer_cb_data = cb_data;
+  return reinterpret_cast<struct cras_timer *>(0x55);
+}
+
 int cras_server_disconnect_from_client_socket(int socket_fd) {
   return 0;
 }
@@ -623,9 +902,18 @@ struct cras_server_state *cras_system_state_get_no_lock()
   return NULL;
 }
 
-key_t cras_sys_state_shm_key()
+int cras_sys_state_shm_fd()
+{
+  return 55;
+}
+
+// The sockets of the tests are pipes, write the message and keep the fds.
+int cras_send_with_fds(int sockfd, const void *buf, size_t len,
+                       const int *fds, unsigned int num_fds)
 {
-  return 1;
+  cras_send_with_fds_num_fds = num_fds;
+  memcpy(cras_send_with_fds_fds, fds, num_fds * sizeof(*fds));
+  return write(sockfd, buf, len);
 }
 
 void cras_dsp_reload_ini()
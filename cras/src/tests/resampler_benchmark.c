@@ -0,0 +1,178 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Compares the polyphase resampler with the speex one.  For each pair of
+ * rates and each resampler prints the CPU used by a stereo stream, as a
+ * percentage of one core, and how far a tone outside the output band is
+ * attenuated where its alias or image would land.
+ */
+
+#include <math.h>
+#include <speex/speex_resampler.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cras_resampler.h"
+#include "cras_util.h"
+
+#define BENCH_CHANNELS 2
+#define BENCH_SECONDS 10
+/* Frames given to the resampler at a time, a typical callback size. */
+#define BENCH_BLOCK_FRAMES 256
+#define SPEEX_QUALITY 4
+#define TONE_AMPLITUDE 16384.0
+
+/* Rates, and a tone that must not reach the output. */
+static const struct {
+	size_t in_rate;
+	size_t out_rate;
+	double tone;
+} rate_pairs[] = {
+	{ 44100, 48000, 21000 },
+	{ 48000, 44100, 23000 },
+	{ 16000, 48000, 7000 },
+	{ 48000, 16000, 9000 },
+};
+
+static const char *quality_names[CRAS_RESAMPLER_NUM_QUALITIES] = {
+	"native_low", "native_medium", "native_high",
+};
+
+/* Either resampler, native when rs is set. */
+struct bench_resampler {
+	struct cras_resampler *rs;
+	SpeexResamplerState *speex;
+};
+
+static double tp_diff(struct timespec *tp2, struct timespec *tp1)
+{
+	return (tp2->tv_sec - tp1->tv_sec)
+		+ (tp2->tv_nsec - tp1->tv_nsec) * 1e-9;
+}
+
+/* Frequency a tone at freq lands on once sampled at rate. */
+static double fold(double freq, double rate)
+{
+	freq = fmod(freq, rate);
+	return freq > rate / 2 ? rate - freq : freq;
+}
+
+/* Amplitude of the freq component of the first channel. */
+static double goertzel(const int16_t *buf, size_t frames, double freq,
+		       double rate)
+{
+	double coef = 2 * cos(2 * M_PI * freq / rate);
+	double s1 = 0, s2 = 0;
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		double s = buf[i * BENCH_CHANNELS] + coef * s1 - s2;
+
+		s2 = s1;
+		s1 = s;
+	}
+	return 2 * sqrt(s1 * s1 + s2 * s2 - coef * s1 * s2) / frames;
+}
+
+static size_t resample(struct bench_resampler *br,
+		       const int16_t *in, size_t in_frames,
+		       int16_t *out, size_t out_frames)
+{
+	spx_uint32_t speex_in = in_frames, speex_out = out_frames;
+
+	if (br->rs) {
+		cras_resampler_process(br->rs, in, &in_frames,
+				       out, &out_frames);
+		return out_frames;
+	}
+	speex_resampler_process_interleaved_int(br->speex, in, &speex_in,
+						out, &speex_out);
+	return speex_out;
+}
+
+/* Resamples BENCH_SECONDS of the tone in blocks, prints the CPU load and
+ * the attenuation at the alias or image frequency. */
+static void bench(const char *name, struct bench_resampler *br,
+		  size_t in_rate, size_t out_rate, double tone,
+		  const int16_t *in, int16_t *out)
+{
+	size_t in_frames = BENCH_SECONDS * in_rate;
+	size_t max_out = BENCH_SECONDS * out_rate + BENCH_BLOCK_FRAMES;
+	size_t used, written = 0;
+	struct timespec tp1, tp2;
+	double freq, level;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp1);
+	for (used = 0; used < in_frames; used += BENCH_BLOCK_FRAMES)
+		written += resample(br, in + used * BENCH_CHANNELS,
+				    min(BENCH_BLOCK_FRAMES, in_frames - used),
+				    out + written * BENCH_CHANNELS,
+				    max_out - written);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp2);
+
+	/* Downsampling folds the tone itself back, upsampling leaves an
+	 * image mirrored around the input Nyquist frequency. */
+	if (out_rate < in_rate)
+		freq = fold(tone, out_rate);
+	else
+		freq = fold(in_rate - tone, out_rate);
+	/* Skip the first second, filters take a while to fill. */
+	level = goertzel(out + out_rate * BENCH_CHANNELS, written - out_rate,
+			 freq, out_rate);
+
+	printf("%5zu->%-5zu %-14s %8.3f%% %8.1f dB at %.0f Hz\n",
+	       in_rate, out_rate, name,
+	       100 * tp_diff(&tp2, &tp1) / BENCH_SECONDS,
+	       20 * log10(level / TONE_AMPLITUDE + 1e-12), freq);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_resampler br;
+	int16_t *in, *out;
+	size_t i, f, q;
+	int err;
+
+	for (i = 0; i < ARRAY_SIZE(rate_pairs); i++) {
+		size_t in_rate = rate_pairs[i].in_rate;
+		size_t out_rate = rate_pairs[i].out_rate;
+		size_t in_frames = BENCH_SECONDS * in_rate;
+
+		in = malloc(in_frames * BENCH_CHANNELS * sizeof(*in));
+		out = malloc((BENCH_SECONDS * out_rate + BENCH_BLOCK_FRAMES) *
+			     BENCH_CHANNELS * sizeof(*out));
+		for (f = 0; f < in_frames * BENCH_CHANNELS; f++)
+			in[f] = lrint(TONE_AMPLITUDE *
+				      sin(2 * M_PI * rate_pairs[i].tone *
+					  (f / BENCH_CHANNELS) / in_rate));
+
+		br.rs = NULL;
+		br.speex = speex_resampler_init(BENCH_CHANNELS, in_rate,
+						out_rate, SPEEX_QUALITY, &err);
+		if (br.speex) {
+			bench("speex", &br, in_rate, out_rate,
+			      rate_pairs[i].tone, in, out);
+			speex_resampler_destroy(br.speex);
+		}
+
+		for (q = 0; q < CRAS_RESAMPLER_NUM_QUALITIES; q++) {
+			br.rs = cras_resampler_create(BENCH_CHANNELS,
+						      in_rate, out_rate, q);
+			if (!br.rs)
+				continue;
+			bench(quality_names[q], &br, in_rate, out_rate,
+			      rate_pairs[i].tone, in, out);
+			cras_resampler_destroy(br.rs);
+		}
+
+		free(in);
+		free(out);
+	}
+
+	return 0;
+}
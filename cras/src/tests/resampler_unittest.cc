@@ -0,0 +1,303 @@
+// Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <math.h>
+#include <gtest/gtest.h>
+
+extern "C" {
+//  Include C file to test static functions.
+#include "cras_resampler.c"
+}
+
+static const size_t kNumChannels = 2;
+static const size_t kNumFrames = 4096;
+static const double kAmplitude = 10000.0;
+
+namespace {
+
+// Fills interleaved frames with a sine of freq Hz in every channel.
+static void FillSine(int16_t *buf, size_t frames, size_t rate, double freq) {
+  for (size_t i = 0; i < frames; i++)
+    for (size_t ch = 0; ch < kNumChannels; ch++)
+      buf[i * kNumChannels + ch] = lrint(kAmplitude *
+                                         sin(2 * M_PI * freq * i / rate));
+}
+
+// Root mean square of the first channel from frame start on, scaled to the
+// amplitude of a sine.
+static double SineAmplitude(const int16_t *buf, size_t start, size_t end) {
+  double sum = 0;
+
+  for (size_t i = start; i < end; i++)
+    sum += (double)buf[i * kNumChannels] * buf[i * kNumChannels];
+  return sqrt(2 * sum / (end - start));
+}
+
+// Resamples all of in at once, returns the frames written to out.
+static size_t ResampleAll(size_t in_rate, size_t out_rate,
+                          enum CRAS_RESAMPLER_QUALITY quality,
+                          const int16_t *in, size_t in_frames,
+                          int16_t *out, size_t out_frames) {
+  struct cras_resampler *rs;
+
+  rs = cras_resampler_create(kNumChannels, in_rate, out_rate, quality);
+  EXPECT_NE((void *)NULL, rs);
+  cras_resampler_process(rs, in, &in_frames, out, &out_frames);
+  cras_resampler_destroy(rs);
+  return out_frames;
+}
+
+TEST(Resampler, CreateBadArgs) {
+  EXPECT_EQ((void *)NULL, cras_resampler_create(0, 48000, 44100,
+                          CRAS_RESAMPLER_QUALITY_MEDIUM));
+  EXPECT_EQ((void *)NULL, cras_resampler_create(2, 0, 44100,
+                          CRAS_RESAMPLER_QUALITY_MEDIUM));
+  EXPECT_EQ((void *)NULL, cras_resampler_create(2, 48000, 44100,
+                          CRAS_RESAMPLER_NUM_QUALITIES));
+  // 44101 Hz is prime, it would need 44101 phases.
+  EXPECT_EQ((void *)NULL, cras_resampler_create(2, 48000, 44101,
+                          CRAS_RESAMPLER_QUALITY_MEDIUM));
+}
+
+TEST(Resampler, SharedFilterTables) {
+  struct cras_resampler *rs1, *rs2, *rs3;
+
+  rs1 = cras_resampler_create(2, 48000, 44100,
+                              CRAS_RESAMPLER_QUALITY_MEDIUM);
+  rs2 = cras_resampler_create(6, 48000, 44100,
+                              CRAS_RESAMPLER_QUALITY_MEDIUM);
+  rs3 = cras_resampler_create(2, 48000, 44100, CRAS_RESAMPLER_QUALITY_HIGH);
+  ASSERT_NE((void *)NULL, rs1);
+  ASSERT_NE((void *)NULL, rs2);
+  ASSERT_NE((void *)NULL, rs3);
+
+  EXPECT_EQ(rs1->filter, rs2->filter);
+  EXPECT_EQ(2, rs1->filter->num_users);
+  EXPECT_NE(rs1->filter, rs3->filter);
+  EXPECT_EQ(1, rs3->filter->num_users);
+  // 147 phases, doubled to have at least MIN_PHASES.
+  EXPECT_EQ(294, rs1->filter->num_phases);
+  EXPECT_EQ(320, rs1->filter->step);
+  EXPECT_EQ(0, rs1->filter->num_taps % 8);
+
+  cras_resampler_destroy(rs1);
+  EXPECT_EQ(1, rs2->filter->num_users);
+  cras_resampler_destroy(rs2);
+  cras_resampler_destroy(rs3);
+  // The tables stay around idle for the next resamplers.
+  EXPECT_EQ(2, num_idle_filters);
+  release_idle_filters(0);
+  EXPECT_EQ((void *)NULL, filters);
+}
+
+TEST(Resampler, PreparedFilterIsLookedUp) {
+  struct resampler_filter *prepared;
+  struct cras_resampler *rs;
+
+  release_idle_filters(0);
+  EXPECT_EQ(-EINVAL, cras_resampler_prepare(0, 44100,
+                                            CRAS_RESAMPLER_QUALITY_LOW));
+  // 44100 / 1 phases is more than MAX_PHASES.
+  EXPECT_EQ(-EINVAL, cras_resampler_prepare(44101, 44100,
+                                            CRAS_RESAMPLER_QUALITY_LOW));
+  EXPECT_EQ((void *)NULL, filters);
+
+  EXPECT_EQ(0, cras_resampler_prepare(32000, 48000,
+                                      CRAS_RESAMPLER_QUALITY_LOW));
+  prepared = filters;
+  ASSERT_NE((void *)NULL, prepared);
+  EXPECT_EQ(0, prepared->num_users);
+  EXPECT_EQ(1, num_idle_filters);
+
+  rs = cras_resampler_create(2, 32000, 48000, CRAS_RESAMPLER_QUALITY_LOW);
+  ASSERT_NE((void *)NULL, rs);
+  EXPECT_EQ(prepared, rs->filter);
+  EXPECT_EQ(1, prepared->num_users);
+  EXPECT_EQ(0, num_idle_filters);
+
+  cras_resampler_destroy(rs);
+  EXPECT_EQ(prepared, filters);
+  EXPECT_EQ(1, num_idle_filters);
+  release_idle_filters(0);
+}
+
+TEST(Resampler, OldestIdleFilterIsFreed) {
+  struct resampler_filter *filter;
+  size_t rate;
+
+  release_idle_filters(0);
+  for (rate = 16000; rate < 16000 + MAX_IDLE_FILTERS + 2; rate++)
+    EXPECT_EQ(0, cras_resampler_prepare(rate, rate,
+                                        CRAS_RESAMPLER_QUALITY_LOW));
+  EXPECT_EQ(MAX_IDLE_FILTERS, num_idle_filters);
+  // The two first ones were dropped.
+  DL_FOREACH(filters, filter)
+    EXPECT_LE(16002, filter->in_rate);
+  release_idle_filters(0);
+  EXPECT_EQ((void *)NULL, filters);
+}
+
+TEST(Resampler, OutputFrameCount) {
+  int16_t *in = (int16_t *)calloc(kNumFrames * kNumChannels, sizeof(*in));
+  int16_t *out = (int16_t *)calloc(2 * kNumFrames * kNumChannels,
+                                   sizeof(*out));
+
+  // Output frame n is produced once input frame n * in / out arrives.
+  EXPECT_EQ(3764, ResampleAll(48000, 44100, CRAS_RESAMPLER_QUALITY_MEDIUM,
+                              in, kNumFrames, out, 2 * kNumFrames));
+  EXPECT_EQ(4459, ResampleAll(44100, 48000, CRAS_RESAMPLER_QUALITY_MEDIUM,
+                              in, kNumFrames, out, 2 * kNumFrames));
+  EXPECT_EQ(1366, ResampleAll(48000, 16000, CRAS_RESAMPLER_QUALITY_LOW,
+                              in, kNumFrames, out, 2 * kNumFrames));
+
+  free(in);
+  free(out);
+}
+
+TEST(Resampler, PassbandAndStopband) {
+  int16_t *in = (int16_t *)calloc(kNumFrames * kNumChannels, sizeof(*in));
+  int16_t *out = (int16_t *)calloc(2 * kNumFrames * kNumChannels,
+                                   sizeof(*out));
+  size_t frames;
+
+  for (int q = 0; q < CRAS_RESAMPLER_NUM_QUALITIES; q++) {
+    enum CRAS_RESAMPLER_QUALITY quality = (enum CRAS_RESAMPLER_QUALITY)q;
+
+    // A 1 kHz tone keeps its level, past the start up.
+    FillSine(in, kNumFrames, 48000, 1000);
+    frames = ResampleAll(48000, 44100, quality, in, kNumFrames,
+                         out, 2 * kNumFrames);
+    EXPECT_NEAR(kAmplitude, SineAmplitude(out, 500, frames),
+                0.01 * kAmplitude);
+
+    // 14 kHz is past 8 kHz Nyquist of the output, its alias must be gone.
+    FillSine(in, kNumFrames, 48000, 14000);
+    frames = ResampleAll(48000, 16000, quality, in, kNumFrames,
+                         out, 2 * kNumFrames);
+    EXPECT_GT(0.002 * kAmplitude, SineAmplitude(out, 500, frames));
+  }
+
+  free(in);
+  free(out);
+}
+
+TEST(Resampler, SimdMatchesC) {
+  int16_t *in = (int16_t *)calloc(kNumFrames * kNumChannels, sizeof(*in));
+  int16_t *out_c = (int16_t *)calloc(2 * kNumFrames * kNumChannels,
+                                     sizeof(*out_c));
+  int16_t *out_simd = (int16_t *)calloc(2 * kNumFrames * kNumChannels,
+                                        sizeof(*out_simd));
+  size_t frames_c, frames_simd;
+
+  for (size_t i = 0; i < kNumFrames * kNumChannels; i++)
+    in[i] = rand();
+
+  cras_resampler_set_cpu_flags(0);
+  frames_c = ResampleAll(44100, 48000, CRAS_RESAMPLER_QUALITY_HIGH,
+                         in, kNumFrames, out_c, 2 * kNumFrames);
+  cras_resampler_set_cpu_flags(~0U);
+  frames_simd = ResampleAll(44100, 48000, CRAS_RESAMPLER_QUALITY_HIGH,
+                            in, kNumFrames, out_simd, 2 * kNumFrames);
+
+  // Summing in another order can round the other way.
+  ASSERT_EQ(frames_c, frames_simd);
+  for (size_t i = 0; i < frames_c * kNumChannels; i++)
+    EXPECT_NEAR(out_c[i], out_simd[i], 1) << "at sample " << i;
+
+  free(in);
+  free(out_c);
+  free(out_simd);
+}
+
+TEST(Resampler, ChunksMatchOneShot) {
+  int16_t *in = (int16_t *)calloc(kNumFrames * kNumChannels, sizeof(*in));
+  int16_t *expected = (int16_t *)calloc(2 * kNumFrames * kNumChannels,
+                                        sizeof(*expected));
+  int16_t *out = (int16_t *)calloc(2 * kNumFrames * kNumChannels,
+                                   sizeof(*out));
+  struct cras_resampler *rs;
+  size_t expected_frames, used = 0, written = 0;
+
+  for (size_t i = 0; i < kNumFrames * kNumChannels; i++)
+    in[i] = rand();
+  expected_frames = ResampleAll(48000, 44100, CRAS_RESAMPLER_QUALITY_MEDIUM,
+                                in, kNumFrames, expected, 2 * kNumFrames);
+
+  // Random sized input, and output too small for it half the time.
+  rs = cras_resampler_create(kNumChannels, 48000, 44100,
+                             CRAS_RESAMPLER_QUALITY_MEDIUM);
+  ASSERT_NE((void *)NULL, rs);
+  while (used < kNumFrames) {
+    size_t in_frames = 1 + rand() % 700;
+    size_t out_frames = 1 + rand() % 700;
+
+    if (in_frames > kNumFrames - used)
+      in_frames = kNumFrames - used;
+    cras_resampler_process(rs, in + used * kNumChannels, &in_frames,
+                           out + written * kNumChannels, &out_frames);
+    used += in_frames;
+    written += out_frames;
+  }
+  // Take what the last small outputs left behind.
+  for (;;) {
+    size_t in_frames = 0;
+    size_t out_frames = 2 * kNumFrames - written;
+
+    cras_resampler_process(rs, in, &in_frames,
+                           out + written * kNumChannels, &out_frames);
+    if (out_frames == 0)
+      break;
+    written += out_frames;
+  }
+  cras_resampler_destroy(rs);
+
+  ASSERT_EQ(expected_frames, written);
+  for (size_t i = 0; i < written * kNumChannels; i++)
+    ASSERT_EQ(expected[i], out[i]) << "at sample " << i;
+
+  free(in);
+  free(expected);
+  free(out);
+}
+
+TEST(Resampler, AdjustedRatio) {
+  int16_t *in = (int16_t *)calloc(kNumFrames * kNumChannels, sizeof(*in));
+  int16_t *out = (int16_t *)calloc(2 * kNumFrames * kNumChannels,
+                                   sizeof(*out));
+  struct cras_resampler *rs;
+  size_t in_frames = kNumFrames, out_frames = 2 * kNumFrames;
+
+  // 1000 ppm faster output of a 1 kHz tone, at the same rate.
+  FillSine(in, kNumFrames, 48000, 1000);
+  rs = cras_resampler_create(kNumChannels, 48000, 48000,
+                             CRAS_RESAMPLER_QUALITY_MEDIUM);
+  ASSERT_NE((void *)NULL, rs);
+  cras_resampler_set_ratio(rs, 1.001);
+  cras_resampler_process(rs, in, &in_frames, out, &out_frames);
+  cras_resampler_destroy(rs);
+
+  EXPECT_EQ(kNumFrames, in_frames);
+  EXPECT_NEAR(kNumFrames * 1.001, out_frames, 1);
+  EXPECT_NEAR(kAmplitude, SineAmplitude(out, 500, out_frames),
+              0.01 * kAmplitude);
+
+  // The tone is stretched, output frame i is input frame i / 1.001, half
+  // the 32 taps late.
+  for (size_t i = 500; i < out_frames; i++) {
+    double expected = kAmplitude * sin(2 * M_PI * 1000 *
+                                       (i / 1.001 - 16) / 48000);
+    ASSERT_NEAR(expected, out[i * kNumChannels], 0.002 * kAmplitude)
+        << "at frame " << i;
+  }
+
+  free(in);
+  free(out);
+}
+
+}  //  namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
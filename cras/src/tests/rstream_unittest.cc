@@ -3,7 +3,6 @@
 // found in the LICENSE file.
 
 #include <stdio.h>
-#include <sys/shm.h>
 #include <gtest/gtest.h>
 
 extern "C" {
@@ -43,6 +42,7 @@ TEST_F(RstreamTestSuite, InvalidDirection) {
       1024,
       2048,
       0,
+      0,
       NULL,
       &s);
   EXPECT_NE(0, rc);
@@ -60,6 +60,7 @@ TEST_F(RstreamTestSuite, InvalidBufferSize) {
       1024,
       2048,
       0,
+      0,
       NULL,
       &s);
   EXPECT_NE(0, rc);
@@ -77,6 +78,7 @@ TEST_F(RstreamTestSuite, InvalidCallbackThreshold) {
       3,
       2048,
       0,
+      0,
       NULL,
       &s);
   EXPECT_NE(0, rc);
@@ -93,6 +95,7 @@ TEST_F(RstreamTestSuite, InvalidStreamPointer) {
       1024,
       2048,
       0,
+      0,
       NULL,
       NULL);
   EXPECT_NE(0, rc);
@@ -103,7 +106,7 @@ TEST_F(RstreamTestSuite, CreateOutput) {
   struct cras_audio_format fmt_ret;
   struct cras_audio_shm *shm_ret;
   struct cras_audio_shm shm_mapped;
-  int rc, key_ret, shmid;
+  int rc, fd_ret;
   size_t shm_size;
 
   rc = cras_rstream_create(555,
@@ -114,6 +117,7 @@ TEST_F(RstreamTestSuite, CreateOutput) {
       1024,
       2048,
       0,
+      0,
       NULL,
       &s);
   EXPECT_EQ(0, rc);
@@ -131,16 +135,16 @@ TEST_F(RstreamTestSuite, CreateOutput) {
   // Check if shm is really set up.
   shm_ret = cras_rstream_output_shm(s);
   ASSERT_NE((void *)NULL, shm_ret);
-  key_ret = cras_rstream_output_shm_key(s);
+  fd_ret = cras_rstream_output_shm_fd(s);
+  EXPECT_GE(fd_ret, 0);
   shm_size = cras_rstream_get_total_shm_size(s);
   EXPECT_GT(shm_size, 4096);
-  shmid = shmget(key_ret, shm_size, 0600);
-  EXPECT_GE(shmid, 0);
-  shm_mapped.area = (struct cras_audio_shm_area *)shmat(shmid, NULL, 0);
-  EXPECT_NE((void *)NULL, shm_mapped.area);
+  shm_mapped.area = (struct cras_audio_shm_area *)cras_shm_map(fd_ret,
+                                                               shm_size, 1);
+  ASSERT_NE((void *)NULL, shm_mapped.area);
   cras_shm_copy_shared_config(&shm_mapped);
   EXPECT_EQ(cras_shm_used_size(&shm_mapped), cras_shm_used_size(shm_ret));
-  shmdt(shm_mapped.area);
+  cras_shm_unmap(shm_mapped.area, shm_size);
 
   cras_rstream_destroy(s);
 }
@@ -150,7 +154,7 @@ TEST_F(RstreamTestSuite, CreateInput) {
   struct cras_audio_format fmt_ret;
   struct cras_audio_shm *shm_ret;
   struct cras_audio_shm shm_mapped;
-  int rc, key_ret, shmid;
+  int rc, fd_ret;
   size_t shm_size;
 
   rc = cras_rstream_create(555,
@@ -161,6 +165,7 @@ TEST_F(RstreamTestSuite, CreateInput) {
       1024,
       2048,
       0,
+      0,
       NULL,
       &s);
   EXPECT_EQ(0, rc);
@@ -178,17 +183,108 @@ TEST_F(RstreamTestSuite, CreateInput) {
   // Check if shm is really set up.
   shm_ret = cras_rstream_input_shm(s);
   ASSERT_NE((void *)NULL, shm_ret);
-  key_ret = cras_rstream_input_shm_key(s);
+  fd_ret = cras_rstream_input_shm_fd(s);
+  EXPECT_GE(fd_ret, 0);
   shm_size = cras_rstream_get_total_shm_size(s);
   EXPECT_GT(shm_size, 4096);
-  shmid = shmget(key_ret, shm_size, 0600);
-  EXPECT_GE(shmid, 0);
-  shm_mapped.area = (struct cras_audio_shm_area *)shmat(shmid, NULL, 0);
-  EXPECT_NE((void *)NULL, shm_mapped.area);
+  shm_mapped.area = (struct cras_audio_shm_area *)cras_shm_map(fd_ret,
+                                                               shm_size, 1);
+  ASSERT_NE((void *)NULL, shm_mapped.area);
   cras_shm_copy_shared_config(&shm_mapped);
   EXPECT_EQ(cras_shm_used_size(&shm_mapped), cras_shm_used_size(shm_ret));
-  shmdt(shm_mapped.area);
+  cras_shm_unmap(shm_mapped.area, shm_size);
+
+  cras_rstream_destroy(s);
+}
+
+TEST_F(RstreamTestSuite, CreateOutputRing) {
+  struct cras_rstream *s;
+  struct cras_audio_shm shm_mapped;
+  size_t shm_size;
+  int rc;
+
+  // Three periods round up to a ring of four.
+  rc = cras_rstream_create(555,
+      CRAS_STREAM_TYPE_DEFAULT,
+      CRAS_STREAM_OUTPUT,
+      &fmt_,
+      4096,
+      4096,
+      2048,
+      0,
+      3,
+      NULL,
+      &s);
+  ASSERT_EQ(0, rc);
+  EXPECT_EQ(4, cras_shm_num_periods(cras_rstream_output_shm(s)));
+  EXPECT_EQ(3 * 4096, cras_rstream_get_fetch_level(s));
+
+  shm_size = cras_rstream_get_total_shm_size(s);
+  //  The four periods and the spare one.
+  EXPECT_EQ(5 * 4096 * 4 + sizeof(struct cras_audio_shm_area), shm_size);
+  shm_mapped.area = (struct cras_audio_shm_area *)cras_shm_map(
+      cras_rstream_output_shm_fd(s), shm_size, 1);
+  ASSERT_NE((void *)NULL, shm_mapped.area);
+  cras_shm_copy_shared_config(&shm_mapped);
+  EXPECT_EQ(CRAS_SHM_LAYOUT_VERSION, shm_mapped.area->layout_version);
+  EXPECT_EQ(4, shm_mapped.config.num_periods);
+  cras_shm_unmap(shm_mapped.area, shm_size);
+
+  cras_rstream_destroy(s);
+}
+
+TEST_F(RstreamTestSuite, OutputShmWakeup) {
+  struct cras_rstream *s;
+  struct cras_audio_shm shm_mapped;
+  uint32_t count = 0;
+  uint32_t frames;
+  uint64_t events;
+  size_t shm_size;
+  int rc;
+
+  rc = cras_rstream_create(555,
+      CRAS_STREAM_TYPE_DEFAULT,
+      CRAS_STREAM_OUTPUT,
+      &fmt_,
+      4096,
+      4096,
+      2048,
+      CRAS_STREAM_FLAG_SHM_WAKEUP,
+      0,
+      NULL,
+      &s);
+  ASSERT_EQ(0, rc);
+  ASSERT_TRUE(cras_rstream_uses_shm_wakeup(s));
+  EXPECT_LE(0, cras_rstream_request_event_fd(s));
+  EXPECT_EQ(cras_rstream_reply_event_fd(s), cras_rstream_get_reply_fd(s));
+
+  shm_size = cras_rstream_get_total_shm_size(s);
+  shm_mapped.area = (struct cras_audio_shm_area *)cras_shm_map(
+      cras_rstream_output_shm_fd(s), shm_size, 1);
+  ASSERT_NE((void *)NULL, shm_mapped.area);
+
+  // The request is posted to shm and signaled on the request eventfd.
+  EXPECT_EQ(0, cras_rstream_request_audio(s));
+  EXPECT_EQ(sizeof(events),
+            read(cras_rstream_request_event_fd(s), &events, sizeof(events)));
+  ASSERT_EQ(1, cras_shm_take_aud_request(&shm_mapped, &count, &frames));
+  EXPECT_EQ(2048, frames);
+
+  // Nothing replied yet.
+  EXPECT_EQ(-EAGAIN, cras_rstream_get_audio_request_reply(s));
+
+  cras_shm_post_aud_reply(&shm_mapped, count, frames);
+  events = 1;
+  EXPECT_EQ(sizeof(events),
+            write(cras_rstream_reply_event_fd(s), &events, sizeof(events)));
+  EXPECT_EQ(0, cras_rstream_get_audio_request_reply(s));
+
+  cras_rstream_request_audio(s);
+  cras_shm_take_aud_request(&shm_mapped, &count, &frames);
+  cras_shm_post_aud_reply(&shm_mapped, count, -EINVAL);
+  EXPECT_EQ(-EIO, cras_rstream_get_audio_request_reply(s));
 
+  cras_shm_unmap(shm_mapped.area, shm_size);
   cras_rstream_destroy(s);
 }
 
@@ -0,0 +1,310 @@
+/* Copyright (c) 2014 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Ping-pong of periods between two threads over a shm area, as between a
+ * playback client and the server.  The writer fills a period and waits until
+ * the reader has consumed it, the reader mixes it, stamps the area like the
+ * server does and frees it.  Prints the time of a round trip, which is mostly
+ * spent moving cache lines of the area between the two cores.
+ *
+ * Three areas are timed in the same run:
+ *  packed - The layout before the fields were grouped by writer, all of them
+ *    on the first lines of the area, with the double buffer.
+ *  double buffer - The current layout with the double buffer.  Its reader
+ *    still clears write_offset when it frees a buffer, so one line keeps
+ *    going back and forth.
+ *  ring - The current layout with a ring, each side only writes its lines.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cras_shm.h"
+#include "cras_util.h"
+
+#define BENCH_ROUND_TRIPS 200000
+#define BENCH_CHANNELS 2
+/* Small periods, so the control fields are most of what is shared. */
+#define BENCH_PERIOD_FRAMES 16
+#define BENCH_FRAME_BYTES (2 * BENCH_CHANNELS)
+#define BENCH_PERIOD_BYTES (BENCH_PERIOD_FRAMES * BENCH_FRAME_BYTES)
+/* Checks of the other side before giving up the CPU. */
+#define BENCH_SPINS 1000
+
+/* The area as it was laid out before, for the baseline. */
+struct packed_shm_area {
+	struct {
+		unsigned int used_size;
+		unsigned int frame_bytes;
+	} config;
+	size_t read_buf_idx;
+	size_t write_buf_idx;
+	size_t read_offset[CRAS_NUM_SHM_BUFFERS];
+	size_t write_offset[CRAS_NUM_SHM_BUFFERS];
+	int write_in_progress[CRAS_NUM_SHM_BUFFERS];
+	float volume_scaler;
+	size_t mute;
+	size_t callback_pending;
+	size_t num_overruns;
+	size_t num_cb_timeouts;
+	struct timespec ts;
+	uint8_t samples[];
+};
+
+struct bench {
+	struct cras_audio_shm shm;
+	struct packed_shm_area *packed;
+	int32_t sum;
+};
+
+/* The sides of the exchange over one kind of area, called through pointers
+ * so the polling loops reload the area. */
+struct bench_ops {
+	const char *name;
+	int (*frames)(struct bench *bench);
+	void (*write)(struct bench *bench, unsigned int mark);
+	void (*read)(struct bench *bench);
+};
+
+static double tp_diff(struct timespec *tp2, struct timespec *tp1)
+{
+	return (tp2->tv_sec - tp1->tv_sec)
+		+ (tp2->tv_nsec - tp1->tv_nsec) * 1e-9;
+}
+
+static void fill_period(int16_t *dst, unsigned int frames, unsigned int mark)
+{
+	unsigned int j;
+
+	for (j = 0; j < frames * BENCH_CHANNELS; j++)
+		dst[j] = mark + j;
+}
+
+static void mix_period(struct bench *bench, const int16_t *src, size_t frames)
+{
+	size_t j;
+
+	for (j = 0; j < frames * BENCH_CHANNELS; j++)
+		bench->sum += src[j];
+}
+
+static int shm_frames(struct bench *bench)
+{
+	return cras_shm_get_frames(&bench->shm);
+}
+
+static void shm_write(struct bench *bench, unsigned int mark)
+{
+	struct cras_audio_shm *shm = &bench->shm;
+	unsigned int limit;
+	int16_t *dst;
+
+	cras_shm_check_write_overrun(shm);
+	dst = (int16_t *)cras_shm_get_writeable_frames(
+			shm, BENCH_PERIOD_FRAMES, &limit);
+	fill_period(dst, limit, mark);
+	cras_shm_buffer_written(shm, limit);
+	cras_shm_buffer_write_complete(shm);
+}
+
+static void shm_read(struct bench *bench)
+{
+	struct cras_audio_shm *shm = &bench->shm;
+	size_t frames;
+	int16_t *src;
+
+	src = cras_shm_get_readable_frames(shm, 0, &frames);
+	mix_period(bench, src, frames);
+	clock_gettime(CLOCK_MONOTONIC, &shm->area->ts);
+	cras_shm_buffer_read(shm, frames);
+}
+
+/* The packed area is used as the double buffer was, by whole periods. */
+static int packed_frames(struct bench *bench)
+{
+	struct packed_shm_area *area = bench->packed;
+	size_t i, total = 0;
+
+	for (i = 0; i < CRAS_NUM_SHM_BUFFERS; i++)
+		if (area->write_offset[i] > area->read_offset[i])
+			total += area->write_offset[i] - area->read_offset[i];
+	return total / BENCH_FRAME_BYTES;
+}
+
+static void packed_write(struct bench *bench, unsigned int mark)
+{
+	struct packed_shm_area *area = bench->packed;
+	size_t i = area->write_buf_idx & CRAS_SHM_BUFFERS_MASK;
+
+	if (!area->write_in_progress[i]) {
+		if (i != (area->read_buf_idx & CRAS_SHM_BUFFERS_MASK))
+			area->num_overruns++;
+		area->write_in_progress[i] = 1;
+		area->write_offset[i] = 0;
+	}
+	fill_period((int16_t *)(area->samples + BENCH_PERIOD_BYTES * i),
+		    BENCH_PERIOD_FRAMES, mark);
+	area->write_offset[i] += BENCH_PERIOD_BYTES;
+	area->read_offset[i] = 0;
+	area->write_in_progress[i] = 0;
+	area->write_buf_idx = (i + 1) & CRAS_SHM_BUFFERS_MASK;
+}
+
+static void packed_read(struct bench *bench)
+{
+	struct packed_shm_area *area = bench->packed;
+	size_t i = area->read_buf_idx & CRAS_SHM_BUFFERS_MASK;
+	size_t bytes = area->write_offset[i] - area->read_offset[i];
+
+	mix_period(bench, (int16_t *)(area->samples + BENCH_PERIOD_BYTES * i +
+				      area->read_offset[i]),
+		   bytes / BENCH_FRAME_BYTES);
+	clock_gettime(CLOCK_MONOTONIC, &area->ts);
+	area->read_offset[i] = 0;
+	area->write_offset[i] = 0;
+	area->read_buf_idx = (i + 1) & CRAS_SHM_BUFFERS_MASK;
+}
+
+static const struct bench_ops packed_ops = {
+	"packed", packed_frames, packed_write, packed_read
+};
+
+static const struct bench_ops double_buffer_ops = {
+	"double buffer", shm_frames, shm_write, shm_read
+};
+
+static const struct bench_ops ring_ops = {
+	"ring", shm_frames, shm_write, shm_read
+};
+
+struct bench_run {
+	const struct bench_ops *ops;
+	struct bench *bench;
+};
+
+/* Spins until the frames queued are empty or not, yielding now and then so a
+ * single core still makes progress. */
+static void wait_frames(const struct bench_run *run, int empty)
+{
+	unsigned int spins = 0;
+
+	while ((run->ops->frames(run->bench) == 0) != empty) {
+		if (++spins == BENCH_SPINS) {
+			sched_yield();
+			spins = 0;
+		}
+	}
+}
+
+static void *reader_thread(void *arg)
+{
+	const struct bench_run *run = (const struct bench_run *)arg;
+	unsigned int i;
+
+	for (i = 0; i < BENCH_ROUND_TRIPS; i++) {
+		wait_frames(run, 0);
+		run->ops->read(run->bench);
+	}
+	return NULL;
+}
+
+static void writer(const struct bench_run *run)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_ROUND_TRIPS; i++) {
+		run->ops->write(run->bench, i);
+		wait_frames(run, 1);
+	}
+}
+
+/* Times the round trips over an area set up in bench. */
+static int run_bench(const struct bench_ops *ops, struct bench *bench)
+{
+	struct bench_run run = { ops, bench };
+	struct timespec start, end;
+	pthread_t tid;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (pthread_create(&tid, NULL, reader_thread, &run)) {
+		fprintf(stderr, "Failed to create the reader\n");
+		return -1;
+	}
+	writer(&run);
+	pthread_join(tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%-14s %u round trips of %u frame periods: %.0f ns each\n",
+	       ops->name, BENCH_ROUND_TRIPS, BENCH_PERIOD_FRAMES,
+	       tp_diff(&end, &start) * 1e9 / BENCH_ROUND_TRIPS);
+	return 0;
+}
+
+/* Allocates a zeroed area page aligned, as the area would be mapped. */
+static void *alloc_area(size_t size)
+{
+	void *area;
+
+	if (posix_memalign(&area, 4096, size)) {
+		fprintf(stderr, "Failed to allocate the area\n");
+		return NULL;
+	}
+	memset(area, 0, size);
+	return area;
+}
+
+static int bench_packed(void)
+{
+	struct bench bench;
+	int rc;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.packed = alloc_area(sizeof(*bench.packed) +
+				  BENCH_PERIOD_BYTES * CRAS_NUM_SHM_BUFFERS);
+	if (!bench.packed)
+		return -1;
+	bench.packed->config.used_size = BENCH_PERIOD_BYTES;
+	bench.packed->config.frame_bytes = BENCH_FRAME_BYTES;
+
+	rc = run_bench(&packed_ops, &bench);
+	printf("(checksum %d)\n", bench.sum);
+	free(bench.packed);
+	return rc;
+}
+
+static int bench_shm(const struct bench_ops *ops, unsigned int num_periods)
+{
+	struct bench bench;
+	int rc;
+
+	memset(&bench, 0, sizeof(bench));
+	cras_shm_set_frame_bytes(&bench.shm, BENCH_FRAME_BYTES);
+	cras_shm_set_used_size(&bench.shm, BENCH_PERIOD_BYTES);
+	cras_shm_set_num_periods(&bench.shm, num_periods);
+	bench.shm.area = alloc_area(cras_shm_total_size(&bench.shm));
+	if (!bench.shm.area)
+		return -1;
+	memcpy(&bench.shm.area->config, &bench.shm.config,
+	       sizeof(bench.shm.config));
+
+	rc = run_bench(ops, &bench);
+	printf("(checksum %d)\n", bench.sum);
+	free(bench.shm.area);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	if (bench_packed() || bench_shm(&double_buffer_ops, 0) ||
+	    bench_shm(&ring_ops, 2))
+		return 1;
+	return 0;
+}
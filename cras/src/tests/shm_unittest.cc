@@ -2,14 +2,29 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
 
 extern "C" {
 #include "cras_shm.h"
 #include "cras_types.h"
 }
 
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+// Seals fcntl refuses with EINVAL, like a kernel that doesn't know them.
+static int fcntl_unknown_seals;
+
 namespace {
 
 class ShmTestSuite : public testing::Test{
@@ -223,8 +238,300 @@ TEST_F(ShmTestSuite, InvalidReadAndWriteOffset) {
   EXPECT_EQ(shm_.config.used_size / 4, frames_);
 }
 
+class ShmRingTestSuite : public testing::Test{
+  protected:
+    virtual void SetUp() {
+      memset(&shm_, 0, sizeof(shm_));
+      cras_shm_set_frame_bytes(&shm_, 4);
+      cras_shm_set_used_size(&shm_, 1024);
+      cras_shm_set_num_periods(&shm_, 4);
+      shm_.area = static_cast<cras_audio_shm_area *>(
+          calloc(1, cras_shm_total_size(&shm_)));
+      memcpy(&shm_.area->config, &shm_.config, sizeof(shm_.config));
+    }
+
+    virtual void TearDown() {
+      free(shm_.area);
+    }
+
+    // Writes a period of frames, each sample holding the value mark.
+    void WritePeriod(unsigned frames, int16_t mark) {
+      unsigned limit;
+      int16_t *dst = (int16_t *)cras_shm_get_writeable_frames(
+          &shm_, cras_shm_used_frames(&shm_), &limit);
+
+      ASSERT_LE(frames, limit);
+      for (unsigned i = 0; i < frames * 2; i++)
+        dst[i] = mark;
+      cras_shm_buffer_written(&shm_, frames);
+      cras_shm_buffer_write_complete(&shm_);
+    }
+
+    struct cras_audio_shm shm_;
+};
+
+TEST_F(ShmRingTestSuite, WriteAheadAndRead) {
+  int16_t *buf;
+  size_t frames;
+
+  EXPECT_EQ(5 * 1024 + sizeof(*shm_.area), cras_shm_total_size(&shm_));
+
+  // All but the last period can be written before any is read.
+  WritePeriod(100, 1);
+  WritePeriod(200, 2);
+  WritePeriod(256, 3);
+  EXPECT_TRUE(cras_shm_is_buffer_available(&shm_));
+  EXPECT_EQ(556, cras_shm_get_frames(&shm_));
+  WritePeriod(10, 4);
+  EXPECT_FALSE(cras_shm_is_buffer_available(&shm_));
+  EXPECT_EQ(0, cras_shm_num_overruns(&shm_));
+
+  // Reading with an offset continues into the next periods.
+  buf = cras_shm_get_readable_frames(&shm_, 150, &frames);
+  ASSERT_NE((void *)NULL, buf);
+  EXPECT_EQ(150, frames);
+  EXPECT_EQ(2, buf[0]);
+  buf = cras_shm_get_readable_frames(&shm_, 566, &frames);
+  EXPECT_EQ((void *)NULL, buf);
+  EXPECT_EQ(0, frames);
+
+  cras_shm_buffer_read(&shm_, 120);
+  EXPECT_TRUE(cras_shm_is_buffer_available(&shm_));
+  EXPECT_EQ(180, cras_shm_get_frames_in_curr_buffer(&shm_));
+  EXPECT_EQ(shm_.area->samples + 1024 + 20 * 4,
+            cras_shm_get_curr_read_buffer(&shm_));
+  EXPECT_EQ(446, cras_shm_get_frames(&shm_));
+
+  // Reading the current period stops at its end.
+  cras_shm_buffer_read_current(&shm_, 180);
+  EXPECT_EQ(266, cras_shm_get_frames(&shm_));
+  buf = cras_shm_get_readable_frames(&shm_, 0, &frames);
+  EXPECT_EQ(256, frames);
+  EXPECT_EQ(3, buf[0]);
+
+  cras_shm_buffer_read(&shm_, 266);
+  EXPECT_EQ(0, cras_shm_get_frames(&shm_));
+}
+
+TEST_F(ShmRingTestSuite, CountersWrapTheSlots) {
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(shm_.area->samples + (i % 4) * 1024,
+              cras_shm_get_write_buffer_base(&shm_));
+    WritePeriod(64, i);
+    EXPECT_EQ(shm_.area->samples + (i % 4) * 1024,
+              cras_shm_get_curr_read_buffer(&shm_));
+    EXPECT_EQ(64, cras_shm_get_frames(&shm_));
+    cras_shm_buffer_read(&shm_, 64);
+  }
+  EXPECT_EQ(10, shm_.area->ring_read_count);
+  EXPECT_EQ(10, shm_.area->ring_write_count);
+}
+
+TEST_F(ShmRingTestSuite, OverrunDropsNewestPeriod) {
+  size_t frames;
+  int16_t *buf;
+
+  for (int i = 0; i < 5; i++)
+    WritePeriod(100, i);
+  EXPECT_EQ(1, cras_shm_num_overruns(&shm_));
+
+  // The last period went to the spare slot and was dropped, the unread ones
+  // are intact.
+  EXPECT_EQ(400, cras_shm_get_frames(&shm_));
+  buf = cras_shm_get_readable_frames(&shm_, 0, &frames);
+  EXPECT_EQ(100, frames);
+  EXPECT_EQ(0, buf[0]);
+  EXPECT_EQ(0, buf[199]);
+  cras_shm_buffer_read(&shm_, 100);
+  buf = cras_shm_get_readable_frames(&shm_, 0, &frames);
+  EXPECT_EQ(1, buf[0]);
+  EXPECT_EQ(300, cras_shm_get_frames(&shm_));
+
+  // With a period free again the next one is kept.
+  WritePeriod(100, 5);
+  EXPECT_EQ(1, cras_shm_num_overruns(&shm_));
+  EXPECT_EQ(400, cras_shm_get_frames(&shm_));
+  buf = cras_shm_get_readable_frames(&shm_, 300, &frames);
+  ASSERT_NE((void *)NULL, buf);
+  EXPECT_EQ(5, buf[0]);
+}
+
+TEST_F(ShmRingTestSuite, PeriodStartedFullStaysInSpare) {
+  unsigned limit;
+  uint8_t *spare = shm_.area->samples + 4 * 1024;
+
+  for (int i = 0; i < 4; i++)
+    WritePeriod(100, i);
+
+  // Once started in the spare slot, a period stays there even if the reader
+  // frees the oldest one meanwhile.
+  EXPECT_EQ(spare, cras_shm_get_writeable_frames(
+      &shm_, cras_shm_used_frames(&shm_), &limit));
+  cras_shm_buffer_written(&shm_, 10);
+  cras_shm_buffer_read(&shm_, 100);
+  EXPECT_EQ(spare, cras_shm_get_write_buffer_base(&shm_));
+  cras_shm_buffer_write_complete(&shm_);
+  EXPECT_EQ(1, cras_shm_num_overruns(&shm_));
+  EXPECT_EQ(300, cras_shm_get_frames(&shm_));
+
+  // The next period takes the freed slot.
+  EXPECT_EQ(shm_.area->samples, cras_shm_get_write_buffer_base(&shm_));
+}
+
+TEST_F(ShmTestSuite, AudRequestAndReply) {
+  uint32_t count = 0;
+  uint32_t frames;
+  int32_t value;
+
+  EXPECT_EQ(0, cras_shm_take_aud_request(&shm_, &count, &frames));
+  cras_shm_post_aud_request(&shm_, 100);
+  EXPECT_EQ(0, cras_shm_aud_reply_ready(&shm_, NULL));
+  ASSERT_EQ(1, cras_shm_take_aud_request(&shm_, &count, &frames));
+  EXPECT_EQ(1, count);
+  EXPECT_EQ(100, frames);
+  // A request is only taken once.
+  EXPECT_EQ(0, cras_shm_take_aud_request(&shm_, &count, &frames));
+
+  cras_shm_post_aud_reply(&shm_, count, 80);
+  ASSERT_EQ(1, cras_shm_aud_reply_ready(&shm_, &value));
+  EXPECT_EQ(80, value);
+
+  // A request not taken yet is replaced by the next one.
+  cras_shm_post_aud_request(&shm_, 50);
+  EXPECT_EQ(0, cras_shm_aud_reply_ready(&shm_, NULL));
+  cras_shm_post_aud_request(&shm_, 60);
+  ASSERT_EQ(1, cras_shm_take_aud_request(&shm_, &count, &frames));
+  EXPECT_EQ(3, count);
+  EXPECT_EQ(60, frames);
+  cras_shm_post_aud_reply(&shm_, count, -EIO);
+  ASSERT_EQ(1, cras_shm_aud_reply_ready(&shm_, &value));
+  EXPECT_EQ(-EIO, value);
+}
+
+TEST(ShmAreaTest, LayoutKeepsSidesApart) {
+  const size_t line = CRAS_SHM_CACHELINE_SIZE;
+  size_t writer = offsetof(struct cras_audio_shm_area, write_buf_idx);
+  size_t reader = offsetof(struct cras_audio_shm_area, read_buf_idx);
+  size_t server = offsetof(struct cras_audio_shm_area, callback_pending);
+
+  EXPECT_EQ(0, writer % line);
+  EXPECT_EQ(0, reader % line);
+  EXPECT_EQ(0, server % line);
+  // The last field of each block is on a line before the next block.
+  EXPECT_GT(writer, offsetof(struct cras_audio_shm_area, mute));
+  EXPECT_GT(reader, offsetof(struct cras_audio_shm_area, ring_period_bytes) +
+                    sizeof(uint32_t) * (CRAS_SHM_MAX_PERIODS - 1));
+  EXPECT_GT(server, offsetof(struct cras_audio_shm_area, ring_read_offset));
+  EXPECT_EQ(0, offsetof(struct cras_audio_shm_area, aud_reply) % line);
+  EXPECT_GT(offsetof(struct cras_audio_shm_area, aud_reply),
+            offsetof(struct cras_audio_shm_area, aud_request));
+  EXPECT_EQ(0, offsetof(struct cras_audio_shm_area, samples) %
+               CRAS_SHM_SAMPLES_ALIGN);
+}
+
+TEST(ShmAreaTest, CreateMapAndSeal) {
+  struct stat st;
+  uint8_t *area, *area2;
+  int fd;
+
+  fd = cras_shm_create("shm_test", 4096);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(0, fstat(fd, &st));
+  EXPECT_EQ(4096, st.st_size);
+
+  // Both mappings see the same, zeroed, memory.
+  area = (uint8_t *)cras_shm_map(fd, 4096, 1);
+  area2 = (uint8_t *)cras_shm_map(fd, 4096, 1);
+  ASSERT_NE((void *)NULL, area);
+  ASSERT_NE((void *)NULL, area2);
+  EXPECT_EQ(0, area[100]);
+  area[100] = 0x55;
+  EXPECT_EQ(0x55, area2[100]);
+
+  // The size is sealed and a larger mapping is refused.
+  EXPECT_GT(0, ftruncate(fd, 1024));
+  EXPECT_GT(0, ftruncate(fd, 8192));
+  EXPECT_EQ((void *)NULL, cras_shm_map(fd, 8192, 1));
+
+  cras_shm_unmap(area, 4096);
+  cras_shm_unmap(area2, 4096);
+  close(fd);
+}
+
+TEST(ShmAreaTest, CreateReadOnlyForOthers) {
+  char path[32];
+  uint8_t *area = NULL, *area2;
+  int fd, rw_fd;
+
+  fd = cras_shm_create_ro("shm_test", 4096, (void **)&area);
+  ASSERT_GE(fd, 0);
+  ASSERT_NE((void *)NULL, area);
+
+  // The creator's mapping stays writable, the others see its writes.
+  area[100] = 0x55;
+  area2 = (uint8_t *)cras_shm_map(fd, 4096, 0);
+  ASSERT_NE((void *)NULL, area2);
+  EXPECT_EQ(0x55, area2[100]);
+  EXPECT_NE(0, mprotect(area2, 4096, PROT_READ | PROT_WRITE));
+  EXPECT_EQ((void *)NULL, cras_shm_map(fd, 4096, 1));
+
+  // Nor can a file opened read write through proc be mapped for writing.
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  rw_fd = open(path, O_RDWR);
+  ASSERT_GE(rw_fd, 0);
+  EXPECT_EQ((void *)NULL, cras_shm_map(rw_fd, 4096, 1));
+  close(rw_fd);
+
+  // The seals are final.
+  EXPECT_GT(0, fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE));
+  EXPECT_GT(0, ftruncate(fd, 8192));
+
+  cras_shm_unmap(area, 4096);
+  cras_shm_unmap(area2, 4096);
+  close(fd);
+}
+
+TEST(ShmAreaTest, CreateReadOnlyWithoutFutureWriteSeal) {
+  uint8_t *area = NULL, *area2;
+  int fd;
+
+  fcntl_unknown_seals = F_SEAL_FUTURE_WRITE;
+  fd = cras_shm_create_ro("shm_test", 4096, (void **)&area);
+  fcntl_unknown_seals = 0;
+  ASSERT_GE(fd, 0);
+  ASSERT_NE((void *)NULL, area);
+
+  // Still shared, only its size is sealed, for good.
+  area[100] = 0x55;
+  area2 = (uint8_t *)cras_shm_map(fd, 4096, 0);
+  ASSERT_NE((void *)NULL, area2);
+  EXPECT_EQ(0x55, area2[100]);
+  EXPECT_GT(0, ftruncate(fd, 8192));
+  EXPECT_GT(0, fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE));
+
+  cras_shm_unmap(area, 4096);
+  cras_shm_unmap(area2, 4096);
+  close(fd);
+}
+
 }  //  namespace
 
+extern "C" {
+int fcntl(int fd, int cmd, ...) {
+  va_list ap;
+  long arg;
+
+  va_start(ap, cmd);
+  arg = va_arg(ap, long);
+  va_end(ap);
+  if (cmd == F_ADD_SEALS && (arg & fcntl_unknown_seals)) {
+    errno = EINVAL;
+    return -1;
+  }
+  return syscall(SYS_fcntl, fd, cmd, arg);
+}
+}  // extern "C"
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
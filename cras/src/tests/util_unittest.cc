@@ -41,6 +41,43 @@ TEST(Util, SendRecvFileDescriptor) {
   close(new_fd);
 }
 
+TEST(Util, SendRecvFileDescriptors) {
+  int fd[2];
+  int sock[2];
+  int fds[3];
+  int new_fds[2];
+  unsigned int num_fds = 2;
+  char buf[6] = {0};
+
+  /* Three fds sent, with room for two the last one is closed. */
+  ASSERT_EQ(0, pipe(fd));
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sock));
+  fds[0] = fd[0];
+  fds[1] = fd[1];
+  fds[2] = fd[1];
+  ASSERT_EQ(5, cras_send_with_fds(sock[0], "hello", 5, fds, 3));
+  ASSERT_EQ(5, cras_recv_with_fds(sock[1], buf, 5, new_fds, &num_fds));
+  ASSERT_STREQ("hello", buf);
+  ASSERT_EQ(2, num_fds);
+
+  close(fd[0]);
+  close(fd[1]);
+  ASSERT_EQ(1, write(new_fds[1], "a", 1));
+  ASSERT_EQ(1, read(new_fds[0], buf, 1));
+  ASSERT_EQ('a', buf[0]);
+  close(new_fds[0]);
+  close(new_fds[1]);
+
+  /* None sent, none received. */
+  num_fds = 2;
+  ASSERT_EQ(5, cras_send_with_fds(sock[0], "hello", 5, NULL, 0));
+  ASSERT_EQ(5, cras_recv_with_fds(sock[1], buf, 5, new_fds, &num_fds));
+  EXPECT_EQ(0, num_fds);
+
+  close(sock[0]);
+  close(sock[1]);
+}
+
 TEST(Util, TimevalAfter) {
   struct timeval t0, t1;
   t0.tv_sec = 0;